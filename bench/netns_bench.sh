@@ -0,0 +1,155 @@
+#!/bin/bash
+# Satrap/bench/netns_bench.sh
+#
+# Benchmark of the tools against simulated hosts. The responder runs
+# in its own network namespace, on the far end of a veth pair, and
+# answers for the live hosts of a whole network. The tools run on the
+# near end, and every run reports:
+#
+#   - its duration (for a scan, until every address is done)
+#   - frames per second sent on the link
+#   - reply capture rate: live hosts found, out of the live hosts
+#   - CPU time (user + system) per frame sent or received
+#
+# The frames are counted on the veth, so they include everything the
+# tool sent and received. Run it as root, after make all bench:
+#
+#   ./bench/netns_bench.sh
+#   NETWORK=10.96.0.0/12 DENSITY=0.01 LATENCY=2000 LOSS=1 ./bench/netns_bench.sh
+#
+# Parameters, from the environment:
+#   NETWORK    simulated network; the tools use its first address
+#   DENSITY    fraction of live addresses, from 0 to 1
+#   LATENCY    reply latency, in microseconds
+#   JITTER     random extra latency, in microseconds
+#   LOSS       replies lost, in percent
+#   RATES      rates of the fixed-rate scans, in probes per second
+#   WORKERS    receiving threads of the threaded scan
+#   MITM_TIME  duration of the poisoning run, in seconds
+#   FRAMES     frames sent by the library benchmarks
+
+set -e
+
+NETWORK=${NETWORK:-10.99.0.0/16}
+DENSITY=${DENSITY:-0.05}
+LATENCY=${LATENCY:-200}
+JITTER=${JITTER:-100}
+LOSS=${LOSS:-0}
+RATES=${RATES:-"10000 50000"}
+WORKERS=${WORKERS:-2}
+MITM_TIME=${MITM_TIME:-10}
+FRAMES=${FRAMES:-1000000}
+
+NS=satrap-bench
+DEV=sb0 # our end
+PEER=sb1 # end of the responder
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+
+for tool in arp_scan arp_mitm bench/responder bench/tx_bench bench/template_bench; do
+  if [ ! -x "$DIR/$tool" ]; then
+    echo "[FAIL] $tool is missing: make all bench"
+    exit 1
+  fi
+done
+
+cleanup() {
+  if [ -n "$RESPONDER" ]; then
+    kill -INT "$RESPONDER" 2>/dev/null || true
+    wait "$RESPONDER" 2>/dev/null || true
+    echo
+    echo "Responder: $(tail -n 1 "$TMP/responder")"
+  fi
+  ip netns del $NS 2>/dev/null || true
+  ip link del $DEV 2>/dev/null || true
+  rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+
+
+# ==========================================================================
+
+# TEST BED
+
+ip netns add $NS
+ip link add $DEV type veth peer name $PEER
+ip link set $PEER netns $NS
+ip netns exec $NS ip link set $PEER up
+ip link set $DEV up
+PREFIX=${NETWORK#*/}
+LOCAL=$(echo "${NETWORK%/*}" | awk -F. '{ printf "%d.%d.%d.%d", $1, $2, $3, $4 + 1 }')
+ip addr add "$LOCAL/$PREFIX" dev $DEV
+
+ip netns exec $NS "$DIR/bench/responder" -d "$DENSITY" -l "$LATENCY" -j "$JITTER" \
+  -p "$LOSS" -x "$LOCAL" $PEER "$NETWORK" > "$TMP/responder" &
+RESPONDER=$!
+# Counting the live hosts of a large network takes a moment
+for i in $(seq 50); do
+  grep -q "hosts alive" "$TMP/responder" && break
+  sleep 0.1
+done
+ALIVE=$(awk '/hosts alive/ { print $2 }' "$TMP/responder")
+if [ -z "$ALIVE" ]; then
+  echo "[FAIL] The responder did not start"
+  exit 1
+fi
+sleep 0.5
+echo "Network $NETWORK: $ALIVE live hosts, latency ${LATENCY}us + ${JITTER}us, ${LOSS}% loss"
+echo
+
+
+
+# ==========================================================================
+
+# RUNS
+
+counter() {
+  cat /sys/class/net/$DEV/statistics/$1
+}
+
+# Runs a tool, and prints its numbers. The output of the tool is kept
+# in $TMP/out.
+run() {
+  local name=$1
+  shift
+  local tx0=$(counter tx_packets) rx0=$(counter rx_packets)
+  local TIMEFORMAT="%R %U %S"
+  local times
+  times=$( { time "$@" > "$TMP/out" 2>&1; } 2>&1 | tail -n 1) || true
+  local tx=$(( $(counter tx_packets) - tx0 )) rx=$(( $(counter rx_packets) - rx0 ))
+  local found=$(grep -c "is alive" "$TMP/out" || true)
+  echo "$times" | awk -v name="$name" -v tx="$tx" -v frames="$((tx + rx))" \
+    -v found="$found" -v alive="$ALIVE" '{
+      capture = found > 0 ? sprintf("%.2f%%", 100 * found / alive) : "-"
+      rate = $1 > 0 ? tx / $1 : 0
+      cpu = frames > 0 ? ($2 + $3) * 1e9 / frames : 0
+      printf "%-28s %8.2f %10.0f %10s %12.0f\n", name, $1, rate, capture, cpu
+    }'
+}
+
+printf "%-28s %8s %10s %10s %12s\n" "run" "seconds" "frames/s" "captured" "CPU ns/frame"
+
+for rate in $RATES; do
+  run "arp_scan -r $rate" "$DIR/arp_scan" -r "$rate" $DEV
+done
+run "arp_scan -A" "$DIR/arp_scan" -A $DEV
+run "arp_scan -A -R -T" "$DIR/arp_scan" -A -R -T $DEV
+run "arp_scan -A -W $WORKERS" "$DIR/arp_scan" -A -W "$WORKERS" $DEV
+
+# The last scan gives the targets of the poisoning: the first host
+# found is the gateway of the others. The run includes the resolution
+# of the targets, and the responder counts the poisoning frames.
+TARGETS=$(awk '/is alive/ { print $2 }' "$TMP/out" | head -n 257)
+GATEWAY=$(echo "$TARGETS" | head -n 1)
+TARGETS=$(echo "$TARGETS" | tail -n +2)
+if [ -n "$TARGETS" ]; then
+  run "arp_mitm $(echo "$TARGETS" | wc -l) pairs, ${MITM_TIME}s" \
+    timeout -s INT "$MITM_TIME" "$DIR/arp_mitm" -i 100 -g "$GATEWAY" $DEV $TARGETS
+fi
+
+# The library paths, on their own
+echo
+"$DIR/bench/tx_bench" $DEV "$FRAMES"
+echo
+"$DIR/bench/template_bench" "$((FRAMES * 10))"
@@ -0,0 +1,192 @@
+/* Satrap/bench/replay_bench.c */
+
+#include <time.h>
+
+#include <sys/epoll.h>
+
+#include "../arp.h"
+#include "../pcap.h"
+#include "../reactor.h"
+#include "../scan.h"
+
+/* Receive path benchmark: replays a capture (pcap or pcapng) through
+   the replay backend, on an event loop, first with a handler which
+   only reads the frames, then through the reply handling of the scan
+   engine and its host table. No root and no network needed:
+
+     ./bench/replay_bench -l 100 capture.pcapng
+     ./bench/replay_bench -t capture.pcap (at the original pace)
+*/
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Prints the results of a run */
+static void report(const char *name, unsigned long count, double elapsed, unsigned long checksum)
+{
+  printf("%-24s %10lu frames %8.3f s %12.0f frames/s %8.1f ns/frame (%08lx)\n",
+	 name, count, elapsed, count / elapsed, elapsed * 1e9 / count,
+	 checksum & 0xffffffff);
+}
+
+
+/* State of a run */
+struct replay {
+  struct frame_io io;
+  frame_handler handler;
+  void *arg;
+  unsigned long frames;
+};
+
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct replay *replay = arg;
+  int n = frame_io_recv(&replay->io, replay->handler, replay->arg);
+  if (n == -1) {
+    perror("[FAIL] frame_io_recv()");
+    exit(EXIT_FAILURE);
+  }
+  replay->frames += n;
+  if (pcap_replay_done(&replay->io))
+    reactor_stop(reactor);
+}
+
+
+/* Replays the capture through the handler, on an event loop as the
+   engines do. Returns the number of frames replayed. */
+static unsigned long run(const char *path, const struct pcap_params *params, frame_handler handler, void *arg)
+{
+  struct replay replay = { .handler = handler, .arg = arg };
+  if (frame_io_pcap(&replay.io, path, params) == -1) {
+    perror("[FAIL] frame_io_pcap()");
+    exit(EXIT_FAILURE);
+  }
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1
+      || !reactor_add_fd(&reactor, replay.io.fd, EPOLLIN, on_frames, &replay)
+      || reactor_run(&reactor) == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+  reactor_free(&reactor);
+  frame_io_close(&replay.io);
+  return replay.frames;
+}
+
+
+
+/* ====================================================================== */
+
+/* What the first run learns about the capture */
+struct survey {
+  unsigned long checksum;
+  unsigned long replies;
+  uint32_t first, last; /* range of the senders of the replies */
+};
+
+
+/* Reads the frames, and finds the range of the senders of the ARP
+   replies */
+static void survey_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  struct survey *survey = arg;
+  if (len)
+    survey->checksum += len + frame[len - 1];
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  if (len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP)
+      || arp->arp.arp_op != htons(ARPOP_REPLY))
+    return;
+  uint32_t sender;
+  memcpy(&sender, arp->arp.arp_spa, sizeof(sender));
+  sender = ntohl(sender);
+  if (survey->replies++ == 0)
+    survey->first = survey->last = sender;
+  if (sender < survey->first)
+    survey->first = sender;
+  if (sender > survey->last)
+    survey->last = sender;
+}
+
+
+/* The frame handler of the scan engine */
+static void handle_reply(const unsigned char *frame, size_t len, void *arg)
+{
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  if (len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP))
+    return;
+  scan_handle_reply(arg, &arp->arp);
+}
+
+
+int main(int argc, char *argv[])
+{
+  struct pcap_params params;
+  pcap_params_default(&params);
+  int opt;
+  while ((opt = getopt(argc, argv, "l:t")) != -1) {
+    switch (opt) {
+    case 'l':
+      params.loops = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      params.realtime = 1;
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
+  if (optind >= argc || params.loops == 0) {
+    fprintf(stderr, "Usage: %s [-l loops, at least 1] [-t (original timestamps)] <capture>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *path = argv[optind];
+  unsigned long frames;
+  double start;
+
+
+  /* The backend alone */
+  struct survey survey;
+  memset(&survey, 0, sizeof(survey));
+  start = now();
+  frames = run(path, &params, survey_frame, &survey);
+  if (frames == 0) {
+    fprintf(stderr, "[FAIL] No Ethernet frame in %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  report("replay", frames, now() - start, survey.checksum);
+
+
+  /* The reply handling of the scanner: the senders are in the range
+     of the engine, so every reply is looked up as during a scan */
+  if (survey.replies == 0) {
+    printf("[OK] No ARP reply in the capture\n");
+    return 0;
+  }
+  unsigned char macaddr[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0, 1 };
+  struct sockaddr_in ipaddr = { .sin_family = AF_INET };
+  struct in_addr first = { htonl(survey.first) }, last = { htonl(survey.last) };
+  struct host_table hosts;
+  struct scan_engine engine;
+  struct frame_io dummy = { .ifindex = 0 };
+  if (hosts_init(&hosts, 0) == -1
+      || scan_init(&engine, &dummy, &ipaddr, macaddr, first, last) == -1) {
+    perror("[FAIL] scan_init()");
+    exit(EXIT_FAILURE);
+  }
+  engine.hosts = &hosts;
+  start = now();
+  frames = run(path, &params, handle_reply, &engine);
+  report("scan_handle_reply", frames, now() - start, hosts.len);
+  printf("[OK] %lu ARP replies per replay, %zu hosts\n",
+	 survey.replies / params.loops, hosts.len);
+
+  scan_free(&engine);
+  hosts_free(&hosts);
+  return 0;
+}
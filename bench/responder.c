@@ -0,0 +1,409 @@
+/* Satrap/bench/responder.c */
+
+#include <signal.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+
+#include "../arp.h"
+#include "../filter.h"
+#include "../reactor.h"
+#include "../ring.h"
+#include "../timer_wheel.h"
+
+/* Simulated hosts: answers the ARP requests for a whole range of
+   addresses, as if a live host sat behind some of them. Run it on the
+   far end of a veth pair, in its own network namespace, so that the
+   tools can be measured against thousands to millions of hosts
+   without a LAN (see netns_bench.sh):
+
+     ip netns exec satrap-bench ./bench/responder -d 0.1 -l 500 -j 200 \
+       -p 1 sb1 10.99.0.0/16
+
+   A host is alive or not for the whole run, from a hash of its
+   address, except the network and broadcast addresses and the address
+   of the tool (-x). Its hardware address is 02:5a followed by its IP
+   address. Every reply waits for the latency plus a random part of
+   the jitter, and each one may be lost.
+*/
+
+/* Replies waiting for their latency */
+#define RESPONDER_MAX_PENDING 65536
+
+/* Receive buffer of the socket, in bytes */
+#define RESPONDER_RCVBUF (1 << 24)
+
+/* Resolution of the latency */
+#define RESPONDER_TICK 100000ULL /* nanoseconds */
+#define RESPONDER_SLOTS 4096
+
+
+/* Reply waiting to be sent */
+struct pending {
+  struct wheel_timer timer; /* first, to find the reply from its timer */
+  struct arp_frame frame;
+};
+
+
+struct responder {
+  struct frame_io *io;
+  uint32_t first, last; /* range of the simulated hosts, host byte order */
+  uint32_t network, broadcast; /* never alive */
+  uint32_t exclude; /* address of the tool, never alive, or 0 */
+  uint32_t threshold; /* a host is alive if its hash is below */
+  uint32_t seed;
+  uint64_t latency, jitter; /* nanoseconds */
+  uint32_t loss; /* probability of losing a reply, out of 2^32 */
+  uint64_t random; /* state of the generator */
+
+  struct timer_wheel wheel;
+  struct pending *pending;
+  unsigned int *free_slots, nfree;
+  struct reactor_source *timer;
+
+  /* Statistics */
+  unsigned long requests; /* for a simulated address */
+  unsigned long replies, lost, overflows;
+  unsigned long poisoned; /* frames claiming a simulated host */
+};
+
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* xorshift64* */
+static uint64_t next_random(struct responder *r)
+{
+  r->random ^= r->random >> 12;
+  r->random ^= r->random << 25;
+  r->random ^= r->random >> 27;
+  return r->random * 0x2545f4914f6cdd1dULL;
+}
+
+
+/* Mixes the bits of an address (the finalizer of MurmurHash3) */
+static uint32_t hash_address(uint32_t ip, uint32_t seed)
+{
+  uint32_t h = ip ^ seed;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static int is_alive(const struct responder *r, uint32_t ip)
+{
+  return ip >= r->first && ip <= r->last
+    && ip != r->network && ip != r->broadcast && ip != r->exclude
+    && hash_address(ip, r->seed) < r->threshold;
+}
+
+
+/* Hardware address of a simulated host */
+static void host_mac(uint32_t ip, unsigned char *mac)
+{
+  mac[0] = 0x02;
+  mac[1] = 0x5a;
+  uint32_t nip = htonl(ip);
+  memcpy(mac + 2, &nip, sizeof(nip));
+}
+
+
+
+/* ====================================================================== */
+
+/* Sends a reply whose latency is over */
+static void send_pending(struct wheel_timer *timer, void *arg)
+{
+  struct responder *r = arg;
+  struct pending *p = (struct pending *) timer;
+  if (frame_io_send(r->io, &p->frame, sizeof(p->frame)) != 0)
+    ++r->overflows;
+  else
+    ++r->replies;
+  r->free_slots[r->nfree++] = p - r->pending;
+}
+
+
+/* Answers the requests for live simulated hosts */
+static void handle_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  struct responder *r = arg;
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  if (len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP))
+    return;
+
+  uint32_t tpa, spa;
+  memcpy(&tpa, arp->arp.arp_tpa, sizeof(tpa));
+  memcpy(&spa, arp->arp.arp_spa, sizeof(spa));
+  tpa = ntohl(tpa);
+  spa = ntohl(spa);
+
+  /* A frame which claims the address of one of our hosts with
+     another hardware address is a poisoning frame. It is still
+     answered if it is a request, as a real host would. */
+  if (is_alive(r, spa)) {
+    unsigned char mac[ETHER_ADDR_LEN];
+    host_mac(spa, mac);
+    if (memcmp(arp->arp.arp_sha, mac, ETHER_ADDR_LEN) != 0)
+      ++r->poisoned;
+  }
+  /* The sender never asks for itself, but for its own address */
+  if (arp->arp.arp_op != htons(ARPOP_REQUEST) || tpa == spa)
+    return;
+  if (tpa < r->first || tpa > r->last)
+    return;
+  ++r->requests;
+  if (!is_alive(r, tpa))
+    return;
+  if ((uint32_t) next_random(r) < r->loss) {
+    ++r->lost;
+    return;
+  }
+
+  struct arp_frame reply;
+  unsigned char mac[ETHER_ADDR_LEN];
+  host_mac(tpa, mac);
+  struct in_addr sender_ip = { htonl(tpa) }, target_ip = { htonl(spa) };
+  build_arp_frame(&reply, ARPOP_REPLY, sender_ip, mac, target_ip, arp->arp.arp_sha);
+
+  /* Without latency, the reply leaves with the batch */
+  uint64_t delay = r->latency + (r->jitter ? next_random(r) % r->jitter : 0);
+  if (delay == 0) {
+    if (frame_io_send(r->io, &reply, sizeof(reply)) != 0)
+      ++r->overflows;
+    else
+      ++r->replies;
+    return;
+  }
+  if (r->nfree == 0) {
+    ++r->overflows;
+    return;
+  }
+  struct pending *p = &r->pending[r->free_slots[--r->nfree]];
+  p->frame = reply;
+  timer_wheel_add(&r->wheel, &p->timer, now_ns() + delay);
+}
+
+
+/* Sets the timer for the next reply due */
+static void arm_timer(struct responder *r)
+{
+  uint64_t wakeup = timer_wheel_next(&r->wheel);
+  if (wakeup == UINT64_MAX)
+    return;
+  uint64_t now = now_ns();
+  reactor_set_timer(r->timer, wakeup > now ? wakeup - now : 1, 0);
+}
+
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct responder *r = arg;
+  if (frame_io_recv(r->io, handle_frame, r) == -1)
+    perror("[FAIL] frame_io_recv()");
+  frame_io_flush(r->io);
+  arm_timer(r);
+}
+
+
+static void on_timer(struct reactor *reactor, void *arg)
+{
+  struct responder *r = arg;
+  timer_wheel_advance(&r->wheel, now_ns(), send_pending, r);
+  frame_io_flush(r->io);
+  arm_timer(r);
+}
+
+
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  reactor_stop(reactor);
+}
+
+
+
+/* ====================================================================== */
+
+int main(int argc, char **argv)
+{
+  double density = 1.0, loss = 0.0;
+  unsigned long latency = 0, jitter = 0; /* microseconds */
+  uint32_t seed = 1;
+  int use_rings = 0;
+  struct in_addr exclude = { 0 };
+  int opt;
+  while ((opt = getopt(argc, argv, "d:l:j:p:s:x:R")) != -1) {
+    switch (opt) {
+    case 'd':
+      density = strtod(optarg, NULL);
+      break;
+    case 'l':
+      latency = strtoul(optarg, NULL, 10);
+      break;
+    case 'j':
+      jitter = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      loss = strtod(optarg, NULL) / 100;
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      if (inet_pton(AF_INET, optarg, &exclude) != 1) {
+	printf("[FAIL] Invalid address: %s\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'R':
+      use_rings = 1;
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
+  if (argc - optind < 2) {
+    printf("[FAIL] Too few arguments\n"
+	   "Usage: %s [-d density of live hosts, 0 to 1] [-l latency in us] "
+	   "[-j jitter in us] [-p loss in %%] [-s seed] "
+	   "[-x address of the tool, never alive] [-R (rings)] "
+	   "<interface> <network>/<prefix length>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  int ifindex = if_nametoindex(argv[optind]);
+  if (ifindex == 0) {
+    perror("[FAIL] if_nametoindex()");
+    exit(EXIT_FAILURE);
+  }
+  char *slash = strchr(argv[optind + 1], '/');
+  unsigned int prefix = slash ? strtoul(slash + 1, NULL, 10) : 32;
+  if (slash)
+    *slash = 0;
+  struct in_addr network;
+  if (inet_pton(AF_INET, argv[optind + 1], &network) != 1 || prefix < 8 || prefix > 32) {
+    printf("[FAIL] Invalid network: %s (prefix from 8 to 32)\n", argv[optind + 1]);
+    exit(EXIT_FAILURE);
+  }
+
+  struct responder r;
+  memset(&r, 0, sizeof(r));
+  uint32_t mask = prefix == 32 ? 0xffffffff : ~(0xffffffffU >> prefix);
+  r.first = ntohl(network.s_addr) & mask;
+  r.last = r.first | ~mask;
+  /* A /31 or a /32 has neither network nor broadcast address */
+  r.network = prefix < 31 ? r.first : 0;
+  r.broadcast = prefix < 31 ? r.last : 0;
+  r.exclude = ntohl(exclude.s_addr);
+  r.threshold = density >= 1.0 ? 0xffffffff : (uint32_t) (density * 4294967296.0);
+  r.seed = seed;
+  r.latency = latency * 1000ULL;
+  r.jitter = jitter * 1000ULL;
+  r.loss = loss >= 1.0 ? 0xffffffff : (uint32_t) (loss * 4294967296.0);
+  r.random = 0x9e3779b97f4a7c15ULL ^ seed;
+
+  /* Every host is alive or not for the whole run */
+  unsigned long alive = 0;
+  for (uint64_t ip = r.first; ip <= r.last; ++ip)
+    alive += is_alive(&r, ip);
+  printf("[OK] %lu simulated hosts alive out of %lu addresses\n",
+	 alive, (unsigned long) r.last - r.first + 1);
+  fflush(stdout);
+
+  /* SOCK_RAW: the frames keep their Ethernet header */
+  int sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
+  if (sockfd < 0) {
+    perror("[FAIL] socket()");
+    exit(EXIT_FAILURE);
+  }
+  /* The requests come in bursts: a scan sends them faster than we
+     answer */
+  int rcvbuf = RESPONDER_RCVBUF;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1
+      && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+    perror("[FAIL] setsockopt()");
+    exit(EXIT_FAILURE);
+  }
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ARP);
+  addr.sll_ifindex = ifindex;
+  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    perror("[FAIL] bind()");
+    exit(EXIT_FAILURE);
+  }
+  struct frame_io io;
+  struct ring_params ring_params;
+  ring_params_default(&ring_params);
+  if (use_rings) {
+    if (frame_io_ring(&io, sockfd, ifindex, &ring_params) == -1) {
+      perror("[FAIL] frame_io_ring()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (frame_io_socket(&io, sockfd, ifindex) == -1) {
+    perror("[FAIL] frame_io_socket()");
+    exit(EXIT_FAILURE);
+  }
+  r.io = &io;
+  struct filter_stats stats;
+  if (filter_stats_init(&stats, io.fd, ifindex) == -1) {
+    perror("[FAIL] filter_stats_init()");
+    exit(EXIT_FAILURE);
+  }
+
+  r.pending = calloc(RESPONDER_MAX_PENDING, sizeof(*r.pending));
+  r.free_slots = calloc(RESPONDER_MAX_PENDING, sizeof(*r.free_slots));
+  if (!r.pending || !r.free_slots
+      || timer_wheel_init(&r.wheel, RESPONDER_SLOTS, RESPONDER_TICK, now_ns()) == -1) {
+    perror("[FAIL] calloc()");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned int i = 0; i < RESPONDER_MAX_PENDING; ++i)
+    r.free_slots[r.nfree++] = RESPONDER_MAX_PENDING - 1 - i;
+
+  /* Runs until SIGINT or SIGTERM */
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1) {
+    perror("[FAIL] reactor_init()");
+    exit(EXIT_FAILURE);
+  }
+  r.timer = reactor_add_timer(&reactor, on_timer, &r);
+  if (!r.timer
+      || !reactor_add_fd(&reactor, io.fd, EPOLLIN, on_frames, &r)
+      || !reactor_add_signal(&reactor, SIGINT, on_signal, &r)
+      || !reactor_add_signal(&reactor, SIGTERM, on_signal, &r)) {
+    perror("[FAIL] reactor_add()");
+    exit(EXIT_FAILURE);
+  }
+  if (reactor_run(&reactor) == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+
+  filter_stats_update(&stats);
+  printf("[OK] %lu requests, %lu replies, %lu lost on purpose, "
+	 "%lu dropped (backend or latency queue full), %lu poisoning frames, "
+	 "%lu frames dropped by the socket\n",
+	 r.requests, r.replies, r.lost, r.overflows, r.poisoned, stats.dropped);
+
+  reactor_free(&reactor);
+  timer_wheel_free(&r.wheel);
+  free(r.pending);
+  free(r.free_slots);
+  frame_io_close(&io);
+  close(sockfd);
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+/* Satrap/bench/tx_bench.c */
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../arp.h"
+#include "../ring.h"
+#include "../xsk.h"
+
+/* Transmit benchmark: sends the same number of ARP requests with each
+   transmit path, and prints the rate and the CPU time per frame. Run
+   it on one end of a veth pair, e.g.:
+
+     ip link add bench0 type veth peer name bench1
+     ip link set bench0 up; ip link set bench1 up
+     ./bench/tx_bench bench0 1000000
+*/
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+    + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+
+/* Prints the results of a run */
+static void report(const char *name, unsigned long count, double elapsed, double cpu, unsigned long retries)
+{
+  printf("%-24s %10lu frames %8.3f s %12.0f frames/s %8.1f ns CPU/frame (%lu retries)\n",
+	 name, count, elapsed, count / elapsed, cpu * 1e9 / count, retries);
+}
+
+
+/* Sends count requests with send_arp_request(), or with
+   send_arp_batch() if batch is more than 1 */
+static void run_legacy(const char *name, int sockfd, int ifindex, unsigned long count, unsigned int batch)
+{
+  unsigned char macaddr[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0, 1 };
+  struct sockaddr_in ipaddr = { .sin_family = AF_INET };
+  ipaddr.sin_addr.s_addr = htonl(0x0a000001);
+  struct arp_msg *msgs = calloc(batch, sizeof(*msgs));
+
+  double start = now(), start_cpu = cpu_time();
+  unsigned long sent = 0, failed = 0;
+  while (sent < count) {
+    if (batch == 1) {
+      struct in_addr target = { htonl(0x0a000000 + (sent & 0xffffff)) };
+      send_arp_request(sockfd, ifindex, &ipaddr, macaddr, target);
+      ++sent;
+      continue;
+    }
+    for (unsigned int i = 0; i < batch; ++i) {
+      msgs[i].op = ARPOP_REQUEST;
+      msgs[i].sender_ip = ipaddr.sin_addr;
+      msgs[i].sender_mac = macaddr;
+      msgs[i].target_ip.s_addr = htonl(0x0a000000 + ((sent + i) & 0xffffff));
+      msgs[i].target_mac = NULL;
+    }
+    int n = send_arp_batch(sockfd, ifindex, msgs, batch);
+    failed += batch - n;
+    sent += batch;
+  }
+  double elapsed = now() - start, cpu = cpu_time() - start_cpu;
+
+  report(name, sent, elapsed, cpu, failed);
+  free(msgs);
+}
+
+
+/* Sends count requests through the backend, flushing every batch
+   frames */
+static void run(const char *name, struct frame_io *io, unsigned long count, unsigned int batch)
+{
+  unsigned char macaddr[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0, 1 };
+  struct in_addr ipaddr = { htonl(0x0a000001) };
+  struct arp_frame frame;
+
+  double start = now(), start_cpu = cpu_time();
+  unsigned long sent = 0, full = 0;
+  while (sent < count) {
+    struct in_addr target = { htonl(0x0a000000 + (sent & 0xffffff)) };
+    build_arp_frame(&frame, ARPOP_REQUEST, ipaddr, macaddr, target, NULL);
+    int err = frame_io_send(io, &frame, sizeof(frame));
+    if (err == -1) {
+      perror("[FAIL] frame_io_send()");
+      exit(EXIT_FAILURE);
+    }
+    if (err == 1) {
+      /* The backend is full: we kick it and try again */
+      ++full;
+      frame_io_flush(io);
+      continue;
+    }
+    if (++sent % batch == 0 && frame_io_flush(io) == -1) {
+      perror("[FAIL] frame_io_flush()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  frame_io_flush(io);
+  double elapsed = now() - start, cpu = cpu_time() - start_cpu;
+
+  report(name, count, elapsed, cpu, full);
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    printf("[FAIL] Too few arguments\n"
+	   "Usage: %s <interface> [frames] [batch]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  unsigned int batch = argc > 3 ? strtoul(argv[3], NULL, 10) : 256;
+  if (batch == 0)
+    batch = 1;
+
+  int ifindex = if_nametoindex(argv[1]);
+  if (ifindex == 0) {
+    perror("[FAIL] if_nametoindex()");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The single-frame functions of arp.h, on the kind of socket used by
+     the tools */
+  int dgramfd = socket(AF_PACKET, SOCK_DGRAM, 0);
+  if (dgramfd < 0) {
+    perror("[FAIL] socket()");
+    exit(EXIT_FAILURE);
+  }
+  run_legacy("send_arp_request()", dgramfd, ifindex, count, 1);
+  run_legacy("send_arp_batch()", dgramfd, ifindex, count, batch);
+  close(dgramfd);
+
+  int sockfd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (sockfd < 0) {
+    perror("[FAIL] socket()");
+    exit(EXIT_FAILURE);
+  }
+
+  struct frame_io io;
+  if (frame_io_socket(&io, sockfd, ifindex) == -1) {
+    perror("[FAIL] frame_io_socket()");
+    exit(EXIT_FAILURE);
+  }
+  run("socket, 1 frame per call", &io, count, 1);
+  run("socket, sendmmsg()", &io, count, batch);
+  frame_io_close(&io);
+
+  struct ring_params params;
+  ring_params_default(&params);
+  if (frame_io_ring(&io, sockfd, ifindex, &params) == -1) {
+    perror("[FAIL] frame_io_ring()");
+    exit(EXIT_FAILURE);
+  }
+  run("PACKET_TX_RING", &io, count, batch);
+  frame_io_close(&io);
+
+  params.qdisc_bypass = 1;
+  if (frame_io_ring(&io, sockfd, ifindex, &params) == -1) {
+    perror("[FAIL] frame_io_ring()");
+    exit(EXIT_FAILURE);
+  }
+  run("PACKET_TX_RING (bypass)", &io, count, batch);
+  frame_io_close(&io);
+
+  /* AF_XDP, in generic mode, then in the driver if it supports XDP.
+     Both copy the frames, unless the driver supports zero-copy. */
+  unsigned char macaddr[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0, 1 };
+  struct in_addr ipaddr = { htonl(0x0a000001) };
+  struct xsk_params xsk_params;
+  xsk_params_default(&xsk_params);
+  xsk_params.mode = XSK_MODE_SKB;
+  if (frame_io_xsk(&io, ifindex, macaddr, ipaddr, &xsk_params) == -1) {
+    perror("[FAIL] frame_io_xsk()");
+    exit(EXIT_FAILURE);
+  }
+  run("AF_XDP (generic)", &io, count, batch);
+  frame_io_close(&io);
+
+  xsk_params.mode = XSK_MODE_NATIVE;
+  if (frame_io_xsk(&io, ifindex, macaddr, ipaddr, &xsk_params) == -1)
+    perror("[FAIL] frame_io_xsk() (native mode)");
+  else {
+    run("AF_XDP (native)", &io, count, batch);
+    frame_io_close(&io);
+  }
+
+  close(sockfd);
+  return EXIT_SUCCESS;
+}
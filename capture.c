@@ -0,0 +1,526 @@
+/* Satrap/capture.c */
+
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+
+
+/* pcapng blocks, in the byte order of the host */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL 9
+#define PCAPNG_SHB_LEN 28
+#define PCAPNG_IDB_LEN 32 /* with the if_tsresol option */
+#define PCAPNG_EPB_LEN 32 /* without the frame */
+
+#define LINKTYPE_ETHERNET 1
+
+/* Length of the file headers: a section, and its single interface */
+#define CAPTURE_HEADER_LEN (PCAPNG_SHB_LEN + PCAPNG_IDB_LEN)
+
+
+
+/* Fills the parameters with their default values: whole frames, a
+   single file, no O_DIRECT */
+void capture_params_default(struct capture_params *params)
+{
+  params->snaplen = 65535;
+  params->file_size = 0;
+  params->files = 0;
+  params->direct = 0;
+}
+
+
+/* Initializes a capture
+
+   capture: the capture to initialize
+   path: the file, or the prefix of the files if they rotate (a number
+   is added: <path>.0, <path>.1...)
+   nqueues: number of producers, each with its own queue
+   params: parameters of the capture, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_init(struct capture *capture, const char *path, unsigned int nqueues, const struct capture_params *params)
+{
+  memset(capture, 0, sizeof(*capture));
+  capture->fd = -1;
+  if (params)
+    capture->params = *params;
+  else
+    capture_params_default(&capture->params);
+  if (nqueues == 0 || capture->params.snaplen == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  unsigned int snaplen = capture->params.snaplen;
+  if (snaplen > sizeof(((struct capture_slot *) NULL)->data))
+    snaplen = sizeof(((struct capture_slot *) NULL)->data);
+  capture->params.snaplen = snaplen;
+
+  capture->path = strdup(path);
+  capture->queues = calloc(nqueues, sizeof(*capture->queues));
+  if (!capture->path || !capture->queues)
+    goto fail;
+  capture->nqueues = nqueues;
+  for (unsigned int i = 0; i < nqueues; ++i) {
+    capture->queues[i].snaplen = snaplen;
+    capture->queues[i].slots = malloc(CAPTURE_QUEUE_SIZE * sizeof(struct capture_slot));
+    if (!capture->queues[i].slots)
+      goto fail;
+  }
+
+  /* A chunk, and the block which made it full */
+  void *buf;
+  int err = posix_memalign(&buf, CAPTURE_ALIGN, CAPTURE_WRITE_SIZE + CAPTURE_ALIGN);
+  if (err) {
+    errno = err;
+    goto fail;
+  }
+  capture->buf = buf;
+  return 0;
+
+ fail: {
+    int err = errno;
+    capture_free(capture);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Copies a frame to a queue, without blocking. Only one thread may
+   use a given queue.
+
+   queue: the queue of the calling thread
+   frame: the Ethernet frame
+   len: its length
+   ts: time of the frame, in nanoseconds since the epoch
+
+   Returns 0 if the frame was queued, -1 if the queue is full.
+ */
+int capture_frame(struct capture_queue *queue, const unsigned char *frame, size_t len, uint64_t ts)
+{
+  /* The tail of the writer is only read again when the queue looks
+     full, so that its cache line stays where the writer is */
+  unsigned int head = queue->head;
+  if (head - queue->free_tail == CAPTURE_QUEUE_SIZE) {
+    queue->free_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head - queue->free_tail == CAPTURE_QUEUE_SIZE) {
+      counter_add(&queue->dropped, 1);
+      return -1;
+    }
+  }
+
+  struct capture_slot *slot = &queue->slots[head & (CAPTURE_QUEUE_SIZE - 1)];
+  slot->ts = ts;
+  slot->len = len;
+  slot->caplen = len < queue->snaplen ? len : queue->snaplen;
+  memcpy(slot->data, frame, slot->caplen);
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  counter_add(&queue->queued, 1);
+  return 0;
+}
+
+
+/* Returns the current time, in nanoseconds since the epoch, for the
+   frames without a timestamp of their own */
+uint64_t capture_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* ====================================================================== */
+
+/* FILES */
+
+static void put32(unsigned char *p, uint32_t value)
+{
+  memcpy(p, &value, sizeof(value));
+}
+
+
+static void put16(unsigned char *p, uint16_t value)
+{
+  memcpy(p, &value, sizeof(value));
+}
+
+
+/* Writes the beginning of the buffer to the file
+
+   Returns 0 on success, -1 on a write error.
+ */
+static int write_buffer(struct capture *capture, size_t len)
+{
+  uint64_t start = monotonic_ns();
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(capture->fd, capture->buf + done, len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    done += n;
+  }
+  counter_add(&capture->bytes, len);
+  counter_add(&capture->write_ns, monotonic_ns() - start);
+  return 0;
+}
+
+
+/* Writes what is left in the buffer, even a partial chunk. O_DIRECT
+   only takes whole blocks: it is turned off for the end of the file.
+
+   Returns 0 on success, -1 on a write error.
+ */
+static int flush_buffer(struct capture *capture)
+{
+  if (!capture->buf_len)
+    return 0;
+  if (capture->direct) {
+    int flags = fcntl(capture->fd, F_GETFL);
+    if (flags == -1 || fcntl(capture->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+      return -1;
+    capture->direct = 0;
+  }
+  if (write_buffer(capture, capture->buf_len) == -1)
+    return -1;
+  capture->buf_len = 0;
+  return 0;
+}
+
+
+/* Writes the full chunk at the beginning of the buffer, and moves
+   the rest to the front
+
+   Returns 0 on success, -1 on a write error.
+ */
+static int write_chunk(struct capture *capture)
+{
+  if (write_buffer(capture, CAPTURE_WRITE_SIZE) == -1)
+    return -1;
+  capture->buf_len -= CAPTURE_WRITE_SIZE;
+  memmove(capture->buf, capture->buf + CAPTURE_WRITE_SIZE, capture->buf_len);
+  return 0;
+}
+
+
+/* Opens the file of the current index, and puts its headers in the
+   buffer
+
+   Returns 0 on success, -1 on error.
+ */
+static int open_file(struct capture *capture)
+{
+  char path[4096];
+  const char *name = capture->path;
+  if (capture->params.file_size) {
+    unsigned int n = capture->params.files ? capture->index % capture->params.files : capture->index;
+    snprintf(path, sizeof(path), "%s.%u", capture->path, n);
+    name = path;
+  }
+
+  /* O_DIRECT is refused by some file systems (e.g. tmpfs) */
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  capture->fd = -1;
+  if (capture->params.direct)
+    capture->fd = open(name, flags | O_DIRECT, 0644);
+  capture->direct = capture->fd != -1;
+  if (capture->fd == -1)
+    capture->fd = open(name, flags, 0644);
+  if (capture->fd == -1)
+    return -1;
+
+  /* A section of the byte order of the host, with a single Ethernet
+     interface, timestamps in nanoseconds */
+  unsigned char *p = capture->buf;
+  put32(p, PCAPNG_SHB);
+  put32(p + 4, PCAPNG_SHB_LEN);
+  put32(p + 8, PCAPNG_BYTE_ORDER_MAGIC);
+  put16(p + 12, 1); /* version 1.0 */
+  put16(p + 14, 0);
+  memset(p + 16, 0xff, 8); /* length of the section not known */
+  put32(p + 24, PCAPNG_SHB_LEN);
+  p += PCAPNG_SHB_LEN;
+
+  put32(p, PCAPNG_IDB);
+  put32(p + 4, PCAPNG_IDB_LEN);
+  put16(p + 8, LINKTYPE_ETHERNET);
+  put16(p + 10, 0);
+  put32(p + 12, capture->params.snaplen);
+  put16(p + 16, PCAPNG_OPT_TSRESOL);
+  put16(p + 18, 1);
+  memset(p + 20, 0, 4);
+  p[20] = 9; /* 10^-9 s */
+  put32(p + 24, 0); /* end of the options */
+  put32(p + 28, PCAPNG_IDB_LEN);
+
+  capture->buf_len = CAPTURE_HEADER_LEN;
+  capture->file_bytes = CAPTURE_HEADER_LEN;
+  counter_add(&capture->files, 1);
+  return 0;
+}
+
+
+/* Writes the end of the current file, and closes it
+
+   Returns 0 on success, -1 on a write error.
+ */
+static int close_file(struct capture *capture)
+{
+  int err = flush_buffer(capture);
+  if (close(capture->fd) == -1)
+    err = -1;
+  capture->fd = -1;
+  return err;
+}
+
+
+/* Adds a frame to the buffer, in an enhanced packet block, after
+   moving to the next file if this one is full
+
+   Returns 0 on success, -1 on error.
+ */
+static int write_frame(struct capture *capture, const struct capture_slot *slot)
+{
+  size_t padded = (slot->caplen + 3) & ~3U;
+  size_t len = PCAPNG_EPB_LEN + padded;
+  if (capture->params.file_size && capture->file_bytes > CAPTURE_HEADER_LEN
+      && capture->file_bytes + len > capture->params.file_size) {
+    if (close_file(capture) == -1)
+      return -1;
+    ++capture->index;
+    if (open_file(capture) == -1)
+      return -1;
+  }
+
+  unsigned char *p = capture->buf + capture->buf_len;
+  put32(p, PCAPNG_EPB);
+  put32(p + 4, len);
+  put32(p + 8, 0); /* interface */
+  put32(p + 12, slot->ts >> 32);
+  put32(p + 16, slot->ts);
+  put32(p + 20, slot->caplen);
+  put32(p + 24, slot->len);
+  memcpy(p + 28, slot->data, slot->caplen);
+  memset(p + 28 + slot->caplen, 0, padded - slot->caplen);
+  put32(p + 28 + padded, len);
+  capture->buf_len += len;
+  capture->file_bytes += len;
+  counter_add(&capture->frames, 1);
+
+  if (capture->buf_len >= CAPTURE_WRITE_SIZE)
+    return write_chunk(capture);
+  return 0;
+}
+
+
+/* Moves the frames of every queue to the buffer, writing the chunks
+   which fill up
+
+   Returns the number of frames taken from the queues, or -1 on
+   error.
+ */
+static int drain_queues(struct capture *capture)
+{
+  int count = 0;
+  for (unsigned int i = 0; i < capture->nqueues; ++i) {
+    struct capture_queue *queue = &capture->queues[i];
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = queue->tail;
+    for (; tail != head; ++tail, ++count) {
+      if (write_frame(capture, &queue->slots[tail & (CAPTURE_QUEUE_SIZE - 1)]) == -1)
+	return -1;
+    }
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+
+
+/* ====================================================================== */
+
+/* WRITER THREAD */
+
+static void *writer_main(void *arg)
+{
+  struct capture *capture = arg;
+
+  /* The signals are handled by the main thread */
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  const struct timespec poll = { 0, CAPTURE_POLL_INTERVAL };
+  uint64_t last = monotonic_ns(); /* last frame taken from a queue */
+  int n;
+  while (!__atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE)) {
+    n = drain_queues(capture);
+    if (n == -1)
+      goto fail;
+    uint64_t now = monotonic_ns();
+    if (n) {
+      last = now;
+      continue;
+    }
+    /* Without traffic, the last frames reach the file anyway */
+    if (!capture->direct && capture->buf_len && now - last >= CAPTURE_FLUSH_INTERVAL
+	&& flush_buffer(capture) == -1)
+      goto fail;
+    nanosleep(&poll, NULL);
+  }
+
+  /* The producers are stopped: what they left goes to the file */
+  if (drain_queues(capture) == -1 || close_file(capture) == -1)
+    goto fail;
+  return NULL;
+
+ fail:
+  __atomic_store_n(&capture->error, errno, __ATOMIC_RELEASE);
+  if (capture->fd != -1) {
+    close(capture->fd);
+    capture->fd = -1;
+  }
+  return NULL;
+}
+
+
+/* Opens the first file, and starts the writer thread
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_start(struct capture *capture)
+{
+  capture->index = 0;
+  capture->stop = 0;
+  capture->error = 0;
+  if (open_file(capture) == -1)
+    return -1;
+  int err = pthread_create(&capture->thread, NULL, writer_main, capture);
+  if (err) {
+    close(capture->fd);
+    capture->fd = -1;
+    errno = err;
+    return -1;
+  }
+  capture->running = 1;
+  return 0;
+}
+
+
+/* Stops the writer thread once the queues are empty, and closes the
+   file. The producers must be stopped first.
+
+   Returns 0 on success, -1 if the writer stopped on a write error
+   (errno is set to that error).
+ */
+int capture_stop(struct capture *capture)
+{
+  if (!capture->running)
+    return 0;
+  __atomic_store_n(&capture->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(capture->thread, NULL);
+  capture->running = 0;
+  if (capture->error) {
+    errno = capture->error;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Sums the frames lost on full queues */
+unsigned long capture_dropped(const struct capture *capture)
+{
+  unsigned long dropped = 0;
+  for (unsigned int i = 0; i < capture->nqueues; ++i)
+    dropped += counter_read(&capture->queues[i].dropped);
+  return dropped;
+}
+
+
+static double read_write_seconds(const void *arg)
+{
+  const struct capture *capture = arg;
+  return counter_read(&capture->write_ns) / 1e9;
+}
+
+
+/* Adds the counters of the capture to a registry of metrics: frames
+   and bytes written, files, and frames queued and lost on the queue
+   of every worker (labeled worker="N").
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_add_metrics(struct capture *capture, struct metrics *m)
+{
+  if (metrics_add_counter(m, "satrap_capture_frames_total",
+			  "Frames written to the capture files", NULL, &capture->frames) == -1
+      || metrics_add_counter(m, "satrap_capture_bytes_total",
+			     "Bytes written to the capture files", NULL, &capture->bytes) == -1
+      || metrics_add_counter(m, "satrap_capture_files_total",
+			     "Capture files opened", NULL, &capture->files) == -1
+      || metrics_add(m, METRIC_COUNTER, "satrap_capture_write_seconds_total",
+		     "Time spent writing the capture files", NULL,
+		     read_write_seconds, capture) == -1)
+    return -1;
+  for (unsigned int i = 0; i < capture->nqueues; ++i) {
+    struct capture_queue *queue = &capture->queues[i];
+    char labels[METRICS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "worker=\"%u\"", i);
+    if (metrics_add_counter(m, "satrap_capture_queued_total",
+			    "Frames queued for the capture writer", labels, &queue->queued) == -1
+	|| metrics_add_counter(m, "satrap_capture_dropped_total",
+			       "Frames lost on the full queue of the capture writer",
+			       labels, &queue->dropped) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+
+/* Releases the resources of the capture, stopping it if needed */
+void capture_free(struct capture *capture)
+{
+  capture_stop(capture);
+  if (capture->fd != -1)
+    close(capture->fd);
+  capture->fd = -1;
+  if (capture->queues) {
+    for (unsigned int i = 0; i < capture->nqueues; ++i)
+      free(capture->queues[i].slots);
+    free(capture->queues);
+  }
+  capture->queues = NULL;
+  capture->nqueues = 0;
+  free(capture->buf);
+  capture->buf = NULL;
+  free(capture->path);
+  capture->path = NULL;
+}
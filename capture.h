@@ -0,0 +1,167 @@
+/* Satrap/capture.h */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+
+
+/* Frames in the queue of a producer (a power of 2) */
+#define CAPTURE_QUEUE_SIZE 4096
+
+/* Size of a slot of a queue: a frame is cut to what fits after the
+   header of the slot */
+#define CAPTURE_SLOT_SIZE 2048
+
+/* The writer hands the file system chunks of this size, aligned on
+   CAPTURE_ALIGN in memory and in the file */
+#define CAPTURE_WRITE_SIZE (1 << 20)
+#define CAPTURE_ALIGN 4096
+
+/* The writer sleeps this long (ns) when every queue is empty */
+#define CAPTURE_POLL_INTERVAL 1000000
+
+/* Without O_DIRECT, the frames of a partial chunk reach the file
+   after this long (ns) without traffic */
+#define CAPTURE_FLUSH_INTERVAL 1000000000ULL
+
+
+/* Parameters of a capture */
+struct capture_params {
+  unsigned int snaplen; /* bytes kept per frame */
+  unsigned long file_size; /* bytes per file before the next one, 0 for a single file */
+  unsigned int files; /* files kept, the oldest is overwritten; 0 to keep them all */
+  int direct; /* if set, O_DIRECT where the file system allows it */
+};
+
+
+/* Frame waiting in a queue */
+struct capture_slot {
+  uint64_t ts; /* nanoseconds since the epoch */
+  uint32_t caplen, len;
+  unsigned char data[CAPTURE_SLOT_SIZE - 16];
+};
+
+
+/* Single-producer single-consumer queue of frames, from a thread of
+   the receive path to the writer. The producer never waits: a frame
+   which finds the queue full is dropped and counted. */
+struct capture_queue {
+  struct capture_slot *slots; /* CAPTURE_QUEUE_SIZE of them */
+  unsigned int snaplen;
+  unsigned int head; /* next slot to write, by the producer */
+  unsigned int tail; /* next slot to read, by the writer */
+  unsigned int free_tail; /* tail as last read by the producer */
+
+  /* Counters of the producer (counter_read() from other threads) */
+  unsigned long queued, dropped;
+};
+
+
+/* Capture to pcapng files. The frames are copied to the queues by
+   the receive path, and written by a thread of their own, in large
+   aligned chunks: a slow disk costs frames, never time on the receive
+   path. */
+struct capture {
+  char *path;
+  struct capture_params params;
+  struct capture_queue *queues;
+  unsigned int nqueues;
+
+  /* Writer, between capture_start() and capture_stop() */
+  pthread_t thread;
+  int running;
+  int stop;
+  int error; /* errno of the write error which stopped the writer, or 0 */
+
+  /* Current file, and the frames not written yet */
+  int fd;
+  int direct; /* the file is open with O_DIRECT */
+  unsigned int index; /* of the current file */
+  unsigned long file_bytes; /* in the current file, with the buffer */
+  unsigned char *buf; /* CAPTURE_WRITE_SIZE, and room for a block */
+  size_t buf_len;
+
+  /* Counters of the writer (counter_read() from other threads) */
+  unsigned long frames; /* written to the files */
+  unsigned long bytes;
+  unsigned long files;
+  unsigned long write_ns; /* time spent in write() */
+};
+
+
+/* Fills the parameters with their default values: whole frames, a
+   single file, no O_DIRECT */
+void capture_params_default(struct capture_params *params);
+
+
+/* Initializes a capture
+
+   capture: the capture to initialize
+   path: the file, or the prefix of the files if they rotate (a number
+   is added: <path>.0, <path>.1...)
+   nqueues: number of producers, each with its own queue
+   params: parameters of the capture, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_init(struct capture *capture, const char *path, unsigned int nqueues, const struct capture_params *params);
+
+
+/* Copies a frame to a queue, without blocking. Only one thread may
+   use a given queue.
+
+   queue: the queue of the calling thread
+   frame: the Ethernet frame
+   len: its length
+   ts: time of the frame, in nanoseconds since the epoch
+
+   Returns 0 if the frame was queued, -1 if the queue is full.
+ */
+int capture_frame(struct capture_queue *queue, const unsigned char *frame, size_t len, uint64_t ts);
+
+
+/* Returns the current time, in nanoseconds since the epoch, for the
+   frames without a timestamp of their own */
+uint64_t capture_now(void);
+
+
+/* Opens the first file, and starts the writer thread
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_start(struct capture *capture);
+
+
+/* Stops the writer thread once the queues are empty, and closes the
+   file. The producers must be stopped first.
+
+   Returns 0 on success, -1 if the writer stopped on a write error
+   (errno is set to that error).
+ */
+int capture_stop(struct capture *capture);
+
+
+/* Sums the frames lost on full queues */
+unsigned long capture_dropped(const struct capture *capture);
+
+
+/* Adds the counters of the capture to a registry of metrics: frames
+   and bytes written, files, and frames queued and lost on the queue
+   of every worker (labeled worker="N").
+
+   Returns 0 on success, -1 on error.
+ */
+int capture_add_metrics(struct capture *capture, struct metrics *m);
+
+
+/* Releases the resources of the capture, stopping it if needed */
+void capture_free(struct capture *capture);
+
+
+
+#endif /* CAPTURE_H_ */
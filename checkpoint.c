@@ -0,0 +1,175 @@
+/* Satrap/checkpoint.c */
+
+#define _GNU_SOURCE /* sync_file_range() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+
+
+/* Maps the records of a file, for capacity of them
+
+   Returns the mapping, or NULL on error.
+ */
+static struct checkpoint_record *map_records(struct checkpoint *cp, uint64_t capacity)
+{
+  void *records = mmap(NULL, capacity * sizeof(struct checkpoint_record),
+		       PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, cp->records_offset);
+  return records == MAP_FAILED ? NULL : records;
+}
+
+
+/* Opens the state file of a scan, or creates it
+
+   cp: the checkpoint to initialize
+   path: the state file
+   first: first address of the range, host byte order
+   count: number of addresses in the range
+
+   Returns 0 on success, -1 on error (EINVAL if the file is the state
+   of another scan, or is damaged).
+ */
+int checkpoint_open(struct checkpoint *cp, const char *path, uint32_t first, uint32_t count)
+{
+  memset(cp, 0, sizeof(*cp));
+  /* The header has the first page, the states start on the second
+     one, and the records on the page after the states */
+  size_t page = sysconf(_SC_PAGESIZE);
+  cp->states_len = page + count;
+  cp->records_offset = (cp->states_len + page - 1) / page * page;
+
+  cp->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (cp->fd == -1)
+    return -1;
+
+  struct stat st;
+  if (fstat(cp->fd, &st) == -1)
+    goto fail;
+  struct checkpoint_header header;
+  if ((size_t) st.st_size < sizeof(header)) {
+    /* A new file, or one which died before its header was written:
+       every address is unsent */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.first = first;
+    header.count = count;
+    header.capacity = CHECKPOINT_DEFAULT_RECORDS;
+    if (ftruncate(cp->fd, 0) == -1
+	|| pwrite(cp->fd, &header, sizeof(header), 0) != sizeof(header)
+	|| ftruncate(cp->fd, cp->records_offset + header.capacity * sizeof(struct checkpoint_record)) == -1)
+      goto fail;
+  }
+  else {
+    if (pread(cp->fd, &header, sizeof(header), 0) != sizeof(header))
+      goto fail;
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))
+	|| header.version != CHECKPOINT_VERSION
+	|| header.first != first || header.count != count
+	|| header.nrecords > header.capacity
+	|| (uint64_t) st.st_size < cp->records_offset + header.capacity * sizeof(struct checkpoint_record)) {
+      errno = EINVAL;
+      goto fail;
+    }
+    cp->resumed = 1;
+  }
+
+  void *states = mmap(NULL, cp->states_len, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+  if (states == MAP_FAILED)
+    goto fail;
+  cp->header = states;
+  cp->states = (unsigned char *) states + page;
+  cp->records = map_records(cp, header.capacity);
+  if (!cp->records)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    if (cp->header)
+      munmap(cp->header, cp->states_len);
+    close(cp->fd);
+    cp->fd = -1;
+    cp->header = NULL;
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Records a host found by the scan
+
+   Returns 0 on success, -1 if the file could not grow.
+ */
+int checkpoint_add_host(struct checkpoint *cp, struct in_addr ip, const unsigned char *mac)
+{
+  struct checkpoint_header *header = cp->header;
+  if (header->nrecords == header->capacity) {
+    uint64_t capacity = 2 * header->capacity;
+    if (ftruncate(cp->fd, cp->records_offset + capacity * sizeof(struct checkpoint_record)) == -1)
+      return -1;
+    struct checkpoint_record *records = map_records(cp, capacity);
+    if (!records)
+      return -1;
+    munmap(cp->records, header->capacity * sizeof(struct checkpoint_record));
+    cp->records = records;
+    header->capacity = capacity;
+  }
+
+  struct checkpoint_record *record = &cp->records[header->nrecords];
+  record->ip = ip.s_addr;
+  memcpy(record->mac, mac, ETHER_ADDR_LEN);
+  record->reserved = 0;
+  /* Counted once whole */
+  ++header->nrecords;
+  return 0;
+}
+
+
+/* Starts the writeback of the file if the last one is older than
+   CHECKPOINT_SYNC_INTERVAL, without waiting for it
+
+   now: CLOCK_MONOTONIC time, in nanoseconds
+ */
+void checkpoint_sync(struct checkpoint *cp, uint64_t now)
+{
+  if (now - cp->last_sync < CHECKPOINT_SYNC_INTERVAL)
+    return;
+  cp->last_sync = now;
+  /* The stores in a shared mapping dirty the pages of the file itself:
+     only the pages written since the last call are queued for writing,
+     and msync(MS_ASYNC) would do nothing at all on Linux */
+  sync_file_range(cp->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+
+/* Writes the file to the disk, and closes it
+
+   Returns 0 on success, -1 on a write error.
+ */
+int checkpoint_close(struct checkpoint *cp)
+{
+  if (cp->fd == -1)
+    return 0;
+  int status = 0;
+  if (msync(cp->header, cp->states_len, MS_SYNC) == -1
+      || msync(cp->records, cp->header->capacity * sizeof(struct checkpoint_record), MS_SYNC) == -1)
+    status = -1;
+  int err = errno;
+  munmap(cp->records, cp->header->capacity * sizeof(struct checkpoint_record));
+  munmap(cp->header, cp->states_len);
+  close(cp->fd);
+  cp->fd = -1;
+  cp->header = NULL;
+  cp->states = NULL;
+  cp->records = NULL;
+  errno = err;
+  return status;
+}
@@ -0,0 +1,102 @@
+/* Satrap/checkpoint.h */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+
+
+#define CHECKPOINT_MAGIC "SATRAPCK"
+#define CHECKPOINT_VERSION 1
+
+/* Nanoseconds between two flushes of the state file to the disk */
+#define CHECKPOINT_SYNC_INTERVAL 1000000000ULL
+
+/* Host records the file has room for at first, doubled when full */
+#define CHECKPOINT_DEFAULT_RECORDS 4096
+
+
+/* Header of a state file, in its first page. The file is in the byte
+   order of the host which wrote it. */
+struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t complete; /* set once the scan is over */
+  uint32_t first; /* first address of the range, host byte order */
+  uint32_t count; /* number of addresses in the range */
+  uint32_t next; /* offset of the next address never probed */
+  uint32_t reserved;
+  uint64_t sent, answered, lost; /* counters of the engine */
+  uint64_t nrecords; /* host records written */
+  uint64_t capacity; /* room for host records */
+};
+
+
+/* Host found by the scan */
+struct checkpoint_record {
+  uint32_t ip; /* network byte order */
+  unsigned char mac[ETHER_ADDR_LEN];
+  uint16_t reserved;
+};
+
+
+/* Progress of a scan, in a memory-mapped state file: the header, the
+   state of every address of the range (one byte each, as in the
+   engine), then the records of the hosts found. Every change is a
+   store in the mapping, so a process which dies loses nothing; the
+   file is flushed to the disk in the background, every
+   CHECKPOINT_SYNC_INTERVAL. */
+struct checkpoint {
+  int fd;
+  struct checkpoint_header *header; /* mapping of the header and states */
+  unsigned char *states;
+  size_t states_len; /* of the mapping, header included */
+  struct checkpoint_record *records; /* mapping of the records */
+  size_t records_offset; /* in the file */
+  int resumed; /* the file holds the progress of an earlier run */
+  uint64_t last_sync;
+};
+
+
+/* Opens the state file of a scan, or creates it
+
+   cp: the checkpoint to initialize
+   path: the state file
+   first: first address of the range, host byte order
+   count: number of addresses in the range
+
+   Returns 0 on success, -1 on error (EINVAL if the file is the state
+   of another scan, or is damaged).
+ */
+int checkpoint_open(struct checkpoint *cp, const char *path, uint32_t first, uint32_t count);
+
+
+/* Records a host found by the scan
+
+   Returns 0 on success, -1 if the file could not grow.
+ */
+int checkpoint_add_host(struct checkpoint *cp, struct in_addr ip, const unsigned char *mac);
+
+
+/* Starts the writeback of the file if the last one is older than
+   CHECKPOINT_SYNC_INTERVAL, without waiting for it
+
+   now: CLOCK_MONOTONIC time, in nanoseconds
+ */
+void checkpoint_sync(struct checkpoint *cp, uint64_t now);
+
+
+/* Writes the file to the disk, and closes it
+
+   Returns 0 on success, -1 on a write error.
+ */
+int checkpoint_close(struct checkpoint *cp);
+
+
+
+#endif /* CHECKPOINT_H_ */
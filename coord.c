@@ -0,0 +1,877 @@
+/* Satrap/coord.c */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "coord.h"
+
+
+
+/* ====================================================================== */
+
+/* CONNECTIONS */
+
+/* Sends as much of the output as the socket takes
+
+   Returns 0 on success, -1 on error.
+ */
+static int conn_flush(struct coord_conn *conn)
+{
+  size_t sent = 0;
+  while (sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + sent, conn->out_len - sent,
+		     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return -1;
+    }
+    sent += n;
+  }
+  memmove(conn->out, conn->out + sent, conn->out_len - sent);
+  conn->out_len -= sent;
+  return 0;
+}
+
+
+/* Sends a line, or queues it if the socket is full
+
+   Returns 0 on success, -1 on error (ENOBUFS if too much output is
+   waiting already).
+ */
+static int conn_send(struct coord_conn *conn, const char *format, ...)
+{
+  char line[COORD_LINE_LEN];
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(line, sizeof(line) - 1, format, ap);
+  va_end(ap);
+  if (n < 0 || (size_t) n >= sizeof(line) - 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  line[n++] = '\n';
+
+  if (conn->out_len + n > conn->out_size) {
+    size_t size = conn->out_size ? 2 * conn->out_size : 4096;
+    while (size < conn->out_len + n)
+      size *= 2;
+    if (size > COORD_MAX_OUTPUT) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    char *out = realloc(conn->out, size);
+    if (!out)
+      return -1;
+    conn->out = out;
+    conn->out_size = size;
+  }
+  memcpy(conn->out + conn->out_len, line, n);
+  conn->out_len += n;
+  return conn_flush(conn);
+}
+
+
+/* Reads what the socket has, and hands every complete line to the
+   handler, without its end of line. The handler returns 0 to go on,
+   1 to stop reading (the connection may be closed then), or -1 on
+   error.
+
+   Returns 0 on success, 1 if the handler stopped the reading, -1 on
+   error (ECONNRESET if the peer closed the connection, EPROTO if a
+   line is too long).
+ */
+static int conn_read(struct coord_conn *conn, int (*handler)(void *arg, char *line), void *arg)
+{
+  ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+		   sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+  if (n == -1)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  if (n == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  conn->in_len += n;
+
+  size_t start = 0;
+  char *end;
+  while ((end = memchr(conn->in + start, '\n', conn->in_len - start))) {
+    *end = 0;
+    char *line = conn->in + start;
+    start = end + 1 - conn->in;
+    if (end > line && end[-1] == '\r')
+      end[-1] = 0;
+    int status = handler(arg, line);
+    if (status != 0)
+      return status;
+  }
+  if (start == 0 && conn->in_len == sizeof(conn->in)) {
+    errno = EPROTO;
+    return -1;
+  }
+  memmove(conn->in, conn->in + start, conn->in_len - start);
+  conn->in_len -= start;
+  return 0;
+}
+
+
+static void conn_close(struct reactor *reactor, struct coord_conn *conn)
+{
+  if (conn->source)
+    reactor_remove(reactor, conn->source);
+  conn->source = NULL;
+  if (conn->fd >= 0)
+    close(conn->fd);
+  conn->fd = -1;
+  free(conn->out);
+  conn->out = NULL;
+  conn->out_len = conn->out_size = 0;
+  conn->in_len = 0;
+}
+
+
+/* Parses an address "<port>" or "<IPv4 address>:<port>", the IP
+   address being 127.0.0.1 if omitted
+
+   Returns 0 on success, -1 with errno set to EINVAL if the address is
+   not valid.
+ */
+int coord_parse_address(const char *address, struct sockaddr_in *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const char *port = strrchr(address, ':');
+  if (port) {
+    char host[INET_ADDRSTRLEN];
+    size_t len = port - address;
+    if (len >= sizeof(host)) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(host, address, len);
+    host[len] = 0;
+    if (!inet_pton(AF_INET, host, &addr->sin_addr)) {
+      errno = EINVAL;
+      return -1;
+    }
+    ++port;
+  }
+  else
+    port = address;
+  char *end;
+  unsigned long n = strtoul(port, &end, 10);
+  if (*port == 0 || *end != 0 || n == 0 || n > 65535) {
+    errno = EINVAL;
+    return -1;
+  }
+  addr->sin_port = htons(n);
+  return 0;
+}
+
+
+/* Parses a hardware address "xx:xx:xx:xx:xx:xx"
+
+   Returns 0 on success, -1 if the address is not valid.
+ */
+static int parse_mac(const char *s, unsigned char *mac)
+{
+  unsigned int bytes[ETHER_ADDR_LEN];
+  char end;
+  if (sscanf(s, "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2],
+	     &bytes[3], &bytes[4], &bytes[5], &end) != ETHER_ADDR_LEN)
+    return -1;
+  for (int i = 0; i < ETHER_ADDR_LEN; ++i) {
+    if (bytes[i] > 0xff)
+      return -1;
+    mac[i] = bytes[i];
+  }
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* COORDINATOR */
+
+/* Initializes a coordinator, without shards
+
+   hosts: table where the hosts are merged
+   shard_prefix: size of the shards, as a network prefix
+ */
+void coord_init(struct coordinator *coord, struct host_table *hosts, unsigned int shard_prefix)
+{
+  memset(coord, 0, sizeof(*coord));
+  coord->hosts = hosts;
+  coord->shard_prefix = shard_prefix > 32 ? 32 : shard_prefix;
+  coord->agent_timeout = COORD_DEFAULT_AGENT_TIMEOUT;
+  coord->shard_timeout = COORD_DEFAULT_SHARD_TIMEOUT;
+  coord->listenfd = -1;
+}
+
+
+/* Appends a pending shard (host byte order). The array may move.
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+static int add_shard(struct coordinator *coord, uint32_t first, uint32_t last)
+{
+  if (coord->nshards == coord->size) {
+    size_t size = coord->size ? 2 * coord->size : 64;
+    struct coord_shard *shards = realloc(coord->shards, size * sizeof(*shards));
+    if (!shards)
+      return -1;
+    coord->shards = shards;
+    coord->size = size;
+  }
+  struct coord_shard *shard = &coord->shards[coord->nshards++];
+  memset(shard, 0, sizeof(*shard));
+  shard->first = first;
+  shard->last = last;
+  return 0;
+}
+
+
+/* Adds the shards of a range of addresses, aligned on the size of the
+   shards
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int coord_add_range(struct coordinator *coord, struct in_addr first, struct in_addr last)
+{
+  uint32_t mask = coord->shard_prefix ? ~0U << (32 - coord->shard_prefix) : 0;
+  uint32_t start = ntohl(first.s_addr), end = ntohl(last.s_addr);
+  if (end < start) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (;;) {
+    uint32_t shard_end = (start & mask) | ~mask;
+    if (shard_end > end)
+      shard_end = end;
+    if (add_shard(coord, start, shard_end) == -1)
+      return -1;
+    if (shard_end == end)
+      return 0;
+    start = shard_end + 1;
+  }
+}
+
+
+static void close_peer(struct coordinator *coord, struct coord_peer *peer)
+{
+  struct coord_peer **p = &coord->peers;
+  while (*p != peer)
+    p = &(*p)->next;
+  *p = peer->next;
+  --coord->npeers;
+  conn_close(coord->reactor, &peer->conn);
+  free(peer);
+}
+
+
+/* Takes a shard back from an agent which did not finish it: it goes
+   back to the pending ones, unless another agent scans it too */
+static void release_shard(struct coordinator *coord, struct coord_peer *peer)
+{
+  if (peer->shard < 0)
+    return;
+  struct coord_shard *shard = &coord->shards[peer->shard];
+  --shard->agents;
+  if (shard->state == SHARD_ASSIGNED && shard->agents == 0) {
+    shard->state = SHARD_PENDING;
+    ++coord->reassigned;
+  }
+  peer->shard = -1;
+}
+
+
+/* Drops an agent, dead or gone */
+static void drop_peer(struct coordinator *coord, struct coord_peer *peer)
+{
+  release_shard(coord, peer);
+  if (!coord->finished)
+    ++coord->lost_peers;
+#ifdef DEBUG
+  printf("[OK] Agent %s left (%lu shards, %lu hosts)\n",
+	 peer->hello ? peer->name : "(unnamed)", peer->shards, peer->hosts);
+#endif
+  close_peer(coord, peer);
+}
+
+
+static int reachable(const struct coord_peer *peer, const struct coord_shard *shard)
+{
+  return peer->hello
+    && (shard->first & peer->mask) == peer->network
+    && (shard->last & peer->mask) == peer->network;
+}
+
+
+/* Cuts a pending shard which overlaps the network of an agent, but
+   does not fit in it (the agent is on a network smaller than a
+   shard): the shard keeps the overlap, the rest goes to new shards at
+   the end, so the ids already given out stay valid.
+
+   Returns 1 if the shard was cut, 0 otherwise.
+ */
+static int split_shard(struct coordinator *coord, const struct coord_peer *peer, size_t i)
+{
+  uint32_t net_first = peer->network, net_last = peer->network | ~peer->mask;
+  struct coord_shard *shard = &coord->shards[i];
+  if (!peer->hello || shard->state != SHARD_PENDING
+      || shard->first > net_last || shard->last < net_first)
+    return 0;
+  uint32_t first = shard->first, last = shard->last;
+  uint32_t cut_first = first > net_first ? first : net_first;
+  uint32_t cut_last = last < net_last ? last : net_last;
+  if ((cut_first > first && add_shard(coord, first, cut_first - 1) == -1)
+      || (cut_last < last && add_shard(coord, cut_last + 1, last) == -1))
+    return 0;
+  shard = &coord->shards[i];
+  shard->first = cut_first;
+  shard->last = cut_last;
+  return 1;
+}
+
+
+static void give_shard(struct coordinator *coord, struct coord_peer *peer, size_t i)
+{
+  struct coord_shard *shard = &coord->shards[i];
+  if (shard->state == SHARD_ASSIGNED)
+    ++coord->speculative;
+  shard->state = SHARD_ASSIGNED;
+  ++shard->agents;
+  shard->assigned = hosts_now();
+  peer->shard = i;
+
+  char first[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
+  struct in_addr ip;
+  ip.s_addr = htonl(shard->first);
+  inet_ntop(AF_INET, &ip, first, sizeof(first));
+  ip.s_addr = htonl(shard->last);
+  inet_ntop(AF_INET, &ip, last, sizeof(last));
+  if (conn_send(&peer->conn, "SHARD %zu %s %s", i, first, last) == -1)
+    peer->failed = 1;
+}
+
+
+/* Gives an idle agent the first pending shard it can reach, or else
+   the oldest shard which takes too long, if it can reach it */
+static void assign(struct coordinator *coord, struct coord_peer *peer)
+{
+  if (!peer->hello || peer->failed || peer->shard >= 0 || coord->finished)
+    return;
+  uint64_t deadline = hosts_now() - coord->shard_timeout * 1000000000ULL;
+  int64_t slow = -1;
+  for (size_t i = 0; i < coord->nshards; ++i) {
+    struct coord_shard *shard = &coord->shards[i];
+    if (!reachable(peer, shard) && !split_shard(coord, peer, i))
+      continue;
+    shard = &coord->shards[i];
+    if (shard->state == SHARD_PENDING) {
+      give_shard(coord, peer, i);
+      return;
+    }
+    /* A second agent at most */
+    if (shard->state == SHARD_ASSIGNED && shard->agents == 1
+	&& shard->assigned <= deadline
+	&& (slow < 0 || shard->assigned < coord->shards[slow].assigned))
+      slow = i;
+  }
+  if (slow >= 0)
+    give_shard(coord, peer, slow);
+}
+
+
+static void assign_all(struct coordinator *coord)
+{
+  for (struct coord_peer *peer = coord->peers; peer; peer = peer->next)
+    assign(coord, peer);
+}
+
+
+/* Says BYE to the agents once every shard is scanned, and calls the
+   done callback once they are gone, or too late to wait for */
+static void check_done(struct coordinator *coord)
+{
+  if (coord->done < coord->nshards)
+    return;
+  if (!coord->finished) {
+    coord->finished = 1;
+    coord->finish_time = hosts_now();
+    for (struct coord_peer *peer = coord->peers; peer; peer = peer->next) {
+      /* The agents leave on their own: closing with their heartbeats
+	 unread would reset the connection before they read BYE */
+      if (conn_send(&peer->conn, "BYE") == -1)
+	peer->failed = 1;
+    }
+  }
+  if (coord->npeers == 0
+      || hosts_now() - coord->finish_time >= coord->agent_timeout * 1000000000ULL) {
+    if (coord->done_callback) {
+      coord_done_callback done = coord->done_callback;
+      coord->done_callback = NULL;
+      done(coord, coord->done_arg);
+    }
+  }
+}
+
+
+/* Handles a line from an agent */
+static int handle_peer_line(void *arg, char *line)
+{
+  struct coord_peer *peer = arg;
+  struct coordinator *coord = peer->coord;
+  peer->last_seen = hosts_now();
+
+  char name[COORD_LINE_LEN], ip_str[INET_ADDRSTRLEN], mac_str[24];
+  unsigned int prefix;
+  long id;
+  unsigned long sent, answered;
+  struct in_addr ip;
+
+  if (!strncmp(line, "HELLO ", 6)) {
+    if (sscanf(line, "HELLO %127s %15[0-9.]/%u", name, ip_str, &prefix) != 3
+	|| !inet_pton(AF_INET, ip_str, &ip) || prefix > 32 || peer->hello)
+      goto invalid;
+    strcpy(peer->name, name);
+    peer->mask = prefix ? ~0U << (32 - prefix) : 0;
+    peer->network = ntohl(ip.s_addr) & peer->mask;
+    peer->hello = 1;
+#ifdef DEBUG
+    printf("[OK] Agent %s joined, for %s/%u\n", name, ip_str, prefix);
+#endif
+    assign(coord, peer);
+  }
+  /* Nothing counts from a connection which did not introduce itself */
+  else if (!peer->hello)
+    goto invalid;
+  else if (!strncmp(line, "PROGRESS ", 9)) {
+    /* The heartbeat: last_seen is enough */
+  }
+  else if (!strncmp(line, "HOST ", 5)) {
+    unsigned char mac[ETHER_ADDR_LEN];
+    if (sscanf(line, "HOST %ld %15s %23s", &id, ip_str, mac_str) != 3
+	|| !inet_pton(AF_INET, ip_str, &ip) || parse_mac(mac_str, mac) == -1)
+      goto invalid;
+    ++peer->hosts;
+    /* Hosts from a cancelled shard are good too */
+    const struct host_entry *entry = hosts_lookup(coord->hosts, ip);
+    int known = entry && entry->state == HOST_ALIVE;
+    if (!hosts_update(coord->hosts, ip, mac))
+      return -1;
+    if (!known && coord->callback)
+      coord->callback(ip, mac, peer, coord->callback_arg);
+  }
+  else if (!strncmp(line, "DONE ", 5)) {
+    if (sscanf(line, "DONE %ld %lu %lu", &id, &sent, &answered) != 3
+	|| id < 0 || (size_t) id >= coord->nshards)
+      goto invalid;
+    if (peer->shard < 0 || id != peer->shard) {
+      /* After a CANCEL, the agent may finish the shard all the same:
+	 only a shard done by another agent was cancelled */
+      if (coord->shards[id].state == SHARD_DONE)
+	return 0;
+      goto invalid;
+    }
+    struct coord_shard *shard = &coord->shards[id];
+    --shard->agents;
+    peer->shard = -1;
+    if (shard->state != SHARD_DONE) {
+      shard->state = SHARD_DONE;
+      ++coord->done;
+      ++peer->shards;
+      /* Another agent may still scan it */
+      for (struct coord_peer *other = coord->peers; other; other = other->next) {
+	if (other->shard != id)
+	  continue;
+	--shard->agents;
+	other->shard = -1;
+	if (conn_send(&other->conn, "CANCEL %ld", id) == -1)
+	  other->failed = 1;
+      }
+    }
+    assign_all(coord);
+  }
+  else
+    goto invalid;
+  return 0;
+
+ invalid:
+  errno = EPROTO;
+  return -1;
+}
+
+
+static void on_peer(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct coord_peer *peer = arg;
+  struct coordinator *coord = peer->coord;
+  if (conn_read(&peer->conn, handle_peer_line, peer) == -1) {
+#ifdef DEBUG
+    if (errno != ECONNRESET)
+      perror("[FAIL] conn_read() (agent)");
+#endif
+    drop_peer(coord, peer);
+  }
+  check_done(coord);
+}
+
+
+static void on_connection(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct coordinator *coord = arg;
+  int peerfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (peerfd == -1)
+    return;
+
+  struct coord_peer *peer = calloc(1, sizeof(*peer));
+  if (!peer) {
+    close(peerfd);
+    return;
+  }
+  peer->coord = coord;
+  peer->conn.fd = peerfd;
+  peer->shard = -1;
+  peer->last_seen = hosts_now();
+  peer->conn.source = reactor_add_fd(reactor, peerfd, EPOLLIN, on_peer, peer);
+  if (!peer->conn.source) {
+    close(peerfd);
+    free(peer);
+    return;
+  }
+  peer->next = coord->peers;
+  coord->peers = peer;
+  ++coord->npeers;
+}
+
+
+/* Drops the silent agents and those whose output failed, sends what
+   waits, and gives the idle agents the shards taken back or too slow */
+static void on_tick(struct reactor *reactor, void *arg)
+{
+  struct coordinator *coord = arg;
+  uint64_t now = hosts_now();
+  struct coord_peer *next;
+  for (struct coord_peer *peer = coord->peers; peer; peer = next) {
+    next = peer->next;
+    if (!peer->failed && conn_flush(&peer->conn) == -1)
+      peer->failed = 1;
+    if (peer->failed || now - peer->last_seen >= coord->agent_timeout * 1000000000ULL)
+      drop_peer(coord, peer);
+  }
+  assign_all(coord);
+  check_done(coord);
+}
+
+
+/* Listens for the agents on an event loop, and hands them the shards
+
+   address: as for coord_parse_address()
+
+   Returns 0 on success, -1 on error.
+ */
+int coord_start(struct coordinator *coord, struct reactor *reactor, const char *address)
+{
+  struct sockaddr_in addr;
+  if (coord_parse_address(address, &addr) == -1)
+    return -1;
+  coord->reactor = reactor;
+
+  coord->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (coord->listenfd == -1)
+    return -1;
+  int one = 1;
+  if (setsockopt(coord->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+      || bind(coord->listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || listen(coord->listenfd, SOMAXCONN) == -1)
+    goto fail;
+
+  coord->listener = reactor_add_fd(reactor, coord->listenfd, EPOLLIN, on_connection, coord);
+  if (!coord->listener)
+    goto fail;
+  coord->timer = reactor_add_timer(reactor, on_tick, coord);
+  if (!coord->timer || reactor_set_timer(coord->timer, COORD_TICK, COORD_TICK) == -1)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    coord_stop(coord);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Closes the connections and stops listening */
+void coord_stop(struct coordinator *coord)
+{
+  while (coord->peers) {
+    release_shard(coord, coord->peers);
+    close_peer(coord, coord->peers);
+  }
+  if (coord->listener)
+    reactor_remove(coord->reactor, coord->listener);
+  if (coord->timer)
+    reactor_remove(coord->reactor, coord->timer);
+  coord->listener = coord->timer = NULL;
+  if (coord->listenfd >= 0)
+    close(coord->listenfd);
+  coord->listenfd = -1;
+}
+
+
+/* Frees the memory used by the coordinator */
+void coord_free(struct coordinator *coord)
+{
+  free(coord->shards);
+  coord->shards = NULL;
+  coord->nshards = coord->size = 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* AGENT */
+
+/* Initializes an agent
+
+   engine: engine set up on the interface of the agent, for the range
+   of its network; the callback of the engine is still called for
+   every host, but the agent takes its done callback
+   name: name of the agent for the coordinator, without spaces
+   local: local address whose network the agent scans
+   prefix: length of the prefix of the network
+
+   Returns 0 on success, -1 with errno set to EINVAL if the name is
+   not valid.
+ */
+int scan_agent_init(struct scan_agent *agent, struct scan_engine *engine, const char *name, struct in_addr local, unsigned int prefix)
+{
+  memset(agent, 0, sizeof(*agent));
+  if (!*name || strlen(name) >= sizeof(agent->name) - 32 || strpbrk(name, " \t\r\n")
+      || prefix > 32) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(agent->name, name);
+  agent->engine = engine;
+  agent->prefix = prefix;
+  agent->network = ntohl(local.s_addr) & (prefix ? ~0U << (32 - prefix) : 0);
+  agent->first = engine->first;
+  agent->last = engine->first + engine->count - 1;
+  agent->callback = engine->callback;
+  agent->callback_arg = engine->callback_arg;
+  agent->conn.fd = -1;
+  agent->shard = -1;
+  return 0;
+}
+
+
+static void agent_finish(struct scan_agent *agent, int status)
+{
+  int err = errno;
+  scan_agent_stop(agent);
+  errno = err;
+  if (agent->done)
+    agent->done(agent, status, agent->done_arg);
+}
+
+
+/* Host callback of the engine: the host goes to the coordinator */
+static void agent_host(struct in_addr ip, const unsigned char *mac, void *arg)
+{
+  struct scan_agent *agent = arg;
+  if (conn_send(&agent->conn, "HOST %ld %s %02x:%02x:%02x:%02x:%02x:%02x",
+		(long) agent->shard, inet_ntoa(ip), mac[0], mac[1], mac[2],
+		mac[3], mac[4], mac[5]) == -1 && !agent->error)
+    agent->error = errno;
+  if (agent->callback)
+    agent->callback(ip, mac, agent->callback_arg);
+}
+
+
+/* Done callback of the engine: the shard is scanned */
+static void agent_shard_done(struct scan_engine *engine, int status, void *arg)
+{
+  struct scan_agent *agent = arg;
+  agent->scanning = 0;
+  if (status == -1) {
+    agent_finish(agent, -1);
+    return;
+  }
+  ++agent->shards;
+  agent->sent += engine->sent;
+  agent->answered += engine->answered;
+  if (conn_send(&agent->conn, "DONE %ld %lu %lu", (long) agent->shard,
+		engine->sent, engine->answered) == -1 && !agent->error)
+    agent->error = errno;
+  agent->shard = -1;
+}
+
+
+/* Starts the scan of a shard, cut to the network of the agent */
+static int start_shard(struct scan_agent *agent, long id, struct in_addr first, struct in_addr last)
+{
+  uint32_t start = ntohl(first.s_addr), end = ntohl(last.s_addr);
+  if (start < agent->first)
+    start = agent->first;
+  if (end > agent->last)
+    end = agent->last;
+  agent->shard = id;
+  if (start > end) {
+    /* Nothing worth probing, e.g. the network address alone */
+    agent->shard = -1;
+    return conn_send(&agent->conn, "DONE %ld 0 0", id);
+  }
+
+  first.s_addr = htonl(start);
+  last.s_addr = htonl(end);
+  if (scan_reset(agent->engine, first, last) == -1)
+    return -1;
+  agent->engine->callback = agent_host;
+  agent->engine->callback_arg = agent;
+  agent->engine->done = agent_shard_done;
+  agent->engine->done_arg = agent;
+  if (scan_start(agent->engine, agent->reactor) == -1)
+    return -1;
+  agent->scanning = 1;
+  return 0;
+}
+
+
+/* Handles a line from the coordinator */
+static int handle_agent_line(void *arg, char *line)
+{
+  struct scan_agent *agent = arg;
+  char first_str[INET_ADDRSTRLEN], last_str[INET_ADDRSTRLEN];
+  struct in_addr first, last;
+  long id;
+
+  if (!strncmp(line, "SHARD ", 6)) {
+    if (sscanf(line, "SHARD %ld %15s %15s", &id, first_str, last_str) != 3
+	|| id < 0 || !inet_pton(AF_INET, first_str, &first)
+	|| !inet_pton(AF_INET, last_str, &last) || agent->scanning)
+      goto invalid;
+    return start_shard(agent, id, first, last);
+  }
+  if (!strncmp(line, "CANCEL ", 7)) {
+    if (sscanf(line, "CANCEL %ld", &id) != 1)
+      goto invalid;
+    if (agent->scanning && id == agent->shard) {
+      scan_stop(agent->engine);
+      agent->scanning = 0;
+      agent->shard = -1;
+    }
+    return 0;
+  }
+  if (!strcmp(line, "BYE"))
+    return 1;
+
+ invalid:
+  errno = EPROTO;
+  return -1;
+}
+
+
+static void on_coordinator(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct scan_agent *agent = arg;
+  int status = conn_read(&agent->conn, handle_agent_line, agent);
+  if (status == -1)
+    agent_finish(agent, -1);
+  else if (status == 1)
+    agent_finish(agent, 0);
+}
+
+
+/* Tells the coordinator that the agent is alive, with its progress */
+static void on_heartbeat(struct reactor *reactor, void *arg)
+{
+  struct scan_agent *agent = arg;
+  if (agent->error) {
+    errno = agent->error;
+    agent_finish(agent, -1);
+    return;
+  }
+  struct scan_engine *engine = agent->engine;
+  if (conn_send(&agent->conn, "PROGRESS %ld %u %u", (long) agent->shard,
+		agent->scanning ? engine->next : 0, agent->scanning ? engine->count : 0) == -1)
+    agent_finish(agent, -1);
+}
+
+
+/* Connects to the coordinator, and scans the shards it gives until it
+   says BYE. The done callback of the agent is called then, with
+   status 0, or with -1 if the connection or a scan fails.
+
+   address: of the coordinator, as for coord_parse_address()
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_agent_start(struct scan_agent *agent, struct reactor *reactor, const char *address)
+{
+  struct sockaddr_in addr;
+  if (coord_parse_address(address, &addr) == -1)
+    return -1;
+  agent->reactor = reactor;
+
+  /* The connection is the only blocking step */
+  agent->conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (agent->conn.fd == -1)
+    return -1;
+  if (connect(agent->conn.fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || fcntl(agent->conn.fd, F_SETFL, O_NONBLOCK) == -1)
+    goto fail;
+
+  agent->conn.source = reactor_add_fd(reactor, agent->conn.fd, EPOLLIN, on_coordinator, agent);
+  if (!agent->conn.source)
+    goto fail;
+  agent->timer = reactor_add_timer(reactor, on_heartbeat, agent);
+  if (!agent->timer
+      || reactor_set_timer(agent->timer, COORD_HEARTBEAT, COORD_HEARTBEAT) == -1)
+    goto fail;
+
+  struct in_addr network = { htonl(agent->network) };
+  if (conn_send(&agent->conn, "HELLO %s %s/%u", agent->name, inet_ntoa(network),
+		agent->prefix) == -1)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    scan_agent_stop(agent);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Disconnects from the coordinator, and stops the scan of a shard */
+void scan_agent_stop(struct scan_agent *agent)
+{
+  if (agent->scanning)
+    scan_stop(agent->engine);
+  agent->scanning = 0;
+  if (agent->timer)
+    reactor_remove(agent->reactor, agent->timer);
+  agent->timer = NULL;
+  conn_close(agent->reactor, &agent->conn);
+}
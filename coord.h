@@ -0,0 +1,254 @@
+/* Satrap/coord.h */
+
+#ifndef COORD_H_
+#define COORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "hosts.h"
+#include "reactor.h"
+#include "scan.h"
+
+
+
+/* Protocol between a coordinator and its agents: lines of text over
+   TCP, the agent being the client.
+
+   agent -> coordinator
+     HELLO <name> <network>/<prefix>    the network the agent can scan
+     PROGRESS <shard> <probed> <count>  every second (shard -1 if idle)
+     HOST <shard> <ip> <mac>            for every host found
+     DONE <shard> <sent> <answered>     the shard is scanned
+
+   coordinator -> agent
+     SHARD <shard> <first ip> <last ip> scan this range
+     CANCEL <shard>                     another agent scanned it first
+     BYE                                every shard is scanned
+
+   An agent scans one shard at a time, and is given the next one when
+   it is done. */
+
+/* Longest line of the protocol */
+#define COORD_LINE_LEN 128
+
+/* Bytes waiting to be sent on a connection before it is closed: the
+   output is never waited for */
+#define COORD_MAX_OUTPUT (4 << 20)
+
+/* Default size of the shards, as a network prefix */
+#define COORD_DEFAULT_SHARD_PREFIX 24
+
+/* Default seconds of silence after which an agent is dead */
+#define COORD_DEFAULT_AGENT_TIMEOUT 5
+
+/* Default seconds after which a shard is also given to an idle agent */
+#define COORD_DEFAULT_SHARD_TIMEOUT 60
+
+/* Nanoseconds between two checks of the coordinator, and two
+   PROGRESS messages of an agent */
+#define COORD_TICK 500000000ULL
+#define COORD_HEARTBEAT 1000000000ULL
+
+
+/* Line-oriented connection, without blocking: the output waits in a
+   buffer while the socket is full */
+struct coord_conn {
+  int fd;
+  struct reactor_source *source;
+  char in[4 * COORD_LINE_LEN];
+  size_t in_len;
+  char *out;
+  size_t out_len, out_size;
+};
+
+
+/* State of a shard */
+enum shard_state {
+  SHARD_PENDING = 0, /* waiting for an agent */
+  SHARD_ASSIGNED, /* being scanned */
+  SHARD_DONE
+};
+
+
+/* Range of addresses scanned by a single agent */
+struct coord_shard {
+  uint32_t first, last; /* host byte order */
+  enum shard_state state;
+  unsigned int agents; /* scanning it */
+  uint64_t assigned; /* CLOCK_MONOTONIC time of the last assignment */
+};
+
+
+struct coordinator;
+
+
+/* Agent connected to a coordinator */
+struct coord_peer {
+  struct coord_peer *next;
+  struct coordinator *coord;
+  struct coord_conn conn;
+  char name[COORD_LINE_LEN];
+  uint32_t network, mask; /* host byte order, valid after HELLO */
+  int hello;
+  int failed; /* dropped at the next check */
+  int64_t shard; /* being scanned, -1 if none */
+  uint64_t last_seen;
+  unsigned long shards, hosts; /* scanned, found */
+};
+
+
+/* Called for every host seen for the first time */
+typedef void (*coord_host_callback)(struct in_addr ip, const unsigned char *mac, const struct coord_peer *peer, void *arg);
+
+/* Called once every shard is scanned, and the agents have left (or
+   had agent_timeout to do so) */
+typedef void (*coord_done_callback)(struct coordinator *coord, void *arg);
+
+
+/* Coordinator of a distributed scan. The target ranges are split into
+   shards, handed to the agents whose network holds them (a shard
+   wider than the network of an agent is cut to it). The shard of
+   an agent which disconnects or goes silent goes back to the pending
+   ones, and a shard which takes too long is given to an idle agent
+   as well: the first one done wins. The hosts of every agent are
+   merged into a single host table. */
+struct coordinator {
+  struct coord_shard *shards;
+  size_t nshards, size;
+  size_t done; /* shards scanned */
+  unsigned int shard_prefix;
+
+  /* Parameters, may be changed before coord_start() */
+  unsigned int agent_timeout; /* seconds */
+  unsigned int shard_timeout; /* seconds */
+
+  struct host_table *hosts; /* where the hosts are merged */
+  coord_host_callback callback;
+  void *callback_arg;
+  coord_done_callback done_callback;
+  void *done_arg;
+
+  /* Between coord_start() and coord_stop() */
+  struct reactor *reactor;
+  int listenfd;
+  struct reactor_source *listener, *timer;
+  struct coord_peer *peers;
+  unsigned int npeers;
+  int finished; /* BYE sent, waiting for the agents to leave */
+  uint64_t finish_time;
+
+  /* Statistics */
+  unsigned long reassigned; /* shards taken back from an agent */
+  unsigned long speculative; /* shards given to a second agent */
+  unsigned long lost_peers; /* agents dead or disconnected */
+};
+
+
+/* Agent of a distributed scan: it scans the shards its coordinator
+   gives it, with an engine set up on its interface, and sends back
+   the hosts found */
+struct scan_agent {
+  struct scan_engine *engine;
+  char name[COORD_LINE_LEN];
+  uint32_t network; /* host byte order */
+  unsigned int prefix;
+  uint32_t first, last; /* range of the engine, host byte order */
+
+  /* Callback of the engine, called after the agent's own */
+  scan_callback callback;
+  void *callback_arg;
+
+  /* Called when the agent is done */
+  void (*done)(struct scan_agent *agent, int status, void *arg);
+  void *done_arg;
+
+  /* Between scan_agent_start() and the end */
+  struct reactor *reactor;
+  struct coord_conn conn;
+  struct reactor_source *timer;
+  int64_t shard; /* being scanned, -1 if none */
+  int scanning; /* the engine runs */
+  int error; /* errno of a failed send, handled at the next heartbeat */
+
+  /* Statistics */
+  unsigned long shards, sent, answered;
+};
+
+
+/* Parses an address "<port>" or "<IPv4 address>:<port>", the IP
+   address being 127.0.0.1 if omitted
+
+   Returns 0 on success, -1 with errno set to EINVAL if the address is
+   not valid.
+ */
+int coord_parse_address(const char *address, struct sockaddr_in *addr);
+
+
+/* Initializes a coordinator, without shards
+
+   hosts: table where the hosts are merged
+   shard_prefix: size of the shards, as a network prefix
+ */
+void coord_init(struct coordinator *coord, struct host_table *hosts, unsigned int shard_prefix);
+
+
+/* Adds the shards of a range of addresses, aligned on the size of the
+   shards
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int coord_add_range(struct coordinator *coord, struct in_addr first, struct in_addr last);
+
+
+/* Listens for the agents on an event loop, and hands them the shards
+
+   address: as for coord_parse_address()
+
+   Returns 0 on success, -1 on error.
+ */
+int coord_start(struct coordinator *coord, struct reactor *reactor, const char *address);
+
+
+/* Closes the connections and stops listening */
+void coord_stop(struct coordinator *coord);
+
+
+/* Frees the memory used by the coordinator */
+void coord_free(struct coordinator *coord);
+
+
+/* Initializes an agent
+
+   engine: engine set up on the interface of the agent, for the range
+   of its network; the callback of the engine is still called for
+   every host, but the agent takes its done callback
+   name: name of the agent for the coordinator, without spaces
+   local: local address whose network the agent scans
+   prefix: length of the prefix of the network
+
+   Returns 0 on success, -1 with errno set to EINVAL if the name is
+   not valid.
+ */
+int scan_agent_init(struct scan_agent *agent, struct scan_engine *engine, const char *name, struct in_addr local, unsigned int prefix);
+
+
+/* Connects to the coordinator, and scans the shards it gives until it
+   says BYE. The done callback of the agent is called then, with
+   status 0, or with -1 if the connection or a scan fails.
+
+   address: of the coordinator, as for coord_parse_address()
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_agent_start(struct scan_agent *agent, struct reactor *reactor, const char *address);
+
+
+/* Disconnects from the coordinator, and stops the scan of a shard */
+void scan_agent_stop(struct scan_agent *agent);
+
+
+
+#endif /* COORD_H_ */
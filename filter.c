@@ -0,0 +1,314 @@
+/* Satrap/filter.c */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/if_ether.h>
+#include <sys/socket.h>
+/* <linux/if_packet.h> conflicts with <netpacket/packet.h>, which is
+   included by arp.h, but we need struct tpacket_stats */
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+
+#include "filter.h"
+
+
+
+/* Initializes a filter
+
+   filter: the filter to initialize
+   macaddr: local hardware address
+   ipaddr: local IP address
+ */
+void filter_init(struct arp_filter *filter, const unsigned char *macaddr, struct in_addr ipaddr)
+{
+  memset(filter, 0, sizeof(*filter));
+  memcpy(filter->macaddr, macaddr, ETHER_ADDR_LEN);
+  filter_add_ip(filter, ipaddr);
+}
+
+
+/* Adds an IP address (for example an impersonated one) to the
+   accepted target addresses */
+void filter_add_ip(struct arp_filter *filter, struct in_addr ip)
+{
+  for (unsigned int i = 0; i < filter->nips; ++i)
+    if (filter->ips[i].s_addr == ip.s_addr)
+      return;
+
+  if (filter->nips < FILTER_MAX_IPS)
+    filter->ips[filter->nips++] = ip;
+  else
+    filter->any_ip = 1;
+}
+
+
+
+/* Compiles the filter to classic BPF and attaches it to a packet
+   socket (SO_ATTACH_FILTER). Works with SOCK_RAW and SOCK_DGRAM
+   sockets, bound to ETH_P_ARP or ETH_P_ALL.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach(int sockfd, const struct arp_filter *filter)
+{
+  /* On a SOCK_DGRAM socket, the filter sees the packet without its
+     link-layer header */
+  int type;
+  socklen_t typelen = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typelen) == -1)
+    return -1;
+  unsigned int base = (type == SOCK_RAW) ? ETHER_HDR_LEN : 0;
+
+  const unsigned char *mac = filter->macaddr;
+  unsigned int nips = filter->any_ip ? 0 : filter->nips;
+
+  /* Every check jumps to "drop" on failure. "drop" comes right after
+     the checks of the IP addresses, and "accept" right after it. */
+  const unsigned int drop = nips ? 9 + nips : 8;
+  const unsigned int accept = drop + 1;
+  struct sock_filter code[10 + FILTER_MAX_IPS];
+  unsigned int len = 0;
+
+  /* Relative offset of a jump from the current instruction */
+#define JUMP_TO(target) ((target) - len - 1)
+
+  /* EtherType, from the metadata of the packet, so it works with both
+     socket types */
+  code[len] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+  ++len;
+  code[len] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 0, JUMP_TO(drop));
+  ++len;
+
+  /* Operation code: ARP reply */
+  code[len] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, base + offsetof(struct ether_arp, arp_op));
+  ++len;
+  code[len] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, JUMP_TO(drop));
+  ++len;
+
+  /* Target hardware address: ours */
+  code[len] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, base + offsetof(struct ether_arp, arp_tha));
+  ++len;
+  code[len] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					    ((uint32_t) mac[0] << 24) | (mac[1] << 16) | (mac[2] << 8) | mac[3],
+					    0, JUMP_TO(drop));
+  ++len;
+  code[len] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, base + offsetof(struct ether_arp, arp_tha) + 4);
+  ++len;
+  code[len] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (mac[4] << 8) | mac[5],
+					    nips ? 0 : JUMP_TO(accept), JUMP_TO(drop));
+  ++len;
+
+  /* Target protocol address: one of the accepted ones */
+  if (nips) {
+    code[len] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, base + offsetof(struct ether_arp, arp_tpa));
+    ++len;
+    for (unsigned int i = 0; i < nips; ++i) {
+      code[len] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(filter->ips[i].s_addr),
+						JUMP_TO(accept), 0);
+      ++len;
+    }
+  }
+
+  /* drop: */
+  code[len] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+  ++len;
+  /* accept: the whole frame */
+  code[len] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0x40000);
+  ++len;
+
+#undef JUMP_TO
+
+  struct sock_fprog prog = { .len = len, .filter = code };
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+
+
+/* Attaches a filter which drops every frame, to a socket which is
+   only used to send
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_drop(int sockfd)
+{
+  struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+  struct sock_fprog prog = { .len = 1, .filter = code };
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+
+
+/* Attaches the filter of the passive discovery: the ARP frames, and
+   the IPv4 packets from an address of the local network, both cut to
+   their first header. The frames sent by the host are dropped.
+
+   local: local IP address
+   prefix: length of the prefix of the local network
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_passive(int sockfd, struct in_addr local, unsigned int prefix)
+{
+  int type;
+  socklen_t typelen = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typelen) == -1)
+    return -1;
+  unsigned int base = (type == SOCK_RAW) ? ETHER_HDR_LEN : 0;
+  uint32_t mask = prefix ? ~0U << (32 - (prefix > 32 ? 32 : prefix)) : 0;
+  uint32_t network = ntohl(local.s_addr) & mask;
+
+  /* Only the headers are copied: at a high rate of traffic, most of
+     the cost of a frame is its copy to the socket */
+  struct sock_filter code[] = {
+    /* 0: our own frames */
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 7, 0),
+    /* 2: ARP, IPv4 */
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 6, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 4),
+    /* 5: source address of the packet in the local network */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, base + 12),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, network, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, base + 20),
+    /* 9: drop */
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    /* 10: ARP */
+    BPF_STMT(BPF_RET | BPF_K, base + sizeof(struct ether_arp)),
+  };
+
+  struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+
+/* Attaches the filter of the restoration of the caches: the ARP frames
+   and the IPv4 packets sent to our hardware address, cut to their
+   first header. The frames heard for other hosts (on a hub, a bridge
+   or in promiscuous mode) and the broadcast frames are dropped.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_watch(int sockfd)
+{
+  int type;
+  socklen_t typelen = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typelen) == -1)
+    return -1;
+  unsigned int base = (type == SOCK_RAW) ? ETHER_HDR_LEN : 0;
+
+  struct sock_filter code[] = {
+    /* 0: frames for us only */
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 4),
+    /* 2: ARP, IPv4 */
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 3, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, base + 20),
+    /* 6: drop */
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    /* 7: ARP */
+    BPF_STMT(BPF_RET | BPF_K, base + sizeof(struct ether_arp)),
+  };
+
+  struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+
+
+/* ====================================================================== */
+
+/* STATISTICS */
+
+/* Reads one of the counters of the interface in sysfs
+
+   Returns 0 on success, -1 on error.
+ */
+static int read_link_counter(int ifindex, const char *counter, unsigned long *value)
+{
+  char if_name[IF_NAMESIZE];
+  if (!if_indextoname(ifindex, if_name))
+    return -1;
+
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", if_name, counter);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return -1;
+  int n = fscanf(file, "%lu", value);
+  fclose(file);
+  if (n != 1) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Frames received and sent on the interface, which is what an
+   ETH_P_ALL socket without filter would see */
+static int read_link_packets(int ifindex, unsigned long *packets)
+{
+  unsigned long rx, tx;
+  if (read_link_counter(ifindex, "rx_packets", &rx) == -1
+      || read_link_counter(ifindex, "tx_packets", &tx) == -1)
+    return -1;
+  *packets = rx + tx;
+  return 0;
+}
+
+
+
+/* Starts counting the frames of a capture socket
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_stats_init(struct filter_stats *stats, int sockfd, int ifindex)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->sockfd = sockfd;
+  stats->ifindex = ifindex;
+
+  /* Reading the statistics of the socket resets them */
+  struct tpacket_stats st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(sockfd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+    return -1;
+
+  return read_link_packets(ifindex, &stats->link_start);
+}
+
+
+/* Updates the statistics with the kernel counters (PACKET_STATISTICS
+   and the counters of the interface). The frames dropped by the
+   filter are link_packets - delivered.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_stats_update(struct filter_stats *stats)
+{
+  /* The first fields of struct tpacket_stats_v3 are the same, and the
+     kernel copies at most the size we give */
+  struct tpacket_stats st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(stats->sockfd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+    return -1;
+  /* tp_packets includes the dropped frames */
+  stats->delivered += st.tp_packets - st.tp_drops;
+  stats->dropped += st.tp_drops;
+
+  unsigned long link;
+  if (read_link_packets(stats->ifindex, &link) == -1)
+    return -1;
+  stats->link_packets = link - stats->link_start;
+
+  return 0;
+}
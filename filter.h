@@ -0,0 +1,107 @@
+/* Satrap/filter.h */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+
+
+/* Maximum number of target IP addresses checked by the filter. With
+   more addresses, only the hardware address is checked. */
+#define FILTER_MAX_IPS 64
+
+
+/* Capture filter: only the ARP replies sent to our hardware address,
+   for our IP address or one of the addresses we impersonate, reach
+   userspace. */
+struct arp_filter {
+  unsigned char macaddr[ETHER_ADDR_LEN]; /* our hardware address */
+  struct in_addr ips[FILTER_MAX_IPS]; /* accepted target IP addresses */
+  unsigned int nips;
+  int any_ip; /* set when there are too many addresses to check */
+};
+
+
+/* Statistics of a capture socket, since filter_stats_init() */
+struct filter_stats {
+  int sockfd, ifindex;
+  unsigned long link_start; /* link counters at initialization */
+  unsigned long link_packets; /* frames received and sent on the link */
+  unsigned long delivered; /* frames accepted by the filter */
+  unsigned long dropped; /* accepted, but dropped on a full socket */
+};
+
+
+/* Initializes a filter
+
+   filter: the filter to initialize
+   macaddr: local hardware address
+   ipaddr: local IP address
+ */
+void filter_init(struct arp_filter *filter, const unsigned char *macaddr, struct in_addr ipaddr);
+
+
+/* Adds an IP address (for example an impersonated one) to the
+   accepted target addresses */
+void filter_add_ip(struct arp_filter *filter, struct in_addr ip);
+
+
+/* Compiles the filter to classic BPF and attaches it to a packet
+   socket (SO_ATTACH_FILTER). Works with SOCK_RAW and SOCK_DGRAM
+   sockets, bound to ETH_P_ARP or ETH_P_ALL.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach(int sockfd, const struct arp_filter *filter);
+
+
+/* Attaches a filter which drops every frame, to a socket which is
+   only used to send
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_drop(int sockfd);
+
+
+/* Attaches the filter of the passive discovery: the ARP frames, and
+   the IPv4 packets from an address of the local network, both cut to
+   their first header. The frames sent by the host are dropped.
+
+   local: local IP address
+   prefix: length of the prefix of the local network
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_passive(int sockfd, struct in_addr local, unsigned int prefix);
+
+
+/* Attaches the filter of the restoration of the caches: the ARP frames
+   and the IPv4 packets sent to our hardware address, cut to their
+   first header. The frames heard for other hosts (on a hub, a bridge
+   or in promiscuous mode) and the broadcast frames are dropped.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_attach_watch(int sockfd);
+
+
+/* Starts counting the frames of a capture socket
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_stats_init(struct filter_stats *stats, int sockfd, int ifindex);
+
+
+/* Updates the statistics with the kernel counters (PACKET_STATISTICS
+   and the counters of the interface). The frames dropped by the
+   filter are link_packets - delivered.
+
+   Returns 0 on success, -1 on error.
+ */
+int filter_stats_update(struct filter_stats *stats);
+
+
+
+#endif /* FILTER_H_ */
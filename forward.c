@@ -0,0 +1,502 @@
+/* Satrap/forward.c */
+
+#define _GNU_SOURCE /* sendmmsg() */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+/* <linux/if_packet.h> conflicts with <netpacket/packet.h>, which is
+   included by arp.h, but we need the definitions of the rings */
+#include <linux/if_packet.h>
+
+#include "forward.h"
+#include "workers.h"
+
+
+
+/* Frames sent per sendmmsg() call */
+#define FORWARD_BATCH 64
+
+/* Forwarded frames wait at most this long (ms) in a block of the
+   ring, instead of RING_DEFAULT_RX_TIMEOUT */
+#define FORWARD_RX_TIMEOUT 1
+
+
+
+/* Initializes the forwarding plane, without its socket
+
+   Returns 0 on success, -1 on error.
+ */
+static int init_tables(struct forwarder *fwd, int ifindex, struct in_addr ipaddr, const unsigned char *macaddr)
+{
+  memset(fwd, 0, sizeof(*fwd));
+  fwd->rx.fd = -1;
+  fwd->xsk.fd = -1;
+  fwd->ifindex = ifindex;
+  fwd->ipaddr = ipaddr;
+  memcpy(fwd->macaddr, macaddr, ETHER_ADDR_LEN);
+
+  if (hosts_init(&fwd->routes, 0) == -1
+      || hosts_init(&fwd->next_hops, 0) == -1) {
+    int err = errno;
+    forward_close(fwd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Initializes a forwarding plane
+
+   fwd: the forwarding plane to initialize
+   ifindex: index of the interface
+   ipaddr: local IP address
+   macaddr: local hardware address
+   params: parameters of the receive ring, or NULL for the defaults
+   (the protocol is always IPv4)
+   qdisc_bypass: if set, the frames skip the queueing discipline
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_init(struct forwarder *fwd, int ifindex, struct in_addr ipaddr, const unsigned char *macaddr, const struct ring_params *params, int qdisc_bypass)
+{
+  if (init_tables(fwd, ifindex, ipaddr, macaddr) == -1)
+    return -1;
+
+  struct ring_params ring_params;
+  if (params) {
+    ring_params = *params;
+  }
+  else {
+    ring_params_default(&ring_params);
+    ring_params.rx_timeout = FORWARD_RX_TIMEOUT;
+  }
+  ring_params.rx_protocol = ETH_P_IP;
+
+  if (rx_ring_open(&fwd->rx, ifindex, &ring_params) == -1)
+    goto fail;
+
+  /* The frames we send must not come back in the ring. Older kernels
+     don't know the option, the frames are ignored anyway since they
+     aren't sent to us. */
+  int one = 1;
+  if (setsockopt(fwd->rx.fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) == -1
+      && errno != ENOPROTOOPT)
+    goto fail;
+  if (qdisc_bypass
+      && setsockopt(fwd->rx.fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) == -1)
+    goto fail;
+
+  return 0;
+
+ fail: {
+    int err = errno;
+    forward_close(fwd);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Initializes a forwarding plane on an AF_XDP socket instead of a
+   packet socket. The XDP program takes the IPv4 packets sent to our
+   hardware address for other hosts, which are sent again from the
+   UMEM where the driver put them.
+
+   fwd: the forwarding plane to initialize
+   ifindex: index of the interface
+   ipaddr: local IP address
+   macaddr: local hardware address
+   params: parameters of the socket, or NULL for the defaults (the
+   protocol is always IPv4)
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_init_xsk(struct forwarder *fwd, int ifindex, struct in_addr ipaddr, const unsigned char *macaddr, const struct xsk_params *params)
+{
+  if (init_tables(fwd, ifindex, ipaddr, macaddr) == -1)
+    return -1;
+
+  struct xsk_params xsk_params;
+  if (params)
+    xsk_params = *params;
+  else
+    xsk_params_default(&xsk_params);
+  xsk_params.protocol = ETH_P_IP;
+
+  if (xsk_open(&fwd->xsk, ifindex, macaddr, ipaddr, &xsk_params) == -1) {
+    int err = errno;
+    forward_close(fwd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Forwards the traffic between two interposed hosts. Each host is
+   also the next hop of the other one for the other destinations, so
+   with a gateway, the traffic of the target to the outside goes to
+   the gateway.
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int forward_add_pair(struct forwarder *fwd, struct in_addr ip1, const unsigned char *mac1, struct in_addr ip2, const unsigned char *mac2)
+{
+  if (!hosts_update(&fwd->routes, ip1, mac1)
+      || !hosts_update(&fwd->routes, ip2, mac2)
+      || !hosts_update(&fwd->next_hops, ip1, mac2)
+      || !hosts_update(&fwd->next_hops, ip2, mac1))
+    return -1;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* DATA PLANE */
+
+/* Chooses the next hop of a frame and rewrites its Ethernet header in
+   place
+
+   Returns 1 if the frame must be sent again, 0 otherwise.
+ */
+static int route_frame(struct forwarder *fwd, unsigned char *frame, size_t len)
+{
+  struct ether_header *eth = (struct ether_header *) frame;
+  if (len < sizeof(*eth) + sizeof(struct iphdr)
+      || memcmp(eth->ether_dhost, fwd->macaddr, ETHER_ADDR_LEN)) {
+    counter_add(&fwd->stats.ignored, 1);
+    return 0;
+  }
+
+  const struct iphdr *ip = (const struct iphdr *) (frame + sizeof(*eth));
+  struct in_addr src = { ip->saddr }, dst = { ip->daddr };
+  if (dst.s_addr == fwd->ipaddr.s_addr) {
+    counter_add(&fwd->stats.ignored, 1);
+    return 0;
+  }
+
+  /* An interposed destination, or else the next hop of the source */
+  const struct host_entry *hop = hosts_lookup(&fwd->routes, dst);
+  if (!hop)
+    hop = hosts_lookup(&fwd->next_hops, src);
+  if (!hop) {
+    counter_add(&fwd->stats.no_route, 1);
+    return 0;
+  }
+
+  memcpy(eth->ether_dhost, hop->mac, ETHER_ADDR_LEN);
+  memcpy(eth->ether_shost, fwd->macaddr, ETHER_ADDR_LEN);
+  return 1;
+}
+
+
+/* Adds 16-bit words to a one's complement sum */
+static uint32_t checksum_add(uint32_t sum, const unsigned char *data, size_t len)
+{
+  for (; len > 1; data += 2, len -= 2)
+    sum += (data[0] << 8) | data[1];
+  if (len)
+    sum += data[0] << 8;
+  return sum;
+}
+
+
+/* Computes the TCP or UDP checksum of an IPv4 packet. The packets the
+   sender's kernel left to the hardware (TP_STATUS_CSUMNOTREADY) only
+   have a partial checksum, which the receiver would reject once we
+   send them again. */
+static void complete_checksum(unsigned char *frame, size_t len)
+{
+  struct iphdr *ip = (struct iphdr *) (frame + sizeof(struct ether_header));
+  size_t ihl = ip->ihl * 4;
+  size_t ip_len = ntohs(ip->tot_len);
+  if (ihl < sizeof(*ip) || ip_len < ihl || sizeof(struct ether_header) + ip_len > len
+      || (ntohs(ip->frag_off) & (IP_MF | IP_OFFMASK)))
+    return;
+
+  unsigned char *l4 = (unsigned char *) ip + ihl;
+  size_t l4_len = ip_len - ihl;
+  uint16_t *check;
+  if (ip->protocol == IPPROTO_TCP && l4_len >= sizeof(struct tcphdr))
+    check = &((struct tcphdr *) l4)->check;
+  else if (ip->protocol == IPPROTO_UDP && l4_len >= sizeof(struct udphdr))
+    check = &((struct udphdr *) l4)->check;
+  else
+    return;
+
+  /* Pseudo-header, then the segment with a null checksum */
+  *check = 0;
+  uint32_t sum = checksum_add(0, (const unsigned char *) &ip->saddr, 8);
+  sum += ip->protocol + l4_len;
+  sum = checksum_add(sum, l4, l4_len);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  uint16_t value = ~sum;
+  /* 0 means "no checksum" for UDP */
+  if (!value && ip->protocol == IPPROTO_UDP)
+    value = 0xffff;
+  *check = htons(value);
+}
+
+
+/* Sends a batch of frames, which point into the ring. A frame which
+   the kernel refuses is dropped. */
+static void send_batch(struct forwarder *fwd, struct mmsghdr *msgs, unsigned int count)
+{
+  unsigned int i = 0;
+  while (i < count) {
+    int n = sendmmsg(fwd->rx.fd, &msgs[i], count - i, MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      counter_add(&fwd->stats.tx_drops, 1);
+      ++i;
+      continue;
+    }
+    for (int j = 0; j < n; ++j) {
+      counter_add(&fwd->stats.fwd_packets, 1);
+      counter_add(&fwd->stats.fwd_bytes, msgs[i + j].msg_hdr.msg_iov->iov_len);
+    }
+    i += n;
+  }
+}
+
+
+/* Forwards the frames waiting on the AF_XDP socket. A frame goes
+   from the receive ring to the transmit ring as is, only its
+   descriptor is copied. */
+static int process_xsk(struct forwarder *fwd)
+{
+  struct xsk_socket *xs = &fwd->xsk;
+  struct xdp_desc descs[FORWARD_BATCH];
+  unsigned long before = fwd->stats.fwd_packets;
+  int err = 0;
+  /* XDP gives no timestamp: the frames of a batch share one */
+  uint64_t now = 0;
+
+  unsigned int n;
+  do {
+    n = xsk_recv(xs, descs, FORWARD_BATCH);
+    if (n && fwd->capture)
+      now = capture_now();
+    for (unsigned int i = 0; i < n; ++i) {
+      unsigned char *frame = xsk_frame(xs, descs[i].addr);
+      counter_add(&fwd->stats.rx_packets, 1);
+      if (!route_frame(fwd, frame, descs[i].len)) {
+	xsk_release(xs, descs[i].addr);
+	continue;
+      }
+      /* XDP does not tell whether the checksum was left to the
+	 hardware, as with the veth of a local sender: it is always
+	 computed again */
+      complete_checksum(frame, descs[i].len);
+      if (fwd->capture)
+	capture_frame(fwd->capture, frame, descs[i].len, now);
+      if (xsk_send(xs, descs[i].addr, descs[i].len) == 1) {
+	counter_add(&fwd->stats.tx_drops, 1);
+	xsk_release(xs, descs[i].addr);
+	continue;
+      }
+      counter_add(&fwd->stats.fwd_packets, 1);
+      counter_add(&fwd->stats.fwd_bytes, descs[i].len);
+    }
+    if (n && xsk_flush(xs) == -1)
+      err = -1;
+    /* The frames sent are replaced by free ones */
+    xsk_refill(xs);
+  } while (n == FORWARD_BATCH);
+
+  return err ? -1 : (int) (fwd->stats.fwd_packets - before);
+}
+
+
+/* Forwards the frames waiting in the ring or the socket, without
+   blocking
+
+   Returns the number of frames forwarded, or -1 on error.
+ */
+int forward_process(struct forwarder *fwd)
+{
+  if (fwd->xsk.fd >= 0)
+    return process_xsk(fwd);
+
+  struct mmsghdr msgs[FORWARD_BATCH];
+  struct iovec iov[FORWARD_BATCH];
+  unsigned long before = fwd->stats.fwd_packets;
+
+  /* The socket is bound to the interface, no address is needed */
+  memset(msgs, 0, sizeof(msgs));
+  for (unsigned int i = 0; i < FORWARD_BATCH; ++i) {
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  struct tpacket_block_desc *block;
+  while ((block = rx_ring_next_block(&fwd->rx))) {
+    unsigned int num_pkts = block->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+      ((unsigned char *) block + block->hdr.bh1.offset_to_first_pkt);
+    unsigned int n = 0;
+
+    for (unsigned int i = 0; i < num_pkts; ++i) {
+      unsigned char *frame = (unsigned char *) hdr + hdr->tp_mac;
+      counter_add(&fwd->stats.rx_packets, 1);
+      if (hdr->tp_snaplen == hdr->tp_len && route_frame(fwd, frame, hdr->tp_snaplen)) {
+	if (hdr->tp_status & TP_STATUS_CSUMNOTREADY)
+	  complete_checksum(frame, hdr->tp_snaplen);
+	if (fwd->capture)
+	  capture_frame(fwd->capture, frame, hdr->tp_snaplen,
+			hdr->tp_sec * 1000000000ULL + hdr->tp_nsec);
+	/* The kernel reads the frame from the ring itself */
+	iov[n].iov_base = frame;
+	iov[n].iov_len = hdr->tp_snaplen;
+	if (++n == FORWARD_BATCH) {
+	  send_batch(fwd, msgs, n);
+	  n = 0;
+	}
+      }
+      hdr = (struct tpacket3_hdr *) ((unsigned char *) hdr + hdr->tp_next_offset);
+    }
+
+    /* The block goes back to the kernel once its frames are sent */
+    if (n)
+      send_batch(fwd, msgs, n);
+    rx_ring_release_block(&fwd->rx, block);
+  }
+
+  return fwd->stats.fwd_packets - before;
+}
+
+
+/* Updates the counters of the kernel (frames lost on a full ring, or
+   for lack of free frames with AF_XDP). With several threads, always
+   call it from the same one. */
+void forward_stats_update(struct forwarder *fwd)
+{
+  /* The counters of AF_XDP are not reset */
+  if (fwd->xsk.fd >= 0) {
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(fwd->xsk.fd, SOL_XDP, XDP_STATISTICS, &st, &len) == 0)
+      __atomic_store_n(&fwd->stats.ring_drops, st.rx_dropped + st.rx_ring_full + st.rx_fill_ring_empty_descs,
+		       __ATOMIC_RELAXED);
+    return;
+  }
+
+  /* Reading the statistics resets them */
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(fwd->rx.fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+    counter_add(&fwd->stats.ring_drops, st.tp_drops);
+}
+
+
+
+/* Copies the counters, which may be updated by another thread */
+void forward_stats_read(const struct forwarder *fwd, struct forward_stats *stats)
+{
+  stats->rx_packets = counter_read(&fwd->stats.rx_packets);
+  stats->fwd_packets = counter_read(&fwd->stats.fwd_packets);
+  stats->fwd_bytes = counter_read(&fwd->stats.fwd_bytes);
+  stats->ignored = counter_read(&fwd->stats.ignored);
+  stats->no_route = counter_read(&fwd->stats.no_route);
+  stats->tx_drops = counter_read(&fwd->stats.tx_drops);
+  stats->ring_drops = counter_read(&fwd->stats.ring_drops);
+}
+
+
+static void update_stats(void *arg)
+{
+  forward_stats_update(arg);
+}
+
+
+/* Adds the counters of the forwarding plane to a registry of metrics.
+   The counters of the kernel are updated on every collection: the
+   registry takes the place of the thread of forward_stats_update().
+
+   labels: labels of the series, e.g. worker="3", or NULL
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_add_metrics(struct forwarder *fwd, struct metrics *m, const char *labels)
+{
+  struct forward_stats *st = &fwd->stats;
+  if (metrics_add_collector(m, update_stats, fwd) == -1
+      || metrics_add_counter(m, "satrap_forward_received_total",
+			     "IPv4 frames received by the forwarding plane",
+			     labels, &st->rx_packets) == -1
+      || metrics_add_counter(m, "satrap_forward_frames_total",
+			     "Frames forwarded", labels, &st->fwd_packets) == -1
+      || metrics_add_counter(m, "satrap_forward_bytes_total",
+			     "Bytes forwarded", labels, &st->fwd_bytes) == -1
+      || metrics_add_counter(m, "satrap_forward_ignored_total",
+			     "Frames not for us, or for our own IP address",
+			     labels, &st->ignored) == -1
+      || metrics_add_counter(m, "satrap_forward_no_route_total",
+			     "Frames from or to an unknown host", labels, &st->no_route) == -1
+      || metrics_add_counter(m, "satrap_forward_tx_drops_total",
+			     "Frames rejected by the kernel on transmission",
+			     labels, &st->tx_drops) == -1
+      || metrics_add_counter(m, "satrap_forward_ring_drops_total",
+			     "Frames lost on a full receive ring, or for lack of UMEM frames",
+			     labels, &st->ring_drops) == -1)
+    return -1;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  forward_process(arg);
+}
+
+
+/* Forwards the frames as they arrive, on an event loop, until
+   forward_stop()
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_start(struct forwarder *fwd, struct reactor *reactor)
+{
+  fwd->reactor = reactor;
+  int fd = fwd->xsk.fd >= 0 ? fwd->xsk.fd : fwd->rx.fd;
+  fwd->source = reactor_add_fd(reactor, fd, EPOLLIN, on_frames, fwd);
+  return fwd->source ? 0 : -1;
+}
+
+
+/* Stops forwarding */
+void forward_stop(struct forwarder *fwd)
+{
+  if (fwd->source)
+    reactor_remove(fwd->reactor, fwd->source);
+  fwd->source = NULL;
+}
+
+
+/* Releases the resources of the forwarding plane */
+void forward_close(struct forwarder *fwd)
+{
+  forward_stop(fwd);
+  rx_ring_close(&fwd->rx);
+  if (fwd->xsk.fd >= 0)
+    xsk_close(&fwd->xsk);
+  hosts_free(&fwd->routes);
+  hosts_free(&fwd->next_hops);
+}
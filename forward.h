@@ -0,0 +1,146 @@
+/* Satrap/forward.h */
+
+#ifndef FORWARD_H_
+#define FORWARD_H_
+
+#include "capture.h"
+#include "hosts.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "ring.h"
+#include "xsk.h"
+
+
+
+/* Counters of the forwarding plane */
+struct forward_stats {
+  unsigned long rx_packets; /* IPv4 frames seen on the interface */
+  unsigned long fwd_packets; /* frames forwarded */
+  unsigned long fwd_bytes;
+  unsigned long ignored; /* not for us, or for our own IP address */
+  unsigned long no_route; /* for us, but from or to an unknown host */
+  unsigned long tx_drops; /* rejected by the kernel on transmission */
+  unsigned long ring_drops; /* lost on a full receive ring */
+};
+
+
+/* Userspace forwarding plane. The IPv4 frames sent to our hardware
+   address by the interposed hosts are received on a ring, their
+   Ethernet addresses are rewritten in place, and they are sent again
+   straight from the ring: userspace never copies them. The TTL is
+   left untouched and no ICMP redirect is ever sent, unlike with the
+   forwarding of the kernel. */
+struct forwarder {
+  struct rx_ring rx; /* the socket is used to send too */
+  struct xsk_socket xsk; /* used instead of the ring if its fd is not -1 */
+  int ifindex;
+  struct in_addr ipaddr; /* local IP address */
+  unsigned char macaddr[ETHER_ADDR_LEN]; /* local hardware address */
+
+  /* Hardware address of every interposed host, and of the next hop
+     of each of them, for the destinations which are not interposed
+     (e.g. behind a gateway) */
+  struct host_table routes;
+  struct host_table next_hops;
+
+  struct forward_stats stats;
+
+  /* Copies of the frames forwarded, as sent, or NULL. The queue is
+     only used by the thread of the forwarding plane. */
+  struct capture_queue *capture;
+
+  /* Event loop, between forward_start() and forward_stop() */
+  struct reactor *reactor;
+  struct reactor_source *source;
+};
+
+
+/* Initializes a forwarding plane
+
+   fwd: the forwarding plane to initialize
+   ifindex: index of the interface
+   ipaddr: local IP address
+   macaddr: local hardware address
+   params: parameters of the receive ring, or NULL for the defaults
+   (the protocol is always IPv4)
+   qdisc_bypass: if set, the frames skip the queueing discipline
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_init(struct forwarder *fwd, int ifindex, struct in_addr ipaddr, const unsigned char *macaddr, const struct ring_params *params, int qdisc_bypass);
+
+
+/* Initializes a forwarding plane on an AF_XDP socket instead of a
+   packet socket. The XDP program takes the IPv4 packets sent to our
+   hardware address for other hosts, which are sent again from the
+   UMEM where the driver put them.
+
+   fwd: the forwarding plane to initialize
+   ifindex: index of the interface
+   ipaddr: local IP address
+   macaddr: local hardware address
+   params: parameters of the socket, or NULL for the defaults (the
+   protocol is always IPv4)
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_init_xsk(struct forwarder *fwd, int ifindex, struct in_addr ipaddr, const unsigned char *macaddr, const struct xsk_params *params);
+
+
+/* Forwards the traffic between two interposed hosts. Each host is
+   also the next hop of the other one for the other destinations, so
+   with a gateway, the traffic of the target to the outside goes to
+   the gateway.
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int forward_add_pair(struct forwarder *fwd, struct in_addr ip1, const unsigned char *mac1, struct in_addr ip2, const unsigned char *mac2);
+
+
+/* Forwards the frames waiting in the ring or the socket, without
+   blocking
+
+   Returns the number of frames forwarded, or -1 on error.
+ */
+int forward_process(struct forwarder *fwd);
+
+
+/* Updates the counters of the kernel (frames lost on a full ring, or
+   for lack of free frames with AF_XDP). With several threads, always
+   call it from the same one. */
+void forward_stats_update(struct forwarder *fwd);
+
+
+/* Copies the counters, which may be updated by another thread */
+void forward_stats_read(const struct forwarder *fwd, struct forward_stats *stats);
+
+
+/* Adds the counters of the forwarding plane to a registry of metrics.
+   The counters of the kernel are updated on every collection: the
+   registry takes the place of the thread of forward_stats_update().
+
+   labels: labels of the series, e.g. worker="3", or NULL
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_add_metrics(struct forwarder *fwd, struct metrics *m, const char *labels);
+
+
+/* Forwards the frames as they arrive, on an event loop, until
+   forward_stop()
+
+   Returns 0 on success, -1 on error.
+ */
+int forward_start(struct forwarder *fwd, struct reactor *reactor);
+
+
+/* Stops forwarding */
+void forward_stop(struct forwarder *fwd);
+
+
+/* Releases the resources of the forwarding plane */
+void forward_close(struct forwarder *fwd);
+
+
+
+#endif /* FORWARD_H_ */
@@ -0,0 +1,235 @@
+/* Satrap/hosts.c */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hosts.h"
+
+
+
+/* Slot of an address: the address is multiplied by a constant close
+   to 2^32 / phi, so consecutive addresses of a subnet are spread over
+   the table (Fibonacci hashing) */
+static size_t host_slot(const struct host_table *table, uint32_t ip)
+{
+  return (ntohl(ip) * 2654435769U) & (table->size - 1);
+}
+
+
+
+/* Initializes a host table
+
+   table: the table to initialize
+   size: expected number of hosts, or 0 for the default
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int hosts_init(struct host_table *table, size_t size)
+{
+  memset(table, 0, sizeof(*table));
+  table->max_age = HOSTS_DEFAULT_MAX_AGE;
+
+  /* The table is at most half full */
+  table->size = HOSTS_DEFAULT_SIZE;
+  while (table->size < 2 * size)
+    table->size *= 2;
+
+  table->entries = calloc(table->size, sizeof(*table->entries));
+  if (!table->entries)
+    return -1;
+  return 0;
+}
+
+
+/* Frees the memory used by a host table */
+void hosts_free(struct host_table *table)
+{
+  free(table->entries);
+  table->entries = NULL;
+  table->size = table->len = 0;
+}
+
+
+/* Returns the current time of CLOCK_MONOTONIC in nanoseconds, the
+   clock of the timestamps of the table */
+uint64_t hosts_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Returns the slot of an address: either the slot of the host, or
+   the empty slot where it would be inserted */
+static struct host_entry *find_slot(const struct host_table *table, uint32_t ip)
+{
+  size_t mask = table->size - 1;
+  for (size_t i = host_slot(table, ip); ; i = (i + 1) & mask) {
+    struct host_entry *e = &table->entries[i];
+    if (e->state == HOST_EMPTY || e->ip == ip)
+      return e;
+  }
+}
+
+
+/* Doubles the size of the table */
+static int grow(struct host_table *table)
+{
+  struct host_table bigger = *table;
+  bigger.size = 2 * table->size;
+  bigger.entries = calloc(bigger.size, sizeof(*bigger.entries));
+  if (!bigger.entries)
+    return -1;
+
+  for (size_t i = 0; i < table->size; ++i) {
+    struct host_entry *e = &table->entries[i];
+    if (e->state != HOST_EMPTY)
+      *find_slot(&bigger, e->ip) = *e;
+  }
+
+  free(table->entries);
+  *table = bigger;
+  return 0;
+}
+
+
+
+/* Looks a host up
+
+   Returns the entry of the host, or NULL if it is unknown. The entry
+   is only valid until the next insertion or removal.
+ */
+struct host_entry *hosts_lookup(const struct host_table *table, struct in_addr ip)
+{
+  struct host_entry *e = find_slot(table, ip.s_addr);
+  return e->state == HOST_EMPTY ? NULL : e;
+}
+
+
+/* Returns the entry of a host, which is created in the HOST_PROBING
+   state if the host is unknown. The entry is only valid until the
+   next insertion or removal.
+
+   Returns NULL if the memory could not be allocated.
+ */
+struct host_entry *hosts_insert(struct host_table *table, struct in_addr ip)
+{
+  struct host_entry *e = find_slot(table, ip.s_addr);
+  if (e->state != HOST_EMPTY)
+    return e;
+
+  if (2 * (table->len + 1) > table->size) {
+    if (grow(table) == -1)
+      return NULL;
+    e = find_slot(table, ip.s_addr);
+  }
+
+  memset(e, 0, sizeof(*e));
+  e->ip = ip.s_addr;
+  e->state = HOST_PROBING;
+  ++table->len;
+  return e;
+}
+
+
+/* Records that a host has been seen with a hardware address: the
+   host is created if needed, and marked alive.
+
+   Returns the entry of the host, or NULL if the memory could not be
+   allocated.
+ */
+struct host_entry *hosts_update(struct host_table *table, struct in_addr ip, const unsigned char *mac)
+{
+  struct host_entry *e = hosts_insert(table, ip);
+  if (!e)
+    return NULL;
+
+  uint64_t now = hosts_now();
+  if (!e->first_seen)
+    e->first_seen = now;
+  e->last_seen = now;
+  memcpy(e->mac, mac, ETHER_ADDR_LEN);
+  e->state = HOST_ALIVE;
+  return e;
+}
+
+
+/* Removes a host from the table */
+void hosts_remove(struct host_table *table, struct in_addr ip)
+{
+  struct host_entry *hole = find_slot(table, ip.s_addr);
+  if (hole->state == HOST_EMPTY)
+    return;
+  --table->len;
+
+  /* Without tombstones, the following entries of the cluster are
+     shifted back, unless the hole is before their own slot */
+  size_t mask = table->size - 1;
+  size_t i = hole - table->entries;
+  for (size_t j = (i + 1) & mask; table->entries[j].state != HOST_EMPTY; j = (j + 1) & mask) {
+    size_t home = host_slot(table, table->entries[j].ip);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table->entries[i] = table->entries[j];
+      i = j;
+    }
+  }
+  memset(&table->entries[i], 0, sizeof(table->entries[i]));
+}
+
+
+
+/* Copies the hardware address of a host, if it is alive and has been
+   seen less than max_age milliseconds ago
+
+   Returns 0 if the address was found, -1 otherwise.
+ */
+int hosts_get_mac(const struct host_table *table, struct in_addr ip, unsigned char *mac)
+{
+  struct host_entry *e = hosts_lookup(table, ip);
+  if (!e || e->state != HOST_ALIVE
+      || hosts_now() - e->last_seen >= (uint64_t) table->max_age * 1000000ULL)
+    return -1;
+  memcpy(mac, e->mac, ETHER_ADDR_LEN);
+  return 0;
+}
+
+
+/* Marks the live hosts which have not been seen for max_age
+   milliseconds as stale
+
+   Returns the number of hosts marked.
+ */
+size_t hosts_expire(struct host_table *table)
+{
+  uint64_t now = hosts_now();
+  uint64_t max_age = (uint64_t) table->max_age * 1000000ULL;
+  size_t count = 0;
+  for (size_t i = 0; i < table->size; ++i) {
+    struct host_entry *e = &table->entries[i];
+    if (e->state == HOST_ALIVE && now - e->last_seen >= max_age) {
+      e->state = HOST_STALE;
+      ++count;
+    }
+  }
+  return count;
+}
+
+
+/* Iterates over the hosts of the table. pos must be 0 on the first
+   call. The table must not be modified during the iteration.
+
+   Returns the next host, or NULL at the end of the table.
+ */
+struct host_entry *hosts_next(const struct host_table *table, size_t *pos)
+{
+  while (*pos < table->size) {
+    struct host_entry *e = &table->entries[(*pos)++];
+    if (e->state != HOST_EMPTY)
+      return e;
+  }
+  return NULL;
+}
@@ -0,0 +1,127 @@
+/* Satrap/hosts.h */
+
+#ifndef HOSTS_H_
+#define HOSTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+
+
+/* Initial number of slots of a host table */
+#define HOSTS_DEFAULT_SIZE 256
+
+/* Age (in milliseconds) after which a host which has not been seen
+   is no longer trusted */
+#define HOSTS_DEFAULT_MAX_AGE 60000
+
+
+/* State of a known host */
+enum host_state {
+  HOST_EMPTY = 0, /* free slot */
+  HOST_PROBING, /* asked, no answer yet */
+  HOST_ALIVE, /* answered recently, the hardware address is valid */
+  HOST_STALE /* not seen for too long, must be asked again */
+};
+
+
+/* Entry of the host table, two of them per cache line */
+struct host_entry {
+  uint32_t ip; /* IP address, network byte order */
+  unsigned char mac[ETHER_ADDR_LEN];
+  unsigned char state;
+  unsigned char pad;
+  uint64_t first_seen; /* CLOCK_MONOTONIC, in nanoseconds */
+  uint64_t last_seen;
+};
+
+
+/* Table of the hosts known on the link, keyed by IP address. The
+   table uses open addressing with linear probing, so a lookup reads
+   one or two cache lines, and it doubles when it is half full. */
+struct host_table {
+  struct host_entry *entries;
+  size_t size; /* number of slots, a power of 2 */
+  size_t len; /* number of hosts */
+  unsigned int max_age; /* milliseconds, for hosts_expire() */
+};
+
+
+/* Initializes a host table
+
+   table: the table to initialize
+   size: expected number of hosts, or 0 for the default
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int hosts_init(struct host_table *table, size_t size);
+
+
+/* Frees the memory used by a host table */
+void hosts_free(struct host_table *table);
+
+
+/* Returns the current time of CLOCK_MONOTONIC in nanoseconds, the
+   clock of the timestamps of the table */
+uint64_t hosts_now(void);
+
+
+/* Looks a host up
+
+   Returns the entry of the host, or NULL if it is unknown. The entry
+   is only valid until the next insertion or removal.
+ */
+struct host_entry *hosts_lookup(const struct host_table *table, struct in_addr ip);
+
+
+/* Returns the entry of a host, which is created in the HOST_PROBING
+   state if the host is unknown. The entry is only valid until the
+   next insertion or removal.
+
+   Returns NULL if the memory could not be allocated.
+ */
+struct host_entry *hosts_insert(struct host_table *table, struct in_addr ip);
+
+
+/* Records that a host has been seen with a hardware address: the
+   host is created if needed, and marked alive.
+
+   Returns the entry of the host, or NULL if the memory could not be
+   allocated.
+ */
+struct host_entry *hosts_update(struct host_table *table, struct in_addr ip, const unsigned char *mac);
+
+
+/* Removes a host from the table */
+void hosts_remove(struct host_table *table, struct in_addr ip);
+
+
+/* Copies the hardware address of a host, if it is alive and has been
+   seen less than max_age milliseconds ago
+
+   Returns 0 if the address was found, -1 otherwise.
+ */
+int hosts_get_mac(const struct host_table *table, struct in_addr ip, unsigned char *mac);
+
+
+/* Marks the live hosts which have not been seen for max_age
+   milliseconds as stale
+
+   Returns the number of hosts marked.
+ */
+size_t hosts_expire(struct host_table *table);
+
+
+/* Iterates over the hosts of the table. pos must be 0 on the first
+   call. The table must not be modified during the iteration.
+
+   Returns the next host, or NULL at the end of the table.
+ */
+struct host_entry *hosts_next(const struct host_table *table, size_t *pos);
+
+
+
+#endif /* HOSTS_H_ */
@@ -0,0 +1,229 @@
+/* Satrap/io.c */
+
+#define _GNU_SOURCE /* sendmmsg(), recvmmsg() */
+
+#include <errno.h>
+
+#include "arp.h"
+#include "io.h"
+
+
+
+/* Number of frames sent or received per system call */
+#define SOCKET_BATCH 64
+
+
+/* Private data of the socket backend */
+struct socket_io {
+  int raw; /* 1 for SOCK_RAW, 0 for SOCK_DGRAM */
+
+  /* Frames queued for sendmmsg() */
+  unsigned int tx_len;
+  struct mmsghdr tx_msgs[SOCKET_BATCH];
+  struct iovec tx_iov[SOCKET_BATCH];
+  struct sockaddr_ll tx_addr[SOCKET_BATCH];
+  unsigned char tx_buf[SOCKET_BATCH][ETH_FRAME_LEN];
+
+  /* Buffers for recvmmsg(). With SOCK_DGRAM, the data is received
+     after room for the Ethernet header. */
+  struct mmsghdr rx_msgs[SOCKET_BATCH];
+  struct iovec rx_iov[SOCKET_BATCH];
+  struct sockaddr_ll rx_addr[SOCKET_BATCH];
+  unsigned char rx_buf[SOCKET_BATCH][ETH_FRAME_LEN];
+};
+
+
+
+/* Sends the queued frames with sendmmsg(). A frame which fails for
+   another reason than a full socket buffer is dropped.
+
+   Returns the number of frames sent, or -1 on error.
+ */
+static int socket_flush(struct frame_io *io)
+{
+  struct socket_io *sock = io->priv;
+  unsigned int i = 0;
+  int sent = 0, err = 0;
+
+  while (i < sock->tx_len) {
+    int n = sendmmsg(io->fd, &sock->tx_msgs[i], sock->tx_len - i, MSG_DONTWAIT);
+    if (n >= 0) {
+      i += n;
+      sent += n;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      break;
+    /* sendmmsg() stops at the first frame which fails */
+    err = errno;
+    ++i;
+  }
+
+  /* The frames left are moved to the front of the queue */
+  unsigned int left = sock->tx_len - i;
+  for (unsigned int j = 0; j < left; ++j) {
+    memcpy(sock->tx_buf[j], sock->tx_buf[i + j], sock->tx_iov[i + j].iov_len);
+    sock->tx_iov[j].iov_len = sock->tx_iov[i + j].iov_len;
+    sock->tx_addr[j] = sock->tx_addr[i + j];
+  }
+  sock->tx_len = left;
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return sent;
+}
+
+
+/* Queues a frame, which is sent on the next flush or when the queue
+   is full */
+static int socket_send(struct frame_io *io, const void *frame, size_t len)
+{
+  struct socket_io *sock = io->priv;
+  const struct ether_header *eth = frame;
+  if (len < sizeof(*eth) || len > ETH_FRAME_LEN) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sock->tx_len == SOCKET_BATCH) {
+    if (socket_flush(io) == -1)
+      return -1;
+    if (sock->tx_len == SOCKET_BATCH)
+      return 1;
+  }
+  unsigned int slot = sock->tx_len++;
+
+  /* The destination of the frame comes from its Ethernet header */
+  struct sockaddr_ll *addr = &sock->tx_addr[slot];
+  memset(addr, 0, sizeof(*addr));
+  addr->sll_family = AF_PACKET;
+  addr->sll_protocol = eth->ether_type;
+  addr->sll_ifindex = io->ifindex;
+  addr->sll_halen = ETHER_ADDR_LEN;
+  memcpy(addr->sll_addr, eth->ether_dhost, ETHER_ADDR_LEN);
+
+  /* With SOCK_DGRAM, the kernel builds the header itself */
+  const unsigned char *data = frame;
+  if (!sock->raw) {
+    data += sizeof(*eth);
+    len -= sizeof(*eth);
+  }
+  memcpy(sock->tx_buf[slot], data, len);
+  sock->tx_iov[slot].iov_len = len;
+
+  return 0;
+}
+
+
+static int socket_recv(struct frame_io *io, frame_handler handler, void *arg)
+{
+  struct socket_io *sock = io->priv;
+  int count = 0;
+
+  while (1) {
+    for (unsigned int i = 0; i < SOCKET_BATCH; ++i)
+      sock->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+
+    int n = recvmmsg(io->fd, sock->rx_msgs, SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return count;
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      size_t len = sock->rx_msgs[i].msg_len;
+      if (!sock->raw) {
+	/* We rebuild the Ethernet header from the link-layer address */
+	struct ether_header *eth = (struct ether_header *) sock->rx_buf[i];
+	struct sockaddr_ll *from = &sock->rx_addr[i];
+	if (from->sll_pkttype == PACKET_BROADCAST)
+	  memset(eth->ether_dhost, 0xff, ETHER_ADDR_LEN);
+	else
+	  memset(eth->ether_dhost, 0, ETHER_ADDR_LEN);
+	memcpy(eth->ether_shost, from->sll_addr, ETHER_ADDR_LEN);
+	eth->ether_type = from->sll_protocol;
+	len += sizeof(*eth);
+      }
+      handler(sock->rx_buf[i], len, arg);
+    }
+    count += n;
+
+    if (n < SOCKET_BATCH)
+      return count;
+  }
+}
+
+
+static void socket_close(struct frame_io *io)
+{
+  socket_flush(io);
+  free(io->priv);
+  io->priv = NULL;
+}
+
+
+static const struct frame_io_ops socket_ops = {
+  .send = socket_send,
+  .flush = socket_flush,
+  .recv = socket_recv,
+  .close = socket_close,
+};
+
+
+
+/* Creates a backend on top of an existing packet socket. Frames are
+   sent in batches with sendmmsg() on every flush, and received in
+   batches with recvmmsg().
+
+   io: the backend to initialize
+   sockfd: packet socket (AF_PACKET), either SOCK_RAW or SOCK_DGRAM.
+   With SOCK_DGRAM, the Ethernet header of the frames to send is
+   replaced by the kernel, and the destination address of the
+   received frames is unknown (zeroed, or broadcast).
+   ifindex: index of the interface
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_socket(struct frame_io *io, int sockfd, int ifindex)
+{
+  int type;
+  socklen_t typelen = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typelen) == -1)
+    return -1;
+
+  struct socket_io *sock = calloc(1, sizeof(*sock));
+  if (!sock)
+    return -1;
+  sock->raw = (type == SOCK_RAW);
+
+  /* Every message points to its own buffer once and for all */
+  size_t header = sock->raw ? 0 : sizeof(struct ether_header);
+  for (unsigned int i = 0; i < SOCKET_BATCH; ++i) {
+    sock->tx_iov[i].iov_base = sock->tx_buf[i];
+    sock->tx_msgs[i].msg_hdr.msg_iov = &sock->tx_iov[i];
+    sock->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    sock->tx_msgs[i].msg_hdr.msg_name = &sock->tx_addr[i];
+    sock->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+
+    sock->rx_iov[i].iov_base = sock->rx_buf[i] + header;
+    sock->rx_iov[i].iov_len = ETH_FRAME_LEN - header;
+    sock->rx_msgs[i].msg_hdr.msg_iov = &sock->rx_iov[i];
+    sock->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    sock->rx_msgs[i].msg_hdr.msg_name = &sock->rx_addr[i];
+  }
+
+  io->ops = &socket_ops;
+  io->fd = sockfd;
+  io->ifindex = ifindex;
+  io->priv = sock;
+  memset(&io->counters, 0, sizeof(io->counters));
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+/* Satrap/io.h */
+
+#ifndef IO_H_
+#define IO_H_
+
+#include <stddef.h>
+
+#include "metrics.h"
+
+
+
+/* Frame I/O backends
+
+   Every backend sends and receives complete Ethernet frames (header
+   included), so the scanner and the MITM engine don't need to know
+   how the frames reach the wire. */
+
+struct frame_io;
+
+
+/* Called for every received frame. The frame is only valid until the
+   handler returns. */
+typedef void (*frame_handler)(const unsigned char *frame, size_t len, void *arg);
+
+
+struct frame_io_ops {
+  /* Queues a frame for transmission. Returns 0 on success, 1 if the
+     backend is full (flush and try again later), -1 on error. */
+  int (*send)(struct frame_io *io, const void *frame, size_t len);
+  /* Transmits the queued frames. Returns the number of frames handed
+     to the kernel, or -1 on error. */
+  int (*flush)(struct frame_io *io);
+  /* Calls the handler for every frame waiting, without blocking.
+     Returns the number of frames handled, or -1 on error. */
+  int (*recv)(struct frame_io *io, frame_handler handler, void *arg);
+  /* Releases the resources of the backend */
+  void (*close)(struct frame_io *io);
+};
+
+
+/* Counters of a backend, written by the thread which uses it */
+struct frame_io_counters {
+  unsigned long tx_frames; /* queued for transmission */
+  unsigned long tx_full; /* refused by a full backend */
+  unsigned long tx_errors;
+  unsigned long rx_frames;
+  unsigned long rx_errors;
+};
+
+
+struct frame_io {
+  const struct frame_io_ops *ops;
+  int fd; /* descriptor to poll for incoming frames */
+  int ifindex; /* index of the interface */
+  void *priv; /* private data of the backend */
+  struct frame_io_counters counters;
+};
+
+
+/* Creates a backend on top of an existing packet socket. Frames are
+   sent in batches with sendmmsg() on every flush, and received in
+   batches with recvmmsg().
+
+   io: the backend to initialize
+   sockfd: packet socket (AF_PACKET), either SOCK_RAW or SOCK_DGRAM.
+   With SOCK_DGRAM, the Ethernet header of the frames to send is
+   replaced by the kernel, and the destination address of the
+   received frames is unknown (zeroed, or broadcast).
+   ifindex: index of the interface
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_socket(struct frame_io *io, int sockfd, int ifindex);
+
+
+/* The wrappers keep the counters of the backend: a relaxed store in
+   the thread of the backend, which costs as much as a plain one */
+static inline int frame_io_send(struct frame_io *io, const void *frame, size_t len)
+{
+  int err = io->ops->send(io, frame, len);
+  if (err == 0)
+    counter_add(&io->counters.tx_frames, 1);
+  else if (err == 1)
+    counter_add(&io->counters.tx_full, 1);
+  else
+    counter_add(&io->counters.tx_errors, 1);
+  return err;
+}
+
+static inline int frame_io_flush(struct frame_io *io)
+{
+  int n = io->ops->flush(io);
+  if (n == -1)
+    counter_add(&io->counters.tx_errors, 1);
+  return n;
+}
+
+static inline int frame_io_recv(struct frame_io *io, frame_handler handler, void *arg)
+{
+  int n = io->ops->recv(io, handler, arg);
+  if (n > 0)
+    counter_add(&io->counters.rx_frames, n);
+  else if (n == -1)
+    counter_add(&io->counters.rx_errors, 1);
+  return n;
+}
+
+static inline void frame_io_close(struct frame_io *io)
+{
+  io->ops->close(io);
+}
+
+
+
+#endif /* IO_H_ */
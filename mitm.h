@@ -0,0 +1,195 @@
+/* Satrap/mitm.h */
+
+#ifndef MITM_H_
+#define MITM_H_
+
+#include "arp.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "timer_wheel.h"
+
+
+
+/* Default delay between two refreshes of a pair, in milliseconds.
+   Every refresh poisons one direction, so each target is poisoned
+   again every two intervals. */
+#define MITM_DEFAULT_INTERVAL 1000
+
+/* Default time given to the restoration of the caches of the targets
+   at the end of the attack, in milliseconds */
+#define MITM_DEFAULT_RESTORE_DEADLINE 2000
+
+/* Silence of a target after its restoring frames, in milliseconds,
+   which confirms that its cache is restored */
+#define MITM_RESTORE_QUIET 200
+
+/* Delay in milliseconds during which the traffic of a target still
+   reaches us after its restoring frames: it was already on its way.
+   The restoration is checked at this period too. */
+#define MITM_RESTORE_GRACE 20
+
+/* Length of the echo request which checks a restoration: Ethernet,
+   IPv4 and ICMP headers */
+#define MITM_ECHO_LEN (14 + 20 + 8)
+
+
+/* State of a pair of targets */
+enum mitm_state {
+  MITM_UNRESOLVED = 0, /* hardware addresses not known yet */
+  MITM_ACTIVE, /* being poisoned */
+  MITM_FAILED /* one of the targets does not answer */
+};
+
+
+/* Pair of targets. Each one is told that the other is at our
+   hardware address. */
+struct mitm_pair {
+  struct in_addr ip1, ip2;
+  unsigned char mac1[ETHER_ADDR_LEN], mac2[ETHER_ADDR_LEN];
+  enum mitm_state state;
+
+  /* Request and reply poisoning target 2, then target 1. They never
+     change, so they are built once. */
+  struct arp_frame poison[2][2];
+  unsigned int direction; /* direction of the next refresh */
+
+  struct wheel_timer timer; /* next refresh */
+  unsigned long refreshes;
+
+  /* Restoration, in the same directions: the true addresses, and an
+     echo request from the other target, whose reply only reaches us
+     while the cache is still poisoned */
+  struct arp_frame restore[2][2];
+  unsigned char echo[2][MITM_ECHO_LEN];
+  uint64_t restore_sent[2]; /* CLOCK_MONOTONIC of the last frames */
+  uint64_t restored[2]; /* time of the confirmation, 0 before */
+  int poisoned[2]; /* traffic through us since the last frames */
+};
+
+
+struct mitm_engine;
+
+/* Called at the end of the restoration */
+typedef void (*mitm_restore_callback)(struct mitm_engine *engine, void *arg);
+
+
+/* Man-in-the-middle engine: any number of pairs, refreshed on a timer
+   wheel. The refreshes of the pairs are spread evenly over the
+   interval, so the frames go out at a constant rate instead of in
+   bursts. */
+struct mitm_engine {
+  struct frame_io *io; /* backend used to send and receive */
+  struct host_table *hosts; /* known hosts, may be NULL */
+  struct sockaddr_in ipaddr; /* local IP address */
+  unsigned char macaddr[ETHER_ADDR_LEN]; /* local hardware address */
+
+  struct mitm_pair *pairs;
+  size_t npairs, size;
+
+  struct timer_wheel wheel;
+  unsigned int interval; /* milliseconds, may be changed before mitm_start() */
+
+  /* Event loop, between mitm_start() and mitm_stop() */
+  struct reactor *reactor;
+  struct reactor_source *rx, *timer;
+
+  /* Restoration, between mitm_restore_start() and its end. The
+     traffic of the targets is watched on a socket of its own. */
+  unsigned int restore_deadline; /* milliseconds */
+  int watchfd;
+  struct frame_io watch;
+  struct reactor_source *watch_rx, *restore_timer;
+  uint64_t restore_start;
+  mitm_restore_callback restore_done;
+  void *restore_done_arg;
+
+  /* Statistics */
+  unsigned long sent;
+  unsigned long restore_sent; /* restoring frames, echo requests included */
+  size_t restore_targets, restore_confirmed; /* directions of the active pairs */
+  uint64_t restore_time; /* nanoseconds until the last confirmation */
+};
+
+
+/* Initializes a man-in-the-middle engine
+
+   engine: the engine to initialize
+   io: frame I/O backend
+   hosts: table of the known hosts, or NULL
+   ipaddr: local IP address
+   macaddr: local hardware address
+ */
+void mitm_init(struct mitm_engine *engine, struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr);
+
+
+/* Adds a pair of targets. Pairs can't be added while the engine is
+   running.
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int mitm_add_pair(struct mitm_engine *engine, struct in_addr ip1, struct in_addr ip2);
+
+
+/* Resolves the hardware addresses of the targets of every pair: the
+   hosts which are not in the host table are asked with a single scan.
+   The pairs whose targets don't answer are marked as failed.
+
+   Returns the number of active pairs, or -1 on error.
+ */
+int mitm_resolve(struct mitm_engine *engine);
+
+
+/* Starts poisoning the active pairs on an event loop, until
+   mitm_stop(). mitm_resolve() must have been called first.
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_start(struct mitm_engine *engine, struct reactor *reactor);
+
+
+/* Stops poisoning */
+void mitm_stop(struct mitm_engine *engine);
+
+
+/* Restores the caches of the targets, once the poisoning is stopped.
+   The true addresses of every active pair are sent at once, in both
+   directions, and again to each target whose traffic still goes
+   through us. A target is restored once it stays silent for
+   MITM_RESTORE_QUIET milliseconds after its frames. The restoration
+   ends when every target is restored, or at the deadline.
+
+   done: called at the end, or NULL
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_restore_start(struct mitm_engine *engine, struct reactor *reactor, mitm_restore_callback done, void *arg);
+
+
+/* Ends the restoration, restored or not */
+void mitm_restore_stop(struct mitm_engine *engine);
+
+
+/* Poisons the active pairs on its own event loop, until SIGINT or
+   SIGTERM is received, and restores the caches of the targets then (a
+   second signal cuts the restoration short). mitm_resolve() must have
+   been called first.
+
+   Returns 0 when interrupted, -1 on error.
+ */
+int mitm_run(struct mitm_engine *engine);
+
+
+/* Adds the counters of the engine to a registry of metrics, which
+   must be collected in the thread of the engine
+
+   Returns 0 on success, -1 on error.
+ */
+int mitm_add_metrics(struct mitm_engine *engine, struct metrics *m);
+
+
+/* Frees the memory used by the engine */
+void mitm_free(struct mitm_engine *engine);
+
+
+
+#endif /* MITM_H_ */
@@ -0,0 +1,231 @@
+/* Satrap/monitor.c */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "monitor.h"
+
+
+
+static void on_host(struct in_addr ip, const unsigned char *mac, void *arg);
+static void on_round_done(struct scan_engine *engine, int status, void *arg);
+
+
+/* Initializes a monitor
+
+   engine: engine set up for the range to watch, with its parameters;
+   the monitor takes its callbacks
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_init(struct monitor *monitor, struct scan_engine *engine)
+{
+  memset(monitor, 0, sizeof(*monitor));
+  if (hosts_init(&monitor->known, 0) == -1)
+    return -1;
+  monitor->engine = engine;
+  monitor->first = engine->first;
+  monitor->last = engine->first + engine->count - 1;
+  monitor->interval = MONITOR_DEFAULT_INTERVAL;
+  monitor->background_rate = MONITOR_DEFAULT_BACKGROUND_RATE;
+  engine->callback = on_host;
+  engine->callback_arg = monitor;
+  engine->done = on_round_done;
+  engine->done_arg = monitor;
+  return 0;
+}
+
+
+static void report(struct monitor *monitor, enum monitor_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac)
+{
+  if (monitor->callback)
+    monitor->callback(event, ip, mac, old_mac, monitor->callback_arg);
+}
+
+
+/* Host callback of the engine: compared with what was reported */
+static void on_host(struct in_addr ip, const unsigned char *mac, void *arg)
+{
+  struct monitor *monitor = arg;
+  struct host_entry *entry = hosts_lookup(&monitor->known, ip);
+  if (!entry) {
+    ++monitor->appeared;
+    report(monitor, MONITOR_APPEARED, ip, mac, NULL);
+  }
+  else if (memcmp(entry->mac, mac, ETHER_ADDR_LEN)) {
+    unsigned char old_mac[ETHER_ADDR_LEN];
+    memcpy(old_mac, entry->mac, ETHER_ADDR_LEN);
+    ++monitor->moved;
+    report(monitor, MONITOR_MOVED, ip, mac, old_mac);
+  }
+  hosts_update(&monitor->known, ip, mac);
+}
+
+
+/* Starts a round: every known host, and a slice of the unknown
+   addresses (all of them in the first round) */
+static int start_round(struct monitor *monitor)
+{
+  struct scan_engine *engine = monitor->engine;
+  struct in_addr first = { htonl(monitor->first) }, last = { htonl(monitor->last) };
+  if (scan_reset(engine, first, last) == -1)
+    return -1;
+
+  /* A known host must answer again in this round */
+  size_t pos = 0;
+  struct host_entry *entry;
+  while ((entry = hosts_next(&monitor->known, &pos)))
+    entry->state = HOST_STALE;
+
+  uint32_t budget = monitor->rounds ? monitor->interval * monitor->background_rate : engine->count;
+  monitor->cursor = scan_restrict(engine, &monitor->known, monitor->cursor, budget,
+				  &monitor->round_unknown);
+  monitor->round_known = monitor->known.len;
+  engine->unicast = &monitor->known;
+
+  if (scan_start(engine, monitor->reactor) == -1)
+    return -1;
+  monitor->scanning = 1;
+  monitor->due = 0;
+  ++monitor->rounds;
+  return 0;
+}
+
+
+/* Done callback of the engine: the known hosts which did not answer
+   are gone */
+static void on_round_done(struct scan_engine *engine, int status, void *arg)
+{
+  struct monitor *monitor = arg;
+  monitor->scanning = 0;
+  monitor->round_sent = engine->sent;
+  if (status == -1) {
+#ifdef DEBUG
+    perror("[FAIL] Round");
+#endif
+    return;
+  }
+
+  /* The table can't change while it is walked */
+  struct host_entry *gone = NULL;
+  size_t ngone = 0, size = 0, pos = 0;
+  struct host_entry *entry;
+  while ((entry = hosts_next(&monitor->known, &pos))) {
+    if (entry->state != HOST_STALE)
+      continue;
+    if (ngone == size) {
+      size = size ? 2 * size : 16;
+      struct host_entry *entries = realloc(gone, size * sizeof(*entries));
+      if (!entries)
+	break;
+      gone = entries;
+    }
+    gone[ngone++] = *entry;
+  }
+  for (size_t i = 0; i < ngone; ++i) {
+    struct in_addr ip = { gone[i].ip };
+    hosts_remove(&monitor->known, ip);
+    ++monitor->disappeared;
+    report(monitor, MONITOR_DISAPPEARED, ip, gone[i].mac, NULL);
+  }
+  free(gone);
+
+#ifdef DEBUG
+  printf("[OK] Round %lu: %u known hosts, %u unknown addresses, %lu probes, "
+	 "%zu hosts now\n", monitor->rounds, monitor->round_known,
+	 monitor->round_unknown, monitor->round_sent, monitor->known.len);
+#endif
+
+  if (monitor->due && start_round(monitor) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] start_round()");
+#endif
+  }
+}
+
+
+/* Starts the next round, or lets the current one end first */
+static void on_interval(struct reactor *reactor, void *arg)
+{
+  struct monitor *monitor = arg;
+  if (monitor->scanning)
+    monitor->due = 1;
+  else if (start_round(monitor) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] start_round()");
+#endif
+  }
+}
+
+
+/* Starts the first round on an event loop, and the next ones every
+   interval, until monitor_stop()
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_start(struct monitor *monitor, struct reactor *reactor)
+{
+  monitor->reactor = reactor;
+  uint64_t interval = (monitor->interval ? monitor->interval : 1) * 1000000000ULL;
+  monitor->timer = reactor_add_timer(reactor, on_interval, monitor);
+  if (!monitor->timer || reactor_set_timer(monitor->timer, interval, interval) == -1
+      || start_round(monitor) == -1) {
+    int err = errno;
+    monitor_stop(monitor);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Stops the monitor, and the round which runs */
+void monitor_stop(struct monitor *monitor)
+{
+  if (monitor->scanning)
+    scan_stop(monitor->engine);
+  monitor->scanning = 0;
+  if (monitor->timer)
+    reactor_remove(monitor->reactor, monitor->timer);
+  monitor->timer = NULL;
+}
+
+
+static double read_known(const void *arg)
+{
+  const struct monitor *monitor = arg;
+  return monitor->known.len;
+}
+
+
+/* Adds the counters of the monitor to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_add_metrics(struct monitor *monitor, struct metrics *m, const char *labels)
+{
+  if (metrics_add_counter(m, "satrap_monitor_rounds_total",
+			  "Rounds of the monitor", labels, &monitor->rounds) == -1
+      || metrics_add_counter(m, "satrap_monitor_hosts_appeared_total",
+			     "Hosts which appeared", labels, &monitor->appeared) == -1
+      || metrics_add_counter(m, "satrap_monitor_hosts_disappeared_total",
+			     "Hosts which stopped answering", labels, &monitor->disappeared) == -1
+      || metrics_add_counter(m, "satrap_monitor_hosts_moved_total",
+			     "Addresses which answered from another hardware address", labels,
+			     &monitor->moved) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_monitor_hosts",
+		     "Hosts known to the monitor", labels, read_known, monitor) == -1)
+    return -1;
+  return 0;
+}
+
+
+/* Frees the memory used by the monitor */
+void monitor_free(struct monitor *monitor)
+{
+  hosts_free(&monitor->known);
+}
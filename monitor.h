@@ -0,0 +1,103 @@
+/* Satrap/monitor.h */
+
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+#include <stdint.h>
+
+#include "hosts.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "scan.h"
+
+
+
+/* Default seconds between the starts of two rounds */
+#define MONITOR_DEFAULT_INTERVAL 10
+
+/* Default number of unknown addresses probed per second of interval */
+#define MONITOR_DEFAULT_BACKGROUND_RATE 100
+
+
+/* Change on the link */
+enum monitor_event {
+  MONITOR_APPEARED, /* a new host answered */
+  MONITOR_DISAPPEARED, /* a known host stopped answering */
+  MONITOR_MOVED /* a known address answered from another hardware address */
+};
+
+
+/* Called for every change. old_mac is the previous hardware address
+   of a host which moved, or NULL. */
+typedef void (*monitor_callback)(enum monitor_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac, void *arg);
+
+
+/* Continuous scan of a range, in rounds, reporting only the changes.
+   The first round scans the whole range. Every later round asks the
+   known hosts again with a unicast request to their hardware address
+   (the last try is broadcast, to catch a host which moved), and only
+   interval * background_rate of the unknown addresses, a different
+   slice every round: the traffic of a round follows the number of
+   hosts and the churn, not the size of the range. */
+struct monitor {
+  struct scan_engine *engine;
+  struct host_table known; /* hosts as last reported */
+  uint32_t first, last; /* range, host byte order */
+  uint32_t cursor; /* offset of the next unknown address to probe */
+
+  /* Parameters, may be changed before monitor_start() */
+  unsigned int interval; /* seconds */
+  unsigned int background_rate; /* unknown addresses per second */
+
+  monitor_callback callback;
+  void *callback_arg;
+
+  /* Between monitor_start() and monitor_stop() */
+  struct reactor *reactor;
+  struct reactor_source *timer;
+  int scanning; /* a round runs */
+  int due; /* the next round is late, and starts at the end of this one */
+
+  /* Statistics */
+  unsigned long rounds;
+  unsigned long appeared, disappeared, moved;
+  uint32_t round_known, round_unknown; /* probed by the last round */
+  unsigned long round_sent; /* probes of the last round */
+};
+
+
+/* Initializes a monitor
+
+   engine: engine set up for the range to watch, with its parameters;
+   the monitor takes its callbacks
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_init(struct monitor *monitor, struct scan_engine *engine);
+
+
+/* Starts the first round on an event loop, and the next ones every
+   interval, until monitor_stop()
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_start(struct monitor *monitor, struct reactor *reactor);
+
+
+/* Stops the monitor, and the round which runs */
+void monitor_stop(struct monitor *monitor);
+
+
+/* Adds the counters of the monitor to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int monitor_add_metrics(struct monitor *monitor, struct metrics *m, const char *labels);
+
+
+/* Frees the memory used by the monitor */
+void monitor_free(struct monitor *monitor);
+
+
+
+#endif /* MONITOR_H_ */
@@ -0,0 +1,335 @@
+/* Satrap/netif.c */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "netif.h"
+
+
+
+/* Size of the receive buffer of the dumps: the kernel fills it with
+   as many messages as fit */
+#define NETIF_DUMP_BUFFER 32768
+
+
+/* Handles a message of a dump. Returns 0 on success, -1 on error. */
+typedef int (*dump_handler)(struct netif_list *list, const struct nlmsghdr *nh);
+
+
+
+/* ====================================================================== */
+
+/* RTNETLINK DUMPS */
+
+/* Sends a dump request, and hands every message of the reply to the
+   handler
+
+   fd: the rtnetlink socket
+   type: the request, RTM_GET*
+   reply: type of the messages of the reply, RTM_NEW*
+   family: address family of the request
+   seq: sequence number of the request
+   handler: called for every message of the reply
+
+   Returns 0 on success, -1 on error.
+ */
+static int dump(int fd, uint16_t type, uint16_t reply, unsigned char family, uint32_t seq, dump_handler handler, struct netif_list *list)
+{
+  /* The family is the first byte of both ifinfomsg and ifaddrmsg */
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+  req.nh.nlmsg_type = type;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nh.nlmsg_seq = seq;
+  req.ifi.ifi_family = family;
+  if (send(fd, &req, req.nh.nlmsg_len, 0) == -1)
+    return -1;
+
+  long buf[NETIF_DUMP_BUFFER / sizeof(long)]; /* aligned for the headers */
+  for (;;) {
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    const struct nlmsghdr *nh = (const struct nlmsghdr *) buf;
+    for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_seq != seq)
+	continue;
+      if (nh->nlmsg_type == NLMSG_DONE)
+	return 0;
+      if (nh->nlmsg_type == NLMSG_ERROR) {
+	const struct nlmsgerr *err = NLMSG_DATA(nh);
+	errno = err->error ? -err->error : EPROTO;
+	return -1;
+      }
+      if (nh->nlmsg_type == reply && handler(list, nh) == -1)
+	return -1;
+    }
+  }
+}
+
+
+/* Adds an interface, from a link message */
+static int add_link(struct netif_list *list, const struct nlmsghdr *nh)
+{
+  const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+  if (list->len == list->size) {
+    size_t size = list->size ? 2 * list->size : 16;
+    struct netif *ifs = realloc(list->ifs, size * sizeof(*ifs));
+    if (!ifs)
+      return -1;
+    list->ifs = ifs;
+    list->size = size;
+  }
+  struct netif *netif = &list->ifs[list->len];
+  memset(netif, 0, sizeof(*netif));
+  netif->index = ifi->ifi_index;
+  netif->type = ifi->ifi_type;
+  netif->flags = ifi->ifi_flags;
+
+  int len = IFLA_PAYLOAD(nh);
+  for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    size_t size = RTA_PAYLOAD(rta);
+    switch (rta->rta_type) {
+    case IFLA_IFNAME:
+      if (size > sizeof(netif->name))
+	size = sizeof(netif->name);
+      memcpy(netif->name, RTA_DATA(rta), size);
+      netif->name[sizeof(netif->name) - 1] = 0;
+      break;
+    case IFLA_MTU:
+      if (size >= sizeof(uint32_t))
+	memcpy(&netif->mtu, RTA_DATA(rta), sizeof(uint32_t));
+      break;
+    case IFLA_ADDRESS:
+      if (netif->type == ARPHRD_ETHER && size == ETHER_ADDR_LEN)
+	memcpy(netif->macaddr, RTA_DATA(rta), ETHER_ADDR_LEN);
+      break;
+    }
+  }
+  ++list->len;
+  return 0;
+}
+
+
+/* Adds an IPv4 address to its interface, from an address message */
+static int add_addr(struct netif_list *list, const struct nlmsghdr *nh)
+{
+  const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+  struct netif *netif = NULL;
+  for (size_t i = 0; i < list->len && !netif; ++i)
+    if (list->ifs[i].index == (int) ifa->ifa_index)
+      netif = &list->ifs[i];
+  if (!netif || ifa->ifa_family != AF_INET)
+    return 0;
+
+  struct netif_addr addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.prefix = ifa->ifa_prefixlen;
+  uint32_t flags = ifa->ifa_flags;
+  int local = 0, found = 0;
+  int len = IFA_PAYLOAD(nh);
+  for (const struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (RTA_PAYLOAD(rta) < sizeof(uint32_t))
+      continue;
+    switch (rta->rta_type) {
+    case IFA_LOCAL:
+      /* On a point-to-point link, IFA_ADDRESS is the peer */
+      memcpy(&addr.addr, RTA_DATA(rta), sizeof(addr.addr));
+      local = found = 1;
+      break;
+    case IFA_ADDRESS:
+      if (!local)
+	memcpy(&addr.addr, RTA_DATA(rta), sizeof(addr.addr));
+      found = 1;
+      break;
+    case IFA_BROADCAST:
+      memcpy(&addr.broadcast, RTA_DATA(rta), sizeof(addr.broadcast));
+      break;
+    case IFA_FLAGS:
+      memcpy(&flags, RTA_DATA(rta), sizeof(flags));
+      break;
+    }
+  }
+  if (!found)
+    return 0;
+  addr.secondary = !!(flags & IFA_F_SECONDARY);
+
+  struct netif_addr *addrs = realloc(netif->addrs, (netif->naddrs + 1) * sizeof(*addrs));
+  if (!addrs)
+    return -1;
+  netif->addrs = addrs;
+  netif->addrs[netif->naddrs++] = addr;
+  return 0;
+}
+
+
+/* Lists the interfaces and their IPv4 addresses, with two dumps
+   (links, then addresses) on a single rtnetlink socket
+
+   Returns 0 on success, -1 on error.
+ */
+int netif_load(struct netif_list *list)
+{
+  memset(list, 0, sizeof(*list));
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+  if (dump(fd, RTM_GETLINK, RTM_NEWLINK, AF_UNSPEC, 1, add_link, list) == -1
+      || dump(fd, RTM_GETADDR, RTM_NEWADDR, AF_INET, 2, add_addr, list) == -1) {
+    int err = errno;
+    close(fd);
+    netif_free(list);
+    errno = err;
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+
+/* Frees the memory used by a list */
+void netif_free(struct netif_list *list)
+{
+  for (size_t i = 0; i < list->len; ++i)
+    free(list->ifs[i].addrs);
+  free(list->ifs);
+  memset(list, 0, sizeof(*list));
+}
+
+
+
+/* ====================================================================== */
+
+/* LOOKUPS */
+
+/* Returns the interfaces of the system, loaded on the first call and
+   kept for the process, or NULL on error. The first call must not
+   race with another one: make it from the main thread. */
+const struct netif_list *netif_all(void)
+{
+  static struct netif_list cache;
+  static int loaded;
+  if (!loaded) {
+    if (netif_load(&cache) == -1)
+      return NULL;
+    loaded = 1;
+  }
+  return &cache;
+}
+
+
+/* Finds an interface of a list by name
+
+   Returns the interface, or NULL with errno set to ENODEV.
+ */
+const struct netif *netif_find(const struct netif_list *list, const char *name)
+{
+  for (size_t i = 0; i < list->len; ++i)
+    if (!strcmp(list->ifs[i].name, name))
+      return &list->ifs[i];
+  errno = ENODEV;
+  return NULL;
+}
+
+
+/* Finds an interface of the system by name, in the list kept by
+   netif_all()
+
+   Returns the interface, or NULL on error (ENODEV if there is no such
+   interface, ENAMETOOLONG if the name is too long for one).
+ */
+const struct netif *netif_lookup(const char *name)
+{
+  if (strlen(name) >= IF_NAMESIZE) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  const struct netif_list *list = netif_all();
+  return list ? netif_find(list, name) : NULL;
+}
+
+
+/* Returns the first primary IPv4 address of an interface, or NULL if
+   it has none */
+const struct netif_addr *netif_primary(const struct netif *netif)
+{
+  for (size_t i = 0; i < netif->naddrs; ++i)
+    if (!netif->addrs[i].secondary)
+      return &netif->addrs[i];
+  return netif->naddrs ? &netif->addrs[0] : NULL;
+}
+
+
+/* Returns the address ip of an interface, or NULL if the interface
+   does not have it */
+const struct netif_addr *netif_find_addr(const struct netif *netif, struct in_addr ip)
+{
+  for (size_t i = 0; i < netif->naddrs; ++i)
+    if (netif->addrs[i].addr.s_addr == ip.s_addr)
+      return &netif->addrs[i];
+  return NULL;
+}
+
+
+/* Returns the IPv4 address of an interface whose network holds ip,
+   the primary one first, or else the first primary address, or NULL
+   if the interface has no IPv4 address */
+const struct netif_addr *netif_addr_for(const struct netif *netif, struct in_addr ip)
+{
+  const struct netif_addr *match = NULL;
+  for (size_t i = 0; i < netif->naddrs; ++i) {
+    const struct netif_addr *addr = &netif->addrs[i];
+    uint32_t mask = netif_netmask(addr->prefix).s_addr;
+    if ((addr->addr.s_addr & mask) == (ip.s_addr & mask)
+	&& (!match || (match->secondary && !addr->secondary)))
+      match = addr;
+  }
+  return match ? match : netif_primary(netif);
+}
+
+
+/* Returns the network mask of a prefix length */
+struct in_addr netif_netmask(unsigned int prefix)
+{
+  struct in_addr mask;
+  mask.s_addr = htonl(prefix ? ~0U << (32 - (prefix > 32 ? 32 : prefix)) : 0);
+  return mask;
+}
+
+
+/* Computes the range of the hosts of the network of an address,
+   without the network and broadcast addresses when there are others
+
+   addr: the address
+   first, last: filled with the first and last addresses of the range
+ */
+void netif_range(const struct netif_addr *addr, struct in_addr *first, struct in_addr *last)
+{
+  uint32_t mask = ntohl(netif_netmask(addr->prefix).s_addr);
+  uint32_t network = ntohl(addr->addr.s_addr) & mask;
+  uint32_t broadcast = network | ~mask;
+  if (broadcast - network >= 3) {
+    first->s_addr = htonl(network + 1);
+    last->s_addr = htonl(broadcast - 1);
+  }
+  else {
+    first->s_addr = htonl(network);
+    last->s_addr = htonl(broadcast);
+  }
+}
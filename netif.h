@@ -0,0 +1,108 @@
+/* Satrap/netif.h */
+
+#ifndef NETIF_H_
+#define NETIF_H_
+
+#include <stddef.h>
+
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+
+
+/* IPv4 address of an interface */
+struct netif_addr {
+  struct in_addr addr; /* local address */
+  unsigned int prefix; /* length of the network prefix */
+  struct in_addr broadcast; /* 0 if there is none */
+  int secondary; /* not the primary address of its network */
+};
+
+
+/* Network interface, with all its IPv4 addresses: the primary
+   addresses come before the secondary ones of their network */
+struct netif {
+  int index;
+  char name[IF_NAMESIZE];
+  unsigned short type; /* link type, ARPHRD_* */
+  unsigned int flags; /* IFF_* */
+  unsigned int mtu;
+  unsigned char macaddr[ETHER_ADDR_LEN]; /* hardware address, if Ethernet */
+  struct netif_addr *addrs;
+  size_t naddrs;
+};
+
+
+/* Every interface of the system, from the kernel's order */
+struct netif_list {
+  struct netif *ifs;
+  size_t len, size;
+};
+
+
+/* Lists the interfaces and their IPv4 addresses, with two dumps
+   (links, then addresses) on a single rtnetlink socket
+
+   Returns 0 on success, -1 on error.
+ */
+int netif_load(struct netif_list *list);
+
+
+/* Frees the memory used by a list */
+void netif_free(struct netif_list *list);
+
+
+/* Returns the interfaces of the system, loaded on the first call and
+   kept for the process, or NULL on error. The first call must not
+   race with another one: make it from the main thread. */
+const struct netif_list *netif_all(void);
+
+
+/* Finds an interface of a list by name
+
+   Returns the interface, or NULL with errno set to ENODEV.
+ */
+const struct netif *netif_find(const struct netif_list *list, const char *name);
+
+
+/* Finds an interface of the system by name, in the list kept by
+   netif_all()
+
+   Returns the interface, or NULL on error (ENODEV if there is no such
+   interface, ENAMETOOLONG if the name is too long for one).
+ */
+const struct netif *netif_lookup(const char *name);
+
+
+/* Returns the first primary IPv4 address of an interface, or NULL if
+   it has none */
+const struct netif_addr *netif_primary(const struct netif *netif);
+
+
+/* Returns the address ip of an interface, or NULL if the interface
+   does not have it */
+const struct netif_addr *netif_find_addr(const struct netif *netif, struct in_addr ip);
+
+
+/* Returns the IPv4 address of an interface whose network holds ip,
+   the primary one first, or else the first primary address, or NULL
+   if the interface has no IPv4 address */
+const struct netif_addr *netif_addr_for(const struct netif *netif, struct in_addr ip);
+
+
+/* Returns the network mask of a prefix length */
+struct in_addr netif_netmask(unsigned int prefix);
+
+
+/* Computes the range of the hosts of the network of an address,
+   without the network and broadcast addresses when there are others
+
+   addr: the address
+   first, last: filled with the first and last addresses of the range
+ */
+void netif_range(const struct netif_addr *addr, struct in_addr *first, struct in_addr *last);
+
+
+
+#endif /* NETIF_H_ */
@@ -0,0 +1,140 @@
+/* Satrap/passive.c */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/if_ether.h>
+#include <sys/epoll.h>
+
+#include "netif.h"
+#include "passive.h"
+
+
+
+/* Initializes a passive discovery
+
+   hosts: table where the hosts are recorded
+   local: local IP address
+   prefix: length of the prefix of the local network
+ */
+void passive_init(struct passive *passive, struct host_table *hosts, struct in_addr local, unsigned int prefix)
+{
+  memset(passive, 0, sizeof(*passive));
+  passive->hosts = hosts;
+  passive->local = local;
+  passive->mask = netif_netmask(prefix).s_addr;
+  passive->network = local.s_addr & passive->mask;
+}
+
+
+/* Records that a host was seen, and calls the callback if it is news */
+static void learn(struct passive *passive, uint32_t ip, const unsigned char *mac)
+{
+  /* Nobody (ARP probes), ourselves, multicast and broadcast senders */
+  if (ip == 0 || ip == passive->local.s_addr || (mac[0] & 1))
+    return;
+
+  struct in_addr addr = { ip };
+  struct host_entry *entry = hosts_lookup(passive->hosts, addr);
+  int news = !entry || entry->state != HOST_ALIVE || memcmp(entry->mac, mac, ETHER_ADDR_LEN);
+  if (!entry || news)
+    entry = hosts_update(passive->hosts, addr, mac);
+  else
+    /* The common case, a host heard again: just its time */
+    entry->last_seen = hosts_now();
+  if (news && entry) {
+    ++passive->learned;
+    if (passive->callback)
+      passive->callback(addr, mac, passive->callback_arg);
+  }
+}
+
+
+/* Handles a received frame (a frame_handler) */
+void passive_handle_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  struct passive *passive = arg;
+  const struct ether_header *eth = (const struct ether_header *) frame;
+  ++passive->frames;
+  if (len < sizeof(*eth))
+    return;
+
+  if (eth->ether_type == htons(ETH_P_ARP)) {
+    /* Requests, replies and announcements all name their sender */
+    const struct ether_arp *arp = (const struct ether_arp *) (eth + 1);
+    if (len < sizeof(*eth) + sizeof(*arp)
+	|| arp->arp_hrd != htons(ARPHRD_ETHER) || arp->arp_pro != htons(ETH_P_IP))
+      return;
+    uint32_t ip;
+    memcpy(&ip, arp->arp_spa, sizeof(ip));
+    ++passive->arp;
+    learn(passive, ip, arp->arp_sha);
+  }
+  else if (eth->ether_type == htons(ETH_P_IP)) {
+    /* The source address, at offset 12 of the header */
+    if (len < sizeof(*eth) + 20)
+      return;
+    uint32_t ip;
+    memcpy(&ip, frame + sizeof(*eth) + 12, sizeof(ip));
+    if ((ip & passive->mask) != passive->network)
+      return;
+    ++passive->ipv4;
+    learn(passive, ip, eth->ether_shost);
+  }
+}
+
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct passive *passive = arg;
+  if (frame_io_recv(passive->io, passive_handle_frame, passive) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] frame_io_recv() (passive)");
+#endif
+  }
+}
+
+
+/* Starts listening to the frames of a backend on an event loop. The
+   sockets of the backend need the filter of filter_attach_passive().
+
+   Returns 0 on success, -1 on error.
+ */
+int passive_start(struct passive *passive, struct reactor *reactor, struct frame_io *io)
+{
+  passive->reactor = reactor;
+  passive->io = io;
+  passive->rx = reactor_add_fd(reactor, io->fd, EPOLLIN, on_frames, passive);
+  return passive->rx ? 0 : -1;
+}
+
+
+/* Stops listening */
+void passive_stop(struct passive *passive)
+{
+  if (passive->rx)
+    reactor_remove(passive->reactor, passive->rx);
+  passive->rx = NULL;
+}
+
+
+/* Adds the counters of the discovery to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int passive_add_metrics(struct passive *passive, struct metrics *m, const char *labels)
+{
+  if (metrics_add_counter(m, "satrap_passive_frames_total",
+			  "Frames heard by the passive discovery", labels, &passive->frames) == -1
+      || metrics_add_counter(m, "satrap_passive_arp_frames_total",
+			     "ARP frames which named a host", labels, &passive->arp) == -1
+      || metrics_add_counter(m, "satrap_passive_ipv4_packets_total",
+			     "IPv4 packets from the local network", labels, &passive->ipv4) == -1
+      || metrics_add_counter(m, "satrap_passive_hosts_learned_total",
+			     "Hosts new, back, or with a new hardware address", labels,
+			     &passive->learned) == -1)
+    return -1;
+  return 0;
+}
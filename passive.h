@@ -0,0 +1,79 @@
+/* Satrap/passive.h */
+
+#ifndef PASSIVE_H_
+#define PASSIVE_H_
+
+#include <netinet/in.h>
+
+#include "hosts.h"
+#include "io.h"
+#include "metrics.h"
+#include "reactor.h"
+
+
+
+/* Called for every host learned: new, back after going stale, or with
+   a new hardware address */
+typedef void (*passive_callback)(struct in_addr ip, const unsigned char *mac, void *arg);
+
+
+/* Passive discovery: the hosts are learned from the traffic of the
+   link, without a single frame sent. The senders of the ARP requests,
+   replies and announcements are recorded, and so are the sources of
+   the IPv4 packets from the local network (the others come through a
+   router, with its hardware address). The socket needs the filter of
+   filter_attach_passive(), which cuts every frame to its headers. */
+struct passive {
+  struct host_table *hosts;
+  struct in_addr local; /* never recorded */
+  uint32_t network, mask; /* network byte order */
+
+  passive_callback callback;
+  void *callback_arg;
+
+  /* Between passive_start() and passive_stop() */
+  struct reactor *reactor;
+  struct frame_io *io;
+  struct reactor_source *rx;
+
+  /* Statistics */
+  unsigned long frames; /* handled */
+  unsigned long arp, ipv4; /* frames which named a host */
+  unsigned long learned; /* hosts for which the callback was called */
+};
+
+
+/* Initializes a passive discovery
+
+   hosts: table where the hosts are recorded
+   local: local IP address
+   prefix: length of the prefix of the local network
+ */
+void passive_init(struct passive *passive, struct host_table *hosts, struct in_addr local, unsigned int prefix);
+
+
+/* Handles a received frame (a frame_handler) */
+void passive_handle_frame(const unsigned char *frame, size_t len, void *arg);
+
+
+/* Starts listening to the frames of a backend on an event loop. The
+   sockets of the backend need the filter of filter_attach_passive().
+
+   Returns 0 on success, -1 on error.
+ */
+int passive_start(struct passive *passive, struct reactor *reactor, struct frame_io *io);
+
+
+/* Stops listening */
+void passive_stop(struct passive *passive);
+
+
+/* Adds the counters of the discovery to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int passive_add_metrics(struct passive *passive, struct metrics *m, const char *labels);
+
+
+
+#endif /* PASSIVE_H_ */
@@ -0,0 +1,531 @@
+/* Satrap/pcap.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "pcap.h"
+
+
+
+/* pcap: file header, then a header before every record */
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_FILE_HEADER_LEN 24
+#define PCAP_RECORD_HEADER_LEN 16
+
+/* pcapng: blocks of type, total length, body, total length */
+#define PCAPNG_SHB 0x0a0d0d0a /* section header, the same both ways */
+#define PCAPNG_IDB 0x00000001 /* interface description */
+#define PCAPNG_SPB 0x00000003 /* simple packet */
+#define PCAPNG_EPB 0x00000006 /* enhanced packet */
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL 9 /* if_tsresol option of an IDB */
+
+#define LINKTYPE_ETHERNET 1
+
+
+/* Interface of a pcapng section */
+struct pcap_interface {
+  uint16_t linktype;
+  uint32_t snaplen;
+  uint8_t tsresol; /* negative power of 10, or of 2 with the high bit */
+};
+
+
+/* Private data of the replay backend */
+struct pcap_io {
+  unsigned char *map;
+  size_t len;
+  size_t start; /* offset of the first record or block */
+  size_t pos; /* offset of the next one */
+
+  int ng; /* pcapng or pcap */
+  int swapped; /* the file and the host have different byte orders */
+  int nsec; /* pcap: the timestamps are in nanoseconds */
+  uint32_t linktype; /* pcap: link type of the file */
+  struct pcap_interface ifaces[PCAP_MAX_INTERFACES];
+  unsigned int nifaces; /* of the current pcapng section */
+
+  int realtime;
+  unsigned int loops; /* replays left after this one, if not forever */
+  int forever;
+  int started; /* the clock of the replay is set */
+  unsigned long pass_frames; /* frames found since the replay started over */
+  uint64_t first_ts; /* timestamp of the first frame, nanoseconds */
+  uint64_t last_ts; /* of the previous frame */
+  uint64_t clock; /* CLOCK_MONOTONIC time of the first frame */
+  int done;
+};
+
+
+/* A frame found in the file */
+struct pcap_frame {
+  const unsigned char *data;
+  uint32_t len;
+  uint64_t ts; /* nanoseconds */
+  int ethernet; /* if not set, the frame is skipped */
+};
+
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint16_t read16(const struct pcap_io *p, const unsigned char *at)
+{
+  uint16_t v;
+  memcpy(&v, at, sizeof(v));
+  return p->swapped ? bswap_16(v) : v;
+}
+
+
+static uint32_t read32(const struct pcap_io *p, const unsigned char *at)
+{
+  uint32_t v;
+  memcpy(&v, at, sizeof(v));
+  return p->swapped ? bswap_32(v) : v;
+}
+
+
+/* Converts a pcapng timestamp to nanoseconds */
+static uint64_t ng_timestamp(uint64_t ts, uint8_t tsresol)
+{
+  unsigned int exp = tsresol & 0x7f;
+  if (tsresol & 0x80) {
+    /* Fractions of a power of 2 */
+    if (exp >= 64)
+      return 0;
+    uint64_t mask = exp ? (1ULL << exp) - 1 : 0;
+    return (ts >> exp) * 1000000000ULL + (((ts & mask) * 1000000000ULL) >> exp);
+  }
+  uint64_t ns = ts;
+  for (; exp < 9; ++exp)
+    ns *= 10;
+  for (; exp > 9; --exp)
+    ns /= 10;
+  return ns;
+}
+
+
+
+/* ====================================================================== */
+
+/* PARSING */
+
+/* Reads the pcapng section header at pos, which sets the byte order
+   and forgets the interfaces of the previous section
+
+   Returns 0 on success, -1 if it is malformed.
+ */
+static int read_section_header(struct pcap_io *p, size_t pos)
+{
+  if (p->len - pos < 28)
+    return -1;
+  uint32_t magic;
+  memcpy(&magic, p->map + pos + 8, sizeof(magic));
+  if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+    p->swapped = 0;
+  else if (magic == bswap_32(PCAPNG_BYTE_ORDER_MAGIC))
+    p->swapped = 1;
+  else
+    return -1;
+  p->nifaces = 0;
+  return 0;
+}
+
+
+/* Reads an interface description block: its link type, and the
+   resolution of its timestamps */
+static void read_interface(struct pcap_io *p, const unsigned char *body, uint32_t body_len)
+{
+  if (body_len < 8 || p->nifaces == PCAP_MAX_INTERFACES)
+    return;
+  struct pcap_interface *iface = &p->ifaces[p->nifaces++];
+  iface->linktype = read16(p, body);
+  iface->snaplen = read32(p, body + 4);
+  iface->tsresol = 6; /* microseconds */
+
+  /* Options: code, length, value padded to 32 bits */
+  uint32_t off = 8;
+  while (body_len - off >= 4) {
+    uint16_t code = read16(p, body + off);
+    uint16_t len = read16(p, body + off + 2);
+    off += 4;
+    if (code == 0 || len > body_len - off)
+      break;
+    if (code == PCAPNG_OPT_TSRESOL && len >= 1)
+      iface->tsresol = body[off];
+    off += (len + 3) & ~3U;
+  }
+}
+
+
+/* Finds the next frame. The other blocks are read on the way, and
+   consumed: the frame is only consumed by the caller, which may leave
+   it for later.
+
+   Returns 1 with the frame and the offset of the following record, 0
+   at the end of the file, -1 if the file is malformed.
+ */
+static int next_frame(struct pcap_io *p, struct pcap_frame *frame, size_t *next)
+{
+  size_t pos = p->pos;
+  while (pos < p->len) {
+    if (!p->ng) {
+      if (p->len - pos < PCAP_RECORD_HEADER_LEN)
+	return -1;
+      const unsigned char *hdr = p->map + pos;
+      uint32_t caplen = read32(p, hdr + 8);
+      if (caplen > p->len - pos - PCAP_RECORD_HEADER_LEN)
+	return -1;
+      frame->data = hdr + PCAP_RECORD_HEADER_LEN;
+      frame->len = caplen;
+      frame->ts = read32(p, hdr) * 1000000000ULL
+	+ read32(p, hdr + 4) * (p->nsec ? 1ULL : 1000ULL);
+      frame->ethernet = p->linktype == LINKTYPE_ETHERNET;
+      *next = pos + PCAP_RECORD_HEADER_LEN + caplen;
+      return 1;
+    }
+
+    /* pcapng: the byte order of a section header is only known once
+       it is read */
+    if (p->len - pos < 12)
+      return -1;
+    uint32_t type;
+    memcpy(&type, p->map + pos, sizeof(type));
+    if (type == PCAPNG_SHB && read_section_header(p, pos) == -1)
+      return -1;
+    uint32_t block_len = read32(p, p->map + pos + 4);
+    if (block_len < 12 || block_len % 4 || block_len > p->len - pos)
+      return -1;
+    const unsigned char *body = p->map + pos + 8;
+    uint32_t body_len = block_len - 12;
+    pos += block_len;
+
+    switch (type) {
+    case PCAPNG_IDB:
+      read_interface(p, body, body_len);
+      p->pos = pos;
+      break;
+
+    case PCAPNG_EPB: {
+      if (body_len < 20)
+	return -1;
+      uint32_t id = read32(p, body);
+      uint64_t ts = ((uint64_t) read32(p, body + 4) << 32) | read32(p, body + 8);
+      uint32_t caplen = read32(p, body + 12);
+      if (caplen > body_len - 20)
+	return -1;
+      const struct pcap_interface *iface = id < p->nifaces ? &p->ifaces[id] : NULL;
+      frame->data = body + 20;
+      frame->len = caplen;
+      frame->ts = iface ? ng_timestamp(ts, iface->tsresol) : 0;
+      frame->ethernet = iface && iface->linktype == LINKTYPE_ETHERNET;
+      *next = pos;
+      return 1;
+    }
+
+    case PCAPNG_SPB: {
+      /* No timestamp: the frame comes with the previous one */
+      if (body_len < 4 || p->nifaces == 0)
+	return -1;
+      uint32_t len = read32(p, body);
+      uint32_t caplen = body_len - 4;
+      if (len < caplen)
+	caplen = len;
+      if (p->ifaces[0].snaplen && p->ifaces[0].snaplen < caplen)
+	caplen = p->ifaces[0].snaplen;
+      frame->data = body + 4;
+      frame->len = caplen;
+      frame->ts = p->last_ts;
+      frame->ethernet = p->ifaces[0].linktype == LINKTYPE_ETHERNET;
+      *next = pos;
+      return 1;
+    }
+
+    default:
+      /* Section header, statistics, name resolution... */
+      p->pos = pos;
+      break;
+    }
+  }
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* Makes the descriptor readable after delay nanoseconds */
+static void arm_timer(struct frame_io *io, uint64_t delay)
+{
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (delay == 0)
+    delay = 1;
+  spec.it_value.tv_sec = delay / 1000000000ULL;
+  spec.it_value.tv_nsec = delay % 1000000000ULL;
+  timerfd_settime(io->fd, 0, &spec, NULL);
+}
+
+
+static int pcap_recv(struct frame_io *io, frame_handler handler, void *arg)
+{
+  struct pcap_io *p = io->priv;
+  uint64_t expirations;
+  if (read(io->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    return -1;
+  if (p->done)
+    return 0;
+
+  int count = 0;
+  uint64_t now = p->realtime ? now_ns() : 0;
+  /* The records we skip count in the batch too */
+  for (unsigned int records = 0; records < PCAP_BATCH; ++records) {
+    struct pcap_frame frame;
+    size_t next;
+    int found = next_frame(p, &frame, &next);
+    if (found == -1) {
+      p->done = 1;
+      errno = EINVAL;
+      return -1;
+    }
+    if (found == 0) {
+      /* The next replay starts over, on a new clock, unless there is
+	 nothing to replay */
+      if ((!p->forever && p->loops == 0) || p->pass_frames == 0) {
+	p->done = 1;
+	return count;
+      }
+      if (!p->forever)
+	--p->loops;
+      p->pos = p->start;
+      p->started = 0;
+      p->pass_frames = 0;
+      continue;
+    }
+
+    /* The frames of other link types don't wait for their time */
+    if (!frame.ethernet) {
+      p->pos = next;
+      ++p->pass_frames;
+      continue;
+    }
+
+    if (p->realtime) {
+      if (!p->started) {
+	p->first_ts = frame.ts;
+	p->clock = now;
+	p->started = 1;
+      }
+      /* A timestamp from before the first frame comes right away */
+      uint64_t due = p->clock + (frame.ts > p->first_ts ? frame.ts - p->first_ts : 0);
+      if (due > now) {
+	arm_timer(io, due - now);
+	return count;
+      }
+    }
+
+    p->pos = next;
+    p->last_ts = frame.ts;
+    ++p->pass_frames;
+    handler(frame.data, frame.len, arg);
+    ++count;
+  }
+
+  /* More frames are due */
+  arm_timer(io, 0);
+  return count;
+}
+
+
+/* The frames to send go nowhere */
+static int pcap_send(struct frame_io *io, const void *frame, size_t len)
+{
+  return 0;
+}
+
+
+static int pcap_flush(struct frame_io *io)
+{
+  return 0;
+}
+
+
+static void pcap_close(struct frame_io *io)
+{
+  struct pcap_io *p = io->priv;
+  munmap(p->map, p->len);
+  close(io->fd);
+  free(p);
+  io->priv = NULL;
+}
+
+
+static const struct frame_io_ops pcap_ops = {
+  .send = pcap_send,
+  .flush = pcap_flush,
+  .recv = pcap_recv,
+  .close = pcap_close,
+};
+
+
+
+/* ====================================================================== */
+
+/* Fills the parameters with their default values: a single replay,
+   as fast as possible */
+void pcap_params_default(struct pcap_params *params)
+{
+  params->realtime = 0;
+  params->loops = 1;
+}
+
+
+/* Reads the header of the file: pcap, with either byte order and
+   timestamp resolution, or pcapng
+
+   Returns 0 on success, -1 if the file is not a capture.
+ */
+static int read_file_header(struct pcap_io *p)
+{
+  if (p->len < 4)
+    return -1;
+  uint32_t magic;
+  memcpy(&magic, p->map, sizeof(magic));
+
+  if (magic == PCAPNG_SHB) {
+    p->ng = 1;
+    if (read_section_header(p, 0) == -1)
+      return -1;
+    p->start = 0; /* the section header is read like any block */
+    return 0;
+  }
+
+  if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC)
+    p->swapped = 0;
+  else if (magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC))
+    p->swapped = 1;
+  else
+    return -1;
+  if (p->len < PCAP_FILE_HEADER_LEN)
+    return -1;
+  p->nsec = read32(p, p->map) == PCAP_MAGIC_NSEC;
+  /* The upper bits of the link type may hold the FCS length */
+  p->linktype = read32(p, p->map + 20) & 0x0fffffff;
+  p->start = PCAP_FILE_HEADER_LEN;
+  return 0;
+}
+
+
+/* Creates a receive backend which replays the Ethernet frames of a
+   capture file, pcap or pcapng. The file is memory-mapped, and the
+   handler gets pointers into the mapping: the frames are never
+   copied. The frames of other link types are skipped.
+
+   The descriptor of the backend is a timer, readable whenever frames
+   are due: right away when the replay is as fast as possible, or at
+   the original timestamps. The frames to send are dropped, as on a
+   link where no one listens, so the engines run unchanged.
+
+   io: the backend to initialize
+   path: the capture file
+   params: parameters of the replay, or NULL for the defaults
+
+   Returns 0 on success, -1 on error (EINVAL if the file is not a
+   capture we can read).
+ */
+int frame_io_pcap(struct frame_io *io, const char *path, const struct pcap_params *params)
+{
+  struct pcap_params defaults;
+  if (!params) {
+    pcap_params_default(&defaults);
+    params = &defaults;
+  }
+
+  struct pcap_io *p = calloc(1, sizeof(*p));
+  if (!p)
+    return -1;
+  int fd = -1, timerfd = -1;
+  p->map = MAP_FAILED;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    goto fail;
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    goto fail;
+  if (st.st_size == 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  p->len = st.st_size;
+  p->map = mmap(NULL, p->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p->map == MAP_FAILED)
+    goto fail;
+  /* The mapping keeps the file */
+  close(fd);
+  fd = -1;
+  madvise(p->map, p->len, MADV_SEQUENTIAL);
+
+  if (read_file_header(p) == -1) {
+    errno = EINVAL;
+    goto fail;
+  }
+  p->pos = p->start;
+  p->realtime = params->realtime;
+  p->forever = params->loops == 0;
+  p->loops = params->loops ? params->loops - 1 : 0;
+
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerfd == -1)
+    goto fail;
+
+  io->ops = &pcap_ops;
+  io->fd = timerfd;
+  io->ifindex = 0;
+  io->priv = p;
+  memset(&io->counters, 0, sizeof(io->counters));
+
+  /* The first frames are due right away */
+  arm_timer(io, 0);
+  return 0;
+
+ fail: {
+    int err = errno;
+    if (p->map != MAP_FAILED)
+      munmap(p->map, p->len);
+    if (fd >= 0)
+      close(fd);
+    if (timerfd >= 0)
+      close(timerfd);
+    free(p);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Returns 1 once every frame of the replay has been handed to the
+   handler, 0 before. A malformed record ends the replay too: the last
+   frame_io_recv() returns -1 with errno set to EINVAL. */
+int pcap_replay_done(const struct frame_io *io)
+{
+  const struct pcap_io *p = io->priv;
+  return p->done;
+}
@@ -0,0 +1,58 @@
+/* Satrap/pcap.h */
+
+#ifndef PCAP_H_
+#define PCAP_H_
+
+#include "io.h"
+
+
+
+/* Frames handed to the handler per call to frame_io_recv(), so that
+   a replay as fast as possible does not starve the other sources of
+   an event loop */
+#define PCAP_BATCH 256
+
+/* Interfaces of a pcapng section whose frames we can replay */
+#define PCAP_MAX_INTERFACES 16
+
+
+/* Parameters of the replay backend */
+struct pcap_params {
+  int realtime; /* if set, the frames come at their original pace */
+  unsigned int loops; /* times the file is replayed, 0 for forever */
+};
+
+
+/* Fills the parameters with their default values: a single replay,
+   as fast as possible */
+void pcap_params_default(struct pcap_params *params);
+
+
+/* Creates a receive backend which replays the Ethernet frames of a
+   capture file, pcap or pcapng. The file is memory-mapped, and the
+   handler gets pointers into the mapping: the frames are never
+   copied. The frames of other link types are skipped.
+
+   The descriptor of the backend is a timer, readable whenever frames
+   are due: right away when the replay is as fast as possible, or at
+   the original timestamps. The frames to send are dropped, as on a
+   link where no one listens, so the engines run unchanged.
+
+   io: the backend to initialize
+   path: the capture file
+   params: parameters of the replay, or NULL for the defaults
+
+   Returns 0 on success, -1 on error (EINVAL if the file is not a
+   capture we can read).
+ */
+int frame_io_pcap(struct frame_io *io, const char *path, const struct pcap_params *params);
+
+
+/* Returns 1 once every frame of the replay has been handed to the
+   handler, 0 before. A malformed record ends the replay too: the last
+   frame_io_recv() returns -1 with errno set to EINVAL. */
+int pcap_replay_done(const struct frame_io *io);
+
+
+
+#endif /* PCAP_H_ */
@@ -0,0 +1,330 @@
+/* Satrap/reactor.c */
+
+#define _GNU_SOURCE /* sigisemptyset() */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+
+
+/* Maximum number of events handled per epoll_wait() */
+#define REACTOR_EVENTS 64
+
+
+enum source_type { SOURCE_FD, SOURCE_TIMER, SOURCE_SIGNAL };
+
+struct reactor_source {
+  struct reactor_source *next; /* in the sources or dead list */
+  struct reactor_source **pprev;
+  enum source_type type;
+  int fd; /* owned by the reactor for timers */
+  int signo;
+  int removed;
+  union {
+    reactor_fd_callback fd;
+    reactor_timer_callback timer;
+    reactor_signal_callback signal;
+  } callback;
+  void *arg;
+};
+
+
+/* Source of the signalfd, shared by every signal */
+static struct reactor_source signal_source;
+
+
+
+static void link_source(struct reactor_source **list, struct reactor_source *source)
+{
+  source->next = *list;
+  source->pprev = list;
+  if (*list)
+    (*list)->pprev = &source->next;
+  *list = source;
+}
+
+
+static void unlink_source(struct reactor_source *source)
+{
+  *source->pprev = source->next;
+  if (source->next)
+    source->next->pprev = source->pprev;
+}
+
+
+static struct reactor_source *new_source(struct reactor *reactor, enum source_type type, int fd, uint32_t events, void *arg)
+{
+  struct reactor_source *source = calloc(1, sizeof(*source));
+  if (!source)
+    return NULL;
+  source->type = type;
+  source->fd = fd;
+  source->arg = arg;
+
+  struct epoll_event ev = { .events = events, .data.ptr = source };
+  if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    free(source);
+    return NULL;
+  }
+  link_source(&reactor->sources, source);
+  return source;
+}
+
+
+
+/* Initializes a reactor
+
+   Returns 0 on success, -1 on error.
+ */
+int reactor_init(struct reactor *reactor)
+{
+  memset(reactor, 0, sizeof(*reactor));
+  reactor->sigfd = -1;
+  sigemptyset(&reactor->sigmask);
+  reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+  return reactor->epfd == -1 ? -1 : 0;
+}
+
+
+/* Frees the sources removed during a dispatch */
+static void free_dead(struct reactor *reactor)
+{
+  while (reactor->dead) {
+    struct reactor_source *source = reactor->dead;
+    unlink_source(source);
+    free(source);
+  }
+}
+
+
+/* Closes the reactor and removes every source. The watched signals
+   are unblocked. */
+void reactor_free(struct reactor *reactor)
+{
+  while (reactor->sources)
+    reactor_remove(reactor, reactor->sources);
+  free_dead(reactor);
+  close(reactor->epfd);
+  reactor->epfd = -1;
+}
+
+
+
+/* Watches a file descriptor. The descriptor stays open when the
+   source is removed.
+
+   events: epoll events, e.g. EPOLLIN
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_fd(struct reactor *reactor, int fd, uint32_t events, reactor_fd_callback callback, void *arg)
+{
+  struct reactor_source *source = new_source(reactor, SOURCE_FD, fd, events, arg);
+  if (source)
+    source->callback.fd = callback;
+  return source;
+}
+
+
+/* Creates a timer (CLOCK_MONOTONIC), disarmed
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_timer(struct reactor *reactor, reactor_timer_callback callback, void *arg)
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  struct reactor_source *source = new_source(reactor, SOURCE_TIMER, fd, EPOLLIN, arg);
+  if (!source) {
+    close(fd);
+    return NULL;
+  }
+  source->callback.timer = callback;
+  return source;
+}
+
+
+/* Arms a timer
+
+   delay: nanoseconds before the first expiry, 0 to disarm the timer
+   interval: nanoseconds between the next expiries, 0 for a one-shot
+   timer
+
+   Returns 0 on success, -1 on error.
+ */
+int reactor_set_timer(struct reactor_source *source, uint64_t delay, uint64_t interval)
+{
+  struct itimerspec its = {
+    .it_value = { delay / 1000000000ULL, delay % 1000000000ULL },
+    .it_interval = { interval / 1000000000ULL, interval % 1000000000ULL },
+  };
+  return timerfd_settime(source->fd, 0, &its, NULL);
+}
+
+
+/* Watches a signal, which is blocked so it is only received by the
+   reactor
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_signal(struct reactor *reactor, int signo, reactor_signal_callback callback, void *arg)
+{
+  if (signo <= 0 || signo >= _NSIG || reactor->signals[signo]) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct reactor_source *source = calloc(1, sizeof(*source));
+  if (!source)
+    return NULL;
+  source->type = SOURCE_SIGNAL;
+  source->fd = -1;
+  source->signo = signo;
+  source->callback.signal = callback;
+  source->arg = arg;
+
+  /* Every signal goes through one signalfd */
+  sigaddset(&reactor->sigmask, signo);
+  if (sigprocmask(SIG_BLOCK, &reactor->sigmask, NULL) == -1)
+    goto fail;
+  int created = (reactor->sigfd == -1);
+  int fd = signalfd(reactor->sigfd, &reactor->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1)
+    goto fail;
+  reactor->sigfd = fd;
+  if (created) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &signal_source };
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      reactor->sigfd = -1;
+      goto fail;
+    }
+  }
+
+  reactor->signals[signo] = source;
+  link_source(&reactor->sources, source);
+  return source;
+
+ fail:
+  sigdelset(&reactor->sigmask, signo);
+  free(source);
+  return NULL;
+}
+
+
+
+/* Removes a source. Sources may be removed from their own callback,
+   or from the callback of another source. */
+void reactor_remove(struct reactor *reactor, struct reactor_source *source)
+{
+  if (source->removed)
+    return;
+  source->removed = 1;
+
+  switch (source->type) {
+  case SOURCE_FD:
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    break;
+  case SOURCE_TIMER:
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    close(source->fd);
+    break;
+  case SOURCE_SIGNAL: {
+    reactor->signals[source->signo] = NULL;
+    sigdelset(&reactor->sigmask, source->signo);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, source->signo);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    if (sigisemptyset(&reactor->sigmask)) {
+      epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, reactor->sigfd, NULL);
+      close(reactor->sigfd);
+      reactor->sigfd = -1;
+    }
+    else {
+      signalfd(reactor->sigfd, &reactor->sigmask, 0);
+    }
+    break;
+  }
+  }
+
+  /* The source may be in the events of the current dispatch: it is
+     freed afterwards */
+  unlink_source(source);
+  link_source(&reactor->dead, source);
+}
+
+
+
+/* Reads the pending signals and calls their callbacks */
+static void dispatch_signals(struct reactor *reactor)
+{
+  struct signalfd_siginfo info;
+  while (reactor->sigfd != -1
+	 && read(reactor->sigfd, &info, sizeof(info)) == sizeof(info)) {
+    struct reactor_source *source = reactor->signals[info.ssi_signo];
+    if (source && !source->removed)
+      source->callback.signal(reactor, info.ssi_signo, source->arg);
+  }
+}
+
+
+/* Dispatches the events until reactor_stop() is called, or until
+   there is no source left
+
+   Returns 0 when stopped, -1 on error.
+ */
+int reactor_run(struct reactor *reactor)
+{
+  struct epoll_event events[REACTOR_EVENTS];
+  reactor->stopped = 0;
+
+  while (!reactor->stopped && reactor->sources) {
+    int n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      struct reactor_source *source = events[i].data.ptr;
+      if (source == &signal_source) {
+	dispatch_signals(reactor);
+	continue;
+      }
+      if (source->removed)
+	continue;
+
+      if (source->type == SOURCE_TIMER) {
+	uint64_t expirations;
+	if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	  continue; /* re-armed in the meantime */
+	source->callback.timer(reactor, source->arg);
+      }
+      else {
+	source->callback.fd(reactor, source->fd, events[i].events, source->arg);
+      }
+    }
+
+    free_dead(reactor);
+  }
+
+  return 0;
+}
+
+
+/* Makes reactor_run() return after the current dispatch */
+void reactor_stop(struct reactor *reactor)
+{
+  reactor->stopped = 1;
+}
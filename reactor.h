@@ -0,0 +1,108 @@
+/* Satrap/reactor.h */
+
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+
+
+/* Single-threaded event loop, built on epoll. Timers are timerfds and
+   signals are received through a signalfd, so everything is a file
+   descriptor, and the loop never busy-waits. */
+
+struct reactor;
+struct reactor_source;
+
+
+/* Called when a file descriptor is ready. events are EPOLLIN,
+   EPOLLOUT... */
+typedef void (*reactor_fd_callback)(struct reactor *reactor, int fd, uint32_t events, void *arg);
+
+/* Called when a timer expires */
+typedef void (*reactor_timer_callback)(struct reactor *reactor, void *arg);
+
+/* Called when a signal is received */
+typedef void (*reactor_signal_callback)(struct reactor *reactor, int signo, void *arg);
+
+
+struct reactor {
+  int epfd;
+  int sigfd; /* -1 until a signal is watched */
+  sigset_t sigmask; /* watched signals, blocked */
+  struct reactor_source *signals[_NSIG];
+
+  struct reactor_source *sources; /* every source */
+  struct reactor_source *dead; /* sources removed during a dispatch */
+  int stopped;
+};
+
+
+/* Initializes a reactor
+
+   Returns 0 on success, -1 on error.
+ */
+int reactor_init(struct reactor *reactor);
+
+
+/* Closes the reactor and removes every source. The watched signals
+   are unblocked. */
+void reactor_free(struct reactor *reactor);
+
+
+/* Watches a file descriptor. The descriptor stays open when the
+   source is removed.
+
+   events: epoll events, e.g. EPOLLIN
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_fd(struct reactor *reactor, int fd, uint32_t events, reactor_fd_callback callback, void *arg);
+
+
+/* Creates a timer (CLOCK_MONOTONIC), disarmed
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_timer(struct reactor *reactor, reactor_timer_callback callback, void *arg);
+
+
+/* Arms a timer
+
+   delay: nanoseconds before the first expiry, 0 to disarm the timer
+   interval: nanoseconds between the next expiries, 0 for a one-shot
+   timer
+
+   Returns 0 on success, -1 on error.
+ */
+int reactor_set_timer(struct reactor_source *source, uint64_t delay, uint64_t interval);
+
+
+/* Watches a signal, which is blocked so it is only received by the
+   reactor
+
+   Returns the new source, or NULL on error.
+ */
+struct reactor_source *reactor_add_signal(struct reactor *reactor, int signo, reactor_signal_callback callback, void *arg);
+
+
+/* Removes a source. Sources may be removed from their own callback,
+   or from the callback of another source. */
+void reactor_remove(struct reactor *reactor, struct reactor_source *source);
+
+
+/* Dispatches the events until reactor_stop() is called, or until
+   there is no source left
+
+   Returns 0 when stopped, -1 on error.
+ */
+int reactor_run(struct reactor *reactor);
+
+
+/* Makes reactor_run() return after the current dispatch */
+void reactor_stop(struct reactor *reactor);
+
+
+
+#endif /* REACTOR_H_ */
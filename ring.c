@@ -0,0 +1,394 @@
+/* Satrap/ring.c */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+/* <linux/if_packet.h> conflicts with <netpacket/packet.h>, which is
+   included by arp.h, but we need the definitions of the rings */
+#include <linux/if_packet.h>
+
+#include "ring.h"
+
+
+
+/* Private data of the ring backend */
+struct ring_io {
+  struct frame_io sock; /* packet socket, for the disabled rings */
+
+  int txfd; /* socket of the transmit ring, -1 if disabled */
+  unsigned char *tx_map; /* the transmit ring */
+  size_t tx_map_len;
+  unsigned int tx_frames, frame_size;
+  unsigned int tx_head; /* next slot to fill */
+  unsigned int tx_queued; /* slots filled since the last flush */
+
+  struct rx_ring rx; /* fd is -1 if disabled */
+};
+
+
+/* Fills the parameters with their default values */
+void ring_params_default(struct ring_params *params)
+{
+  params->tx_frames = RING_DEFAULT_TX_FRAMES;
+  params->frame_size = RING_DEFAULT_FRAME_SIZE;
+  params->qdisc_bypass = 0;
+  params->rx_block_size = RING_DEFAULT_RX_BLOCK_SIZE;
+  params->rx_blocks = RING_DEFAULT_RX_BLOCKS;
+  params->rx_timeout = RING_DEFAULT_RX_TIMEOUT;
+  params->rx_protocol = ETH_P_ARP;
+}
+
+
+
+/* ====================================================================== */
+
+/* TRANSMIT RING */
+
+/* Without PACKET_TX_HAS_OFF, the frame starts right after the header
+   of the slot, see Documentation/networking/packet_mmap.rst */
+#define TX_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+
+static int ring_send(struct frame_io *io, const void *frame, size_t len)
+{
+  struct ring_io *ring = io->priv;
+  if (ring->txfd < 0)
+    return frame_io_send(&ring->sock, frame, len);
+  if (len > ring->frame_size - TX_DATA_OFFSET) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  struct tpacket2_hdr *hdr =
+    (struct tpacket2_hdr *) (ring->tx_map + (size_t) ring->tx_head * ring->frame_size);
+  if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+    return 1; /* the kernel hasn't sent this slot yet */
+
+  memcpy((unsigned char *) hdr + TX_DATA_OFFSET, frame, len);
+  hdr->tp_len = len;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  ring->tx_head = (ring->tx_head + 1) % ring->tx_frames;
+  ++ring->tx_queued;
+  return 0;
+}
+
+
+/* A single send() call makes the kernel transmit every slot marked
+   with TP_STATUS_SEND_REQUEST */
+static int ring_flush(struct frame_io *io)
+{
+  struct ring_io *ring = io->priv;
+  if (ring->txfd < 0)
+    return frame_io_flush(&ring->sock);
+  if (ring->tx_queued == 0)
+    return 0;
+
+  if (send(ring->txfd, NULL, 0, MSG_DONTWAIT) == -1) {
+    /* The slots stay marked, and the next flush kicks them again */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      return 0;
+    return -1;
+  }
+
+  int count = ring->tx_queued;
+  ring->tx_queued = 0;
+  return count;
+}
+
+
+
+
+/* ====================================================================== */
+
+/* RECEIVE RING */
+
+/* Returns the next block filled by the kernel (a struct
+   tpacket_block_desc), or NULL if there is none */
+void *rx_ring_next_block(struct rx_ring *rx)
+{
+  struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+    (rx->map + (size_t) rx->head * rx->block_size);
+  if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+	& TP_STATUS_USER))
+    return NULL;
+  return block;
+}
+
+
+/* Gives the block returned by rx_ring_next_block() back to the
+   kernel */
+void rx_ring_release_block(struct rx_ring *rx, void *block)
+{
+  struct tpacket_block_desc *desc = block;
+  __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  rx->head = (rx->head + 1) % rx->blocks;
+}
+
+
+/* Walks the blocks that the kernel has handed to us, and gives them
+   back once every frame has been handled */
+static int ring_recv(struct frame_io *io, frame_handler handler, void *arg)
+{
+  struct ring_io *ring = io->priv;
+  if (ring->rx.fd < 0)
+    return frame_io_recv(&ring->sock, handler, arg);
+
+  int count = 0;
+  struct tpacket_block_desc *block;
+  while ((block = rx_ring_next_block(&ring->rx))) {
+    unsigned int num_pkts = block->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+      ((unsigned char *) block + block->hdr.bh1.offset_to_first_pkt);
+    for (unsigned int i = 0; i < num_pkts; ++i) {
+      handler((unsigned char *) hdr + hdr->tp_mac, hdr->tp_snaplen, arg);
+      hdr = (struct tpacket3_hdr *) ((unsigned char *) hdr + hdr->tp_next_offset);
+    }
+    count += num_pkts;
+    rx_ring_release_block(&ring->rx, block);
+  }
+  return count;
+}
+
+
+
+/* ====================================================================== */
+
+static void ring_close(struct frame_io *io)
+{
+  struct ring_io *ring = io->priv;
+  ring_flush(io);
+  if (ring->tx_map)
+    munmap(ring->tx_map, ring->tx_map_len);
+  if (ring->txfd >= 0)
+    close(ring->txfd);
+  rx_ring_close(&ring->rx);
+  frame_io_close(&ring->sock);
+  free(ring);
+  io->priv = NULL;
+}
+
+
+static const struct frame_io_ops ring_ops = {
+  .send = ring_send,
+  .flush = ring_flush,
+  .recv = ring_recv,
+  .close = ring_close,
+};
+
+
+
+/* Opens the socket of the transmit ring and maps the ring
+
+   Returns 0 on success, -1 on error.
+ */
+static int setup_tx_ring(struct ring_io *ring, int ifindex, const struct ring_params *params)
+{
+  /* Protocol 0: this socket never receives anything */
+  ring->txfd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (ring->txfd == -1)
+    return -1;
+
+  int version = TPACKET_V2;
+  if (setsockopt(ring->txfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+    return -1;
+
+  if (params->qdisc_bypass) {
+    int one = 1;
+    if (setsockopt(ring->txfd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) == -1)
+      return -1;
+  }
+
+  /* A frame the kernel rejects is skipped, and its slot given back:
+     without this, the slot stays in TP_STATUS_WRONG_FORMAT and the
+     ring is full for good */
+  int one = 1;
+  if (setsockopt(ring->txfd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) == -1)
+    return -1;
+
+  /* Every block holds a whole number of slots */
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned int block_size = page_size;
+  while (block_size < params->frame_size)
+    block_size *= 2;
+  unsigned int per_block = block_size / params->frame_size;
+  unsigned int block_nr = (params->tx_frames + per_block - 1) / per_block;
+
+  struct tpacket_req req;
+  req.tp_block_size = block_size;
+  req.tp_block_nr = block_nr;
+  req.tp_frame_size = params->frame_size;
+  req.tp_frame_nr = block_nr * per_block;
+  if (setsockopt(ring->txfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1)
+    return -1;
+
+  ring->tx_frames = req.tp_frame_nr;
+  ring->frame_size = req.tp_frame_size;
+  ring->tx_map_len = (size_t) block_size * block_nr;
+  ring->tx_map = mmap(NULL, ring->tx_map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, ring->txfd, 0);
+  if (ring->tx_map == MAP_FAILED) {
+    ring->tx_map = NULL;
+    return -1;
+  }
+
+  /* The socket sends on the interface given at bind time */
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = 0;
+  addr.sll_ifindex = ifindex;
+  if (bind(ring->txfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    return -1;
+
+  return 0;
+}
+
+
+
+/* Opens a packet socket with a receive ring, and maps the ring. The
+   socket receives the frames of params->rx_protocol on the interface.
+
+   rx: the ring to open
+   ifindex: index of the interface
+   params: parameters of the ring (rx_block_size, rx_blocks,
+   rx_timeout, frame_size and rx_protocol)
+
+   Returns 0 on success, -1 on error.
+ */
+int rx_ring_open(struct rx_ring *rx, int ifindex, const struct ring_params *params)
+{
+  memset(rx, 0, sizeof(*rx));
+  rx->fd = socket(AF_PACKET, SOCK_RAW, htons(params->rx_protocol));
+  if (rx->fd == -1)
+    return -1;
+
+  int version = TPACKET_V3;
+  if (setsockopt(rx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+    goto fail;
+
+  /* With TPACKET_V3 the frames have a variable size: the frame size is
+     only checked against the block size by the kernel */
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = params->rx_block_size;
+  req.tp_block_nr = params->rx_blocks;
+  req.tp_frame_size = params->frame_size;
+  req.tp_frame_nr = params->rx_block_size / params->frame_size * params->rx_blocks;
+  req.tp_retire_blk_tov = params->rx_timeout;
+  if (setsockopt(rx->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+    goto fail;
+
+  rx->block_size = params->rx_block_size;
+  rx->blocks = params->rx_blocks;
+  rx->map_len = (size_t) params->rx_block_size * params->rx_blocks;
+  rx->map = mmap(NULL, rx->map_len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED, rx->fd, 0);
+  if (rx->map == MAP_FAILED) {
+    rx->map = NULL;
+    goto fail;
+  }
+
+  /* We only receive from our interface */
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(params->rx_protocol);
+  addr.sll_ifindex = ifindex;
+  if (bind(rx->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    goto fail;
+
+  return 0;
+
+ fail: {
+    int err = errno;
+    rx_ring_close(rx);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Unmaps the ring and closes its socket */
+void rx_ring_close(struct rx_ring *rx)
+{
+  if (rx->map)
+    munmap(rx->map, rx->map_len);
+  if (rx->fd >= 0)
+    close(rx->fd);
+  rx->map = NULL;
+  rx->fd = -1;
+}
+
+
+
+/* Creates a backend which sends frames through a memory-mapped
+   transmit ring (PACKET_TX_RING), and receives them through a
+   block-based receive ring (PACKET_RX_RING, TPACKET_V3).
+
+   Queued frames are written directly in the transmit ring, and
+   frame_io_flush() sends all of them with a single system call.
+
+   The kernel fills the blocks of the receive ring, and hands a block
+   to us when it is full or after rx_timeout. frame_io_recv() calls the
+   handler with pointers into the ring, without copying the frames,
+   and gives the block back once every frame has been handled.
+
+   io: the backend to initialize
+   sockfd: packet socket used when one of the rings is disabled, as
+   with frame_io_socket()
+   ifindex: index of the interface
+   params: parameters of the ring, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_ring(struct frame_io *io, int sockfd, int ifindex, const struct ring_params *params)
+{
+  struct ring_params defaults;
+  if (!params) {
+    ring_params_default(&defaults);
+    params = &defaults;
+  }
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (params->frame_size % TPACKET_ALIGNMENT || params->frame_size <= TX_DATA_OFFSET
+      || (params->rx_blocks && (params->rx_block_size % page_size
+				|| params->rx_block_size < params->frame_size))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct ring_io *ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return -1;
+  ring->txfd = -1;
+  ring->rx.fd = -1;
+
+  if (frame_io_socket(&ring->sock, sockfd, ifindex) == -1) {
+    free(ring);
+    return -1;
+  }
+
+  io->ops = &ring_ops;
+  io->fd = sockfd;
+  io->ifindex = ifindex;
+  io->priv = ring;
+  memset(&io->counters, 0, sizeof(io->counters));
+
+  if ((params->tx_frames && setup_tx_ring(ring, ifindex, params) == -1)
+      || (params->rx_blocks && rx_ring_open(&ring->rx, ifindex, params) == -1)) {
+    int err = errno;
+    ring_close(io);
+    errno = err;
+    return -1;
+  }
+  if (ring->rx.fd >= 0)
+    io->fd = ring->rx.fd;
+
+  return 0;
+}
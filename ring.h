@@ -0,0 +1,99 @@
+/* Satrap/ring.h */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include "io.h"
+
+
+
+/* Default parameters of the memory-mapped rings */
+#define RING_DEFAULT_TX_FRAMES 1024 /* slots of the transmit ring */
+#define RING_DEFAULT_FRAME_SIZE 2048 /* size of a slot, header included */
+#define RING_DEFAULT_RX_BLOCK_SIZE (1 << 18) /* bytes per receive block */
+#define RING_DEFAULT_RX_BLOCKS 16 /* blocks of the receive ring */
+#define RING_DEFAULT_RX_TIMEOUT 10 /* ms before a partial block is retired */
+
+
+/* Parameters of the memory-mapped backend. A ring with no slots or no
+   blocks is disabled, and the packet socket is used instead. */
+struct ring_params {
+  unsigned int tx_frames; /* number of slots of the transmit ring */
+  unsigned int frame_size; /* size of a slot, must be a multiple of 16 */
+  int qdisc_bypass; /* if set, frames skip the queueing discipline */
+
+  unsigned int rx_block_size; /* multiple of the page size */
+  unsigned int rx_blocks; /* number of blocks of the receive ring */
+  unsigned int rx_timeout; /* milliseconds */
+  unsigned short rx_protocol; /* EtherType to receive, host byte order */
+};
+
+
+/* Block-based receive ring (PACKET_RX_RING, TPACKET_V3) on its own
+   packet socket. The blocks are struct tpacket_block_desc, from
+   <linux/if_packet.h>. */
+struct rx_ring {
+  int fd;
+  unsigned char *map;
+  size_t map_len;
+  unsigned int block_size, blocks;
+  unsigned int head; /* next block to read */
+};
+
+
+/* Fills the parameters with their default values */
+void ring_params_default(struct ring_params *params);
+
+
+/* Creates a backend which sends frames through a memory-mapped
+   transmit ring (PACKET_TX_RING), and receives them through a
+   block-based receive ring (PACKET_RX_RING, TPACKET_V3).
+
+   Queued frames are written directly in the transmit ring, and
+   frame_io_flush() sends all of them with a single system call.
+
+   The kernel fills the blocks of the receive ring, and hands a block
+   to us when it is full or after rx_timeout. frame_io_recv() calls the
+   handler with pointers into the ring, without copying the frames,
+   and gives the block back once every frame has been handled.
+
+   io: the backend to initialize
+   sockfd: packet socket used when one of the rings is disabled, as
+   with frame_io_socket()
+   ifindex: index of the interface
+   params: parameters of the ring, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_ring(struct frame_io *io, int sockfd, int ifindex, const struct ring_params *params);
+
+
+/* Opens a packet socket with a receive ring, and maps the ring. The
+   socket receives the frames of params->rx_protocol on the interface.
+
+   rx: the ring to open
+   ifindex: index of the interface
+   params: parameters of the ring (rx_block_size, rx_blocks,
+   rx_timeout, frame_size and rx_protocol)
+
+   Returns 0 on success, -1 on error.
+ */
+int rx_ring_open(struct rx_ring *rx, int ifindex, const struct ring_params *params);
+
+
+/* Returns the next block filled by the kernel (a struct
+   tpacket_block_desc), or NULL if there is none */
+void *rx_ring_next_block(struct rx_ring *rx);
+
+
+/* Gives the block returned by rx_ring_next_block() back to the
+   kernel */
+void rx_ring_release_block(struct rx_ring *rx, void *block);
+
+
+/* Unmaps the ring and closes its socket */
+void rx_ring_close(struct rx_ring *rx);
+
+
+
+#endif /* RING_H_ */
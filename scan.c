@@ -0,0 +1,1181 @@
+/* Satrap/scan.c */
+
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "scan.h"
+
+
+
+/* Current time of CLOCK_MONOTONIC in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Helpers to read and write the state and the number of tries of a
+   probe, packed in one byte */
+#define PROBE_STATE(p) ((p) & 0x0f)
+#define PROBE_TRIES(p) ((p) >> 4)
+#define PROBE_MAKE(state, tries) ((unsigned char) (((tries) << 4) | (state)))
+
+
+
+/* ====================================================================== */
+
+/* PROBE QUEUES */
+
+static int queue_push(struct probe_queue *q, uint32_t offset, uint64_t deadline, uint32_t rate)
+{
+  if (q->len == q->size) {
+    /* The queue is full: we double its size and unwrap it */
+    size_t size = q->size ? 2 * q->size : 1024;
+    struct probe_entry *entries = malloc(size * sizeof(*entries));
+    if (!entries)
+      return -1;
+    for (size_t i = 0; i < q->len; ++i)
+      entries[i] = q->entries[(q->head + i) % q->size];
+    free(q->entries);
+    q->entries = entries;
+    q->head = 0;
+    q->size = size;
+  }
+
+  struct probe_entry *e = &q->entries[(q->head + q->len) % q->size];
+  e->offset = offset;
+  e->deadline = deadline;
+  e->rate = rate;
+  ++q->len;
+  return 0;
+}
+
+
+static struct probe_entry *queue_front(struct probe_queue *q)
+{
+  return q->len ? &q->entries[q->head] : NULL;
+}
+
+
+static void queue_pop(struct probe_queue *q)
+{
+  q->head = (q->head + 1) % q->size;
+  --q->len;
+}
+
+
+
+/* ====================================================================== */
+
+/* Initializes a scan engine
+
+   engine: the engine to initialize
+   io: frame I/O backend, which receives ARP
+   ipaddr: local IP address, used as the sender of the requests
+   macaddr: local hardware address
+   first: first address to scan
+   last: last address to scan (included)
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int scan_init(struct scan_engine *engine, struct frame_io *io, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr first, struct in_addr last)
+{
+  memset(engine, 0, sizeof(*engine));
+  engine->io = io;
+  engine->ipaddr = *ipaddr;
+  memcpy(engine->macaddr, macaddr, ETHER_ADDR_LEN);
+  arp_template_init(&engine->request, io->ifindex, ARPOP_REQUEST,
+		    ipaddr->sin_addr, macaddr);
+
+  uint32_t first_h = ntohl(first.s_addr);
+  uint32_t last_h = ntohl(last.s_addr);
+  if (last_h < first_h || last_h - first_h == UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  engine->first = first_h;
+  engine->count = last_h - first_h + 1;
+
+  engine->probes = calloc(engine->count, 1);
+  if (!engine->probes)
+    return -1;
+
+  engine->rate = SCAN_DEFAULT_RATE;
+  engine->timeout = SCAN_DEFAULT_TIMEOUT;
+  engine->retries = SCAN_DEFAULT_RETRIES;
+  engine->window = SCAN_DEFAULT_WINDOW;
+  engine->min_rate = SCAN_DEFAULT_MIN_RATE;
+  engine->max_rate = SCAN_DEFAULT_MAX_RATE;
+  engine->rate_step = SCAN_DEFAULT_RATE_STEP;
+  engine->tokens = 1;
+
+  return 0;
+}
+
+
+
+/* Prepares the engine for the scan of another range, on the same
+   backend, with the same parameters, host table and callbacks. The
+   rate starts where the previous scan left it, the counters from
+   zero. The engine must be stopped, without workers or checkpoint.
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_reset(struct scan_engine *engine, struct in_addr first, struct in_addr last)
+{
+  struct scan_engine old = *engine;
+  scan_free(engine);
+  if (scan_init(engine, old.io, &old.ipaddr, old.macaddr, first, last) == -1)
+    return -1;
+
+  engine->rate = old.rate;
+  engine->timeout = old.timeout;
+  engine->retries = old.retries;
+  engine->window = old.auto_window ? 0 : old.window;
+  engine->adaptive = old.adaptive;
+  engine->min_rate = old.min_rate;
+  engine->max_rate = old.max_rate;
+  engine->rate_step = old.rate_step;
+  engine->stats = old.stats;
+  engine->dropped = old.dropped; /* the drops of the socket add up */
+  engine->hosts = old.hosts;
+  engine->callback = old.callback;
+  engine->callback_arg = old.callback_arg;
+  engine->done = old.done;
+  engine->done_arg = old.done_arg;
+  return 0;
+}
+
+
+
+/* Queues the ARP request of a probe in the backend. We don't use
+   send_arp_request(), because the engine must not exit on a full
+   socket buffer.
+
+   Returns 0 if the frame was queued, 1 if the backend is full, -1 on
+   error.
+ */
+static int send_probe(struct scan_engine *engine, uint32_t offset)
+{
+  struct arp_frame request;
+  struct in_addr target = { htonl(engine->first + offset) };
+  const unsigned char *mac = NULL;
+  unsigned int tries = PROBE_TRIES(engine->probes[offset]) + 1;
+  if (engine->unicast && (tries == 1 || tries <= engine->retries)) {
+    const struct host_entry *entry = hosts_lookup(engine->unicast, target);
+    if (entry && entry->state != HOST_PROBING)
+      mac = entry->mac;
+  }
+  arp_template_stamp(&engine->request, &request, target, mac);
+  return frame_io_send(engine->io, &request, sizeof(request));
+}
+
+
+
+/* Timeout of a try of a probe, in nanoseconds: the first one waits
+   for the timeout of the engine, and every retry twice as long as the
+   previous one (exponential backoff), up to SCAN_BACKOFF_LIMIT times
+   the timeout */
+static uint64_t try_timeout(struct scan_engine *engine, unsigned int tries)
+{
+  uint64_t factor = 1ULL << (tries - 1);
+  if (factor > SCAN_BACKOFF_LIMIT)
+    factor = SCAN_BACKOFF_LIMIT;
+  return factor * engine->timeout * 1000000ULL;
+}
+
+
+/* Counts a reply which came for a retransmission or after its
+   deadline. For the rate control, it is a loss only if the try which
+   went unanswered was sent after the last decrease of the rate: the
+   older losses were already paid for.
+
+   expired: tries of the probe whose deadline passed, the last of them
+   sent about its timeout ago
+ */
+static void record_late(struct scan_engine *engine, unsigned int expired)
+{
+  ++engine->late;
+  if (engine->adaptive
+      && now_ns() - try_timeout(engine, expired) >= engine->last_decrease)
+    ++engine->interval_losses;
+}
+
+
+
+/* Handles a received ARP frame: the sender is recorded in the host
+   table, and if it answers one of our outstanding probes, the probe
+   is marked as answered and the callback is called.
+
+   Returns 1 if the frame answered a probe, 0 otherwise.
+ */
+int scan_handle_reply(struct scan_engine *engine, const struct ether_arp *reply)
+{
+  if (ntohs(reply->arp_op) != ARPOP_REPLY)
+    return 0;
+
+  uint32_t sender;
+  memcpy(&sender, reply->arp_spa, sizeof(sender));
+  if (engine->hosts) {
+    struct in_addr ip = { sender };
+    hosts_update(engine->hosts, ip, reply->arp_sha);
+  }
+
+  uint32_t offset = ntohl(sender) - engine->first;
+  if (offset >= engine->count)
+    return 0;
+
+  unsigned char *probe = &engine->probes[offset];
+  switch (PROBE_STATE(*probe)) {
+  case PROBE_INFLIGHT:
+    --engine->outstanding;
+    /* The previous tries went unanswered */
+    if (PROBE_TRIES(*probe) > 1)
+      record_late(engine, PROBE_TRIES(*probe) - 1);
+    break;
+  case PROBE_RETRY:
+    record_late(engine, PROBE_TRIES(*probe));
+    break;
+  case PROBE_DEAD:
+    /* Too late to count as an answer, but the host is there */
+    record_late(engine, PROBE_TRIES(*probe));
+    return 0;
+  default:
+    /* Unsolicited or duplicate reply, or the answer of the canary of
+       the rate control */
+    if (offset == engine->canary)
+      engine->canary = -1;
+    return 0;
+  }
+  /* The host goes to the state file before its probe is answered: a
+     run killed in between finds it again, instead of losing it */
+  if (engine->checkpoint) {
+    struct in_addr ip = { sender };
+    if (checkpoint_add_host(engine->checkpoint, ip, reply->arp_sha) == -1
+	&& !engine->checkpoint_error)
+      engine->checkpoint_error = errno;
+  }
+  *probe = PROBE_MAKE(PROBE_ANSWERED, PROBE_TRIES(*probe));
+  ++engine->answered;
+  engine->last_alive = offset;
+
+  if (engine->callback) {
+    struct in_addr ip = { sender };
+    engine->callback(ip, reply->arp_sha, engine->callback_arg);
+  }
+  return 1;
+}
+
+
+
+/* Frame handler of the engine */
+static void handle_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  /* The backend may receive every EtherType */
+  if (len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP))
+    return;
+  scan_handle_reply(arg, &arp->arp);
+}
+
+
+
+/* Returns 1 if the last try of a probe was sent at a rate which has
+   been lowered since, after losses: the host deserves one more try */
+static int congested_try(struct scan_engine *engine, unsigned int tries, const struct probe_entry *e)
+{
+  return engine->adaptive && tries == engine->retries + 1
+    && tries < SCAN_MAX_TRIES && e->rate > engine->rate;
+}
+
+
+/* Moves the probes whose deadline has passed to the retry queue, or
+   declares them dead if they have used all of their tries.
+ */
+static void expire_probes(struct scan_engine *engine, uint64_t now)
+{
+  for (unsigned int i = 0; i < SCAN_MAX_TRIES; ++i) {
+    struct probe_queue *inflight = &engine->inflight[i];
+    struct probe_entry *e;
+    while ((e = queue_front(inflight)) && e->deadline <= now) {
+      uint32_t offset = e->offset;
+      queue_pop(inflight);
+
+      unsigned char *probe = &engine->probes[offset];
+      if (PROBE_STATE(*probe) != PROBE_INFLIGHT)
+	continue; /* answered in the meantime */
+
+      --engine->outstanding;
+      unsigned int tries = PROBE_TRIES(*probe);
+      if ((tries <= engine->retries || congested_try(engine, tries, e))
+	  && queue_push(&engine->retry, offset, 0, 0) == 0) {
+	*probe = PROBE_MAKE(PROBE_RETRY, PROBE_TRIES(*probe));
+      }
+      else {
+	*probe = PROBE_MAKE(PROBE_DEAD, PROBE_TRIES(*probe));
+	++engine->lost;
+      }
+    }
+  }
+}
+
+
+/* Returns the earliest deadline of the outstanding probes, or
+   UINT64_MAX if there is none */
+static uint64_t next_deadline(struct scan_engine *engine)
+{
+  uint64_t deadline = UINT64_MAX;
+  for (unsigned int i = 0; i < SCAN_MAX_TRIES; ++i) {
+    struct probe_entry *e = queue_front(&engine->inflight[i]);
+    if (e && e->deadline < deadline)
+      deadline = e->deadline;
+  }
+  return deadline;
+}
+
+
+
+/* Returns the offset of the next address to probe: first the probes
+   to send again, then the addresses never probed. Returns -1 if there
+   is nothing left to send.
+ */
+static int64_t next_probe(struct scan_engine *engine)
+{
+  struct probe_entry *e;
+  while ((e = queue_front(&engine->retry))) {
+    uint32_t offset = e->offset;
+    queue_pop(&engine->retry);
+    if (PROBE_STATE(engine->probes[offset]) == PROBE_RETRY)
+      return offset;
+  }
+
+  while (engine->next < engine->count) {
+    uint32_t offset = engine->next++;
+    /* No need to ask for our own address */
+    if (htonl(engine->first + offset) == engine->ipaddr.sin_addr.s_addr)
+      continue;
+    /* A resumed scan may have probed beyond the last saved offset */
+    if (PROBE_STATE(engine->probes[offset]) != PROBE_UNSENT)
+      continue;
+    return offset;
+  }
+
+  return -1;
+}
+
+
+static int has_work(struct scan_engine *engine)
+{
+  return engine->retry.len > 0 || engine->next < engine->count;
+}
+
+
+
+/* Sends as many probes as the rate limiter and the window allow
+
+   Returns 0 on success, -1 on error.
+ */
+static int send_probes(struct scan_engine *engine, uint64_t now)
+{
+  /* Refill the token bucket, with a burst of at most 10 ms of
+     traffic */
+  double burst = engine->rate / 100.0;
+  if (burst < 1)
+    burst = 1;
+  engine->tokens += (now - engine->last_refill) * (double) engine->rate / 1e9;
+  if (engine->tokens > burst)
+    engine->tokens = burst;
+  engine->last_refill = now;
+
+  while (engine->tokens >= 1 && engine->outstanding < engine->window) {
+    int64_t offset = next_probe(engine);
+    if (offset < 0)
+      break;
+
+    int err = send_probe(engine, offset);
+    if (err == -1)
+      return -1;
+    if (err == 1) {
+      /* Backend full: try again later */
+      unsigned char *probe = &engine->probes[offset];
+      *probe = PROBE_MAKE(PROBE_RETRY, PROBE_TRIES(*probe));
+      if (queue_push(&engine->retry, offset, 0, 0) == -1)
+	return -1;
+      break;
+    }
+
+    unsigned char *probe = &engine->probes[offset];
+    unsigned int tries = PROBE_TRIES(*probe) + 1;
+    *probe = PROBE_MAKE(PROBE_INFLIGHT, tries);
+    if (queue_push(&engine->inflight[tries - 1], offset,
+		   now + try_timeout(engine, tries), engine->rate) == -1)
+      return -1;
+    ++engine->outstanding;
+    ++engine->sent;
+    engine->tokens -= 1;
+  }
+
+  if (frame_io_flush(engine->io) == -1)
+    return -1;
+
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* RATE CONTROL */
+
+/* Returns the frames dropped by the receiving sockets since the
+   previous call. The statistics may also be updated by someone else
+   (e.g. the metrics), so the totals are compared. */
+static unsigned long read_drops(struct scan_engine *engine)
+{
+  unsigned long dropped = 0;
+  if (engine->pool) {
+    for (unsigned int i = 0; i < engine->pool->count; ++i) {
+      struct scan_receiver *rcv = &engine->receivers[i];
+      filter_stats_update(&rcv->stats);
+      /* A reply lost on a full queue is lost all the same */
+      dropped += rcv->stats.dropped + counter_read(&rcv->overflows);
+    }
+  }
+  else if (engine->stats) {
+    filter_stats_update(engine->stats);
+    dropped = engine->stats->dropped;
+  }
+  unsigned long drops = dropped - engine->dropped;
+  engine->dropped = dropped;
+  return drops;
+}
+
+
+/* Sets the rate, within its bounds if it is adaptive, and the window
+   which goes with it */
+static void set_rate(struct scan_engine *engine, uint64_t rate)
+{
+  if (engine->adaptive) {
+    if (rate < engine->min_rate)
+      rate = engine->min_rate;
+    if (rate > engine->max_rate)
+      rate = engine->max_rate;
+  }
+  engine->rate = rate;
+  if (engine->auto_window) {
+    /* A probe stays in flight for the timeout of its try: the window
+       covers the mean timeout of the tries of an unanswered probe */
+    uint64_t timeouts = 0;
+    for (unsigned int tries = 1; tries <= engine->retries + 1; ++tries)
+      timeouts += try_timeout(engine, tries);
+    engine->window = engine->rate * timeouts / (engine->retries + 1) / 1000000000ULL + 1;
+  }
+}
+
+
+/* Adjusts the rate once per interval, from the losses of the
+   interval (AIMD) */
+static void adapt_rate(struct scan_engine *engine, uint64_t now)
+{
+  uint64_t elapsed = now - engine->interval_start;
+  if (elapsed < SCAN_INTERVAL * 1000000ULL)
+    return;
+
+  unsigned long drops = read_drops(engine);
+  engine->drops += drops;
+  unsigned long sent = engine->sent - engine->interval_sent;
+  unsigned long answered = engine->answered - engine->interval_answered;
+  unsigned long losses = engine->interval_losses + drops;
+
+  engine->interval_start = now;
+  engine->interval_sent = engine->sent;
+  engine->interval_answered = engine->answered;
+  engine->interval_losses = 0;
+
+  /* Replies which disappear leave no late reply behind: every try of
+     their probe went unanswered. A live host is asked again on every
+     interval, and its silence is a loss we can see. */
+  uint64_t timeout = engine->timeout * 1000000ULL;
+  if (engine->canary >= 0 && now - engine->canary_sent >= timeout) {
+    if (engine->canary_sent >= engine->last_decrease)
+      ++losses;
+    engine->canary = -1;
+  }
+  if (engine->canary < 0 && engine->last_alive >= 0
+      && send_probe(engine, engine->last_alive) == 0) {
+    engine->canary = engine->last_alive;
+    engine->canary_sent = now;
+  }
+
+  if (losses > answered / SCAN_LOSS_TOLERANCE) {
+    set_rate(engine, engine->rate / 2);
+    engine->slow_start = 0;
+    engine->last_decrease = now;
+    ++engine->decreases;
+#ifdef DEBUG
+    printf("[OK] %lu losses, %lu replies for %lu probes: rate lowered to "
+	   "%u probes/s\n", losses, answered, sent, engine->rate);
+#endif
+  }
+  else if (losses == 0 && sent * 1e9 >= 0.9 * engine->rate * elapsed) {
+    /* Only a rate which limits the scan is raised: the window or the
+       end of the range may hold it back too. The losses of a rate
+       show up one timeout later, so the slow start doubles the rate
+       once per timeout. */
+    if (!engine->slow_start)
+      set_rate(engine, (uint64_t) engine->rate + engine->rate_step);
+    else if (now - engine->last_increase >= timeout) {
+      set_rate(engine, 2ULL * engine->rate);
+      engine->last_increase = now;
+    }
+  }
+}
+
+
+
+/* ====================================================================== */
+
+/* Saves the position and the counters of the engine in the header of
+   its state file, and starts the writeback of the file from time to
+   time */
+static void save_progress(struct scan_engine *engine, uint64_t now)
+{
+  struct checkpoint_header *header = engine->checkpoint->header;
+  header->next = engine->next;
+  header->sent = engine->sent;
+  header->answered = engine->answered;
+  header->lost = engine->lost;
+  checkpoint_sync(engine->checkpoint, now);
+}
+
+
+/* Ends the scan and calls the done callback */
+static void scan_finish(struct scan_engine *engine, int status)
+{
+  scan_stop(engine);
+  if (engine->checkpoint) {
+    save_progress(engine, now_ns());
+    if (status == 0)
+      engine->checkpoint->header->complete = 1;
+  }
+
+#ifdef DEBUG
+  printf("[OK] Scan complete: %lu probes sent, %lu answered, %lu lost\n",
+	 engine->sent, engine->answered, engine->lost);
+#endif
+
+  if (engine->done)
+    engine->done(engine, status, engine->done_arg);
+}
+
+
+/* Expires the probes, sends the next ones, and sets the timer for
+   the next event: a deadline, or a new token if there is something
+   left to send */
+static void scan_step(struct scan_engine *engine)
+{
+  uint64_t now = now_ns();
+  expire_probes(engine, now);
+  if (engine->adaptive)
+    adapt_rate(engine, now);
+  if (send_probes(engine, now) == -1) {
+    scan_finish(engine, -1);
+    return;
+  }
+  if (engine->checkpoint) {
+    if (engine->checkpoint_error) {
+      errno = engine->checkpoint_error;
+      scan_finish(engine, -1);
+      return;
+    }
+    save_progress(engine, now);
+  }
+  if (!has_work(engine) && engine->outstanding == 0) {
+    scan_finish(engine, 0);
+    return;
+  }
+
+  uint64_t wakeup = next_deadline(engine);
+  if (has_work(engine) && engine->outstanding < engine->window) {
+    /* We wait for about 1 ms worth of tokens, to send the probes in
+       small batches instead of waking up for every one of them */
+    double batch = engine->rate / 1000.0;
+    if (batch < 1)
+      batch = 1;
+    uint64_t refill = now;
+    if (engine->tokens < batch)
+      refill += (batch - engine->tokens) * 1e9 / engine->rate;
+    if (refill < wakeup)
+      wakeup = refill;
+  }
+
+  /* A zero delay would disarm the timer */
+  uint64_t delay = 1000000000ULL;
+  if (wakeup != UINT64_MAX)
+    delay = wakeup > now ? wakeup - now : 1;
+  if (reactor_set_timer(engine->timer, delay, 0) == -1)
+    scan_finish(engine, -1);
+}
+
+
+static void on_timer(struct reactor *reactor, void *arg)
+{
+  scan_step(arg);
+}
+
+
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct scan_engine *engine = arg;
+  if (frame_io_recv(engine->io, handle_frame, engine) == -1) {
+    scan_finish(engine, -1);
+    return;
+  }
+  /* The last reply ends the scan right away, the other ones wait for
+     the timer */
+  if (!has_work(engine) && engine->outstanding == 0)
+    scan_finish(engine, 0);
+}
+
+
+
+/* ====================================================================== */
+
+/* RECEIVING WORKERS */
+
+/* Frame handler of a worker: the replies are queued for the engine */
+static void queue_frame(const unsigned char *frame, size_t len, void *arg)
+{
+  struct scan_receiver *rcv = arg;
+  const struct arp_frame *arp = (const struct arp_frame *) frame;
+  counter_add(&rcv->frames, 1);
+  if (len < sizeof(*arp) || arp->eth.ether_type != htons(ETH_P_ARP)
+      || arp->arp.arp_op != htons(ARPOP_REPLY))
+    return;
+
+  /* A lost reply is only a retransmission later */
+  unsigned int tail = __atomic_load_n(&rcv->tail, __ATOMIC_ACQUIRE);
+  if (rcv->head - tail == SCAN_QUEUE_SIZE) {
+    counter_add(&rcv->overflows, 1);
+    return;
+  }
+  rcv->queue[rcv->head & (SCAN_QUEUE_SIZE - 1)] = arp->arp;
+  __atomic_store_n(&rcv->head, rcv->head + 1, __ATOMIC_RELEASE);
+  ++rcv->pushed;
+  counter_add(&rcv->replies, 1);
+}
+
+
+/* Receives on the socket of a worker, and wakes the engine up once
+   per batch */
+static void on_worker_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct scan_receiver *rcv = arg;
+  frame_io_recv(&rcv->io, queue_frame, rcv);
+  if (rcv->pushed) {
+    uint64_t one = 1;
+    if (write(rcv->eventfd, &one, sizeof(one)) == -1) {
+#ifdef DEBUG
+      perror("[FAIL] write() (eventfd)");
+#endif
+    }
+    rcv->pushed = 0;
+  }
+}
+
+
+static int start_receiver(struct worker *worker, void *arg)
+{
+  struct scan_engine *engine = arg;
+  struct scan_receiver *rcv = &engine->receivers[worker->id];
+  return reactor_add_fd(&worker->reactor, rcv->sockfd, EPOLLIN, on_worker_frames, rcv) ? 0 : -1;
+}
+
+
+/* Handles the replies queued by a worker, in the thread of the
+   engine */
+static void on_replies(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct scan_receiver *rcv = arg;
+  struct scan_engine *engine = rcv->engine;
+  uint64_t value;
+  if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    return;
+
+  unsigned int head = __atomic_load_n(&rcv->head, __ATOMIC_ACQUIRE);
+  unsigned int tail = rcv->tail;
+  for (; tail != head; ++tail)
+    scan_handle_reply(engine, &rcv->queue[tail & (SCAN_QUEUE_SIZE - 1)]);
+  __atomic_store_n(&rcv->tail, tail, __ATOMIC_RELEASE);
+
+  if (!has_work(engine) && engine->outstanding == 0)
+    scan_finish(engine, 0);
+}
+
+
+/* Closes the sockets of the receivers and frees them: the engine
+   receives on its backend again */
+static void free_receivers(struct scan_engine *engine)
+{
+  if (!engine->pool)
+    return;
+  for (unsigned int i = 0; i < engine->pool->count; ++i) {
+    struct scan_receiver *rcv = &engine->receivers[i];
+    if (rcv->sockfd >= 0) {
+      frame_io_close(&rcv->io);
+      close(rcv->sockfd);
+    }
+    if (rcv->eventfd >= 0)
+      close(rcv->eventfd);
+    free(rcv->queue);
+  }
+  free(engine->receivers);
+  engine->receivers = NULL;
+  engine->pool = NULL;
+}
+
+
+/* Receives the replies on a pool of workers instead of the backend.
+   Every worker opens its own packet socket on the interface, with the
+   filter, in the fanout group of the pool. The workers run from
+   scan_start() to the end of the scan.
+
+   The backend still receives its copy of the frames: give it a filter
+   which drops everything (filter_attach_drop()).
+
+   Returns 0 on success, -1 on error (the engine is left without
+   receivers, the rest of it untouched).
+ */
+int scan_use_workers(struct scan_engine *engine, struct worker_pool *pool, const struct arp_filter *filter)
+{
+  /* The receivers of a previous call are replaced */
+  free_receivers(engine);
+  engine->receivers = calloc(pool->count, sizeof(*engine->receivers));
+  if (!engine->receivers)
+    return -1;
+  engine->pool = pool;
+  for (unsigned int i = 0; i < pool->count; ++i) {
+    engine->receivers[i].sockfd = -1;
+    engine->receivers[i].eventfd = -1;
+  }
+
+  for (unsigned int i = 0; i < pool->count; ++i) {
+    struct scan_receiver *rcv = &engine->receivers[i];
+    rcv->engine = engine;
+    rcv->queue = malloc(SCAN_QUEUE_SIZE * sizeof(*rcv->queue));
+    if (!rcv->queue)
+      goto fail;
+    rcv->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rcv->eventfd == -1)
+      goto fail;
+
+    /* Every socket of a fanout group is bound to the same protocol
+       and interface */
+    rcv->sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
+    if (rcv->sockfd == -1)
+      goto fail;
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ARP);
+    addr.sll_ifindex = engine->io->ifindex;
+    if (filter_attach(rcv->sockfd, filter) == -1
+	|| bind(rcv->sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+	|| filter_stats_init(&rcv->stats, rcv->sockfd, engine->io->ifindex) == -1
+	|| worker_pool_join(pool, rcv->sockfd) == -1
+	|| frame_io_socket(&rcv->io, rcv->sockfd, engine->io->ifindex) == -1) {
+      close(rcv->sockfd);
+      rcv->sockfd = -1;
+      goto fail;
+    }
+  }
+  return 0;
+
+ fail: {
+    int err = errno;
+    free_receivers(engine);
+    errno = err;
+    return -1;
+  }
+}
+
+
+
+/* Starts the scan on an event loop. The engine watches the descriptor
+   of its backend, and uses a timer to pace the probes and expire them.
+   The callback of the engine is called for every live host, and the
+   done callback once every address has been answered or has used all
+   of its tries. The scan can be stopped earlier with scan_stop().
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_start(struct scan_engine *engine, struct reactor *reactor)
+{
+  if (engine->retries > SCAN_MAX_TRIES - 1)
+    engine->retries = SCAN_MAX_TRIES - 1;
+  if (engine->rate == 0)
+    engine->rate = 1;
+  if (engine->adaptive) {
+    if (engine->min_rate == 0)
+      engine->min_rate = 1;
+    if (engine->max_rate < engine->min_rate)
+      engine->max_rate = engine->min_rate;
+    engine->slow_start = 1;
+  }
+  engine->canary = engine->last_alive = -1;
+  /* Enough probes in flight to keep sending at full rate even if no
+     host answers */
+  engine->auto_window = engine->window == 0;
+  set_rate(engine, engine->rate);
+  engine->last_refill = engine->interval_start = engine->last_increase = now_ns();
+
+  engine->reactor = reactor;
+  engine->timer = reactor_add_timer(reactor, on_timer, engine);
+  if (!engine->timer)
+    return -1;
+
+  /* The replies come either from the backend, or from the queues of
+     the workers */
+  if (engine->pool) {
+    for (unsigned int i = 0; i < engine->pool->count; ++i) {
+      struct scan_receiver *rcv = &engine->receivers[i];
+      rcv->wakeup = reactor_add_fd(reactor, rcv->eventfd, EPOLLIN, on_replies, rcv);
+      if (!rcv->wakeup)
+	goto fail;
+    }
+    if (worker_pool_start(engine->pool, start_receiver, engine) == -1)
+      goto fail;
+  }
+  else {
+    engine->rx = reactor_add_fd(reactor, engine->io->fd, EPOLLIN, on_frames, engine);
+    if (!engine->rx)
+      goto fail;
+  }
+
+  if (reactor_set_timer(engine->timer, 1, 0) == -1)
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    scan_stop(engine);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Stops a scan started with scan_start(), without calling the done
+   callback */
+void scan_stop(struct scan_engine *engine)
+{
+  if (engine->rx)
+    reactor_remove(engine->reactor, engine->rx);
+  if (engine->timer)
+    reactor_remove(engine->reactor, engine->timer);
+  engine->rx = engine->timer = NULL;
+
+  if (engine->pool) {
+    worker_pool_stop(engine->pool);
+    for (unsigned int i = 0; i < engine->pool->count; ++i) {
+      struct scan_receiver *rcv = &engine->receivers[i];
+      if (rcv->wakeup)
+	reactor_remove(engine->reactor, rcv->wakeup);
+      rcv->wakeup = NULL;
+    }
+  }
+}
+
+
+
+/* Records the status of the scan of scan_run(). Its event loop ends
+   by itself, with the removal of the last source. */
+static void record_status(struct scan_engine *engine, int status, void *arg)
+{
+  *(int *) arg = status;
+}
+
+
+/* Runs the scan on its own event loop, until every address has been
+   answered or has used all of its tries. The callback of the engine
+   is called for every live host.
+
+   Returns 0 when the scan is complete, -1 on a socket error.
+ */
+int scan_run(struct scan_engine *engine)
+{
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1)
+    return -1;
+
+  int status = -1;
+  engine->done = record_status;
+  engine->done_arg = &status;
+  int err = scan_start(engine, &reactor);
+  if (err == 0)
+    err = reactor_run(&reactor);
+  reactor_free(&reactor);
+
+  return err == 0 ? status : -1;
+}
+
+
+
+static double read_outstanding(const void *arg)
+{
+  const struct scan_engine *engine = arg;
+  return engine->outstanding;
+}
+
+
+static double read_rate(const void *arg)
+{
+  const struct scan_engine *engine = arg;
+  return engine->rate;
+}
+
+
+/* Marks the hosts alive in a table as answered, so that only the
+   unknown addresses of the range are probed, e.g. after a passive
+   discovery. The callback is not called for them. Call it before
+   scan_start().
+
+   Returns the number of addresses marked.
+ */
+size_t scan_seed(struct scan_engine *engine, const struct host_table *hosts)
+{
+  size_t marked = 0, pos = 0;
+  struct host_entry *entry;
+  while ((entry = hosts_next(hosts, &pos))) {
+    uint32_t offset = ntohl(entry->ip) - engine->first;
+    if (entry->state != HOST_ALIVE || offset >= engine->count
+	|| PROBE_STATE(engine->probes[offset]) != PROBE_UNSENT)
+      continue;
+    engine->probes[offset] = PROBE_MAKE(PROBE_ANSWERED, 0);
+    ++marked;
+  }
+  return marked;
+}
+
+
+/* Limits the next scan to the hosts of a table, and to a number of
+   the other addresses of the range, from an offset on (wrapping
+   around). Call it before scan_start().
+
+   known: the hosts to probe
+   cursor: offset of the first other address to probe
+   budget: number of other addresses to probe
+   probed: filled with the number of other addresses to probe
+
+   Returns the offset of the first other address left out, where the
+   next call should go on from.
+ */
+uint32_t scan_restrict(struct scan_engine *engine, const struct host_table *known, uint32_t cursor, uint32_t budget, uint32_t *probed)
+{
+  memset(engine->probes, PROBE_SKIPPED, engine->count);
+  size_t pos = 0;
+  struct host_entry *entry;
+  while ((entry = hosts_next(known, &pos))) {
+    uint32_t offset = ntohl(entry->ip) - engine->first;
+    if (offset < engine->count)
+      engine->probes[offset] = PROBE_UNSENT;
+  }
+
+  uint32_t offset = cursor < engine->count ? cursor : 0;
+  uint32_t n = 0;
+  for (uint32_t seen = 0; n < budget && seen < engine->count; ++seen) {
+    if (engine->probes[offset] == PROBE_SKIPPED) {
+      engine->probes[offset] = PROBE_UNSENT;
+      ++n;
+    }
+    if (++offset == engine->count)
+      offset = 0;
+  }
+  *probed = n;
+  return offset;
+}
+
+
+/* Keeps the progress of the scan in a state file: the engine works
+   on the states of the addresses in the mapping of the file, and
+   appends every host which answers to it. If the file comes from an
+   earlier run of the same scan, the scan resumes from there: the
+   probes which were in flight are sent again, and the hosts already
+   found are recorded in the host table and handed to the callback.
+   Call it after the parameters, the host table and the callback are
+   set, before scan_start(); the checkpoint must outlive the engine.
+
+   Returns 0 on success, -1 on error (EINVAL if the file is the state
+   of another range).
+ */
+int scan_use_checkpoint(struct scan_engine *engine, struct checkpoint *cp)
+{
+  struct checkpoint_header *header = cp->header;
+  if (header->first != engine->first || header->count != engine->count) {
+    errno = EINVAL;
+    return -1;
+  }
+  free(engine->probes);
+  engine->probes = cp->states;
+  engine->checkpoint = cp;
+  if (!cp->resumed)
+    return 0;
+
+  engine->next = header->next < engine->count ? header->next : engine->count;
+  engine->sent = header->sent;
+  engine->answered = header->answered;
+  engine->lost = header->lost;
+
+  /* The deadlines of the probes in flight died with the previous run:
+     they are all sent again, if they have a try left */
+  for (uint32_t offset = 0; offset < engine->count; ++offset) {
+    unsigned char *probe = &engine->probes[offset];
+    unsigned int state = PROBE_STATE(*probe);
+    if (state != PROBE_INFLIGHT && state != PROBE_RETRY)
+      continue;
+    if (PROBE_TRIES(*probe) <= engine->retries && PROBE_TRIES(*probe) < SCAN_MAX_TRIES
+	&& queue_push(&engine->retry, offset, 0, 0) == 0)
+      *probe = PROBE_MAKE(PROBE_RETRY, PROBE_TRIES(*probe));
+    else {
+      *probe = PROBE_MAKE(PROBE_DEAD, PROBE_TRIES(*probe));
+      ++engine->lost;
+    }
+  }
+
+  for (uint64_t i = 0; i < header->nrecords; ++i) {
+    const struct checkpoint_record *record = &cp->records[i];
+    struct in_addr ip = { record->ip };
+    if (engine->hosts)
+      hosts_update(engine->hosts, ip, record->mac);
+    if (engine->callback)
+      engine->callback(ip, record->mac, engine->callback_arg);
+  }
+  return 0;
+}
+
+
+/* Adds the counters of the engine, and those of its workers, to a
+   registry of metrics collected in the thread of the engine. Call it
+   after scan_use_workers().
+
+   labels: labels of the series, e.g. interface="eth0", or NULL (the
+   workers add their own)
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_add_metrics(struct scan_engine *engine, struct metrics *m, const char *labels)
+{
+  if (metrics_add_counter(m, "satrap_scan_probes_sent_total",
+			  "Probes sent, retransmissions included", labels, &engine->sent) == -1
+      || metrics_add_counter(m, "satrap_scan_probes_answered_total",
+			     "Probes answered", labels, &engine->answered) == -1
+      || metrics_add_counter(m, "satrap_scan_probes_unanswered_total",
+			     "Probes which used all of their tries", labels, &engine->lost) == -1
+      || metrics_add_counter(m, "satrap_scan_late_replies_total",
+			     "Replies to a retransmission or after the deadline", labels,
+			     &engine->late) == -1
+      || metrics_add_counter(m, "satrap_scan_rate_decreases_total",
+			     "Decreases of the rate", labels, &engine->decreases) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_scan_probes_outstanding",
+		     "Probes in flight and not answered yet", labels,
+		     read_outstanding, engine) == -1
+      || metrics_add(m, METRIC_GAUGE, "satrap_scan_rate",
+		     "Probes per second", labels, read_rate, engine) == -1)
+    return -1;
+
+  for (unsigned int i = 0; engine->pool && i < engine->pool->count; ++i) {
+    struct scan_receiver *rcv = &engine->receivers[i];
+    char worker[METRICS_LABELS_LEN];
+    snprintf(worker, sizeof(worker), "%s%sworker=\"%u\"",
+	     labels ? labels : "", labels ? "," : "", i);
+    if (metrics_add_counter(m, "satrap_scan_worker_frames_total",
+			    "Frames received by the worker", worker, &rcv->frames) == -1
+	|| metrics_add_counter(m, "satrap_scan_worker_replies_total",
+			       "Replies queued by the worker", worker, &rcv->replies) == -1
+	|| metrics_add_counter(m, "satrap_scan_worker_overflows_total",
+			       "Replies lost on the full queue of the worker", worker,
+			       &rcv->overflows) == -1
+	|| metrics_add_filter_stats(m, &rcv->stats, worker) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+
+
+/* Frees the memory used by the engine */
+void scan_free(struct scan_engine *engine)
+{
+  free_receivers(engine);
+  /* The probes of a checkpoint are in the mapping of its file */
+  if (!engine->checkpoint)
+    free(engine->probes);
+  engine->probes = NULL;
+  engine->checkpoint = NULL;
+  for (unsigned int i = 0; i < SCAN_MAX_TRIES; ++i) {
+    free(engine->inflight[i].entries);
+    engine->inflight[i].entries = NULL;
+  }
+  free(engine->retry.entries);
+  engine->retry.entries = NULL;
+}
+
+
+
+/* Copies the hardware address found by arp_resolve() */
+static void copy_mac(struct in_addr ip, const unsigned char *mac, void *arg)
+{
+  memcpy(arg, mac, ETHER_ADDR_LEN);
+}
+
+
+/* Resolves the hardware address of a host, with a scan of a single
+   address, unless the host is alive in the host table
+
+   io: frame I/O backend
+   hosts: table of the known hosts, which is updated, or NULL
+   ipaddr: local IP address
+   macaddr: local hardware address
+   target_ip: IP address of the host
+   target_mac: filled with the hardware address of the host
+
+   Returns 0 if the host answered, -1 otherwise.
+ */
+int arp_resolve(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr target_ip, unsigned char *target_mac)
+{
+  if (hosts) {
+    if (hosts_get_mac(hosts, target_ip, target_mac) == 0)
+      return 0;
+    /* A host not seen for too long is asked again */
+    struct host_entry *e = hosts_insert(hosts, target_ip);
+    if (!e)
+      return -1;
+    if (e->state == HOST_ALIVE)
+      e->state = HOST_STALE;
+  }
+
+  struct scan_engine engine;
+  if (scan_init(&engine, io, ipaddr, macaddr, target_ip, target_ip) == -1)
+    return -1;
+  engine.callback = copy_mac;
+  engine.callback_arg = target_mac;
+  engine.hosts = hosts;
+
+  int err = scan_run(&engine);
+  int answered = engine.answered;
+  scan_free(&engine);
+
+  /* A host which never answered is forgotten */
+  if (hosts && !answered) {
+    struct host_entry *e = hosts_lookup(hosts, target_ip);
+    if (e && e->state == HOST_PROBING)
+      hosts_remove(hosts, target_ip);
+  }
+
+  return (err == 0 && answered) ? 0 : -1;
+}
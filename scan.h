@@ -0,0 +1,336 @@
+/* Satrap/scan.h */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stdint.h>
+
+#include "arp.h"
+#include "checkpoint.h"
+#include "filter.h"
+#include "reactor.h"
+#include "workers.h"
+
+
+
+/* Default parameters of the scan engine */
+#define SCAN_DEFAULT_RATE 10000 /* probes per second, initial rate if
+				   adaptive */
+#define SCAN_DEFAULT_TIMEOUT 300 /* milliseconds before the first try of a
+				    probe is lost, doubled on every retry */
+#define SCAN_DEFAULT_RETRIES 2 /* retransmissions of an unanswered probe */
+#define SCAN_DEFAULT_MIN_RATE 100 /* bounds of the adaptive rate */
+#define SCAN_DEFAULT_MAX_RATE 1000000
+#define SCAN_DEFAULT_RATE_STEP 1000 /* probes per second added on every
+				       interval without loss */
+#define SCAN_INTERVAL 100 /* milliseconds between two rate adjustments */
+#define SCAN_LOSS_TOLERANCE 50 /* one loss in that many replies is noise */
+#define SCAN_BACKOFF_LIMIT 16 /* longest timeout of a try, in multiples of
+				 the first one */
+#define SCAN_MAX_TRIES 15 /* tries of a probe, retries included */
+#define SCAN_DEFAULT_WINDOW 0 /* maximum number of probes in flight, 0 for
+				  the number sent during the mean timeout
+				  of a try */
+#define SCAN_QUEUE_SIZE 4096 /* replies waiting between a worker and the
+				engine, power of two */
+
+
+/* State of every address of the scanned range */
+enum probe_state {
+  PROBE_UNSENT = 0, /* never probed */
+  PROBE_INFLIGHT, /* request sent, waiting for the reply */
+  PROBE_RETRY, /* deadline passed, waiting to be sent again */
+  PROBE_ANSWERED, /* the host replied */
+  PROBE_DEAD, /* every try went unanswered */
+  PROBE_SKIPPED /* not part of this scan (scan_restrict()) */
+};
+
+
+/* Entry of a probe queue */
+struct probe_entry {
+  uint32_t offset; /* offset of the address in the scanned range */
+  uint64_t deadline; /* CLOCK_MONOTONIC, in nanoseconds */
+  uint32_t rate; /* at which the try was sent */
+};
+
+
+/* Growable circular queue of probes. Every try of a probe has its own
+   timeout, the same for every probe, so there is one queue of
+   outstanding probes per try, and each of them is naturally sorted by
+   deadline. */
+struct probe_queue {
+  struct probe_entry *entries;
+  size_t head, len, size;
+};
+
+
+/* Called for every host that answered a probe */
+typedef void (*scan_callback)(struct in_addr ip, const unsigned char *mac, void *arg);
+
+struct scan_engine;
+
+
+/* Receiver of the replies, on a worker thread. The frames arrive on
+   the own packet socket of the worker, and the ARP replies go to the
+   engine through a single-producer single-consumer queue: only the
+   thread of the engine touches the probes and the host table, so no
+   thread ever waits for a lock. */
+struct scan_receiver {
+  struct scan_engine *engine;
+  int sockfd;
+  struct frame_io io;
+
+  struct ether_arp *queue; /* SCAN_QUEUE_SIZE replies */
+  unsigned int head; /* next reply to write, by the worker */
+  unsigned int tail; /* next reply to read, by the engine */
+  unsigned int pushed; /* replies written since the last wake-up */
+  int eventfd; /* wakes the engine up */
+  struct reactor_source *wakeup; /* in the reactor of the engine */
+
+  /* Counters of the worker (counter_read() from other threads) */
+  unsigned long frames, replies, overflows;
+
+  /* Drops of the socket, read by the engine */
+  struct filter_stats stats;
+};
+
+
+/* Called when a scan started with scan_start() is over. status is 0
+   if the scan is complete, -1 on a socket error or if the state
+   file could not be written. */
+typedef void (*scan_done_callback)(struct scan_engine *engine, int status, void *arg);
+
+
+/* Pipelined ARP scanner. Requests are sent at a given rate, and
+   replies are matched to their outstanding probe by target IP
+   address, so the duration of a scan depends on the rate and not on
+   the round-trip time.
+
+   With adaptive set, the rate follows the losses (AIMD): it doubles on
+   every interval until the first loss, then grows by rate_step, and
+   it is halved when the losses go beyond the tolerance. A loss is a
+   frame dropped by a receiving socket, a reply which came for a
+   retransmission or after its deadline (the host is alive, but the
+   first request or its reply went missing), or the silence of a live
+   host asked again (the canary). */
+struct scan_engine {
+  struct frame_io *io; /* backend used to send and receive */
+  struct sockaddr_in ipaddr; /* local IP address */
+  unsigned char macaddr[ETHER_ADDR_LEN]; /* local hardware address */
+  struct arp_template request; /* every probe is stamped from it */
+
+  uint32_t first; /* first address of the range, host byte order */
+  uint32_t count; /* number of addresses in the range */
+  uint32_t next; /* offset of the next address never probed */
+  unsigned char *probes; /* state (low 4 bits) and tries (high 4 bits) */
+
+  struct probe_queue inflight[SCAN_MAX_TRIES]; /* sent probes, by try */
+  struct probe_queue retry; /* probes to send again */
+  size_t outstanding; /* probes in flight and not answered yet */
+
+  double tokens; /* token bucket of the rate limiter */
+  uint64_t last_refill;
+
+  /* Parameters, may be changed between scan_init() and scan_run() */
+  unsigned int rate; /* probes per second */
+  unsigned int timeout; /* milliseconds, for the first try */
+  unsigned int retries;
+  unsigned int window; /* 0 for rate * mean timeout of a try */
+  int adaptive; /* if set, the rate follows the losses */
+  unsigned int min_rate, max_rate, rate_step; /* probes per second */
+
+  /* Capture statistics of the backend, whose drops count as losses,
+     or NULL */
+  struct filter_stats *stats;
+
+  /* Rate control, since the start of the current interval */
+  int slow_start; /* the rate doubles until the first loss */
+  int auto_window; /* the window follows the rate */
+  uint64_t interval_start;
+  uint64_t last_decrease; /* the losses of older probes are ignored */
+  uint64_t last_increase; /* of the slow start */
+  int64_t last_alive; /* offset of the last host which answered */
+  int64_t canary; /* offset of the live host asked again, -1 if none */
+  uint64_t canary_sent;
+  unsigned long interval_sent, interval_answered; /* at the start */
+  unsigned long interval_losses;
+  unsigned long dropped; /* by the receivers, at the last interval */
+
+  /* Statistics */
+  unsigned long sent, answered, lost;
+  unsigned long late; /* replies to a retransmission or after the deadline */
+  unsigned long drops; /* frames dropped by the receiving sockets */
+  unsigned long decreases; /* of the rate */
+
+  /* Table where every host that answers is recorded, or NULL */
+  struct host_table *hosts;
+
+  /* Hosts asked at their hardware address, but for the last try which
+     is broadcast in case the address moved, or NULL */
+  const struct host_table *unicast;
+
+  /* State file which the probes live in, or NULL */
+  struct checkpoint *checkpoint;
+  int checkpoint_error; /* errno of a host which could not be recorded */
+
+  scan_callback callback;
+  void *callback_arg;
+
+  /* Event loop, between scan_start() and the end of the scan */
+  struct reactor *reactor;
+  struct reactor_source *rx, *timer;
+  scan_done_callback done;
+  void *done_arg;
+
+  /* Workers which receive the replies, or NULL to receive them on the
+     backend */
+  struct worker_pool *pool;
+  struct scan_receiver *receivers;
+};
+
+
+/* Initializes a scan engine
+
+   engine: the engine to initialize
+   io: frame I/O backend, which receives ARP
+   ipaddr: local IP address, used as the sender of the requests
+   macaddr: local hardware address
+   first: first address to scan
+   last: last address to scan (included)
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int scan_init(struct scan_engine *engine, struct frame_io *io, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr first, struct in_addr last);
+
+
+/* Prepares the engine for the scan of another range, on the same
+   backend, with the same parameters, host table and callbacks. The
+   rate starts where the previous scan left it, the counters from
+   zero. The engine must be stopped, without workers or checkpoint.
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_reset(struct scan_engine *engine, struct in_addr first, struct in_addr last);
+
+
+/* Starts the scan on an event loop. The engine watches the descriptor
+   of its backend, and uses a timer to pace the probes and expire them.
+   The callback of the engine is called for every live host, and the
+   done callback once every address has been answered or has used all
+   of its tries. The scan can be stopped earlier with scan_stop().
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_start(struct scan_engine *engine, struct reactor *reactor);
+
+
+/* Stops a scan started with scan_start(), without calling the done
+   callback */
+void scan_stop(struct scan_engine *engine);
+
+
+/* Runs the scan on its own event loop, until every address has been
+   answered or has used all of its tries. The callback of the engine
+   is called for every live host.
+
+   Returns 0 when the scan is complete, -1 on a socket error.
+ */
+int scan_run(struct scan_engine *engine);
+
+
+/* Handles a received ARP frame: the sender is recorded in the host
+   table, and if it answers one of our outstanding probes, the probe
+   is marked as answered and the callback is called.
+
+   Returns 1 if the frame answered a probe, 0 otherwise.
+ */
+int scan_handle_reply(struct scan_engine *engine, const struct ether_arp *reply);
+
+
+/* Receives the replies on a pool of workers instead of the backend.
+   Every worker opens its own packet socket on the interface, with the
+   filter, in the fanout group of the pool. The workers run from
+   scan_start() to the end of the scan.
+
+   The backend still receives its copy of the frames: give it a filter
+   which drops everything (filter_attach_drop()).
+
+   Returns 0 on success, -1 on error (the engine is left without
+   receivers, the rest of it untouched).
+ */
+int scan_use_workers(struct scan_engine *engine, struct worker_pool *pool, const struct arp_filter *filter);
+
+
+/* Marks the hosts alive in a table as answered, so that only the
+   unknown addresses of the range are probed, e.g. after a passive
+   discovery. The callback is not called for them. Call it before
+   scan_start().
+
+   Returns the number of addresses marked.
+ */
+size_t scan_seed(struct scan_engine *engine, const struct host_table *hosts);
+
+
+/* Limits the next scan to the hosts of a table, and to a number of
+   the other addresses of the range, from an offset on (wrapping
+   around). Call it before scan_start().
+
+   known: the hosts to probe
+   cursor: offset of the first other address to probe
+   budget: number of other addresses to probe
+   probed: filled with the number of other addresses to probe
+
+   Returns the offset of the first other address left out, where the
+   next call should go on from.
+ */
+uint32_t scan_restrict(struct scan_engine *engine, const struct host_table *known, uint32_t cursor, uint32_t budget, uint32_t *probed);
+
+
+/* Keeps the progress of the scan in a state file: the engine works
+   on the states of the addresses in the mapping of the file, and
+   appends every host which answers to it. If the file comes from an
+   earlier run of the same scan, the scan resumes from there: the
+   probes which were in flight are sent again, and the hosts already
+   found are recorded in the host table and handed to the callback.
+   Call it after the parameters, the host table and the callback are
+   set, before scan_start(); the checkpoint must outlive the engine.
+
+   Returns 0 on success, -1 on error (EINVAL if the file is the state
+   of another range).
+ */
+int scan_use_checkpoint(struct scan_engine *engine, struct checkpoint *cp);
+
+
+/* Adds the counters of the engine, and those of its workers, to a
+   registry of metrics collected in the thread of the engine. Call it
+   after scan_use_workers().
+
+   labels: labels of the series, e.g. interface="eth0", or NULL (the
+   workers add their own)
+
+   Returns 0 on success, -1 on error.
+ */
+int scan_add_metrics(struct scan_engine *engine, struct metrics *m, const char *labels);
+
+
+/* Frees the memory used by the engine */
+void scan_free(struct scan_engine *engine);
+
+
+/* Resolves the hardware address of a host, with a scan of a single
+   address, unless the host is alive in the host table
+
+   io: frame I/O backend
+   hosts: table of the known hosts, which is updated, or NULL
+   ipaddr: local IP address
+   macaddr: local hardware address
+   target_ip: IP address of the host
+   target_mac: filled with the hardware address of the host
+
+   Returns 0 if the host answered, -1 otherwise.
+ */
+int arp_resolve(struct frame_io *io, struct host_table *hosts, struct sockaddr_in *ipaddr, unsigned char *macaddr, struct in_addr target_ip, unsigned char *target_mac);
+
+
+
+#endif /* SCAN_H_ */
@@ -0,0 +1,157 @@
+/* Satrap/scan_coord.c */
+
+#include "coord.h"
+#include "hosts.h"
+#include "netif.h"
+#include "reactor.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+
+/* Prints every host once, whichever agent found it first */
+static void print_host(struct in_addr ip, const unsigned char *mac, const struct coord_peer *peer, void *arg)
+{
+  unsigned char *bytes = (unsigned char *) &ip.s_addr;
+  printf("Host %d.%d.%d.%d is alive! (%02x:%02x:%02x:%02x:%02x:%02x) from %s\n",
+	 bytes[0], bytes[1], bytes[2], bytes[3],
+	 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], peer->name);
+}
+
+
+static void on_done(struct coordinator *coord, void *arg)
+{
+  reactor_stop(coord->reactor);
+}
+
+
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  reactor_stop(reactor);
+}
+
+
+int main(int argc, char **argv)
+{
+
+  /* ARGUMENT PARSING
+     - size of the shards, timeouts
+     - address to listen on
+     - networks to scan
+  */
+
+  unsigned int shard_prefix = COORD_DEFAULT_SHARD_PREFIX;
+  unsigned int agent_timeout = COORD_DEFAULT_AGENT_TIMEOUT;
+  unsigned int shard_timeout = COORD_DEFAULT_SHARD_TIMEOUT;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:T:")) != -1) {
+    switch (opt) {
+    case 'p':
+      shard_prefix = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      agent_timeout = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      shard_timeout = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      optind = argc; /* print the usage below */
+    }
+  }
+
+  if (argc - optind < 2) {
+    printf("[FAIL] Too few arguments\n"
+	   "Usage: %s [-p shard size, as a prefix length (default %d)] "
+	   "[-t seconds of silence before an agent is dead (default %d)] "
+	   "[-T seconds before a shard is also given to an idle agent (default %d)] "
+	   "<listen address (port, or IP:port; 127.0.0.1 by default)> "
+	   "<network>/<prefix> [<network>/<prefix> ...]\n"
+	   "The agents are arp_scan -J <address> <interface>, each given the "
+	   "shards inside its network.\n",
+	   argv[0], COORD_DEFAULT_SHARD_PREFIX, COORD_DEFAULT_AGENT_TIMEOUT,
+	   COORD_DEFAULT_SHARD_TIMEOUT);
+    exit(EXIT_FAILURE);
+  }
+  if (shard_prefix > 32 || agent_timeout == 0) {
+    printf("[FAIL] Invalid shard size or timeout\n");
+    exit(EXIT_FAILURE);
+  }
+  const char *address = argv[optind];
+
+  /* Every host goes to a single table, whichever agent found it */
+  struct host_table hosts;
+  if (hosts_init(&hosts, 0) == -1) {
+    perror("[FAIL] hosts_init()");
+    exit(EXIT_FAILURE);
+  }
+  struct coordinator coord;
+  coord_init(&coord, &hosts, shard_prefix);
+  coord.agent_timeout = agent_timeout;
+  coord.shard_timeout = shard_timeout;
+  coord.callback = print_host;
+  coord.done_callback = on_done;
+
+  for (int i = optind + 1; i < argc; ++i) {
+    char network[INET_ADDRSTRLEN];
+    unsigned int prefix;
+    struct in_addr target;
+    if (sscanf(argv[i], "%15[0-9.]/%u", network, &prefix) != 2 || prefix > 32
+	|| !inet_pton(AF_INET, network, &target)) {
+      printf("[FAIL] Badly formatted network: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+    /* The whole block: the agents leave out the network and broadcast
+       addresses of their own network */
+    struct in_addr mask = netif_netmask(prefix), first, last;
+    first.s_addr = target.s_addr & mask.s_addr;
+    last.s_addr = first.s_addr | ~mask.s_addr;
+    if (coord_add_range(&coord, first, last) == -1) {
+      perror("[FAIL] coord_add_range()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("[OK] %zu shards of /%u to scan\n", coord.nshards, shard_prefix);
+
+
+
+  /* ====================================================================== */
+
+  /* The coordinator runs on an event loop, until every shard is
+     scanned, or SIGINT or SIGTERM */
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1) {
+    perror("[FAIL] reactor_init()");
+    exit(EXIT_FAILURE);
+  }
+  if (!reactor_add_signal(&reactor, SIGINT, on_signal, NULL)
+      || !reactor_add_signal(&reactor, SIGTERM, on_signal, NULL)) {
+    perror("[FAIL] reactor_add_signal()");
+    exit(EXIT_FAILURE);
+  }
+  if (coord_start(&coord, &reactor, address) == -1) {
+    fprintf(stderr, "[FAIL] coord_start() (%s): %s\n", address, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (reactor_run(&reactor) == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+  coord_stop(&coord);
+  reactor_free(&reactor);
+
+  printf("[OK] %zu of %zu shards scanned, %zu hosts alive; %lu shards taken back "
+	 "from %lu lost agents, %lu given to a second agent\n",
+	 coord.done, coord.nshards, hosts.len, coord.reassigned,
+	 coord.lost_peers, coord.speculative);
+
+  int complete = coord.done == coord.nshards;
+  coord_free(&coord);
+  hosts_free(&hosts);
+  exit(complete ? EXIT_SUCCESS : EXIT_FAILURE);
+}
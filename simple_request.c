@@ -1,6 +1,68 @@
 /* Satrap/simple_request.c */
 
+#include <sys/epoll.h>
+
 #include "arp.h"
+#include "filter.h"
+#include "netif.h"
+#include "reactor.h"
+
+/* Number of requests sent before giving up, one per second */
+#define REQUEST_TRIES 3
+
+
+/* State of the request, shared by the callbacks */
+struct request {
+  int sockfd, ifindex;
+  struct sockaddr_in *ipaddr;
+  unsigned char *macaddr;
+  struct in_addr target_ip;
+  unsigned int tries;
+  int answered;
+};
+
+
+/* Sends the request again, or gives up */
+static void on_timeout(struct reactor *reactor, void *arg)
+{
+  struct request *req = arg;
+  if (req->tries == REQUEST_TRIES) {
+    reactor_stop(reactor);
+    return;
+  }
+  send_arp_request(req->sockfd, req->ifindex, req->ipaddr, req->macaddr, req->target_ip);
+  ++req->tries;
+}
+
+
+/* Reads the frames waiting, and stops at the reply of the target */
+static void on_frames(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct request *req = arg;
+  struct ether_arp frames[16];
+  int n = recv_arp_batch(fd, frames, 16, MSG_DONTWAIT);
+  for (int i = 0; i < n; ++i) {
+    struct ether_arp *reply = &frames[i];
+    if (ntohs(reply->arp_op) != ARPOP_REPLY
+	|| memcmp(reply->arp_spa, &req->target_ip.s_addr, sizeof(reply->arp_spa)))
+      continue;
+
+    unsigned char *macaddr1 = reply->arp_sha;
+    printf("Target hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
+	   macaddr1[0],macaddr1[1],macaddr1[2],
+	   macaddr1[3],macaddr1[4],macaddr1[5]);
+    req->answered = 1;
+    reactor_stop(reactor);
+    return;
+  }
+}
+
+
+static void on_signal(struct reactor *reactor, int signo, void *arg)
+{
+  reactor_stop(reactor);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -51,92 +113,82 @@ int main(int argc, char **argv)
 
   /* INFORMATION ON THE LOCAL COMPUTER:
      - index number of the network interface
-     - local IP address
+     - local IP address, on the network of the target
      - local MAC address
+     They all come from a single rtnetlink dump of the interfaces,
+     which sees their secondary addresses too.
   */
-
-  /* Since this is very low-level, we can't use the usual interface
-     name (e.g. "eth0"), so we need to get the index number of the
-     ethernet interface. */
-  //char *if_name = "wlp3s0"; /* Change this if needed */
-  struct ifreq ifrindex;
-  size_t if_name_len = strlen(if_name);
-  if (if_name_len < sizeof(ifrindex.ifr_name)) {
-    memcpy(ifrindex.ifr_name, if_name, if_name_len);
-    ifrindex.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
+  const struct netif *netif = netif_lookup(if_name);
+  if (!netif) {
+    perror("[FAIL] netif_lookup()");
+    exit(EXIT_FAILURE);
   }
-  /* We use ioctl() with SIOCGIFINDEX */
-  if (ioctl(sockfd, SIOCGIFINDEX, &ifrindex) == -1) {
-    perror("[FAIL] ioctl()");
+  if (netif->type != ARPHRD_ETHER) {
+    printf("[FAIL] Interface %s is not an Ethernet interface\n", if_name);
     exit(EXIT_FAILURE);
   }
-  int ifindex = ifrindex.ifr_ifindex;
+  int ifindex = netif->index;
 #ifdef DEBUG
   printf("[OK] Index number of the Ethernet interface %s: %d\n", if_name, ifindex);
 #endif
 
-  /* We get our IP address using ioctl() and SIOCGIFADDR */
-  struct ifreq ifraddr;
-  if (if_name_len < sizeof(ifraddr.ifr_name)) {
-    memcpy(ifraddr.ifr_name, if_name, if_name_len);
-    ifraddr.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
-  }
-  if (ioctl(sockfd, SIOCGIFADDR, &ifraddr) == -1) {
-    perror("[FAIL] ioctl()");
-    exit(EXIT_FAILURE);
-  }
-  struct sockaddr_in *ipaddr = (struct sockaddr_in *) &ifraddr.ifr_addr;
-  char local_ip_string[16];
-  if (!inet_ntop(AF_INET, &ipaddr->sin_addr, local_ip_string, sizeof(local_ip_string))) {
-    perror("[FAIL] inet_ntop()");
+  const struct netif_addr *local = netif_addr_for(netif, target_ip);
+  if (!local) {
+    printf("[FAIL] No IPv4 address on interface %s\n", if_name);
     exit(EXIT_FAILURE);
   }
+  struct sockaddr_in local_addr = { .sin_family = AF_INET, .sin_addr = local->addr };
+  struct sockaddr_in *ipaddr = &local_addr;
 #ifdef DEBUG
-  printf("[OK] Local IP address: %s\n", local_ip_string);
+  printf("[OK] Local IP address: %s/%u\n", inet_ntoa(local->addr), local->prefix);
 #endif
 
-  /* We get the MAC address using ioctl() (again) with SIOCGIFHWADDR */
-  struct ifreq ifrhwaddr;
-  if (if_name_len < sizeof(ifrhwaddr.ifr_name)) {
-    memcpy(ifrhwaddr.ifr_name, if_name, if_name_len);
-    ifrhwaddr.ifr_name[if_name_len] = 0;
-  }
-  else {
-    printf("[FAIL] Error: interface name is too long\n");
-  }
-  if (ioctl(sockfd, SIOCGIFHWADDR, &ifrhwaddr) == -1) {
-    perror("[FAIL] ioctl()");
-    exit(EXIT_FAILURE);
-  }
-  unsigned char *macaddr = (unsigned char *) &ifrhwaddr.ifr_hwaddr.sa_data;
+  unsigned char macaddr[ETHER_ADDR_LEN];
+  memcpy(macaddr, netif->macaddr, ETHER_ADDR_LEN);
 #ifdef DEBUG
   printf("[OK] Local MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
 	 macaddr[0], macaddr[1], macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
 #endif
 
 
-  /* ====================================================================== */
-
-  send_arp_request(sockfd, ifindex, ipaddr, macaddr, target_ip);
-  
+  /* Only the ARP replies for us reach userspace */
+  struct arp_filter filter;
+  filter_init(&filter, macaddr, ipaddr->sin_addr);
+  if (filter_attach(sockfd, &filter) == -1) {
+    perror("[FAIL] filter_attach()");
+    exit(EXIT_FAILURE);
+  }
 
 
   /* ====================================================================== */
 
-  /* We listens to the answer */
-  
-  struct ether_arp *result = malloc(sizeof(struct ether_arp));
-  listen_arp_frame(sockfd, result);
-  unsigned char *macaddr1 = result->arp_sha;
-  printf("Target hardware address: %02x:%02x:%02x:%02x:%02x:%02x\n",
-    	 macaddr1[0],macaddr1[1],macaddr1[2],
-    	 macaddr1[3],macaddr1[4],macaddr1[5]);
+  /* The request is sent every second until the target answers, and
+     the replies are read as soon as they arrive: both are callbacks
+     of an event loop */
+  struct request req = { sockfd, ifindex, ipaddr, macaddr, target_ip, 0, 0 };
+  struct reactor reactor;
+  if (reactor_init(&reactor) == -1) {
+    perror("[FAIL] reactor_init()");
+    exit(EXIT_FAILURE);
+  }
+  struct reactor_source *timer = reactor_add_timer(&reactor, on_timeout, &req);
+  if (!reactor_add_fd(&reactor, sockfd, EPOLLIN, on_frames, &req)
+      || !timer || reactor_set_timer(timer, 1, 1000000000ULL) == -1
+      || !reactor_add_signal(&reactor, SIGINT, on_signal, NULL)) {
+    perror("[FAIL] reactor_add()");
+    exit(EXIT_FAILURE);
+  }
+
+  if (reactor_run(&reactor) == -1) {
+    perror("[FAIL] reactor_run()");
+    exit(EXIT_FAILURE);
+  }
+  reactor_free(&reactor);
+
+  if (!req.answered) {
+    printf("[FAIL] Target does not answer\n");
+    exit(EXIT_FAILURE);
+  }
 
 
   
@@ -0,0 +1,356 @@
+/* Satrap/sink.c */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "sink.h"
+
+
+
+/* Longest text record: a line of NDJSON with every field */
+#define SINK_LINE_LEN 256
+
+static const char *const event_names[] = {
+  [SINK_FOUND] = "found",
+  [SINK_APPEARED] = "appeared",
+  [SINK_DISAPPEARED] = "disappeared",
+  [SINK_MOVED] = "moved"
+};
+
+
+/* Parses the name of a format: "ndjson", "csv" or "binary"
+
+   Returns 0 on success, -1 if the name is unknown.
+ */
+int sink_parse_format(const char *name, enum sink_format *format)
+{
+  if (!strcmp(name, "ndjson") || !strcmp(name, "json"))
+    *format = SINK_NDJSON;
+  else if (!strcmp(name, "csv"))
+    *format = SINK_CSV;
+  else if (!strcmp(name, "binary"))
+    *format = SINK_BINARY;
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* ====================================================================== */
+
+/* QUEUE */
+
+/* Writes out as much of the queue as the file descriptor takes
+
+   Returns 0 on success, -1 on error.
+ */
+static int flush(struct sink *sink)
+{
+  while (sink->len) {
+    struct iovec iov[2];
+    size_t first = sink->capacity - sink->head;
+    iov[0].iov_base = sink->queue + sink->head;
+    iov[0].iov_len = first < sink->len ? first : sink->len;
+    iov[1].iov_base = sink->queue;
+    iov[1].iov_len = sink->len - iov[0].iov_len;
+    ssize_t n = writev(sink->fd, iov, iov[1].iov_len ? 2 : 1);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      sink->error = errno;
+      return -1;
+    }
+    sink->head = (sink->head + n) % sink->capacity;
+    sink->len -= n;
+    sink->bytes += n;
+  }
+  if (!sink->len)
+    sink->head = 0;
+  return 0;
+}
+
+
+static void on_writable(struct reactor *reactor, int fd, uint32_t events, void *arg);
+
+
+/* Writes out the queue, and waits for the reader if something is
+   left: the source is there only then, so the loop does not wake up
+   for an idle output */
+static int drain(struct sink *sink)
+{
+  if (flush(sink) == -1)
+    return -1;
+  if (sink->len && !sink->source && sink->reactor) {
+    sink->source = reactor_add_fd(sink->reactor, sink->fd, EPOLLOUT, on_writable, sink);
+    /* A regular file can't be watched, but never makes us wait */
+    if (!sink->source && errno != EPERM)
+      return -1;
+  }
+  else if (!sink->len && sink->source) {
+    reactor_remove(sink->reactor, sink->source);
+    sink->source = NULL;
+  }
+  return 0;
+}
+
+
+static void on_writable(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  struct sink *sink = arg;
+  if (drain(sink) == -1) {
+#ifdef DEBUG
+    perror("[FAIL] Sink");
+#endif
+    reactor_remove(reactor, sink->source);
+    sink->source = NULL;
+  }
+}
+
+
+/* Appends a record to the queue, whole or not at all
+
+   Returns 0 on success, -1 if it does not fit (ENOBUFS).
+ */
+static int enqueue(struct sink *sink, const void *data, size_t len)
+{
+  if (len > sink->capacity - sink->len) {
+    ++sink->overflows;
+    errno = ENOBUFS;
+    return -1;
+  }
+  size_t tail = (sink->head + sink->len) % sink->capacity;
+  size_t first = sink->capacity - tail;
+  if (first > len)
+    first = len;
+  memcpy(sink->queue + tail, data, first);
+  memcpy(sink->queue, (const char *) data + first, len - first);
+  sink->len += len;
+  ++sink->records;
+  return 0;
+}
+
+
+
+/* ====================================================================== */
+
+/* SINK */
+
+/* Initializes a sink. The file descriptor is made nonblocking.
+
+   fd: file descriptor of the output, which stays open
+   capacity: size of the queue in bytes, or 0 for the default
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_open(struct sink *sink, int fd, enum sink_format format, size_t capacity)
+{
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = fd;
+  sink->format = format;
+  sink->capacity = capacity ? capacity : SINK_DEFAULT_CAPACITY;
+  sink->flags = fcntl(fd, F_GETFL);
+  if (sink->flags == -1 || hosts_init(&sink->seen, 0) == -1)
+    return -1;
+  sink->queue = malloc(sink->capacity);
+  if (!sink->queue || fcntl(fd, F_SETFL, sink->flags | O_NONBLOCK) == -1)
+    goto fail;
+
+  static const char header[] = "time,event,ip,mac,old_mac,interface\n";
+  if (format == SINK_CSV
+      && (enqueue(sink, header, sizeof(header) - 1) == -1 || flush(sink) == -1))
+    goto fail;
+  return 0;
+
+ fail: {
+    int err = errno;
+    fcntl(fd, F_SETFL, sink->flags);
+    free(sink->queue);
+    sink->queue = NULL;
+    hosts_free(&sink->seen);
+    errno = err;
+    return -1;
+  }
+}
+
+
+/* Lets the event loop write the queue out when the reader is slow.
+   Before, what the file descriptor does not take stays queued until
+   the next record.
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_start(struct sink *sink, struct reactor *reactor)
+{
+  sink->reactor = reactor;
+  return drain(sink);
+}
+
+
+/* Quotes the name of an interface for the text formats, as needed */
+static void quote_name(enum sink_format format, const char *name, char *out)
+{
+  int csv = format == SINK_CSV;
+  if (csv && !strpbrk(name, ",\"\n")) {
+    strcpy(out, name);
+    return;
+  }
+  if (csv)
+    *out++ = '"';
+  for (; *name; ++name) {
+    if (*name == '"' || (!csv && *name == '\\'))
+      *out++ = csv ? '"' : '\\';
+    *out++ = *name;
+  }
+  if (csv)
+    *out++ = '"';
+  *out = 0;
+}
+
+
+/* Formats a record in the text formats
+
+   Returns the length of the line.
+ */
+static int format_line(const struct sink *sink, char *line, const struct timespec *now, enum sink_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac, const struct netif *netif)
+{
+  struct tm tm;
+  char time[32], ipstr[INET_ADDRSTRLEN], macstr[18], old_macstr[18] = "";
+  gmtime_r(&now->tv_sec, &tm);
+  int n = strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(time + n, sizeof(time) - n, ".%06ldZ", now->tv_nsec / 1000);
+  inet_ntop(AF_INET, &ip, ipstr, sizeof(ipstr));
+  snprintf(macstr, sizeof(macstr), "%02x:%02x:%02x:%02x:%02x:%02x",
+	   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  if (old_mac)
+    snprintf(old_macstr, sizeof(old_macstr), "%02x:%02x:%02x:%02x:%02x:%02x",
+	     old_mac[0], old_mac[1], old_mac[2], old_mac[3], old_mac[4], old_mac[5]);
+  /* The kernel refuses spaces and slashes in the names of the
+     interfaces, but not quotes, commas or backslashes */
+  char ifname[2 * IFNAMSIZ + 3];
+  quote_name(sink->format, netif ? netif->name : "", ifname);
+
+  if (sink->format == SINK_CSV)
+    return snprintf(line, SINK_LINE_LEN, "%s,%s,%s,%s,%s,%s\n", time,
+		    event_names[event], ipstr, macstr, old_macstr, ifname);
+  n = snprintf(line, SINK_LINE_LEN, "{\"time\":\"%s\",\"event\":\"%s\",\"ip\":\"%s\",\"mac\":\"%s\"",
+	       time, event_names[event], ipstr, macstr);
+  if (old_mac)
+    n += snprintf(line + n, SINK_LINE_LEN - n, ",\"old_mac\":\"%s\"", old_macstr);
+  if (netif)
+    n += snprintf(line + n, SINK_LINE_LEN - n, ",\"interface\":\"%s\"", ifname);
+  n += snprintf(line + n, SINK_LINE_LEN - n, "}\n");
+  return n;
+}
+
+
+/* Queues a record, and writes out what the file descriptor takes
+
+   mac: hardware address of the host
+   old_mac: previous hardware address (SINK_MOVED), or NULL
+   netif: interface where the host is, or NULL
+
+   Returns 0 on success (the record may be a duplicate), -1 on error
+   (ENOBUFS if the queue is full).
+ */
+int sink_report(struct sink *sink, enum sink_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac, const struct netif *netif)
+{
+  if (sink->error) {
+    errno = sink->error;
+    return -1;
+  }
+
+  /* The host must be new, or have changed */
+  struct host_entry *entry = hosts_lookup(&sink->seen, ip);
+  if (event == SINK_FOUND && entry && !memcmp(entry->mac, mac, ETHER_ADDR_LEN)) {
+    ++sink->duplicates;
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (sink->format == SINK_BINARY) {
+    struct sink_record record;
+    memset(&record, 0, sizeof(record));
+    record.time = htobe64(now.tv_sec * 1000000000ULL + now.tv_nsec);
+    record.ip = ip.s_addr;
+    record.ifindex = htonl(netif ? netif->index : 0);
+    memcpy(record.mac, mac, ETHER_ADDR_LEN);
+    if (old_mac)
+      memcpy(record.old_mac, old_mac, ETHER_ADDR_LEN);
+    record.event = event;
+    if (enqueue(sink, &record, sizeof(record)) == -1)
+      return -1;
+  }
+  else {
+    char line[SINK_LINE_LEN];
+    int n = format_line(sink, line, &now, event, ip, mac, old_mac, netif);
+    if (enqueue(sink, line, n) == -1)
+      return -1;
+  }
+
+  /* Once queued: a record dropped on a full queue is not a duplicate
+     of the next one */
+  if (event == SINK_DISAPPEARED)
+    hosts_remove(&sink->seen, ip);
+  else if (!hosts_update(&sink->seen, ip, mac))
+    return -1;
+
+  /* While the reader is slow, the event loop waits for it */
+  return sink->source ? 0 : drain(sink);
+}
+
+
+/* Adds the counters of the sink to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_add_metrics(struct sink *sink, struct metrics *m, const char *labels)
+{
+  if (metrics_add_counter(m, "satrap_sink_records_total",
+			  "Records queued for the output", labels, &sink->records) == -1
+      || metrics_add_counter(m, "satrap_sink_duplicates_total",
+			     "Hosts found again, not reported", labels, &sink->duplicates) == -1
+      || metrics_add_counter(m, "satrap_sink_overflows_total",
+			     "Records dropped on a full queue", labels, &sink->overflows) == -1
+      || metrics_add_counter(m, "satrap_sink_bytes_total",
+			     "Bytes written to the output", labels, &sink->bytes) == -1)
+    return -1;
+  return 0;
+}
+
+
+/* Writes out the rest of the queue, waiting for the reader, restores
+   the flags of the file descriptor and frees the sink
+
+   Returns 0 on success, -1 if a write failed.
+ */
+int sink_close(struct sink *sink)
+{
+  if (sink->source)
+    reactor_remove(sink->reactor, sink->source);
+  sink->source = NULL;
+  fcntl(sink->fd, F_SETFL, sink->flags);
+  if (!sink->error && sink->len && !(sink->flags & O_NONBLOCK))
+    flush(sink);
+  free(sink->queue);
+  sink->queue = NULL;
+  hosts_free(&sink->seen);
+  if (sink->error) {
+    errno = sink->error;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+/* Satrap/sink.h */
+
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#include "hosts.h"
+#include "metrics.h"
+#include "netif.h"
+#include "reactor.h"
+
+
+
+/* Default size of the queue of a sink, in bytes */
+#define SINK_DEFAULT_CAPACITY (1 << 20)
+
+
+/* Format of the records */
+enum sink_format {
+  SINK_NDJSON, /* a JSON object per line */
+  SINK_CSV, /* a header line, then a line per record */
+  SINK_BINARY /* struct sink_record */
+};
+
+
+/* What a record says about a host */
+enum sink_event {
+  SINK_FOUND, /* answered, or was heard: reported once */
+  SINK_APPEARED, /* the changes of a continuous scan */
+  SINK_DISAPPEARED,
+  SINK_MOVED /* answered from another hardware address */
+};
+
+
+/* Binary record, 32 bytes, the integers in network byte order */
+struct sink_record {
+  uint64_t time; /* nanoseconds since the Epoch */
+  uint32_t ip;
+  uint32_t ifindex; /* 0 if unknown */
+  unsigned char mac[ETHER_ADDR_LEN];
+  unsigned char old_mac[ETHER_ADDR_LEN]; /* SINK_MOVED, zeros otherwise */
+  uint8_t event; /* enum sink_event */
+  uint8_t reserved[3];
+};
+
+
+/* Output of the results for other programs. The records go to a
+   bounded queue, written out whenever the file descriptor takes them:
+   a slow reader never blocks the event loop, and a record which does
+   not fit in the queue is dropped and counted. A host is found once:
+   a second SINK_FOUND record with the same hardware address is
+   dropped too. */
+struct sink {
+  int fd;
+  int flags; /* of the file description, restored by sink_close() */
+  enum sink_format format;
+  struct host_table seen; /* hosts reported */
+
+  /* Queue, a ring of bytes */
+  char *queue;
+  size_t capacity, head, len;
+
+  /* Between sink_start() and sink_close() */
+  struct reactor *reactor;
+  struct reactor_source *source; /* while the queue waits for the reader */
+  int error; /* errno of a failed write, which ends the output */
+
+  /* Statistics */
+  unsigned long records; /* queued */
+  unsigned long duplicates, overflows; /* dropped */
+  unsigned long bytes; /* written */
+};
+
+
+/* Parses the name of a format: "ndjson", "csv" or "binary"
+
+   Returns 0 on success, -1 if the name is unknown.
+ */
+int sink_parse_format(const char *name, enum sink_format *format);
+
+
+/* Initializes a sink. The file descriptor is made nonblocking.
+
+   fd: file descriptor of the output, which stays open
+   capacity: size of the queue in bytes, or 0 for the default
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_open(struct sink *sink, int fd, enum sink_format format, size_t capacity);
+
+
+/* Lets the event loop write the queue out when the reader is slow.
+   Before, what the file descriptor does not take stays queued until
+   the next record.
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_start(struct sink *sink, struct reactor *reactor);
+
+
+/* Queues a record, and writes out what the file descriptor takes
+
+   mac: hardware address of the host
+   old_mac: previous hardware address (SINK_MOVED), or NULL
+   netif: interface where the host is, or NULL
+
+   Returns 0 on success (the record may be a duplicate), -1 on error
+   (ENOBUFS if the queue is full).
+ */
+int sink_report(struct sink *sink, enum sink_event event, struct in_addr ip, const unsigned char *mac, const unsigned char *old_mac, const struct netif *netif);
+
+
+/* Adds the counters of the sink to a registry of metrics
+
+   Returns 0 on success, -1 on error.
+ */
+int sink_add_metrics(struct sink *sink, struct metrics *m, const char *labels);
+
+
+/* Writes out the rest of the queue, waiting for the reader, restores
+   the flags of the file descriptor and frees the sink
+
+   Returns 0 on success, -1 if a write failed.
+ */
+int sink_close(struct sink *sink);
+
+
+
+#endif /* SINK_H_ */
@@ -0,0 +1,168 @@
+/* Satrap/timer_wheel.c */
+
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+
+
+/* Inserts a timer after a list head */
+static void list_insert(struct wheel_timer *head, struct wheel_timer *timer)
+{
+  timer->next = head->next;
+  timer->prev = head;
+  head->next->prev = timer;
+  head->next = timer;
+}
+
+
+/* Removes a timer from its list */
+static void list_remove(struct wheel_timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+
+
+/* Initializes a timer wheel
+
+   wheel: the wheel to initialize
+   size: number of slots, rounded up to a power of 2
+   tick: nanoseconds per tick
+   now: current time, CLOCK_MONOTONIC in nanoseconds
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int size, uint64_t tick, uint64_t now)
+{
+  wheel->size = 1;
+  while (wheel->size < size)
+    wheel->size *= 2;
+  wheel->tick = tick ? tick : 1;
+  wheel->start = now;
+  wheel->current = 0;
+  wheel->count = 0;
+
+  wheel->slots = malloc(wheel->size * sizeof(*wheel->slots));
+  if (!wheel->slots)
+    return -1;
+  for (unsigned int i = 0; i < wheel->size; ++i)
+    wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+
+  return 0;
+}
+
+
+/* Frees the memory used by a timer wheel */
+void timer_wheel_free(struct timer_wheel *wheel)
+{
+  free(wheel->slots);
+  wheel->slots = NULL;
+}
+
+
+
+/* Schedules a timer. A timer which is already scheduled is moved.
+   A timer in the past fires on the next call to timer_wheel_advance().
+
+   expires: time of expiry, CLOCK_MONOTONIC in nanoseconds, rounded up
+   to the next tick
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires)
+{
+  timer_wheel_del(wheel, timer);
+
+  uint64_t tick = 0;
+  if (expires > wheel->start)
+    tick = (expires - wheel->start + wheel->tick - 1) / wheel->tick;
+  if (tick < wheel->current)
+    tick = wheel->current;
+
+  timer->expires = tick;
+  list_insert(&wheel->slots[tick & (wheel->size - 1)], timer);
+  ++wheel->count;
+}
+
+
+/* Cancels a timer, if it is scheduled */
+void timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+  if (!timer->next)
+    return;
+  list_remove(timer);
+  --wheel->count;
+}
+
+
+
+/* Fires every timer which has expired at the given time
+
+   now: current time, CLOCK_MONOTONIC in nanoseconds
+   callback: called for every timer which fires
+
+   Returns the number of timers fired.
+ */
+unsigned int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_callback callback, void *arg)
+{
+  if (now < wheel->start)
+    return 0;
+  uint64_t last = (now - wheel->start) / wheel->tick;
+  unsigned int fired = 0;
+
+  for (; wheel->current <= last; ++wheel->current) {
+    if (wheel->count == 0) {
+      /* Nothing to look at: we jump to the end */
+      wheel->current = last + 1;
+      break;
+    }
+
+    /* The timers of the slot are moved to a private list first, so
+       the callbacks may add and remove timers freely */
+    struct wheel_timer *slot = &wheel->slots[wheel->current & (wheel->size - 1)];
+    if (slot->next == slot)
+      continue;
+    struct wheel_timer pending;
+    pending.next = slot->next;
+    pending.prev = slot->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    slot->next = slot->prev = slot;
+
+    while (pending.next != &pending) {
+      struct wheel_timer *timer = pending.next;
+      list_remove(timer);
+      if (timer->expires > wheel->current) {
+	/* A later round */
+	list_insert(slot, timer);
+	continue;
+      }
+      --wheel->count;
+      ++fired;
+      callback(timer, arg);
+    }
+  }
+
+  return fired;
+}
+
+
+/* Returns the time at which timer_wheel_advance() should be called
+   next: the expiry of the first timer of the next round, or the end
+   of the round if there is none, or UINT64_MAX if no timer is
+   scheduled */
+uint64_t timer_wheel_next(const struct timer_wheel *wheel)
+{
+  if (wheel->count == 0)
+    return UINT64_MAX;
+
+  uint64_t tick = wheel->current;
+  for (unsigned int i = 0; i < wheel->size; ++i, ++tick) {
+    const struct wheel_timer *slot = &wheel->slots[tick & (wheel->size - 1)];
+    for (const struct wheel_timer *t = slot->next; t != slot; t = t->next)
+      if (t->expires == tick)
+	return wheel->start + tick * wheel->tick;
+  }
+  return wheel->start + tick * wheel->tick;
+}
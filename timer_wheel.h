@@ -0,0 +1,90 @@
+/* Satrap/timer_wheel.h */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Default geometry of a timer wheel: 1024 slots of 1 ms, so timers
+   up to one second away are found without skipping any round */
+#define TIMER_WHEEL_DEFAULT_SLOTS 1024
+#define TIMER_WHEEL_DEFAULT_TICK 1000000ULL /* nanoseconds */
+
+
+/* Timer, embedded in the structure it belongs to */
+struct wheel_timer {
+  struct wheel_timer *next, *prev; /* NULL when not scheduled */
+  uint64_t expires; /* tick at which the timer fires */
+};
+
+
+/* Called for every timer which fires. The timer is no longer
+   scheduled, and may be added again. */
+typedef void (*timer_callback)(struct wheel_timer *timer, void *arg);
+
+
+/* Hashed timer wheel: a timer which expires at tick t is kept in the
+   slot t % slots, so adding and removing a timer are O(1), and every
+   tick only looks at one slot. Timers more than one round away stay
+   in their slot until their round comes. */
+struct timer_wheel {
+  struct wheel_timer *slots; /* list heads, one per slot */
+  unsigned int size; /* number of slots, a power of 2 */
+  uint64_t tick; /* nanoseconds per tick */
+  uint64_t start; /* time of tick 0, CLOCK_MONOTONIC in nanoseconds */
+  uint64_t current; /* next tick to process */
+  size_t count; /* number of scheduled timers */
+};
+
+
+/* Initializes a timer wheel
+
+   wheel: the wheel to initialize
+   size: number of slots, rounded up to a power of 2
+   tick: nanoseconds per tick
+   now: current time, CLOCK_MONOTONIC in nanoseconds
+
+   Returns 0 on success, -1 if the memory could not be allocated.
+ */
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int size, uint64_t tick, uint64_t now);
+
+
+/* Frees the memory used by a timer wheel */
+void timer_wheel_free(struct timer_wheel *wheel);
+
+
+/* Schedules a timer. A timer which is already scheduled is moved.
+   A timer in the past fires on the next call to timer_wheel_advance().
+
+   expires: time of expiry, CLOCK_MONOTONIC in nanoseconds, rounded up
+   to the next tick
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires);
+
+
+/* Cancels a timer, if it is scheduled */
+void timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+
+/* Fires every timer which has expired at the given time
+
+   now: current time, CLOCK_MONOTONIC in nanoseconds
+   callback: called for every timer which fires
+
+   Returns the number of timers fired.
+ */
+unsigned int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_callback callback, void *arg);
+
+
+/* Returns the time at which timer_wheel_advance() should be called
+   next: the expiry of the first timer of the next round, or the end
+   of the round if there is none, or UINT64_MAX if no timer is
+   scheduled */
+uint64_t timer_wheel_next(const struct timer_wheel *wheel);
+
+
+
+#endif /* TIMER_WHEEL_H_ */
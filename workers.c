@@ -0,0 +1,253 @@
+/* Satrap/workers.c */
+
+#define _GNU_SOURCE /* CPU_SET(), pthread_setaffinity_np() */
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+/* <linux/if_packet.h> conflicts with <netpacket/packet.h>, which is
+   included by arp.h, but we need the definitions of PACKET_FANOUT */
+#include <linux/if_packet.h>
+
+#include "workers.h"
+
+
+
+/* Fanout groups are unique to a process, and shared by every socket
+   of a pool */
+static unsigned int next_group;
+
+
+/* Initializes a pool of workers
+
+   pool: the pool to initialize
+   count: number of workers, 0 for one per CPU we may use
+   mode: how the frames are spread over the workers
+   pin: if set, every worker is pinned to its own CPU
+
+   Returns 0 on success, -1 on error.
+ */
+int worker_pool_init(struct worker_pool *pool, unsigned int count, enum fanout_mode mode, int pin)
+{
+  memset(pool, 0, sizeof(*pool));
+
+  /* The CPUs we may run on, in order */
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+    return -1;
+  unsigned int ncpus = CPU_COUNT(&cpus);
+  if (count == 0)
+    count = ncpus;
+
+  pool->workers = calloc(count, sizeof(*pool->workers));
+  if (!pool->workers)
+    return -1;
+  pool->count = count;
+  pool->mode = mode;
+  pool->pin = pin;
+  pool->group = (getpid() + __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) & 0xffff;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  int cpu = -1;
+  for (unsigned int i = 0; i < count; ++i) {
+    struct worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->id = i;
+    worker->wakefd = -1;
+    worker->cpu = -1;
+    if (pin) {
+      /* Round robin over the CPUs, if there are more workers */
+      do
+	cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu, &cpus));
+      worker->cpu = cpu;
+    }
+  }
+  return 0;
+}
+
+
+/* Adds a packet socket to the fanout group of the pool. The socket
+   must be bound to the interface, and every socket of the group must
+   be bound to the same protocol.
+
+   Returns 0 on success, -1 on error.
+ */
+int worker_pool_join(struct worker_pool *pool, int sockfd)
+{
+  int type;
+  switch (pool->mode) {
+  case FANOUT_CPU:
+    type = PACKET_FANOUT_CPU;
+    break;
+  case FANOUT_LB:
+    type = PACKET_FANOUT_LB;
+    break;
+  default:
+    /* The fragments of a datagram have no ports: they are gathered
+       first, so that they reach the same worker */
+    type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+  }
+  int arg = pool->group | (type << 16);
+  return setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg));
+}
+
+
+
+/* ====================================================================== */
+
+/* Stops the event loop of the worker, on a request of another
+   thread */
+static void on_wake(struct reactor *reactor, int fd, uint32_t events, void *arg)
+{
+  uint64_t value;
+  if (read(fd, &value, sizeof(value)) == sizeof(value))
+    reactor_stop(reactor);
+}
+
+
+/* Tells the thread which started the pool how the start-up went */
+static void report_start(struct worker_pool *pool, int ok)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (ok)
+    ++pool->ready;
+  else
+    ++pool->failed;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+static void *worker_main(void *arg)
+{
+  struct worker *worker = arg;
+  struct worker_pool *pool = worker->pool;
+
+  /* The signals are handled by the main thread */
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  if (worker->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  if (!reactor_add_fd(&worker->reactor, worker->wakefd, EPOLLIN, on_wake, worker)
+      || pool->init(worker, pool->arg) == -1) {
+    worker->status = -1;
+    report_start(pool, 0);
+    return NULL;
+  }
+  report_start(pool, 1);
+
+  worker->status = reactor_run(&worker->reactor);
+  return NULL;
+}
+
+
+/* Starts the threads. Every worker calls init before running its
+   event loop, which runs until worker_pool_stop().
+
+   Returns 0 once every worker is running, -1 if one of them could not
+   start (the others are stopped).
+ */
+int worker_pool_start(struct worker_pool *pool, worker_init init, void *arg)
+{
+  pool->init = init;
+  pool->arg = arg;
+  pool->ready = pool->failed = 0;
+
+  unsigned int started = 0;
+  int err = 0;
+  for (; started < pool->count; ++started) {
+    struct worker *worker = &pool->workers[started];
+    worker->status = 0;
+    if (reactor_init(&worker->reactor) == -1) {
+      err = errno;
+      break;
+    }
+    worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wakefd == -1) {
+      err = errno;
+      reactor_free(&worker->reactor);
+      break;
+    }
+    if ((err = pthread_create(&worker->thread, NULL, worker_main, worker))) {
+      close(worker->wakefd);
+      worker->wakefd = -1;
+      reactor_free(&worker->reactor);
+      break;
+    }
+  }
+
+  /* We wait for the threads we could start */
+  pthread_mutex_lock(&pool->lock);
+  while (pool->ready + pool->failed < started)
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  int failed = pool->failed;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (started < pool->count || failed) {
+    pool->count = started;
+    worker_pool_stop(pool);
+    errno = err ? err : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Stops the event loops of the workers and waits for their threads
+
+   Returns 0 if every event loop ended normally, -1 otherwise.
+ */
+int worker_pool_stop(struct worker_pool *pool)
+{
+  int status = 0;
+  for (unsigned int i = 0; i < pool->count; ++i) {
+    struct worker *worker = &pool->workers[i];
+    if (worker->wakefd < 0)
+      continue;
+    uint64_t one = 1;
+    if (write(worker->wakefd, &one, sizeof(one)) != sizeof(one))
+      status = -1;
+  }
+
+  for (unsigned int i = 0; i < pool->count; ++i) {
+    struct worker *worker = &pool->workers[i];
+    if (worker->wakefd < 0)
+      continue;
+    pthread_join(worker->thread, NULL);
+    if (worker->status == -1)
+      status = -1;
+    reactor_free(&worker->reactor);
+    close(worker->wakefd);
+    worker->wakefd = -1;
+  }
+  return status;
+}
+
+
+/* Releases the resources of the pool */
+void worker_pool_free(struct worker_pool *pool)
+{
+  worker_pool_stop(pool);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->count = 0;
+}
@@ -0,0 +1,102 @@
+/* Satrap/workers.h */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <pthread.h>
+
+#include "metrics.h"
+#include "reactor.h"
+
+
+
+/* How the kernel spreads the frames over the sockets of a fanout
+   group */
+enum fanout_mode {
+  FANOUT_HASH, /* by flow: both directions of a flow go to one socket */
+  FANOUT_CPU, /* by the CPU which received the frame */
+  FANOUT_LB, /* round robin, for frames without flows (e.g. ARP) */
+};
+
+
+/* Worker thread, with its own event loop. The sockets of a worker
+   are only used by its thread. */
+struct worker {
+  struct worker_pool *pool;
+  unsigned int id; /* from 0 to the number of workers - 1 */
+  int cpu; /* CPU the thread is pinned to, -1 if it is not pinned */
+  pthread_t thread;
+  struct reactor reactor;
+  int wakefd; /* eventfd, to stop the worker from another thread */
+  int status; /* return value of reactor_run(), once stopped */
+};
+
+
+/* Called in the thread of a worker before its event loop runs, to
+   add its sources to the reactor of the worker. Returns 0 on
+   success, -1 on error. */
+typedef int (*worker_init)(struct worker *worker, void *arg);
+
+
+/* Pool of worker threads. The packet sockets of the workers join a
+   fanout group (PACKET_FANOUT), so that each frame reaches a single
+   worker. */
+struct worker_pool {
+  struct worker *workers;
+  unsigned int count;
+  enum fanout_mode mode;
+  unsigned int group; /* fanout group, unique to the process */
+  int pin; /* if set, worker i runs on the i-th CPU we may use */
+
+  /* Start-up of the threads */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int ready, failed;
+  worker_init init;
+  void *arg;
+};
+
+
+/* Initializes a pool of workers
+
+   pool: the pool to initialize
+   count: number of workers, 0 for one per CPU we may use
+   mode: how the frames are spread over the workers
+   pin: if set, every worker is pinned to its own CPU
+
+   Returns 0 on success, -1 on error.
+ */
+int worker_pool_init(struct worker_pool *pool, unsigned int count, enum fanout_mode mode, int pin);
+
+
+/* Adds a packet socket to the fanout group of the pool. The socket
+   must be bound to the interface, and every socket of the group must
+   be bound to the same protocol.
+
+   Returns 0 on success, -1 on error.
+ */
+int worker_pool_join(struct worker_pool *pool, int sockfd);
+
+
+/* Starts the threads. Every worker calls init before running its
+   event loop, which runs until worker_pool_stop().
+
+   Returns 0 once every worker is running, -1 if one of them could not
+   start (the others are stopped).
+ */
+int worker_pool_start(struct worker_pool *pool, worker_init init, void *arg);
+
+
+/* Stops the event loops of the workers and waits for their threads
+
+   Returns 0 if every event loop ended normally, -1 otherwise.
+ */
+int worker_pool_stop(struct worker_pool *pool);
+
+
+/* Releases the resources of the pool */
+void worker_pool_free(struct worker_pool *pool);
+
+
+
+#endif /* WORKERS_H_ */
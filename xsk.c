@@ -0,0 +1,616 @@
+/* Satrap/xsk.c */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include "xsk.h"
+
+
+
+/* Frames handled per call in the backend */
+#define XSK_BATCH 64
+
+
+/* Fills the parameters with their default values */
+void xsk_params_default(struct xsk_params *params)
+{
+  params->frames = XSK_DEFAULT_FRAMES;
+  params->frame_size = XSK_DEFAULT_FRAME_SIZE;
+  params->ring_size = XSK_DEFAULT_RING_SIZE;
+  params->queue = 0;
+  params->mode = XSK_MODE_AUTO;
+  params->zerocopy = 0;
+  params->protocol = ETH_P_ARP;
+}
+
+
+
+/* ====================================================================== */
+
+/* XDP PROGRAM */
+
+/* There is no libbpf here: the program is assembled by hand, like the
+   classic BPF filter of filter.c, and loaded with bpf(2) */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+#define INSN(code_, dst, src, off_, imm_)				\
+  ((struct bpf_insn) { .code = (code_), .dst_reg = (dst), .src_reg = (src), .off = (off_), .imm = (imm_) })
+
+
+/* Loads the program which redirects the frames to the socket of their
+   queue in the map, or passes them to the kernel
+
+   Returns the file descriptor of the program, or -1 on error.
+ */
+static int load_program(int map_fd, unsigned short protocol, const unsigned char *macaddr, struct in_addr ipaddr)
+{
+  /* The comparisons are done on the bytes of the frame as loaded, so
+     the constants are built from the bytes too */
+  uint32_t mac_head;
+  uint16_t mac_tail;
+  memcpy(&mac_head, macaddr, sizeof(mac_head));
+  memcpy(&mac_tail, macaddr + 4, sizeof(mac_tail));
+  int arp = (protocol == ETH_P_ARP);
+  /* Bytes to read: up to the operation code of ARP, or the
+     destination address of IPv4 */
+  int headers = arp ? ETHER_HDR_LEN + 8 : ETHER_HDR_LEN + 20;
+
+  /* Every check jumps to "pass" on failure, at the end of the
+     program */
+  const unsigned int pass = 19;
+  struct bpf_insn code[21];
+  unsigned int len = 0;
+
+#define JUMP_TO(target) ((target) - len - 1)
+
+  /* r2 = data, r3 = data_end (struct xdp_md) */
+  code[len++] = INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, 0, 0);
+  code[len++] = INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, 4, 0);
+  code[len++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  code[len++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, headers);
+  code[len] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, JUMP_TO(pass), 0);
+  ++len;
+
+  /* Destination hardware address: ours */
+  code[len++] = INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 0, 0);
+  code[len] = INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_4, 0, JUMP_TO(pass), mac_head);
+  ++len;
+  code[len++] = INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 4, 0);
+  code[len] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, JUMP_TO(pass), mac_tail);
+  ++len;
+
+  /* EtherType */
+  code[len++] = INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 12, 0);
+  code[len] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, JUMP_TO(pass), htons(protocol));
+  ++len;
+
+  if (arp) {
+    /* Operation code: ARP reply */
+    code[len++] = INSN(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, ETHER_HDR_LEN + 6, 0);
+    code[len] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, JUMP_TO(pass), htons(ARPOP_REPLY));
+    ++len;
+  }
+  else {
+    /* Destination IP address: not ours */
+    code[len++] = INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, ETHER_HDR_LEN + 16, 0);
+    code[len] = INSN(BPF_JMP32 | BPF_JEQ | BPF_K, BPF_REG_4, 0, JUMP_TO(pass), ipaddr.s_addr);
+    ++len;
+  }
+
+  /* return bpf_redirect_map(&map, ctx->rx_queue_index, XDP_PASS):
+     the frames of a queue without socket go to the kernel */
+  code[len++] = INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, 16, 0);
+  code[len++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+  code[len++] = INSN(0, 0, 0, 0, 0);
+  code[len++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+  code[len++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+  code[len++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  /* pass: */
+  code[len++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  code[len++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+#undef JUMP_TO
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t) code;
+  attr.insn_cnt = len;
+  attr.license = (uintptr_t) "Dual BSD/GPL";
+#ifdef DEBUG
+  static char log[4096];
+  attr.log_buf = (uintptr_t) log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+#endif
+  int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+#ifdef DEBUG
+  if (fd == -1)
+    printf("[FAIL] XDP program rejected:\n%s\n", log);
+#endif
+  return fd;
+}
+
+
+/* Attaches the program to the interface. The link is released, and
+   the program detached, when the link is closed.
+
+   Returns the file descriptor of the link, or -1 on error.
+ */
+static int attach_program(int prog_fd, int ifindex, unsigned int flags)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = flags;
+  return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+
+/* Creates the map of the sockets, loads the program and attaches it.
+   skb_mode is set if the program runs in generic mode.
+
+   Returns 0 on success, -1 on error.
+ */
+static int setup_program(struct xsk_socket *xs, const unsigned char *macaddr, struct in_addr ipaddr, const struct xsk_params *params, int *skb_mode)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(int);
+  attr.max_entries = params->queue + 1;
+  xs->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (xs->map_fd == -1)
+    return -1;
+
+  xs->prog_fd = load_program(xs->map_fd, params->protocol, macaddr, ipaddr);
+  if (xs->prog_fd == -1)
+    return -1;
+
+  if (params->mode != XSK_MODE_SKB)
+    xs->link_fd = attach_program(xs->prog_fd, xs->ifindex, XDP_FLAGS_DRV_MODE);
+  *skb_mode = params->mode == XSK_MODE_SKB
+    || (params->mode == XSK_MODE_AUTO && xs->link_fd == -1 && errno != EBUSY);
+  if (*skb_mode)
+    xs->link_fd = attach_program(xs->prog_fd, xs->ifindex, XDP_FLAGS_SKB_MODE);
+  return xs->link_fd == -1 ? -1 : 0;
+}
+
+
+/* Puts the socket in the map, so that the program redirects the
+   frames of its queue to it */
+static int register_socket(struct xsk_socket *xs)
+{
+  uint32_t key = xs->queue;
+  int value = xs->fd;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xs->map_fd;
+  attr.key = (uintptr_t) &key;
+  attr.value = (uintptr_t) &value;
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+
+/* ====================================================================== */
+
+/* RINGS */
+
+/* Maps one of the rings of the socket
+
+   Returns 0 on success, -1 on error.
+ */
+static int map_ring(struct xsk_ring *ring, int fd, const struct xdp_ring_offset *off, uint32_t size, size_t desc_size, off_t pgoff)
+{
+  ring->size = size;
+  ring->map_len = off->desc + size * desc_size;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    return -1;
+  }
+  ring->producer = (uint32_t *) ((unsigned char *) ring->map + off->producer);
+  ring->consumer = (uint32_t *) ((unsigned char *) ring->map + off->consumer);
+  ring->flags = (uint32_t *) ((unsigned char *) ring->map + off->flags);
+  ring->descs = (unsigned char *) ring->map + off->desc;
+  return 0;
+}
+
+
+/* Descriptors we can write on a ring filled by userspace */
+static uint32_t ring_free(const struct xsk_ring *ring)
+{
+  return ring->size - (ring->head - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+
+/* Makes the descriptors written so far visible to the kernel */
+static void ring_publish(struct xsk_ring *ring)
+{
+  __atomic_store_n(ring->producer, ring->head, __ATOMIC_RELEASE);
+}
+
+
+/* Address of the start of the frame containing addr: the kernel adds
+   its headroom to the addresses of the received frames */
+static uint64_t frame_base(const struct xsk_socket *xs, uint64_t addr)
+{
+  return addr & ~(uint64_t) (xs->frame_size - 1);
+}
+
+
+/* Gives a frame of the UMEM back to the pool of free frames */
+void xsk_release(struct xsk_socket *xs, uint64_t addr)
+{
+  xs->free_frames[xs->nfree++] = frame_base(xs, addr);
+}
+
+
+/* Takes back the frames the kernel has sent */
+static void reap_completions(struct xsk_socket *xs)
+{
+  uint32_t cons = *xs->comp.consumer;
+  uint32_t prod = __atomic_load_n(xs->comp.producer, __ATOMIC_ACQUIRE);
+  const uint64_t *addrs = xs->comp.descs;
+  for (; cons != prod; ++cons)
+    xsk_release(xs, addrs[cons & (xs->comp.size - 1)]);
+  __atomic_store_n(xs->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+/* Gives free frames to the kernel for reception */
+void xsk_refill(struct xsk_socket *xs)
+{
+  uint32_t n = ring_free(&xs->fill);
+  if (n > xs->nfree)
+    n = xs->nfree;
+  uint64_t *addrs = xs->fill.descs;
+  for (uint32_t i = 0; i < n; ++i)
+    addrs[xs->fill.head++ & (xs->fill.size - 1)] = xs->free_frames[--xs->nfree];
+  if (n)
+    ring_publish(&xs->fill);
+
+  /* In native mode, the driver stops when the fill ring is empty, and
+     waits for us to wake it up */
+  if (__atomic_load_n(xs->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    recvfrom(xs->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+
+/* Takes up to max received frames. Each of them is then either given
+   back with xsk_release(), or sent again with xsk_send().
+
+   Returns the number of descriptors written in descs.
+ */
+unsigned int xsk_recv(struct xsk_socket *xs, struct xdp_desc *descs, unsigned int max)
+{
+  uint32_t cons = *xs->rx.consumer;
+  uint32_t avail = __atomic_load_n(xs->rx.producer, __ATOMIC_ACQUIRE) - cons;
+  if (avail > max)
+    avail = max;
+  const struct xdp_desc *ring = xs->rx.descs;
+  for (uint32_t i = 0; i < avail; ++i)
+    descs[i] = ring[(cons + i) & (xs->rx.size - 1)];
+  __atomic_store_n(xs->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+  return avail;
+}
+
+
+/* Queues a frame of the UMEM for transmission, without copying it.
+   The frame returns to the pool once the kernel has sent it.
+
+   Returns 0 on success, 1 if the transmit ring is full.
+ */
+int xsk_send(struct xsk_socket *xs, uint64_t addr, uint32_t len)
+{
+  if (ring_free(&xs->tx) == 0)
+    return 1;
+  struct xdp_desc *desc = (struct xdp_desc *) xs->tx.descs + (xs->tx.head++ & (xs->tx.size - 1));
+  desc->addr = addr;
+  desc->len = len;
+  desc->options = 0;
+  return 0;
+}
+
+
+/* Makes the kernel send the queued frames, and takes back the frames
+   already sent
+
+   Returns the number of frames handed to the kernel, or -1 on error.
+ */
+int xsk_flush(struct xsk_socket *xs)
+{
+  int count = xs->tx.head - *xs->tx.producer;
+  ring_publish(&xs->tx);
+
+  /* In copy mode, the kernel sends a limited batch of frames per call
+     (EAGAIN), and none when the completion ring is full: we go on as
+     long as it makes progress */
+  while (1) {
+    reap_completions(xs);
+    uint32_t cons = __atomic_load_n(xs->tx.consumer, __ATOMIC_ACQUIRE);
+    if (cons == xs->tx.head
+	|| !(__atomic_load_n(xs->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP))
+      break;
+    if (sendto(xs->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EBUSY && errno != ENOBUFS)
+	return -1;
+      if (__atomic_load_n(xs->tx.consumer, __ATOMIC_ACQUIRE) == cons)
+	break; /* the device is busy, the frames wait for the next flush */
+    }
+  }
+  reap_completions(xs);
+
+  return count;
+}
+
+
+
+/* ====================================================================== */
+
+/* Detaches the XDP program, and releases the socket and its UMEM */
+void xsk_close(struct xsk_socket *xs)
+{
+  if (xs->link_fd >= 0)
+    close(xs->link_fd);
+  if (xs->prog_fd >= 0)
+    close(xs->prog_fd);
+  if (xs->map_fd >= 0)
+    close(xs->map_fd);
+
+  struct xsk_ring *rings[] = { &xs->rx, &xs->tx, &xs->fill, &xs->comp };
+  for (unsigned int i = 0; i < sizeof(rings) / sizeof(rings[0]); ++i)
+    if (rings[i]->map)
+      munmap(rings[i]->map, rings[i]->map_len);
+  if (xs->fd >= 0)
+    close(xs->fd);
+  if (xs->umem)
+    munmap(xs->umem, xs->umem_len);
+  free(xs->free_frames);
+
+  memset(xs, 0, sizeof(*xs));
+  xs->fd = xs->map_fd = xs->prog_fd = xs->link_fd = -1;
+}
+
+
+/* Opens an AF_XDP socket, registers its UMEM, attaches the XDP
+   program to the interface and gives half of the frames to the
+   kernel for reception.
+
+   xs: the socket to open
+   ifindex: index of the interface
+   macaddr: local hardware address
+   ipaddr: local IP address (its packets stay in the kernel)
+   params: parameters of the socket, or NULL for the defaults
+
+   Returns 0 on success, -1 on error (EBUSY if another XDP program is
+   attached to the interface).
+ */
+int xsk_open(struct xsk_socket *xs, int ifindex, const unsigned char *macaddr, struct in_addr ipaddr, const struct xsk_params *params)
+{
+  struct xsk_params defaults;
+  if (!params) {
+    xsk_params_default(&defaults);
+    params = &defaults;
+  }
+
+  memset(xs, 0, sizeof(*xs));
+  xs->fd = xs->map_fd = xs->prog_fd = xs->link_fd = -1;
+
+  /* The UMEM is cut into frames of a power of two bytes (aligned
+     mode), and the rings must have a power of two descriptors */
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned int fs = params->frame_size, rs = params->ring_size;
+  if (fs < 2048 || fs > page_size || (fs & (fs - 1))
+      || rs == 0 || (rs & (rs - 1)) || params->frames < 2
+      || (params->protocol != ETH_P_ARP && params->protocol != ETH_P_IP)) {
+    errno = EINVAL;
+    return -1;
+  }
+  xs->ifindex = ifindex;
+  xs->queue = params->queue;
+  xs->frame_size = fs;
+
+  xs->fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (xs->fd == -1)
+    goto fail;
+
+  xs->umem_len = (size_t) params->frames * fs;
+  xs->umem = mmap(NULL, xs->umem_len, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (xs->umem == MAP_FAILED) {
+    xs->umem = NULL;
+    goto fail;
+  }
+  xs->free_frames = malloc(params->frames * sizeof(*xs->free_frames));
+  if (!xs->free_frames)
+    goto fail;
+  for (unsigned int i = 0; i < params->frames; ++i)
+    xs->free_frames[xs->nfree++] = (uint64_t) (params->frames - 1 - i) * fs;
+
+  struct xdp_umem_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = (uintptr_t) xs->umem;
+  reg.len = xs->umem_len;
+  reg.chunk_size = fs;
+  reg.headroom = 0;
+  if (setsockopt(xs->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1
+      || setsockopt(xs->fd, SOL_XDP, XDP_UMEM_FILL_RING, &rs, sizeof(rs)) == -1
+      || setsockopt(xs->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &rs, sizeof(rs)) == -1
+      || setsockopt(xs->fd, SOL_XDP, XDP_RX_RING, &rs, sizeof(rs)) == -1
+      || setsockopt(xs->fd, SOL_XDP, XDP_TX_RING, &rs, sizeof(rs)) == -1)
+    goto fail;
+
+  struct xdp_mmap_offsets off;
+  socklen_t optlen = sizeof(off);
+  if (getsockopt(xs->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1
+      || map_ring(&xs->rx, xs->fd, &off.rx, rs, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1
+      || map_ring(&xs->tx, xs->fd, &off.tx, rs, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1
+      || map_ring(&xs->fill, xs->fd, &off.fr, rs, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1
+      || map_ring(&xs->comp, xs->fd, &off.cr, rs, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1)
+    goto fail;
+
+  /* The program must be attached before binding: its mode tells
+     whether the frames can be shared with the driver (zero-copy) */
+  int skb_mode;
+  if (setup_program(xs, macaddr, ipaddr, params, &skb_mode) == -1)
+    goto fail;
+  struct sockaddr_xdp addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sxdp_family = AF_XDP;
+  addr.sxdp_ifindex = ifindex;
+  addr.sxdp_queue_id = params->queue;
+  addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+  if (skb_mode)
+    addr.sxdp_flags |= XDP_COPY;
+  else if (params->zerocopy)
+    addr.sxdp_flags |= XDP_ZEROCOPY;
+  if (bind(xs->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+      || register_socket(xs) == -1)
+    goto fail;
+
+  /* Half of the frames for reception, the other half for
+     transmission */
+  unsigned int rx_frames = params->frames / 2;
+  if (rx_frames > rs)
+    rx_frames = rs;
+  uint64_t *fill = xs->fill.descs;
+  for (unsigned int i = 0; i < rx_frames; ++i)
+    fill[xs->fill.head++ & (rs - 1)] = xs->free_frames[--xs->nfree];
+  ring_publish(&xs->fill);
+
+  return 0;
+
+ fail: {
+    int err = errno;
+    xsk_close(xs);
+    errno = err;
+    return -1;
+  }
+}
+
+
+
+/* ====================================================================== */
+
+/* FRAME I/O BACKEND */
+
+static int xsk_io_send(struct frame_io *io, const void *frame, size_t len)
+{
+  struct xsk_socket *xs = io->priv;
+  if (len > xs->frame_size) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  /* Without free frames, the kernel must send some first */
+  if (xs->nfree == 0)
+    reap_completions(xs);
+  if (xs->nfree == 0 || ring_free(&xs->tx) == 0)
+    return 1;
+
+  uint64_t addr = xs->free_frames[--xs->nfree];
+  memcpy(xsk_frame(xs, addr), frame, len);
+  xsk_send(xs, addr, len);
+  return 0;
+}
+
+
+static int xsk_io_flush(struct frame_io *io)
+{
+  return xsk_flush(io->priv);
+}
+
+
+static int xsk_io_recv(struct frame_io *io, frame_handler handler, void *arg)
+{
+  struct xsk_socket *xs = io->priv;
+  struct xdp_desc descs[XSK_BATCH];
+  int count = 0;
+  unsigned int n;
+  do {
+    n = xsk_recv(xs, descs, XSK_BATCH);
+    for (unsigned int i = 0; i < n; ++i) {
+      handler(xsk_frame(xs, descs[i].addr), descs[i].len, arg);
+      xsk_release(xs, descs[i].addr);
+    }
+    count += n;
+    xsk_refill(xs);
+  } while (n == XSK_BATCH);
+  return count;
+}
+
+
+static void xsk_io_close(struct frame_io *io)
+{
+  struct xsk_socket *xs = io->priv;
+  xsk_flush(xs);
+  xsk_close(xs);
+  free(xs);
+  io->priv = NULL;
+}
+
+
+static const struct frame_io_ops xsk_ops = {
+  .send = xsk_io_send,
+  .flush = xsk_io_flush,
+  .recv = xsk_io_recv,
+  .close = xsk_io_close,
+};
+
+
+/* Creates a backend on top of an AF_XDP socket. The frames received
+   are handed to the handler straight from the UMEM, and the frames to
+   send are copied into free frames of the UMEM.
+
+   io: the backend to initialize
+   ifindex: index of the interface
+   macaddr: local hardware address
+   ipaddr: local IP address
+   params: parameters of the socket, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_xsk(struct frame_io *io, int ifindex, const unsigned char *macaddr, struct in_addr ipaddr, const struct xsk_params *params)
+{
+  struct xsk_socket *xs = malloc(sizeof(*xs));
+  if (!xs)
+    return -1;
+  if (xsk_open(xs, ifindex, macaddr, ipaddr, params) == -1) {
+    int err = errno;
+    free(xs);
+    errno = err;
+    return -1;
+  }
+
+  io->ops = &xsk_ops;
+  io->fd = xs->fd;
+  io->ifindex = ifindex;
+  io->priv = xs;
+  memset(&io->counters, 0, sizeof(io->counters));
+  return 0;
+}
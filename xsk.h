@@ -0,0 +1,165 @@
+/* Satrap/xsk.h */
+
+#ifndef XSK_H_
+#define XSK_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+#include <linux/if_xdp.h>
+
+#include "io.h"
+
+/* For older C libraries */
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+
+
+/* Default parameters of the AF_XDP sockets */
+#define XSK_DEFAULT_FRAMES 4096 /* frames of the UMEM */
+#define XSK_DEFAULT_FRAME_SIZE 2048 /* bytes per frame */
+#define XSK_DEFAULT_RING_SIZE 2048 /* descriptors per ring */
+
+
+/* Where the XDP program runs */
+enum xsk_mode {
+  XSK_MODE_AUTO, /* in the driver if it supports XDP, generic otherwise */
+  XSK_MODE_SKB, /* generic XDP, after the allocation of the socket
+		   buffer: works on every interface (e.g. veth) */
+  XSK_MODE_NATIVE, /* in the driver */
+};
+
+
+/* Parameters of an AF_XDP socket */
+struct xsk_params {
+  unsigned int frames; /* frames of the UMEM, shared by RX and TX */
+  unsigned int frame_size; /* power of two, from 2048 to the page size */
+  unsigned int ring_size; /* descriptors per ring, power of two */
+  unsigned int queue; /* receive queue of the interface */
+  enum xsk_mode mode;
+  int zerocopy; /* if set, fail rather than copy the frames */
+  unsigned short protocol; /* ETH_P_ARP or ETH_P_IP, host byte order */
+};
+
+
+/* One of the rings shared with the kernel. The descriptors are struct
+   xdp_desc for RX and TX, and UMEM addresses (uint64_t) for the fill
+   and completion rings. */
+struct xsk_ring {
+  uint32_t *producer, *consumer, *flags;
+  void *descs;
+  uint32_t size;
+  uint32_t head; /* next descriptor to write, on the rings we fill */
+  void *map;
+  size_t map_len;
+};
+
+
+/* AF_XDP socket bound to one queue of an interface, with its UMEM and
+   the XDP program which redirects the frames to it. The program
+   only takes the frames sent to our hardware address: the ARP
+   replies with ETH_P_ARP, and the IPv4 packets for other hosts with
+   ETH_P_IP. Everything else goes on to the kernel. */
+struct xsk_socket {
+  int fd;
+  int ifindex;
+  unsigned int queue;
+  int map_fd, prog_fd, link_fd; /* XSKMAP, program, and its link */
+
+  unsigned char *umem;
+  size_t umem_len;
+  unsigned int frame_size;
+  struct xsk_ring rx, tx, fill, comp;
+
+  /* Frames owned by userspace and not in use, for TX and for the fill
+     ring alike */
+  uint64_t *free_frames;
+  unsigned int nfree;
+};
+
+
+/* Fills the parameters with their default values */
+void xsk_params_default(struct xsk_params *params);
+
+
+/* Opens an AF_XDP socket, registers its UMEM, attaches the XDP
+   program to the interface and gives half of the frames to the
+   kernel for reception.
+
+   xs: the socket to open
+   ifindex: index of the interface
+   macaddr: local hardware address
+   ipaddr: local IP address (its packets stay in the kernel)
+   params: parameters of the socket, or NULL for the defaults
+
+   Returns 0 on success, -1 on error (EBUSY if another XDP program is
+   attached to the interface).
+ */
+int xsk_open(struct xsk_socket *xs, int ifindex, const unsigned char *macaddr, struct in_addr ipaddr, const struct xsk_params *params);
+
+
+/* Detaches the XDP program, and releases the socket and its UMEM */
+void xsk_close(struct xsk_socket *xs);
+
+
+/* Takes up to max received frames. Each of them is then either given
+   back with xsk_release(), or sent again with xsk_send().
+
+   Returns the number of descriptors written in descs.
+ */
+unsigned int xsk_recv(struct xsk_socket *xs, struct xdp_desc *descs, unsigned int max);
+
+
+/* Gives a frame of the UMEM back to the pool of free frames */
+void xsk_release(struct xsk_socket *xs, uint64_t addr);
+
+
+/* Queues a frame of the UMEM for transmission, without copying it.
+   The frame returns to the pool once the kernel has sent it.
+
+   Returns 0 on success, 1 if the transmit ring is full.
+ */
+int xsk_send(struct xsk_socket *xs, uint64_t addr, uint32_t len);
+
+
+/* Makes the kernel send the queued frames, and takes back the frames
+   already sent
+
+   Returns the number of frames handed to the kernel, or -1 on error.
+ */
+int xsk_flush(struct xsk_socket *xs);
+
+
+/* Gives free frames to the kernel for reception */
+void xsk_refill(struct xsk_socket *xs);
+
+
+/* Address of a frame of the UMEM */
+static inline unsigned char *xsk_frame(struct xsk_socket *xs, uint64_t addr)
+{
+  return xs->umem + addr;
+}
+
+
+/* Creates a backend on top of an AF_XDP socket. The frames received
+   are handed to the handler straight from the UMEM, and the frames to
+   send are copied into free frames of the UMEM.
+
+   io: the backend to initialize
+   ifindex: index of the interface
+   macaddr: local hardware address
+   ipaddr: local IP address
+   params: parameters of the socket, or NULL for the defaults
+
+   Returns 0 on success, -1 on error.
+ */
+int frame_io_xsk(struct frame_io *io, int ifindex, const unsigned char *macaddr, struct in_addr ipaddr, const struct xsk_params *params);
+
+
+
+#endif /* XSK_H_ */